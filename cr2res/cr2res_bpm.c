@@ -364,44 +364,57 @@ static cpl_mask * cr2res_bpm_compute_local_stats(
 {
     cpl_mask        *   out ;
     cpl_binary      *   pout ;
-    double              threshold, med, sigma ;
-    int                 badpix;
-    cpl_size            i, j, nx, ny, llx, lly, urx, ury ;
+    cpl_image       *   cast ;
+    cpl_image       *   med ;
+    cpl_image       *   sigma ;
+    const double    *   pimg ;
+    const double    *   pmed ;
+    const double    *   psigma ;
+    const cpl_binary *  pbad ;
+    double              threshold ;
+    cpl_size            i, j, nx, ny ;
 
     /* Check Entries */
     if (img == NULL) return NULL ;
     nx = cpl_image_get_size_x(img) ;
     ny = cpl_image_get_size_y(img) ;
-    if (sigma < 0.0) return NULL ;
+
+    /* Local statistics in the sliding windows */
+    if (cr2res_image_median_window(img, size, size, &med, &sigma)) {
+        cpl_msg_error(__func__, "Cannot compute the local statistics") ;
+        return NULL ;
+    }
+    cast = NULL ;
+    if (cpl_image_get_type(img) == CPL_TYPE_DOUBLE) {
+        pimg = cpl_image_get_data_double_const(img) ;
+    } else {
+        cast = cpl_image_cast(img, CPL_TYPE_DOUBLE) ;
+        pimg = cpl_image_get_data_double_const(cast) ;
+    }
+    pmed = cpl_image_get_data_double_const(med) ;
+    psigma = cpl_image_get_data_double_const(sigma) ;
+    pbad = cpl_mask_get_data_const(cpl_image_get_bpm_const(med)) ;
 
     /* Create Output mask */
     out = cpl_mask_new(nx, ny) ;
     pout = cpl_mask_get_data(out) ;
 
     /* Loop on the pixels */
-    for (i = 0; i < nx ; i++) {
-        for (j = 0; j < ny ; j++) {
-            llx = i+1-size ;
-            lly = j+1-size ;
-            urx = i+1+size ;
-            ury = j+1+size ;
-            if (llx < 1) llx = 1 ;
-            if (lly < 1) lly = 1 ;
-            if (urx > nx) urx = nx ;
-            if (ury > ny) ury = ny ;
-
-            /* Local statistics */
-            med = cpl_image_get_median_dev_window(img, llx, lly, urx,
-                    ury, &sigma); 
+    for (j = 0; j < ny ; j++) {
+        for (i = 0; i < nx ; i++) {
+            if (pbad[i + j*nx]) continue ;
 
             /* Compute Threshold */
-            threshold = med + kappa*sigma ;
+            threshold = pmed[i + j*nx] + kappa * psigma[i + j*nx] ;
 
             /* Set Bad Pixel */
-            if (fabs(cpl_image_get(img, i+1, j+1, &badpix)) > threshold) 
+            if (fabs(pimg[i + j*nx]) > threshold) 
                 pout[i + j*nx] = CPL_BINARY_1 ;
         }   
     }
+    if (cast != NULL) cpl_image_delete(cast) ;
+    cpl_image_delete(med) ;
+    cpl_image_delete(sigma) ;
     return out;
 }
 
@@ -428,7 +441,6 @@ static cpl_mask * cr2res_bpm_compute_running_filter(
     cpl_mask    *   out ;
     cpl_binary  *   pout ;
     cpl_image   *   copy ;
-    cpl_mask    *   kernel ;
     double          mad, median;
     int             badpix;
     double          threshold;
@@ -441,17 +453,11 @@ static cpl_mask * cr2res_bpm_compute_running_filter(
     if (nx < size || ny < size) return NULL ;
     if (size % 2 != 1) return NULL ;
 
-    /* Local copy */
-    copy = cpl_image_duplicate(img);
-
-    /* Filtering Kernel */
-    kernel = cpl_mask_new(size, 1);
-    cpl_mask_not(kernel);
-
-    /* Apply Filter */
-    cpl_image_filter_mask(copy, img, kernel, CPL_FILTER_MEDIAN, 
-            CPL_BORDER_FILTER);
-    cpl_mask_delete(kernel);
+    /* Apply the median filter along the rows */
+    if (cr2res_image_median_window(img, size/2, 0, &copy, NULL)) {
+        cpl_msg_error(__func__, "Cannot apply the median filter") ;
+        return NULL ;
+    }
 
     /* Reject 0 values */
     for (i = 1; i <= nx ; i++) {
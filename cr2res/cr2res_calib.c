@@ -26,6 +26,10 @@
  -----------------------------------------------------------------------------*/
 
 #include <math.h>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <cpl.h>
 #include "cr2res_calib.h"
 #include "cr2res_bpm.h"
@@ -34,10 +38,76 @@
 #include "cr2res_detlin.h"
 #include "cr2res_utils.h"
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* Kernels built for AVX-512, AVX2 and the baseline, chosen at run time */
+#if defined(__GNUC__) && __GNUC__ >= 6 && !defined(__clang__) && \
+    defined(__x86_64__) && defined(__linux__)
+#define CR2RES_CALIB_SIMD \
+    __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define CR2RES_CALIB_SIMD
+#endif
+
+struct _cr2res_calib_context_ {
+    int                     chip ;
+    int                     clean_bad ;
+    int                     cosmics_corr ;
+    cpl_mask            *   bpm ;       /* Bad pixels, or NULL */
+    hdrl_imagelist      *   detlin ;    /* Non-linearity coeffs, or NULL */
+    hdrl_image          *   dark ;      /* Linearized dark, or NULL */
+    double                  dark_dit ;
+    hdrl_image          *   flat ;      /* Flat field, or NULL */
+    /* Pixel buffers of the above, NULL if not used */
+    const cpl_binary    *   pbpm ;
+    const double        *   pcoeff[3] ;
+    const double        *   perrcoeff[3] ;
+    const double        *   pdark ;
+    const double        *   perrdark ;
+    const cpl_binary    *   pbpmdark ;
+    const double        *   pflat ;
+    const double        *   perrflat ;
+    const cpl_binary    *   pbpmflat ;
+} ;
+
+struct _cr2res_calib_stack_ {
+    int                     weighted ;
+    cpl_size                nx ;
+    cpl_size                ny ;
+    double              *   sum ;       /* Sum of d, or of d/e^2 */
+    double              *   sum_err ;   /* Sum of e^2, or of 1/e^2 */
+    int                 *   contrib ;   /* Number of good values */
+} ;
+
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
+static void cr2res_calib_context_prepare(cr2res_calib_context * ctx) ;
+static int cr2res_calib_check_size(
+        const cr2res_calib_context  *   ctx,
+        cpl_size                        nx,
+        cpl_size                        ny) ;
+static int cr2res_calib_apply_in_place(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out,
+        double                          dit) ;
+static void cr2res_calib_cosmics(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out) ;
+static CR2RES_CALIB_SIMD void cr2res_calib_sweep_row(
+        const cr2res_calib_context  *   ctx,
+        cpl_size                        offset,
+        cpl_size                        nx,
+        double                          dit,
+        int                             mask_bpm,
+        double                      *   pdata,
+        double                      *   perr,
+        cpl_binary                  *   pbpm) ;
+static inline double cr2res_calib_select(int cond, double a, double b) ;
+
 /*----------------------------------------------------------------------------*/
 /**
   @defgroup cr2res_calib
@@ -61,6 +131,9 @@
   The flat, dark and bpm must have the same size as the input in.
   In the case of detlin, data are only taken in normal mode.
   @return   the newly allocated imagelist or NULL in error case
+
+  The calibrations are loaded once with cr2res_calib_context_new(), and
+  the images are calibrated concurrently (if built with OpenMP).
  */
 /*----------------------------------------------------------------------------*/
 hdrl_imagelist * cr2res_calib_imagelist(
@@ -74,37 +147,63 @@ hdrl_imagelist * cr2res_calib_imagelist(
         const cpl_frame         *   detlin,
         const cpl_vector        *   dits)
 {
-    hdrl_imagelist      *   out ;
-    const hdrl_image    *   cur_ima ;
-    hdrl_image          *   cur_ima_calib ;
-    double                  dit ;
-    cpl_size                i ;
+    cr2res_calib_context    *   ctx ;
+    hdrl_imagelist          *   out ;
+    hdrl_image              **  calibrated ;
+    cpl_size                    i, nima ;
+    int                         nfailed ;
 
     /* Check Inputs */
     if (in == NULL) return NULL ;
+    nima = hdrl_imagelist_get_size(in) ;
+    if (dark != NULL && (dits == NULL || cpl_vector_get_size(dits) < nima)) {
+        cpl_msg_error(__func__, "The DITs are needed for the dark correction");
+        return NULL ;
+    }
 
-    /* Initialise */
-    dit = 0.0 ;
-
-    /* Create calibrated image list */
-    out = hdrl_imagelist_new() ;
+    /* Load the calibrations once for all the images */
+    if ((ctx = cr2res_calib_context_new(chip, clean_bad, cosmics_corr, flat,
+                    dark, bpm, detlin)) == NULL) {
+        cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
+        return NULL ;
+    }
 
     /* Loop on the images */
-    for (i=0 ; i<hdrl_imagelist_get_size(in) ; i++) {
-        cur_ima = hdrl_imagelist_get(in, i) ;
-        if (dark != NULL) dit = cpl_vector_get(dits, i) ;
-
-        /* Calibrate */
-        if ((cur_ima_calib = cr2res_calib_image(cur_ima, chip, clean_bad, 
-                        cosmics_corr, flat, dark, bpm, detlin, dit)) == NULL) {
-            cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
-            hdrl_imagelist_delete(out) ;
-            return NULL ;
-        } else {
-            /* All the calibrated image in the list */
-            hdrl_imagelist_set(out, cur_ima_calib, i);
+    calibrated = cpl_calloc(nima, sizeof(hdrl_image *)) ;
+    nfailed = 0 ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(dynamic,1) if(nima > 1)
+#endif
+    for (i=0 ; i<nima ; i++) {
+        calibrated[i] = cr2res_calib_context_apply(ctx,
+                hdrl_imagelist_get_const(in, i),
+                dark != NULL ? cpl_vector_get(dits, i) : 0.0) ;
+        if (calibrated[i] == NULL) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+            nfailed++ ;
+            /* Do not leave the error in the pooled worker thread */
+            cpl_error_reset() ;
         }
     }
+    cr2res_calib_context_delete(ctx) ;
+
+    if (nfailed > 0) {
+        cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
+        cpl_error_set_message(__func__, CPL_ERROR_ILLEGAL_OUTPUT,
+                "%d image(s) could not be calibrated", nfailed) ;
+        for (i=0 ; i<nima ; i++)
+            if (calibrated[i] != NULL) hdrl_image_delete(calibrated[i]) ;
+        cpl_free(calibrated) ;
+        return NULL ;
+    }
+
+    /* All the calibrated image in the list, in the input order */
+    out = hdrl_imagelist_new() ;
+    for (i=0 ; i<nima ; i++) hdrl_imagelist_set(out, calibrated[i], i) ;
+    cpl_free(calibrated) ;
     return out ;
 }
  
@@ -123,6 +222,9 @@ hdrl_imagelist * cr2res_calib_imagelist(
   The flat, dark and bpm must have the same size as the input in.
   In the case of detlin, data are only taken in normal mode.
   @return   the newly allocated image or NULL in error case
+
+  To calibrate several images with the same calibrations, use
+  cr2res_calib_context_new() once and cr2res_calib_context_apply().
  */
 /*----------------------------------------------------------------------------*/
 hdrl_image * cr2res_calib_image(
@@ -136,128 +238,807 @@ hdrl_image * cr2res_calib_image(
         const cpl_frame     *   detlin,
         double                  dit)
 {
-    hdrl_image          *   out ;
-    hdrl_image          *   calib ;
-    hdrl_imagelist      *   calib_list ;
-    cpl_propertylist    *   plist ;
-    double                  dark_dit ;
+    cr2res_calib_context    *   ctx ;
+    hdrl_image              *   out ;
 
     /* Test entries */
     if (in == NULL) return NULL ;
     if (chip < 1 || chip > CR2RES_NB_DETECTORS) return NULL ;
 
-    /* Create out image */
-    out = hdrl_image_duplicate(in) ;
+    /* Load the calibrations and apply them */
+    if ((ctx = cr2res_calib_context_new(chip, clean_bad, cosmics_corr, flat,
+                    dark, bpm, detlin)) == NULL) return NULL ;
+    out = cr2res_calib_context_apply(ctx, in, dit) ;
+    cr2res_calib_context_delete(ctx) ;
+    return out ;
+}
 
-    /* Clean the bad pixels */
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load and prepare the calibrations of a chip
+  @param    chip        the chip to calibrate (1 to CR2RES_NB_DETECTORS)
+  @param    clean_bad   Flag to activate the cleaning of the bad pixels 
+  @param    cosmics_corr    Flag to correct for cosmics
+  @param    flat        the flat frame or NULL
+  @param    dark        the dark frame or NULL
+  @param    bpm         the bpm frame or NULL
+  @param    detlin      the detlin frame or NULL
+  @return   the newly allocated context or NULL in error case
+
+  The BPM, the non-linearity coefficients, the dark with its DIT and the
+  flat are loaded once. The dark is already corrected for the
+  non-linearity. The context can then be applied to any number of images
+  with cr2res_calib_context_apply().
+  The returned context must be deallocated with
+  cr2res_calib_context_delete()
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_calib_context * cr2res_calib_context_new(
+        int                     chip,
+        int                     clean_bad,
+        int                     cosmics_corr,
+        const cpl_frame     *   flat,
+        const cpl_frame     *   dark,
+        const cpl_frame     *   bpm,
+        const cpl_frame     *   detlin)
+{
+    cr2res_calib_context    *   ctx ;
+    cpl_image               *   bpm_im ;
+    cpl_propertylist        *   plist ;
+
+    /* Test entries */
+    if (chip < 1 || chip > CR2RES_NB_DETECTORS) return NULL ;
+
+    /* Initialise */
+    ctx = cpl_calloc(1, sizeof(cr2res_calib_context)) ;
+    ctx->chip = chip ;
+    ctx->clean_bad = clean_bad ;
+    ctx->cosmics_corr = cosmics_corr ;
+
+    /* Load the bad pixels */
     if (bpm != NULL) {
-        cpl_msg_info(__func__, "Correct the bad pixels") ;
-        if (cr2res_bpm_set_and_correct_image(hdrl_image_get_image(out),
-                    cpl_frame_get_filename(bpm), chip, clean_bad) != 0) {
+        cpl_msg_info(__func__, "Load the bad pixels") ;
+        if ((bpm_im = cr2res_io_load_BPM(cpl_frame_get_filename(bpm), chip,
+                        1)) == NULL) {
+            cpl_msg_error(__func__, "Cannot load the bpm") ;
             cpl_msg_error(__func__, "Cannot clean the bad pixels");
-            hdrl_image_delete(out);
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
+        /* Convert the map to binary */
+        ctx->bpm = cpl_mask_threshold_image_create(bpm_im, -0.5, 0.5) ;
+        cpl_mask_not(ctx->bpm) ;
+        cpl_image_delete(bpm_im) ;
     }
 
-    /* Apply the non linearity correction */
+    /* Load the detlin coeffs */
     if (detlin != NULL) {
-        /* Load the detlin coeffs */
         cpl_msg_info(__func__, "Load the Non-Linearity coefficients") ;
-        if ((calib_list = cr2res_io_load_DETLIN_COEFFS(
+        if ((ctx->detlin = cr2res_io_load_DETLIN_COEFFS(
                         cpl_frame_get_filename(detlin), chip)) == NULL) {
             cpl_msg_error(__func__, "Cannot load the detlin") ;
-            hdrl_image_delete(out);
-            return NULL ;
-        }
-
-        /* Detlin correction */
-        cpl_msg_info(__func__, "Correct for the Non-Linearity") ;
-        if (cr2res_detlin_correct(out, calib_list)) {
-            hdrl_imagelist_delete(calib_list) ;
-            hdrl_image_delete(out);
-            cpl_msg_error(__func__, "Cannot correct for the Non-Linearity") ;
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
     }
 
-    /* Apply the dark */
+    /* Load the dark */
     if (dark != NULL) {
-        cpl_msg_info(__func__, "Correct for the dark") ;
-
-        /* Load the dark */
-        if ((calib = cr2res_io_load_MASTER_DARK(cpl_frame_get_filename(dark), 
-                        chip)) == NULL) {
+        cpl_msg_info(__func__, "Load the dark") ;
+        if ((ctx->dark = cr2res_io_load_MASTER_DARK(
+                        cpl_frame_get_filename(dark), chip)) == NULL) {
             cpl_msg_error(__func__, "Cannot load the dark") ;
-            hdrl_image_delete(out);
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
 
-        if (detlin != NULL) {
+        if (ctx->detlin != NULL) {
             cpl_msg_info(__func__, "Correct DARK for Non-Linearity") ;
-            if (cr2res_detlin_correct(calib, calib_list)) {
-                hdrl_imagelist_delete(calib_list) ;
-                hdrl_image_delete(calib) ;
-                hdrl_image_delete(out);
+            if (cr2res_detlin_correct(ctx->dark, ctx->detlin)) {
                 cpl_msg_error(__func__,"Cannot correct DARK for Non-Linearity") ;
+                cr2res_calib_context_delete(ctx) ;
                 return NULL ;
             }
         }
 
         /* Get the dark DIT */
         plist = cpl_propertylist_load(cpl_frame_get_filename(dark), 0);
-        dark_dit = cr2res_pfits_get_dit(plist) ;
+        ctx->dark_dit = cr2res_pfits_get_dit(plist) ;
         cpl_propertylist_delete(plist) ;
-        /* Multiply the dark by dit/dark_dit */
-        hdrl_value hdrl_dit_corr = {dit/dark_dit, 0.0};
-        hdrl_image_mul_scalar(calib, hdrl_dit_corr) ;
-
-        /* Subtract the dark */
-        if (hdrl_image_sub_image(out, calib) != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot apply the dark") ;
-            hdrl_image_delete(calib) ;
-            hdrl_image_delete(out);
+    }
+
+    /* Load the flat */
+    if (flat != NULL) {
+        cpl_msg_info(__func__, "Load the flat field") ;
+        if ((ctx->flat = cr2res_io_load_MASTER_FLAT(
+                        cpl_frame_get_filename(flat), chip)) == NULL) {
+            cpl_msg_error(__func__, "Cannot load the flat field") ;
+            cr2res_calib_context_delete(ctx) ;
             return NULL ;
         }
-        hdrl_image_delete(calib) ;
     }
+    cr2res_calib_context_prepare(ctx) ;
+    return ctx ;
+}
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate an image with a calibration context
+  @param    ctx     the calibration context
+  @param    in      the input hdrl image
+  @param    dit     the DIT for the dark correction
+  @return   the newly allocated image or NULL in error case
 
-    if (detlin != NULL) {
-       hdrl_imagelist_delete(calib_list) ;
+  Same as cr2res_calib_image() without loading anything. The context is
+  only read, so different images can be calibrated concurrently.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_calib_context_apply(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit)
+{
+    hdrl_image          *   out ;
+
+    /* Test entries */
+    if (ctx == NULL || in == NULL) return NULL ;
+
+    /* Create out image */
+    out = hdrl_image_duplicate(in) ;
+    if (cr2res_calib_apply_in_place(ctx, out, dit)) {
+        hdrl_image_delete(out) ;
+        return NULL ;
     }
+    return out ;
+}
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate a mapped raw image with a calibration context
+  @param    ctx     the calibration context
+  @param    raw     the mapped raw image of the context chip
+  @param    dit     the DIT for the dark correction
+  @return   the newly allocated image or NULL in error case
 
-    /* Apply the flatfield */
-    if (flat != NULL) {
-        /* Load the flat */
-        cpl_msg_info(__func__, "Load the flat field") ;
-        if ((calib = cr2res_io_load_MASTER_FLAT(
-                        cpl_frame_get_filename(flat), chip)) == NULL) {
-            cpl_msg_error(__func__, "Cannot load the flat field") ;
-            hdrl_image_delete(out);
+  Same as cr2res_io_raw_load_image() and cr2res_calib_context_apply(),
+  but the raw pixels are converted row by row with
+  cr2res_io_raw_get_rows() and calibrated with cr2res_calib_sweep_row()
+  while they are in the cache, without an intermediate image.
+  The interpolation of the bad pixels needs the whole image: with
+  clean_bad and a bpm, the image is converted first and calibrated with
+  cr2res_calib_context_apply().
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_calib_context_apply_raw(
+        const cr2res_calib_context  *   ctx,
+        const cr2res_io_raw         *   raw,
+        double                          dit)
+{
+    hdrl_image          *   out ;
+    double              *   pdata ;
+    double              *   perr ;
+    cpl_binary          *   pbpm ;
+    cpl_size                nx, ny, i, j ;
+
+    /* Test entries */
+    if (ctx == NULL || raw == NULL) return NULL ;
+
+    /* The bad pixels interpolation needs the full image */
+    if (ctx->bpm != NULL && ctx->clean_bad) {
+        if ((out = cr2res_io_raw_load_image(raw)) == NULL) return NULL ;
+        if (cr2res_calib_apply_in_place(ctx, out, dit)) {
+            hdrl_image_delete(out) ;
             return NULL ;
         }
-        
-        /* Divide */
-        cpl_msg_info(__func__, "Correct for the flat field") ;
-        if (hdrl_image_div_image(out, calib) != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot apply the flat field") ;
-            hdrl_image_delete(calib) ;
-            hdrl_image_delete(out);
+        return out ;
+    }
+
+    /* Initialise */
+    nx = cr2res_io_raw_get_size_x(raw) ;
+    ny = cr2res_io_raw_get_size_y(raw) ;
+    if (cr2res_calib_check_size(ctx, nx, ny)) return NULL ;
+    out = hdrl_image_new(nx, ny) ;
+    pdata = cpl_image_get_data_double(hdrl_image_get_image(out)) ;
+    perr = cpl_image_get_data_double(hdrl_image_get_error(out)) ;
+    pbpm = cpl_mask_get_data(cpl_image_get_bpm(hdrl_image_get_image(out))) ;
+
+    /* Convert and calibrate each row, the errors start at 0 */
+    for (j=0 ; j<ny ; j++) {
+        if (cr2res_io_raw_get_rows(raw, j+1, j+1, pdata + j * nx)) {
+            hdrl_image_delete(out) ;
             return NULL ;
         }
-        hdrl_image_delete(calib) ;
+        for (i=0 ; i<nx ; i++)
+            if (isnan(pdata[i + j * nx])) pbpm[i + j * nx] = CPL_BINARY_1 ;
+        cr2res_calib_sweep_row(ctx, j * nx, nx, dit, 1,
+                pdata + j * nx, perr + j * nx, pbpm + j * nx) ;
     }
+    cr2res_calib_cosmics(ctx, out) ;
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create an empty stack
+  @param    weighted    1 for the weighted mean, 0 for the mean
+  @return   the newly allocated stack
+
+  The images are added one at a time with cr2res_calib_stack_add(), so
+  the memory needed does not depend on their number.
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_calib_stack * cr2res_calib_stack_new(int weighted)
+{
+    cr2res_calib_stack  *   stack ;
+
+    stack = cpl_calloc(1, sizeof(cr2res_calib_stack)) ;
+    stack->weighted = weighted ;
+    return stack ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Add an image to a stack
+  @param    stack   the stack
+  @param    in      the image to add
+  @return   0 if ok, -1 otherwise
+
+  The bad pixels of in are not added. All images must have the same size.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_calib_stack_add(
+        cr2res_calib_stack  *   stack,
+        const hdrl_image    *   in)
+{
+    const double        *   pdata ;
+    const double        *   perr ;
+    const cpl_binary    *   pbpm ;
+    const cpl_mask      *   mask ;
+    double                  w ;
+    cpl_size                i, npix ;
+
+    /* Test entries */
+    if (stack == NULL || in == NULL) return -1 ;
+
+    /* The first image gives the size */
+    if (stack->sum == NULL) {
+        stack->nx = hdrl_image_get_size_x(in) ;
+        stack->ny = hdrl_image_get_size_y(in) ;
+        npix = stack->nx * stack->ny ;
+        stack->sum = cpl_calloc(npix, sizeof(double)) ;
+        stack->sum_err = cpl_calloc(npix, sizeof(double)) ;
+        stack->contrib = cpl_calloc(npix, sizeof(int)) ;
+    } else if (hdrl_image_get_size_x(in) != stack->nx ||
+            hdrl_image_get_size_y(in) != stack->ny) {
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+    npix = stack->nx * stack->ny ;
+
+    pdata = cpl_image_get_data_double_const(hdrl_image_get_image_const(in)) ;
+    perr = cpl_image_get_data_double_const(hdrl_image_get_error_const(in)) ;
+    mask = cpl_image_get_bpm_const(hdrl_image_get_image_const(in)) ;
+    pbpm = mask != NULL ? cpl_mask_get_data_const(mask) : NULL ;
+
+    /* Loop on pixels */
+    for (i=0 ; i<npix ; i++) {
+        if (pbpm != NULL && pbpm[i]) continue ;
+        if (stack->weighted) {
+            w = 1. / (perr[i] * perr[i]) ;
+            stack->sum[i] += w * pdata[i] ;
+            stack->sum_err[i] += w ;
+        } else {
+            stack->sum[i] += pdata[i] ;
+            stack->sum_err[i] += perr[i] * perr[i] ;
+        }
+        stack->contrib[i]++ ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Collapse the images added to a stack
+  @param    stack   the stack
+  @param    contrib [out] the number of good values per pixel, or NULL
+  @return   the collapsed image or NULL in error case
+
+  The mean is sum(d)/n with the error sqrt(sum(e^2))/n, the weighted mean
+  is sum(d/e^2)/sum(1/e^2) with the error 1/sqrt(sum(1/e^2)), as with
+  hdrl_imagelist_collapse_mean() and
+  hdrl_imagelist_collapse_weighted_mean(). The pixels without good value
+  are bad, with NAN values and errors as with hdrl.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_calib_stack_collapse(
+        const cr2res_calib_stack    *   stack,
+        cpl_image                   **  contrib)
+{
+    hdrl_image          *   out ;
+    double              *   pdata ;
+    double              *   perr ;
+    int                 *   pcontrib ;
+    cpl_size                i, npix ;
 
-    /* Comics correction */
-    if (cosmics_corr) {
+    /* Test entries */
+    if (stack == NULL || stack->sum == NULL) return NULL ;
+
+    /* Initialise */
+    npix = stack->nx * stack->ny ;
+    out = hdrl_image_new(stack->nx, stack->ny) ;
+    pdata = cpl_image_get_data_double(hdrl_image_get_image(out)) ;
+    perr = cpl_image_get_data_double(hdrl_image_get_error(out)) ;
+
+    /* Loop on pixels */
+    for (i=0 ; i<npix ; i++) {
+        if (stack->contrib[i] == 0) {
+            pdata[i] = perr[i] = NAN ;
+            hdrl_image_reject(out, i % stack->nx + 1, i / stack->nx + 1) ;
+        } else if (stack->weighted) {
+            pdata[i] = stack->sum[i] / stack->sum_err[i] ;
+            perr[i] = 1. / sqrt(stack->sum_err[i]) ;
+        } else {
+            pdata[i] = stack->sum[i] / stack->contrib[i] ;
+            perr[i] = sqrt(stack->sum_err[i]) / stack->contrib[i] ;
+        }
+    }
+
+    if (contrib != NULL) {
+        *contrib = cpl_image_new(stack->nx, stack->ny, CPL_TYPE_INT) ;
+        pcontrib = cpl_image_get_data_int(*contrib) ;
+        for (i=0 ; i<npix ; i++) pcontrib[i] = stack->contrib[i] ;
+    }
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a stack
+  @param    stack   the stack to delete
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_calib_stack_delete(cr2res_calib_stack * stack)
+{
+    if (stack == NULL) return ;
+    cpl_free(stack->sum) ;
+    cpl_free(stack->sum_err) ;
+    cpl_free(stack->contrib) ;
+    cpl_free(stack) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate and collapse the frames of a set one by one
+  @param    raws    the raw frames
+  @param    ctx     the calibration context, it gives the chip
+  @param    dits    the DITs of the frames for the dark correction or NULL
+  @param    contrib [out] the number of good values per pixel, or NULL
+  @return   the mean of the calibrated frames or NULL in error case
+
+  Same result as cr2res_io_load_image_list_from_set(),
+  cr2res_calib_imagelist() and hdrl_imagelist_collapse_mean(), but only
+  one frame is held in memory at a time.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_calib_frameset_collapse_mean(
+        const cpl_frameset          *   raws,
+        const cr2res_calib_context  *   ctx,
+        const cpl_vector            *   dits,
+        cpl_image                   **  contrib)
+{
+    cr2res_calib_stack  *   stack ;
+    cr2res_io_raw       *   raw ;
+    hdrl_image          *   ima ;
+    hdrl_image          *   ima_calib ;
+    hdrl_image          *   out ;
+    const char          *   fname ;
+    double                  dit ;
+    cpl_size                i, nframes ;
+
+    /* Test entries */
+    if (raws == NULL || ctx == NULL) return NULL ;
+    nframes = cpl_frameset_get_size(raws) ;
+    if (nframes < 1) return NULL ;
+    if (ctx->dark != NULL && (dits == NULL ||
+                cpl_vector_get_size(dits) < nframes)) {
+        cpl_msg_error(__func__, "The DITs are needed for the dark") ;
+        return NULL ;
+    }
+
+    /* Loop on the frames */
+    stack = cr2res_calib_stack_new(0) ;
+    for (i=0 ; i<nframes ; i++) {
+        fname = cpl_frame_get_filename(cpl_frameset_get_position_const(raws,
+                    i)) ;
+        dit = dits != NULL ? cpl_vector_get(dits, i) : 0.0 ;
+
+        /* The uncompressed raw pixels are converted while calibrating */
+        if ((raw = cr2res_io_raw_open(fname, ctx->chip)) != NULL) {
+            ima_calib = cr2res_calib_context_apply_raw(ctx, raw, dit) ;
+            cr2res_io_raw_close(raw) ;
+        } else {
+            if ((ima = cr2res_io_load_image(fname, ctx->chip)) == NULL) {
+                cpl_msg_error(__func__, "Cannot load the image from %s",
+                        fname) ;
+                cr2res_calib_stack_delete(stack) ;
+                return NULL ;
+            }
+            ima_calib = cr2res_calib_context_apply(ctx, ima, dit) ;
+            hdrl_image_delete(ima) ;
+        }
+        if (ima_calib == NULL || cr2res_calib_stack_add(stack, ima_calib)) {
+            cpl_msg_error(__func__, "Cannot calibrate the image from %s",
+                    fname) ;
+            if (ima_calib != NULL) hdrl_image_delete(ima_calib) ;
+            cr2res_calib_stack_delete(stack) ;
+            return NULL ;
+        }
+        hdrl_image_delete(ima_calib) ;
+    }
+    out = cr2res_calib_stack_collapse(stack, contrib) ;
+    cr2res_calib_stack_delete(stack) ;
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a calibration context
+  @param    ctx     the context to delete
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_calib_context_delete(cr2res_calib_context * ctx)
+{
+    if (ctx == NULL) return ;
+    if (ctx->bpm != NULL) cpl_mask_delete(ctx->bpm) ;
+    if (ctx->detlin != NULL) hdrl_imagelist_delete(ctx->detlin) ;
+    if (ctx->dark != NULL) hdrl_image_delete(ctx->dark) ;
+    if (ctx->flat != NULL) hdrl_image_delete(ctx->flat) ;
+    cpl_free(ctx) ;
+}
+
+/**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Keep the pixel buffers of the calibrations in the context
+  @param    ctx     the calibration context
+  @return   nothing
+
+  The dark and the flat get an empty bad pixel map if they have none, so
+  that the sweep does not need to test for it.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_calib_context_prepare(cr2res_calib_context * ctx)
+{
+    const hdrl_image    *   coeff ;
+    int                     k ;
+
+    if (ctx->bpm != NULL) ctx->pbpm = cpl_mask_get_data_const(ctx->bpm) ;
+    if (ctx->detlin != NULL) {
+        for (k=0 ; k<3 ; k++) {
+            coeff = hdrl_imagelist_get_const(ctx->detlin, k) ;
+            if (coeff == NULL) continue ;
+            ctx->pcoeff[k] = cpl_image_get_data_double_const(
+                    hdrl_image_get_image_const(coeff)) ;
+            ctx->perrcoeff[k] = cpl_image_get_data_double_const(
+                    hdrl_image_get_error_const(coeff)) ;
+        }
+    }
+    if (ctx->dark != NULL) {
+        ctx->pdark = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(ctx->dark)) ;
+        ctx->perrdark = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(ctx->dark)) ;
+        ctx->pbpmdark = cpl_mask_get_data_const(
+                cpl_image_get_bpm(hdrl_image_get_image(ctx->dark))) ;
+    }
+    if (ctx->flat != NULL) {
+        ctx->pflat = cpl_image_get_data_double_const(
+                hdrl_image_get_image_const(ctx->flat)) ;
+        ctx->perrflat = cpl_image_get_data_double_const(
+                hdrl_image_get_error_const(ctx->flat)) ;
+        ctx->pbpmflat = cpl_mask_get_data_const(
+                cpl_image_get_bpm(hdrl_image_get_image(ctx->flat))) ;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check that the calibrations of a context have the data size
+  @param    ctx     the calibration context
+  @param    nx      the data size in x
+  @param    ny      the data size in y
+  @return   0 if the sizes match, -1 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_calib_check_size(
+        const cr2res_calib_context  *   ctx,
+        cpl_size                        nx,
+        cpl_size                        ny)
+{
+    const hdrl_image    *   im ;
+    int                     k ;
+
+    if (ctx->bpm != NULL && (cpl_mask_get_size_x(ctx->bpm) != nx ||
+                cpl_mask_get_size_y(ctx->bpm) != ny)) {
+        cpl_msg_error(__func__, "Cannot clean the bad pixels") ;
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+    if (ctx->detlin != NULL) {
+        for (k=0 ; k<3 ; k++) {
+            im = hdrl_imagelist_get_const(ctx->detlin, k) ;
+            if (im == NULL || hdrl_image_get_size_x(im) != nx ||
+                    hdrl_image_get_size_y(im) != ny) {
+                cpl_msg_error(__func__,
+                        "Cannot correct for the Non-Linearity") ;
+                cpl_msg_error(__func__, "Incompatible sizes") ;
+                return -1 ;
+            }
+        }
+    }
+    if (ctx->dark != NULL && (hdrl_image_get_size_x(ctx->dark) != nx ||
+                hdrl_image_get_size_y(ctx->dark) != ny)) {
+        cpl_msg_error(__func__, "Cannot apply the dark") ;
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+    if (ctx->flat != NULL && (hdrl_image_get_size_x(ctx->flat) != nx ||
+                hdrl_image_get_size_y(ctx->flat) != ny)) {
+        cpl_msg_error(__func__, "Cannot apply the flat field") ;
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate an image in place with a calibration context
+  @param    ctx     the calibration context
+  @param    out     the image to calibrate
+  @param    dit     the DIT for the dark correction
+  @return   0 if ok, -1 in error case
+
+  The image is calibrated row by row with cr2res_calib_sweep_row(). The
+  interpolation of the bad pixels needs their neighbours, so it is done
+  on the whole image before, and the bad pixels are then not masked
+  again in the sweep.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_calib_apply_in_place(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out,
+        double                          dit)
+{
+    double              *   pdata ;
+    double              *   perr ;
+    cpl_binary          *   pbpm ;
+    cpl_size                nx, ny, j ;
+
+    /* Initialise */
+    nx = hdrl_image_get_size_x(out) ;
+    ny = hdrl_image_get_size_y(out) ;
+    if (cr2res_calib_check_size(ctx, nx, ny)) return -1 ;
+
+    /* Clean the bad pixels */
+    if (ctx->bpm != NULL && ctx->clean_bad) {
+        cpl_msg_debug(__func__, "Correct the bad pixels") ;
+        cpl_image_reject_from_mask(hdrl_image_get_image(out), ctx->bpm);
+        if (cpl_detector_interpolate_rejected(
+                    hdrl_image_get_image(out)) != CPL_ERROR_NONE) {
+            cpl_error_reset();
+            cpl_msg_error(__func__, "Cannot clean the BPM") ;
+            cpl_msg_error(__func__, "Cannot clean the bad pixels");
+            return -1 ;
+        }
+    }
+
+    /* Mask the bad pixels, apply the non linearity, the dark and the */
+    /* flat in one pass */
+    cpl_msg_debug(__func__,
+            "Correct the bad pixels, the Non-Linearity, dark and flat") ;
+    pdata = cpl_image_get_data_double(hdrl_image_get_image(out)) ;
+    perr = cpl_image_get_data_double(hdrl_image_get_error(out)) ;
+    pbpm = cpl_mask_get_data(cpl_image_get_bpm(hdrl_image_get_image(out))) ;
+    for (j=0 ; j<ny ; j++)
+        cr2res_calib_sweep_row(ctx, j * nx, nx, dit, !ctx->clean_bad,
+                pdata + j * nx, perr + j * nx, pbpm + j * nx) ;
+    cr2res_calib_cosmics(ctx, out) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Correct a calibrated image for the cosmics
+  @param    ctx     the calibration context
+  @param    out     the image to correct
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_calib_cosmics(
+        const cr2res_calib_context  *   ctx,
+        hdrl_image                  *   out)
+{
+    /* Cosmics correction */
+    if (ctx->cosmics_corr) {
         cpl_msg_info(__func__, "Apply the cosmics corrections") ;
         /* TODO */
         cpl_msg_info(__func__, "NOT YET IMPLEMENTED") ;
     }
-    return out ;
 }
 
-/**@}*/
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Calibrate consecutive pixels in place in one pass
+  @param    ctx         the calibration context
+  @param    offset      the index of the first pixel in the calibrations
+  @param    nx          the number of pixels, usually one row
+  @param    dit         the DIT for the dark correction
+  @param    mask_bpm    flag to mark the bad pixels of the context
+  @param    pdata       [in/out] the pixel values [nx]
+  @param    perr        [in/out] the pixel errors [nx]
+  @param    pbpm        [in/out] the pixel bad pixel flags [nx]
+  @return   nothing
 
+  Each pixel goes through the same operations as with
+  cpl_image_reject_from_mask(), cr2res_detlin_correct(),
+  hdrl_image_mul_scalar() on the dark, hdrl_image_sub_image() and
+  hdrl_image_div_image(), in this order:
+  - the bad pixels of the context are marked, if mask_bpm is set
+  - the non linearity is corrected above CR2RES_DETLIN_THRESHOLD, also
+    on the bad pixels, with cr2res_detlin_correct_pixel()
+  - the dark and the flat skip the pixels that are already bad, and mark
+    the pixels that are bad in the dark or in the flat
+  - a division by a zero flat gives NaN and a bad pixel
+  Each step is one branch free loop on the pixels, which the compiler
+  vectorizes, and the pixels stay in the cache from one step to the
+  next. The steps work on the variances: the errors are squared at the
+  start and their square roots taken at the end, in a loop that stays
+  scalar as sqrt() sets errno. The errors may thus differ from the hdrl
+  operations in the last bits.
+  The sizes must have been checked by the caller.
+ */
+/*----------------------------------------------------------------------------*/
+static CR2RES_CALIB_SIMD void cr2res_calib_sweep_row(
+        const cr2res_calib_context  *   ctx,
+        cpl_size                        offset,
+        cpl_size                        nx,
+        double                          dit,
+        int                             mask_bpm,
+        double                      *   pdata,
+        double                      *   perr,
+        cpl_binary                  *   pbpm)
+{
+    const double        *   pa ;
+    const double        *   pea ;
+    const double        *   pb ;
+    const double        *   peb ;
+    const double        *   pc ;
+    const double        *   pec ;
+    const double        *   pdark ;
+    const double        *   perrdark ;
+    const cpl_binary    *   pbpmdark ;
+    const double        *   pflat ;
+    const double        *   perrflat ;
+    const cpl_binary    *   pbpmflat ;
+    const cpl_binary    *   pmask ;
+    double                  dit_corr ;
+    cpl_size                i ;
+
+    /* Bad pixels, and the errors to variances */
+    if (mask_bpm && ctx->pbpm != NULL) {
+        pmask = ctx->pbpm + offset ;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for (i=0 ; i<nx ; i++) pbpm[i] |= pmask[i] ;
+    }
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (i=0 ; i<nx ; i++) perr[i] *= perr[i] ;
+
+    /* Non linearity, as in cr2res_detlin_correct() */
+    if (ctx->detlin != NULL) {
+        pa = ctx->pcoeff[0] + offset ;
+        pea = ctx->perrcoeff[0] + offset ;
+        pb = ctx->pcoeff[1] + offset ;
+        peb = ctx->perrcoeff[1] + offset ;
+        pc = ctx->pcoeff[2] + offset ;
+        pec = ctx->perrcoeff[2] + offset ;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for (i=0 ; i<nx ; i++) {
+            double  d = pdata[i] ;
+            double  v = perr[i] ;
+            double  dc = d ;
+            double  vc = v ;
+            int     linear = d < CR2RES_DETLIN_THRESHOLD ;
+
+            cr2res_detlin_correct_pixel(pa[i], pea[i], pb[i], peb[i], pc[i],
+                    pec[i], &dc, &vc) ;
+            pdata[i] = cr2res_calib_select(linear, d, dc) ;
+            perr[i] = cr2res_calib_select(linear, v, vc) ;
+        }
+    }
+
+    /* Dark scaled by dit/dark_dit, the bad pixels are left untouched */
+    if (ctx->dark != NULL) {
+        dit_corr = dit / ctx->dark_dit ;
+        pdark = ctx->pdark + offset ;
+        perrdark = ctx->perrdark + offset ;
+        pbpmdark = ctx->pbpmdark + offset ;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for (i=0 ; i<nx ; i++) {
+            double  d = pdata[i] ;
+            double  v = perr[i] ;
+            double  ev = perrdark[i] * dit_corr ;
+            double  dn = d - pdark[i] * dit_corr ;
+            double  vn = v + ev * ev ;
+            int     skip = pbpm[i] | pbpmdark[i] ;
+
+            pdata[i] = cr2res_calib_select(skip, d, dn) ;
+            perr[i] = cr2res_calib_select(skip, v, vn) ;
+            pbpm[i] = skip ? CPL_BINARY_1 : CPL_BINARY_0 ;
+        }
+    }
+
+    /* Flat, the bad pixels are left untouched */
+    if (ctx->flat != NULL) {
+        pflat = ctx->pflat + offset ;
+        perrflat = ctx->perrflat + offset ;
+        pbpmflat = ctx->pbpmflat + offset ;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for (i=0 ; i<nx ; i++) {
+            double  d = pdata[i] ;
+            double  v = perr[i] ;
+            double  f = pflat[i] ;
+            double  ef = perrflat[i] * d / (f * f) ;
+            double  q = d / f ;
+            double  vq = v / (f * f) + ef * ef ;
+            int     skip = pbpm[i] | pbpmflat[i] ;
+            int     zero = f == 0. ;
+
+            pdata[i] = cr2res_calib_select(skip, d,
+                    cr2res_calib_select(zero, NAN, q)) ;
+            perr[i] = cr2res_calib_select(skip, v,
+                    cr2res_calib_select(zero, NAN, vq)) ;
+            pbpm[i] = (skip || zero) ? CPL_BINARY_1 : CPL_BINARY_0 ;
+        }
+    }
+
+    /* Variances back to errors */
+    for (i=0 ; i<nx ; i++) perr[i] = sqrt(perr[i]) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Branch free choice between two values
+  @param    cond    the condition
+  @param    a       the value if cond is true
+  @param    b       the value if cond is false
+  @return   a or b
+
+  Both values are computed before and blended with integer masks. With
+  ?: the compiler moves their computation into branches, as it could
+  raise floating point exceptions, and the loop is not vectorized.
+ */
+/*----------------------------------------------------------------------------*/
+static inline double cr2res_calib_select(int cond, double a, double b)
+{
+    union { double d ; uint64_t u ; } ua, ub ;
+    uint64_t    mask = -(uint64_t)(cond != 0) ;
+
+    ua.d = a ;
+    ub.d = b ;
+    ua.u = (ua.u & mask) | (ub.u & ~mask) ;
+    return ua.d ;
+}
@@ -27,6 +27,8 @@
 #include <cpl.h>
 #include "hdrl.h"
 
+#include "cr2res_io.h"
+
 /*-----------------------------------------------------------------------------
                                     Define
  -----------------------------------------------------------------------------*/
@@ -39,6 +41,12 @@ typedef enum {
     CR2RES_COLLAPSE_MEDIAN,
 } cr2res_collapse ;
 
+/* Calibration data of one chip, loaded once for many images */
+typedef struct _cr2res_calib_context_ cr2res_calib_context ;
+
+/* Running sums to collapse images that are added one by one */
+typedef struct _cr2res_calib_stack_ cr2res_calib_stack ;
+
 /*-----------------------------------------------------------------------------
                                 Prototypes
  -----------------------------------------------------------------------------*/
@@ -54,6 +62,45 @@ hdrl_imagelist * cr2res_calib_imagelist(
         const cpl_frame         *   detlin,
         const cpl_vector        *   dits) ;
 
+cr2res_calib_context * cr2res_calib_context_new(
+        int                     chip,
+        int                     clean_bad,
+        int                     cosmics_corr,
+        const cpl_frame     *   flat,
+        const cpl_frame     *   dark,
+        const cpl_frame     *   bpm,
+        const cpl_frame     *   detlin) ;
+
+hdrl_image * cr2res_calib_context_apply(
+        const cr2res_calib_context  *   ctx,
+        const hdrl_image            *   in,
+        double                          dit) ;
+
+hdrl_image * cr2res_calib_context_apply_raw(
+        const cr2res_calib_context  *   ctx,
+        const cr2res_io_raw         *   raw,
+        double                          dit) ;
+
+void cr2res_calib_context_delete(cr2res_calib_context * ctx) ;
+
+cr2res_calib_stack * cr2res_calib_stack_new(int weighted) ;
+
+int cr2res_calib_stack_add(
+        cr2res_calib_stack  *   stack,
+        const hdrl_image    *   in) ;
+
+hdrl_image * cr2res_calib_stack_collapse(
+        const cr2res_calib_stack    *   stack,
+        cpl_image                   **  contrib) ;
+
+void cr2res_calib_stack_delete(cr2res_calib_stack * stack) ;
+
+hdrl_image * cr2res_calib_frameset_collapse_mean(
+        const cpl_frameset          *   raws,
+        const cr2res_calib_context  *   ctx,
+        const cpl_vector            *   dits,
+        cpl_image                   **  contrib) ;
+
 hdrl_image * cr2res_calib_image(
         const hdrl_image    *   in,
         int                     chip,
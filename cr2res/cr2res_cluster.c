@@ -25,23 +25,87 @@
                                    Includes
  -----------------------------------------------------------------------------*/
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <cpl.h>
 #include "cr2res_dfs.h"
+#include "cr2res_utils.h"
 #include "cr2res_cluster.h"
 
 /*-----------------------------------------------------------------------------
                                    Defines
  -----------------------------------------------------------------------------*/
 
-#define SWAP(r,s)  do{int t=r; r=s; s=t; } while(0)
+struct _cr2res_cluster_labels_ {
+    int             nx ;
+    int             ny ;
+    cpl_size        nruns ;
+    int         *   run_y ;     /* Runs in the image order, from 0 */
+    int         *   run_x0 ;    /* First pixel of the run */
+    int         *   run_x1 ;    /* Last pixel of the run */
+    cpl_size    *   run_label ; /* From 1, 0 for the filtered runs */
+    cpl_size        nlabels ;
+    cpl_size    *   npix ;      /* Per label */
+    int         *   llx ;       /* Per label bounding box, from 0 */
+    int         *   lly ;
+    int         *   urx ;
+    int         *   ury ;
+} ;
 
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
-static void siftDown(int *a, int *i, int start, int end) ;
-static void isort(int *a, int *i, int count) ;
-static int * diag_sort(int *x, int *y, int *index, int n, int nX, int nY) ;
+static cr2res_cluster_labels * cr2res_cluster_labels_create(
+        const cpl_mask  *   mask,
+        int                 diagonal,
+        cpl_size            min_npix) ;
+static int cr2res_cluster_compare(const void * a, const void * b) ;
+static uint64_t * cr2res_cluster_bits_pack(
+        const cpl_mask  *   mask,
+        int             *   nwords) ;
+static cpl_mask * cr2res_cluster_bits_unpack(
+        const uint64_t  *   bits,
+        int                 nwords,
+        int                 nx,
+        int                 ny) ;
+static uint64_t cr2res_cluster_bits_shifted(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 w,
+        int                 s) ;
+static void cr2res_cluster_bits_filter_row(
+        const uint64_t  *   in,
+        const uint64_t  *   copy,
+        const uint64_t  *   border,
+        int                 nwords,
+        int                 hx,
+        int                 dilate,
+        uint64_t        *   out) ;
+static int cr2res_cluster_bits_next(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 nx,
+        int                 x,
+        int                 value) ;
+static cpl_size cr2res_cluster_bits_runs(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 nx,
+        int             *   x0,
+        int             *   x1) ;
+static cpl_size cr2res_cluster_find(
+        cpl_size    *   parent,
+        cpl_size        i) ;
+static cpl_size cr2res_cluster_union(
+        cpl_size    *   parent,
+        cpl_size    *   size,
+        cpl_size        a,
+        cpl_size        b) ;
 
 /*----------------------------------------------------------------------------*/
 /**
@@ -51,463 +115,792 @@ static int * diag_sort(int *x, int *y, int *index, int n, int nX, int nY) ;
 
 /**@{*/
 
-int locate_clusters(int argc, void *argv[])
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Detect the clusters of pixels of a mask
+  @param    mask        The input mask
+  @param    mincluster  Minimum number of pixels of a cluster
+  @return   The newly allocated cluster table or NULL in error case
+
+  The table has one row per selected pixel of the mask, in the columns
+  order (y runs faster), with the columns CR2RES_COL_XS, CR2RES_COL_YS
+  (pixel positions, from 1) and CR2RES_COL_CLUSTERS.
+  A cluster contains all the pixels adjacent to one of its pixels,
+  including the diagonal neighbours. The clusters are numbered from 1, in
+  the table order of their first pixel. The pixels of the clusters with
+  less than mincluster pixels are not members of any cluster (0).
+
+  The mask runs are merged with a union-find that keeps the clusters
+  sizes, so that the small clusters are dropped when the clusters are
+  numbered, right after the merge.
+ */
+/*----------------------------------------------------------------------------*/
+cpl_table * cr2res_cluster_detect(
+        cpl_mask    *   mask,
+        int             mincluster)
 {
-/*
- locate_clusters takes a 2D integer array with horizontal structures
- (spectral orders) in it  and returns X and Y coodinates of pixels
- "with signal" in two integer arrays. Pixel selection is based on a
- simple comparizon of a box-car filtered image with the original. The
- filtering (smoothing) is done in vertical direction. Pixels in the
- original image that have higher counts than the smoothed image are
- considered to have "signal". An optional "noise" parameter is used to
- control the selection threshold thus allowing for more robust
- discrimination. On exit locate_clusters returns the number of pixels
- "with signal" (int) or negative number indicating an error condition.
- This function has 7 mandatory and two optional
- parameters passed by pointers. The mandatory parameters are:
-   nX     - (input, int) number of columns in the input array;
-   nY     - (input, int) number of rows in the input array;
-   filter - (input, int) filter window. Filtered value in pixel [x,y] is
-            1/filter * sum(i=x-filter/2,x+filter/2) Image[x,i];
-   im     - (input, *int) image;
-   nmax   - (input, int) size of the allocated arrays for pixels with signal;
-   x      - (ouput, *int) array that will hold X-coordinates of pixels with
-            signal. This array must be allocated prior to calling locate
-            clusters. The allocated size is passed
-   y      - (ouput, *int) array that will hold Y-coordinates of pixels with
-            signal;
-
- Optional parameters are:
-   noise  - (input, float) extra margin for selecting pixels with signal.
-            The selection condition is thus: im[x,y] > im_smoothed[x,y]+noise.
-            The default value is 1;
-   mask   - (input, *unsigned char) mask of bad pixels. 0 - bad pixel, good
-            otherwise.
-
- Returning negative number indicates an error:
-   -1     - not all mandatory arguments were specified;
-   -2     -
-
- WARNING: locate_clusters do not check the consitency between the actual size
-          of the arrays and their given dimensions.
-
-  A typical call from IDL may look like this:
-
-  nx=size(im[*,0])
-  ny=size(im[0,*])
-  nmax=nx*ny
-  x=lonarr(nmax)
-  y=lonarr(nmax)
-  filter=25L
-  noise=8.
-  n=call_external(<DLL name>,'locate_clusters',nx,ny,filter $
-                  ,long(im),nmax,x,y,noise)
-
- History: 17-Jul-2000 N.Piskunov wrote the IDL version.
-          02-Jan-2014 N.Piskunov ported this routine to C.
-*/
-  int nX, nY, *im, *x, *y, filter, nmax, n;
-  unsigned char *mask;
-  float noise;
-  int iX, iY, half, has_mask;
-  float offset, box, nbox;
-
-  if(argc<7) return -1;
-  nX    =*(int *)argv[0];
-  nY    =*(int *)argv[1];
-  filter=*(int *)argv[2];
-  im    = (int *)argv[3];
-  nmax  =*(int *)argv[4];
-  x     = (int *)argv[5];
-  y     = (int *)argv[6];
-  noise = (argc>7)?*(float *)argv[7]:1.;
-  if(argc>8)
-  {
-    mask  = (unsigned char *)argv[8];
-    has_mask=1;
-  }
-  else has_mask=0;
-
-  n=0;
-  half=filter/2;
-  if(has_mask)
-  {
-    for(iX=0; iX<nX; iX++)
-    {
-      box=0.; nbox=0;
-      for(iY=0; iY<half; iY++) {box+=*(im+iY*nX+iX); nbox++;}
-      for(iY=0; iY<nY; iY++)
-      {
-        if(iY+half<nY) {box+=*(im+(iY+half)*nX+iX); nbox++;}
-        if(iY-half>=0) {box-=*(im+(iY-half)*nX+iX); nbox--;}
-        if(*(im+iY*nX+iX)>box/nbox+noise && *(mask+iY*nX+iX))
-        {
-          if(n==nmax) return -2;
-          x[n]=iX; y[n]=iY; n++;
-        }
-      }
+    cr2res_cluster_labels   *   labels ;
+    cpl_table               *   table ;
+    cpl_size                *   first ;
+    cpl_size                *   cursor ;
+    int                     *   translation ;
+    int                     *   pxs ;
+    int                     *   pys ;
+    int                     *   pclusters ;
+    cpl_size                    r, k, lab, npix, nlabels, count, key ;
+    int                         x, nx, ny ;
+
+    /* Check entries */
+    if (mask == NULL) return NULL ;
+
+    /* Find the clusters */
+    if ((labels = cr2res_cluster_labels_create(mask, 1,
+                    mincluster > 1 ? mincluster : 1)) == NULL) {
+        cpl_msg_error(__func__, "Cannot find the clusters") ;
+        return NULL ;
     }
-  }
-  else
-  {
-    for(iX=0; iX<nX; iX++)
-    {
-      box=0.; nbox=0;
-      for(iY=0; iY<half; iY++) {box+=*(im+iY*nX+iX); nbox++;}
-      for(iY=0; iY<nY; iY++)
-      {
-        if(iY+half<nY) {box+=*(im+(iY+half)*nX+iX); nbox++;}
-        if(iY-half>=0) {box-=*(im+(iY-half)*nX+iX); nbox--;}
-        if(*(im+iY*nX+iX)>box/nbox+noise)
-        {
-          if(n==nmax) return -2;
-          x[n]=iX; y[n]=iY; n++;
+    nx = labels->nx ;
+    ny = labels->ny ;
+    nlabels = labels->nlabels ;
+    cpl_msg_debug(__func__, "mask: %d %d, %"CPL_SIZE_FORMAT" clusters",
+            nx, ny, nlabels) ;
+
+    /* Renumber the clusters in the columns order of their first pixel */
+    first = cpl_malloc((nlabels+1) * sizeof(cpl_size)) ;
+    for (lab=0 ; lab<nlabels ; lab++) first[lab] = -1 ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        lab = labels->run_label[r] - 1 ;
+        if (lab < 0) continue ;
+        key = (cpl_size)labels->run_x0[r] * ny + labels->run_y[r] ;
+        if (first[lab] < 0 || key < first[lab]) first[lab] = key ;
+    }
+    for (lab=0 ; lab<nlabels ; lab++) first[lab] = first[lab]*nlabels + lab ;
+    qsort(first, nlabels, sizeof(cpl_size), cr2res_cluster_compare) ;
+    translation = cpl_malloc((nlabels+1) * sizeof(int)) ;
+    for (lab=0 ; lab<nlabels ; lab++)
+        translation[first[lab] % nlabels] = (int)lab + 1 ;
+    cpl_free(first) ;
+
+    /* First row of each column */
+    cursor = cpl_calloc(nx+1, sizeof(cpl_size)) ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        cursor[labels->run_x0[r]]++ ;
+        cursor[labels->run_x1[r]+1]-- ;
+    }
+    npix = count = 0 ;
+    for (x=0 ; x<nx ; x++) {
+        count += cursor[x] ;
+        cursor[x] = npix ;
+        npix += count ;
+    }
+
+    /* Put result into a table */
+    table = cpl_table_new(npix) ;
+    cpl_table_new_column(table, CR2RES_COL_XS, CPL_TYPE_INT) ;
+    cpl_table_new_column(table, CR2RES_COL_YS, CPL_TYPE_INT) ;
+    cpl_table_new_column(table, CR2RES_COL_CLUSTERS, CPL_TYPE_INT) ;
+    if (npix > 0) {
+        pxs = cpl_table_get_data_int(table, CR2RES_COL_XS) ;
+        pys = cpl_table_get_data_int(table, CR2RES_COL_YS) ;
+        pclusters = cpl_table_get_data_int(table, CR2RES_COL_CLUSTERS) ;
+
+        /* The runs are sorted by y, so are the pixels of each column */
+        for (r=0 ; r<labels->nruns ; r++) {
+            lab = labels->run_label[r] ;
+            for (x=labels->run_x0[r] ; x<=labels->run_x1[r] ; x++) {
+                k = cursor[x]++ ;
+                pxs[k] = x + 1 ;
+                pys[k] = labels->run_y[r] + 1 ;
+                pclusters[k] = lab > 0 ? translation[lab-1] : 0 ;
+            }
         }
-      }
     }
-  }
-  return n;
+    cpl_free(cursor) ;
+    cpl_free(translation) ;
+    cr2res_cluster_labels_delete(labels) ;
+    return table ;
 }
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Identify clusters of pixels
-  @param    x   X positions of detected pixels
-  @param    y   Y positions of detected pixels
-  @param    n   Number of pixels
-  @return   0 if everything is ok
-  Cluster takes two 1D integer arrays with X and Y coodinates of
-  pixels somehow selected in a 2D (Nx,Ny) array and identifies
-  clusters of pixels. X and Y should be Y-sorted, that is X should run faster
-  while Y should increase monotonously. If that is not the case, it could be
-  achieved with the following commands:
-  i=sort(Y*2L^15+X) & Y=Y(i) & X=X(i)
-  A cluster is defined so that every pixel in a cluster is adjacent to at
-  list one other pixel from the same cluster (their X and Y coordinates do
-  not differ by more then 1) and all the pixels that are adjacent to any
-  pixel in a cluster belong ; to the same cluster.
-  The function returns a 1D integer array of the same size as X and Y
-  that contains cluster number for each pixel. Non-cluster members
-  are marked with 0.
-  Other parameters:
-    thres    - (input) consider clusters with "threshold"
-               or smaller number of members to be non-clustered (index eq 0)
-    index    - (output) integer array of the same size as x and y containing
-               cluster number that contains pixel with coordinates [x, y]
-    nregions - (output) contain the number of identified clusters also
-               counting non-cluster pixels (if any) as a separate cluster
-
-  History: 17-July-2000 N.Piskunov wrote the version optimized for
-                        clusters oriented preferentially along rows or
-                        columns.
-           21-July-2000 N.Piskunov modified to handle arbitrary oriented
-                        clusters in the optimal way. It is slower than the
-                        original version by about 10% for spectral orders
-                        which are nearly horizontal/vertical.
+  @brief    Horizontal opening of a mask
+  @param    mask        The input mask
+  @param    kernel_x    The (odd) size of the 1D horizontal kernel
+  @return   The newly allocated opened mask or NULL in error case
+
+  The mask is bit-packed (64 pixels per word), eroded then dilated by
+  the kernel_x x 1 kernel, one word at a time.
+  As with CPL_BORDER_COPY, the kernel_x/2 pixels on the left and right
+  borders of each row are copied from the input.
  */
 /*----------------------------------------------------------------------------*/
-int cluster(int *x, int *y, int n, int nX, int nY, int thres, int *index)
+cpl_mask * cr2res_cluster_opening_x(
+        const cpl_mask  *   mask,
+        int                 kernel_x)
 {
-  //int *x, *y, n, nX, nY, thres, *index;
-  int *Xsort, *i2X, *X2i, *Ysort, *i2Y, *Y2i,
-      *Lsort, *i2L, *L2i, *Rsort, *i2R, *R2i,
-      *dummy, *dummy1;
-  int i, j[9], jj, nj, njj, j1, j2, iX, iY, n_branches;
-  int threshold, nregions;
-  int min_clr, max_clr, clrs[9], *uniq_clr, *translation;
-
-  //if(argc<7) return -1;
-  //x=(int *)argv[0];
-  //y=(int *)argv[1];
-  //n=*(int *)argv[2];
-  if(n<=0) return -2;
-  //nX=*(int *)argv[3];
-  //nY=*(int *)argv[4];
-  if(n>nX*nY) return -4;
-  //thres=*(int *)argv[5];
-  //index=(int *)argv[6];
-
-  dummy =(int *)cpl_malloc(n*sizeof(int));
-  dummy1=(int *)cpl_malloc(n*sizeof(int));
-
-  i2X   =(int *)cpl_malloc(n*sizeof(int));
-  X2i   =(int *)cpl_malloc(n*sizeof(int));
-
-  i2Y   =(int *)cpl_malloc(n*sizeof(int));
-  Y2i   =(int *)cpl_malloc(n*sizeof(int));
-
-  i2L   =(int *)cpl_malloc(n*sizeof(int));
-  L2i   =(int *)cpl_malloc(n*sizeof(int));
-
-  i2R   =(int *)cpl_malloc(n*sizeof(int));
-  R2i   =(int *)cpl_malloc(n*sizeof(int));
-
-  for(i=0; i<n; i++) index[i]=0;
-
-/*
-   The initial X and Y are Y-sorted, which
-   means that X runs faster while Y is
-   increasing monotonously.
-*/
-
-  for(i=0; i<n; i++) dummy[i]=x[i]+y[i]*nX;
-  isort(dummy, X2i, n);                  /* X-sorted indices for each i     */
-  for(i=0;i<n;i++) i2X[X2i[i]]=i;        /* i-value for each X-sorted index */
-
-  for(i=0; i<n; i++) dummy[i]=y[i]+x[i]*nY;
-  isort(dummy, Y2i, n);                  /* Y-sorted indices for each i     */
-  for(i=0;i<n;i++) i2Y[Y2i[i]]=i;        /* i-value for each Y-sorted index */
-
-  diag_sort(x, y, dummy, n, nX, nY);
-  isort(dummy, L2i, n);                  /* Left-diag-sorted indices for each i     */
-  for(i=0; i<n; i++) i2L[L2i[i]]=i;      /* i-value for each left-diag-sorted index */
-
-  for(i=0; i<n; i++) dummy1[i]=nX-1-x[i];
-  diag_sort(dummy1, y, dummy, n, nX, nY);
-  isort(dummy, R2i, n);                  /* Right-diag-sorted indices for each i     */
-  for(i=0; i<n; i++) i2R[R2i[i]]=i;      /* i-value for each right-diag-sorted index */
-
-  cpl_free(dummy);
-  cpl_free(dummy1);
-
-  translation=(int *)cpl_calloc(n+1, sizeof(int)); /* Color look-up table */
-
-  n_branches=0;                          /* Branch counter */
-
-  jj=0;
-  for(i=0;i<n;i++)                       /* Loop through pixels */
-  {
-    nj=1;
-    j[0]= i;                             /* Mark the current pixel i    */
-
-    j1=i2X[i];                           /* X-sorted number of pixel i  */
-    j2=j1-1;                             /* Previous X-sorted number    */
-    if(j2>=0 && x[X2i[j2]]+1==x[i] && y[X2i[j2]]==y[i]) j[nj++]=X2i[j2];
-    j2=j1+1;                             /* Next X-sorted number        */
-    if(j2<n  && x[X2i[j2]]-1==x[i] && y[X2i[j2]]==y[i]) j[nj++]=X2i[j2];
-
-    j1=i2Y[i];                           /* X-sorted number of pixel i  */
-    j2=j1-1;                             /* Previous X-sorted number    */
-    if(j2>=0 && x[Y2i[j2]]==x[i] && y[Y2i[j2]]+1==y[i]) j[nj++]=Y2i[j2];
-    j2=j1+1;                             /* Next X-sorted number        */
-    if(j2<n  && x[Y2i[j2]]==x[i] && y[Y2i[j2]]-1==y[i]) j[nj++]=Y2i[j2];
-
-    j1=i2L[i];                           /* X-sorted number of pixel i  */
-    j2=j1-1;                             /* Previous X-sorted number    */
-    if(j2>=0 && x[L2i[j2]]-1==x[i] && y[L2i[j2]]+1==y[i]) j[nj++]=L2i[j2];
-    j2=j1+1;                             /* Next X-sorted number        */
-    if(j2<n  && x[L2i[j2]]+1==x[i] && y[L2i[j2]]-1==y[i]) j[nj++]=L2i[j2];
-
-    j1=i2R[i];                           /* X-sorted number of pixel i  */
-    j2=j1-1;                             /* Previous X-sorted number    */
-    if(j2>=0 && x[R2i[j2]]+1==x[i] && y[R2i[j2]]+1==y[i]) j[nj++]=R2i[j2];
-    j2=j1+1;                             /* Next X-sorted number        */
-    if(j2<n  && x[R2i[j2]]-1==x[i] && y[R2i[j2]]-1==y[i]) j[nj++]=R2i[j2];
-
-    njj=0;
-    min_clr=n+1;                         /* Initialize minimum color     */
-    for(j1=0; j1<nj; j1++)               /* Find minimum color           */
-    {                                    /* any existing cluster member  */
-      j2=index[j[j1]];                   /* Color of this pixel          */
-      if(j2 > 0 && j2 < min_clr) min_clr=j2;
+    cpl_mask    *   out ;
+    uint64_t    *   bits ;
+    uint64_t    *   opened ;
+    uint64_t    *   border ;
+    int             nx, ny, nwords, hx, i, j ;
+
+    /* Check entries */
+    if (mask == NULL) return NULL ;
+    if (kernel_x < 1 || kernel_x % 2 == 0) {
+        cpl_msg_error(__func__, "The kernel size must be odd") ;
+        return NULL ;
     }
 
-	if(min_clr == n+1)                   /* None found (only uncolored pixels)  */
+    /* Initialise */
+    nx = cpl_mask_get_size_x(mask) ;
+    ny = cpl_mask_get_size_y(mask) ;
+    hx = kernel_x / 2 ;
+    bits = cr2res_cluster_bits_pack(mask, &nwords) ;
+
+    /* Pixels copied from the input, including the padding bits */
+    border = cpl_calloc(nwords, sizeof(uint64_t)) ;
+    for (i=0 ; i<nwords*64 ; i++)
+        if (i < hx || i >= nx - hx) border[i>>6] |= (uint64_t)1 << (i&63) ;
+
+    /* Erode then dilate each row */
+    opened = cpl_malloc((cpl_size)ny * nwords * sizeof(uint64_t)) ;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(cr2res_thread_budget()) private(j)
+#endif
     {
-      n_branches++;
-      for(j1=0; j1<nj; j1++) index[j[j1]]=n_branches;
-      translation[n_branches]=n_branches;
-    }
-    else                                  /* Found colored pixels, re-paint all  */
-    {                                     /* pixels with smallest non-zero color */
-      for(j1=0;j1<nj;j1++)
-      {
-        j2=index[j[j1]];                  /* Color of this pixel          */
-        if(j2>min_clr) translation[j2]=min_clr; /* Adjust the look-up table     */
-        index[j[j1]]=min_clr;             /* Re-color this pixel          */
-      }
-    }
-  }
-  cpl_free(X2i); cpl_free(i2X);
-  cpl_free(Y2i); cpl_free(i2Y);
-  cpl_free(L2i); cpl_free(i2L);
-  cpl_free(R2i); cpl_free(i2R);
+        uint64_t    *   eroded ;
 
-  for(i=0; i<n; i++)                      /* Reduce reference chains in look-up  */
-  {                                       /* table to single direct references   */
-    translation[i]=translation[translation[i]];
-  }
+        eroded = cpl_malloc(nwords * sizeof(uint64_t)) ;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (j=0 ; j<ny ; j++) {
+            cr2res_cluster_bits_filter_row(bits + (cpl_size)j*nwords,
+                    bits + (cpl_size)j*nwords, border, nwords, hx, 0, eroded) ;
+            cr2res_cluster_bits_filter_row(eroded, bits + (cpl_size)j*nwords,
+                    border, nwords, hx, 1, opened + (cpl_size)j*nwords) ;
+        }
+        cpl_free(eroded) ;
+    }
+    out = cr2res_cluster_bits_unpack(opened, nwords, nx, ny) ;
+    cpl_free(bits) ;
+    cpl_free(opened) ;
+    cpl_free(border) ;
+    return out ;
+}
 
-  for(i=0; i<n; i++)                      /* Apply look-up table                 */
-  {
-    index[i]=translation[index[i]];
-  }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the connected components of a mask
+  @param    mask    The input mask
+  @return   The newly allocated labels or NULL in error case
+
+  The mask is bit-packed and scanned for runs of selected pixels. The
+  overlapping runs of consecutive rows are merged with a union-find
+  (4-connectivity). The components are numbered from 1, in the order of
+  their first pixel, as with cpl_image_labelise_mask_create().
+  No label image is created: the pixels counts and bounding boxes are
+  computed from the runs.
+  The returned object needs to be deallocated with
+  cr2res_cluster_labels_delete().
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_cluster_labels * cr2res_cluster_labels_new(const cpl_mask * mask)
+{
+    return cr2res_cluster_labels_create(mask, 0, 0) ;
+}
 
-  threshold=thres>1?thres:1;              /* Prepare for measuring cluster sizes */
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate the labels
+  @param    labels  The labels to delete
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_cluster_labels_delete(cr2res_cluster_labels * labels)
+{
+    if (labels == NULL) return ;
+    cpl_free(labels->run_y) ;
+    cpl_free(labels->run_x0) ;
+    cpl_free(labels->run_x1) ;
+    cpl_free(labels->run_label) ;
+    cpl_free(labels->npix) ;
+    cpl_free(labels->llx) ;
+    cpl_free(labels->lly) ;
+    cpl_free(labels->urx) ;
+    cpl_free(labels->ury) ;
+    cpl_free(labels) ;
+}
 
-  max_clr=0;                              /* Find maximum color index            */
-  for(i=0;i<n;i++) if(index[i]>max_clr) max_clr=index[i];
-  max_clr++;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of labels
+  @param    labels  The labels
+  @return   The number of connected components or -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size cr2res_cluster_labels_get_size(const cr2res_cluster_labels * labels)
+{
+    if (labels == NULL) return -1 ;
+    return labels->nlabels ;
+}
 
-  uniq_clr=(int *)cpl_calloc(max_clr, sizeof(int));
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of pixels of a label
+  @param    labels  The labels
+  @param    label   The label number (from 1)
+  @return   The number of pixels or -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size cr2res_cluster_labels_get_npix(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        label)
+{
+    if (labels == NULL || label < 1 || label > labels->nlabels) return -1 ;
+    return labels->npix[label-1] ;
+}
 
-  for(i=0;i<n;i++) uniq_clr[index[i]]++;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the bounding box of a label
+  @param    labels  The labels
+  @param    label   The label number (from 1)
+  @param    llx     [out] Lower left x position (from 1)
+  @param    lly     [out] Lower left y position (from 1)
+  @param    urx     [out] Upper right x position (from 1)
+  @param    ury     [out] Upper right y position (from 1)
+  @return   0 if ok, -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_cluster_labels_get_bbox(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        label,
+        int                         *   llx,
+        int                         *   lly,
+        int                         *   urx,
+        int                         *   ury)
+{
+    if (labels == NULL || label < 1 || label > labels->nlabels) return -1 ;
+    if (llx == NULL || lly == NULL || urx == NULL || ury == NULL) return -1 ;
+    *llx = labels->llx[label-1] + 1 ;
+    *lly = labels->lly[label-1] + 1 ;
+    *urx = labels->urx[label-1] + 1 ;
+    *ury = labels->ury[label-1] + 1 ;
+    return 0 ;
+}
 
-  j1=0;
-  translation[0]=0;
-  for(i=1;i<max_clr;i++)
-  {
-    if(uniq_clr[i]>=threshold)
-    {
-      j1++;
-      translation[i]=j1;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the mask of the big enough components
+  @param    labels      The labels
+  @param    min_npix    Minimum number of pixels of the kept components
+  @return   The newly allocated mask or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_mask * cr2res_cluster_labels_get_mask(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        min_npix)
+{
+    cpl_mask    *   mask ;
+    cpl_binary  *   pmask ;
+    cpl_size        r ;
+
+    if (labels == NULL) return NULL ;
+
+    mask = cpl_mask_new(labels->nx, labels->ny) ;
+    pmask = cpl_mask_get_data(mask) ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        if (labels->run_label[r] == 0) continue ;
+        if (labels->npix[labels->run_label[r]-1] < min_npix) continue ;
+        memset(pmask + (cpl_size)labels->run_y[r] * labels->nx +
+                labels->run_x0[r], CPL_BINARY_1,
+                labels->run_x1[r] - labels->run_x0[r] + 1) ;
     }
-    else translation[i]=0;
-  }
-
-  nregions=j1;
-  cpl_free(uniq_clr);
-
-  for(i=0;i<n;i++) index[i]=translation[index[i]];
-
-  cpl_free(translation);
-
-  return nregions;
+    return mask ;
 }
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief
-  @param
-  @param
-  @param
-  @return
+  @brief    Create the cluster table of the labels
+  @param    labels      The labels
+  @return   The newly allocated table or NULL in error case
+
+  The table has one row per pixel, with the columns CR2RES_COL_XS,
+  CR2RES_COL_YS (pixel positions, from 1) and CR2RES_COL_CLUSTERS (label).
+  The rows are grouped by increasing label, and are in the image order
+  within a label.
  */
 /*----------------------------------------------------------------------------*/
-cpl_table * cr2res_cluster_detect(
-        cpl_mask    *   mask,
-        int             mincluster)
+cpl_table * cr2res_cluster_labels_get_table(
+        const cr2res_cluster_labels *   labels)
 {
-    int                 i, j, nx, ny, nclusters, count, npix ;
-    int             *   xs ;
-    int             *   ys ;
-    int             *   clusters ;
-    cpl_table       *   table;
-    /* Convert the Mask in inputs needed by cluster() */
-    npix = cpl_mask_count(mask);
-    nx = cpl_mask_get_size_x(mask);
-    ny = cpl_mask_get_size_y(mask);
-    cpl_msg_debug(__func__, "mask: %d %d, %d", nx, ny, npix);
-
-    xs=(int *)cpl_malloc(npix*sizeof(int));
-    ys=(int *)cpl_malloc(npix*sizeof(int));
-    clusters=(int *)cpl_malloc(npix*sizeof(int));
-    count = 0 ;
-    for (i=1 ; i<=nx ; i++) {
-        for (j=1 ; j<=ny ; j++) {
-            if (cpl_mask_get(mask,i,j) == CPL_BINARY_1) {
-                xs[count] = i ;
-                ys[count] = j ;
-                count++;
-            }
-        }
+    cpl_table   *   table ;
+    cpl_size    *   cursor ;
+    int         *   pxs ;
+    int         *   pys ;
+    int         *   pclusters ;
+    cpl_size        r, lab, npix, k ;
+    int             x ;
+
+    if (labels == NULL) return NULL ;
+
+    /* First row of each label */
+    cursor = cpl_malloc((labels->nlabels+1) * sizeof(cpl_size)) ;
+    npix = 0 ;
+    for (lab=0 ; lab<labels->nlabels ; lab++) {
+        cursor[lab] = npix ;
+        npix += labels->npix[lab] ;
     }
 
-    nclusters = cluster(xs, ys, npix, nx, ny, mincluster, clusters) ;
+    /* Create the output table */
+    table = cpl_table_new(npix) ;
+    cpl_table_new_column(table, CR2RES_COL_XS, CPL_TYPE_INT) ;
+    cpl_table_new_column(table, CR2RES_COL_YS, CPL_TYPE_INT) ;
+    cpl_table_new_column(table, CR2RES_COL_CLUSTERS, CPL_TYPE_INT) ;
+    if (npix == 0) {
+        cpl_free(cursor) ;
+        return table ;
+    }
+    pxs = cpl_table_get_data_int(table, CR2RES_COL_XS) ;
+    pys = cpl_table_get_data_int(table, CR2RES_COL_YS) ;
+    pclusters = cpl_table_get_data_int(table, CR2RES_COL_CLUSTERS) ;
+
+    /* Fill the pixels of the runs */
+    for (r=0 ; r<labels->nruns ; r++) {
+        lab = labels->run_label[r] ;
+        if (lab == 0) continue ;
+        k = cursor[lab-1] ;
+        for (x=labels->run_x0[r] ; x<=labels->run_x1[r] ; x++, k++) {
+            pxs[k] = x + 1 ;
+            pys[k] = labels->run_y[r] + 1 ;
+            pclusters[k] = (int)lab ;
+        }
+        cursor[lab-1] = k ;
+    }
+    cpl_free(cursor) ;
+    return table ;
+}
 
-    /* Put result into a table*/
-    table = cpl_table_new(npix);
-    cpl_table_wrap_int(table, xs, CR2RES_COL_XS);
-    cpl_table_wrap_int(table, ys, CR2RES_COL_YS);
-    cpl_table_wrap_int(table, clusters, CR2RES_COL_CLUSTERS);
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the label image
+  @param    labels      The labels
+  @return   The newly allocated INT image or NULL in error case
 
-    return table;
+  The pixels out of the components are 0.
+ */
+/*----------------------------------------------------------------------------*/
+cpl_image * cr2res_cluster_labels_get_image(
+        const cr2res_cluster_labels *   labels)
+{
+    cpl_image   *   image ;
+    int         *   pimage ;
+    cpl_size        r ;
+    int             x ;
+
+    if (labels == NULL) return NULL ;
+
+    image = cpl_image_new(labels->nx, labels->ny, CPL_TYPE_INT) ;
+    pimage = cpl_image_get_data_int(image) ;
+    for (r=0 ; r<labels->nruns ; r++)
+        for (x=labels->run_x0[r] ; x<=labels->run_x1[r] ; x++)
+            pimage[(cpl_size)labels->run_y[r] * labels->nx + x] =
+                (int)labels->run_label[r] ;
+    return image ;
 }
 
 /**@}*/
 
-static void siftDown(int *a, int *i, int start, int end)
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the connected components of a mask
+  @param    mask        The input mask
+  @param    diagonal    1 to connect the diagonal neighbours, 0 otherwise
+  @param    min_npix    Minimum number of pixels of the kept components
+  @return   The newly allocated labels or NULL in error case
+
+  First pass: the runs of each row are found in the bit-packed mask, and
+  the overlapping runs of consecutive rows are merged with a union-find
+  that keeps the components sizes.
+  Second pass: the components are numbered from 1, in the order of their
+  first run. The runs of the components smaller than min_npix get the
+  label 0, and are ignored by the accessors.
+ */
+/*----------------------------------------------------------------------------*/
+static cr2res_cluster_labels * cr2res_cluster_labels_create(
+        const cpl_mask  *   mask,
+        int                 diagonal,
+        cpl_size            min_npix)
 {
-  int root = start;
-
-  while(root*2+1 < end)
-  {
-    int child = 2*root + 1;
-    if((child+1 < end) && (a[child] < a[child+1]))
-    {
-      child++;
+    cr2res_cluster_labels   *   labels ;
+    uint64_t                *   bits ;
+    cpl_size                *   row_first ;
+    cpl_size                *   parent ;
+    cpl_size                *   size ;
+    cpl_size                    r, p, c, lab ;
+    int                         nx, ny, nwords, j, d ;
+
+    /* Check entries */
+    if (mask == NULL) return NULL ;
+
+    /* Initialise */
+    nx = cpl_mask_get_size_x(mask) ;
+    ny = cpl_mask_get_size_y(mask) ;
+    d = diagonal ? 1 : 0 ;
+    bits = cr2res_cluster_bits_pack(mask, &nwords) ;
+
+    /* Count the runs of each row */
+    row_first = cpl_calloc(ny+1, sizeof(cpl_size)) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(static)
+#endif
+    for (j=0 ; j<ny ; j++)
+        row_first[j+1] = cr2res_cluster_bits_runs(bits + (cpl_size)j*nwords,
+                nwords, nx, NULL, NULL) ;
+    for (j=0 ; j<ny ; j++) row_first[j+1] += row_first[j] ;
+
+    /* Store the runs */
+    labels = cpl_malloc(sizeof(cr2res_cluster_labels)) ;
+    labels->nx = nx ;
+    labels->ny = ny ;
+    labels->nruns = row_first[ny] ;
+    labels->run_y = cpl_malloc((labels->nruns+1) * sizeof(int)) ;
+    labels->run_x0 = cpl_malloc((labels->nruns+1) * sizeof(int)) ;
+    labels->run_x1 = cpl_malloc((labels->nruns+1) * sizeof(int)) ;
+    labels->run_label = cpl_calloc(labels->nruns+1, sizeof(cpl_size)) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(static) private(r)
+#endif
+    for (j=0 ; j<ny ; j++) {
+        cr2res_cluster_bits_runs(bits + (cpl_size)j*nwords, nwords, nx,
+                labels->run_x0 + row_first[j], labels->run_x1 + row_first[j]);
+        for (r=row_first[j] ; r<row_first[j+1] ; r++) labels->run_y[r] = j ;
     }
-    if(a[root] < a[child])
-    {
-      SWAP(a[child], a[root]);
-      SWAP(i[child], i[root]);
-      root = child;
+    cpl_free(bits) ;
+
+    /* Merge the overlapping runs of consecutive rows */
+    parent = cpl_malloc((labels->nruns+1) * sizeof(cpl_size)) ;
+    size = cpl_malloc((labels->nruns+1) * sizeof(cpl_size)) ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        parent[r] = r ;
+        size[r] = labels->run_x1[r] - labels->run_x0[r] + 1 ;
     }
-    else return;
-  }
+    for (j=1 ; j<ny ; j++) {
+        p = row_first[j-1] ;
+        c = row_first[j] ;
+        while (p < row_first[j] && c < row_first[j+1]) {
+            if (labels->run_x0[p] <= labels->run_x1[c] + d &&
+                    labels->run_x0[c] <= labels->run_x1[p] + d)
+                cr2res_cluster_union(parent, size, p, c) ;
+            if (labels->run_x1[p] < labels->run_x1[c]) p++ ;
+            else c++ ;
+        }
+    }
+    cpl_free(row_first) ;
+
+    /* Number the components - the root of a component is its first run */
+    labels->nlabels = 0 ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        p = cr2res_cluster_find(parent, r) ;
+        if (p == r)
+            labels->run_label[r] = size[r] >= min_npix ?
+                ++(labels->nlabels) : 0 ;
+        else
+            labels->run_label[r] = labels->run_label[p] ;
+    }
+    cpl_free(parent) ;
+    cpl_free(size) ;
+
+    /* Pixels counts and bounding boxes */
+    labels->npix = cpl_calloc(labels->nlabels+1, sizeof(cpl_size)) ;
+    labels->llx = cpl_malloc((labels->nlabels+1) * sizeof(int)) ;
+    labels->lly = cpl_malloc((labels->nlabels+1) * sizeof(int)) ;
+    labels->urx = cpl_malloc((labels->nlabels+1) * sizeof(int)) ;
+    labels->ury = cpl_malloc((labels->nlabels+1) * sizeof(int)) ;
+    for (r=0 ; r<labels->nruns ; r++) {
+        lab = labels->run_label[r] - 1 ;
+        if (lab < 0) continue ;
+        if (labels->npix[lab] == 0) {
+            labels->llx[lab] = labels->run_x0[r] ;
+            labels->urx[lab] = labels->run_x1[r] ;
+            labels->lly[lab] = labels->run_y[r] ;
+        }
+        if (labels->run_x0[r] < labels->llx[lab])
+            labels->llx[lab] = labels->run_x0[r] ;
+        if (labels->run_x1[r] > labels->urx[lab])
+            labels->urx[lab] = labels->run_x1[r] ;
+        labels->ury[lab] = labels->run_y[r] ;
+        labels->npix[lab] += labels->run_x1[r] - labels->run_x0[r] + 1 ;
+    }
+    return labels ;
 }
 
-static void isort(int *a, int *i, int count)
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Pack a mask, 64 pixels per word
+  @param    mask    The mask
+  @param    nwords  [out] The number of words per row
+  @return   The ny * nwords words. Bit i of word w in a row is x = 64w+i.
+ */
+/*----------------------------------------------------------------------------*/
+static uint64_t * cr2res_cluster_bits_pack(
+        const cpl_mask  *   mask,
+        int             *   nwords)
 {
-  int start, end;
+    const cpl_binary    *   pmask ;
+    uint64_t            *   bits ;
+    int                     nx, ny, i, j ;
+
+    nx = cpl_mask_get_size_x(mask) ;
+    ny = cpl_mask_get_size_y(mask) ;
+    pmask = cpl_mask_get_data_const(mask) ;
+    *nwords = (nx + 63) / 64 ;
+
+    bits = cpl_calloc((cpl_size)ny * *nwords, sizeof(uint64_t)) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(static) private(i)
+#endif
+    for (j=0 ; j<ny ; j++) {
+        uint64_t            *   row = bits + (cpl_size)j * *nwords ;
+        const cpl_binary    *   prow = pmask + (cpl_size)j * nx ;
+        for (i=0 ; i<nx ; i++)
+            if (prow[i]) row[i>>6] |= (uint64_t)1 << (i&63) ;
+    }
+    return bits ;
+}
 
-  for(start=0; start<count; start++) i[start]=start;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unpack bits into a new mask
+  @param    bits    The ny * nwords words
+  @param    nwords  The number of words per row
+  @param    nx      The mask x size
+  @param    ny      The mask y size
+  @return   The newly allocated mask
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_mask * cr2res_cluster_bits_unpack(
+        const uint64_t  *   bits,
+        int                 nwords,
+        int                 nx,
+        int                 ny)
+{
+    cpl_mask    *   mask ;
+    cpl_binary  *   pmask ;
+    int             i, j ;
+
+    mask = cpl_mask_new(nx, ny) ;
+    pmask = cpl_mask_get_data(mask) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(static) private(i)
+#endif
+    for (j=0 ; j<ny ; j++) {
+        const uint64_t  *   row = bits + (cpl_size)j * nwords ;
+        cpl_binary      *   prow = pmask + (cpl_size)j * nx ;
+        for (i=0 ; i<nx ; i++)
+            prow[i] = (row[i>>6] >> (i&63)) & 1 ? CPL_BINARY_1 : CPL_BINARY_0;
+    }
+    return mask ;
+}
 
-  for(start=(count-2)/2; start>=0; start--)
-  {
-    siftDown(a, i, start, count);
-  }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get a word of a shifted row
+  @param    row     The row words
+  @param    nwords  The number of words in the row
+  @param    w       The word to get
+  @param    s       The shift
+  @return   The word w of the row where pixel x holds pixel x+s (0 outside)
+ */
+/*----------------------------------------------------------------------------*/
+static uint64_t cr2res_cluster_bits_shifted(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 w,
+        int                 s)
+{
+    uint64_t    v ;
+    int         ws, bs, lo ;
+
+    ws = (s >= 0) ? s / 64 : -((-s + 63) / 64) ;
+    bs = s - 64 * ws ;
+    lo = w + ws ;
+    v = (lo >= 0 && lo < nwords) ? row[lo] >> bs : 0 ;
+    if (bs != 0 && lo + 1 >= 0 && lo + 1 < nwords)
+        v |= row[lo+1] << (64 - bs) ;
+    return v ;
+}
 
-  for (end=count-1; end > 0; end--)
-  {
-    SWAP(a[end], a[0]);
-    SWAP(i[end], i[0]);
-    siftDown(a, i, 0, end);
-  }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Erode or dilate a row with a horizontal kernel
+  @param    in      The row words to filter
+  @param    copy    The row words copied on the border
+  @param    border  The border pixels of a row
+  @param    nwords  The number of words in the row
+  @param    hx      Half size of the kernel
+  @param    dilate  1 for a dilation, 0 for an erosion
+  @param    out     [out] The filtered row words
+  @return   void
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_cluster_bits_filter_row(
+        const uint64_t  *   in,
+        const uint64_t  *   copy,
+        const uint64_t  *   border,
+        int                 nwords,
+        int                 hx,
+        int                 dilate,
+        uint64_t        *   out)
+{
+    uint64_t    acc, v ;
+    int         w, s ;
+
+    for (w=0 ; w<nwords ; w++) {
+        acc = dilate ? 0 : ~(uint64_t)0 ;
+        for (s=-hx ; s<=hx ; s++) {
+            v = cr2res_cluster_bits_shifted(in, nwords, w, s) ;
+            acc = dilate ? (acc | v) : (acc & v) ;
+        }
+        out[w] = (acc & ~border[w]) | (copy[w] & border[w]) ;
+    }
 }
 
-static int *diag_sort(int *x, int *y, int *index, int n, int nX, int nY)
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the next pixel with a given value in a row
+  @param    row     The row words
+  @param    nwords  The number of words in the row
+  @param    nx      The number of pixels in the row
+  @param    x       The first position to check
+  @param    value   The value to look for (0 or 1)
+  @return   The position of the found pixel, nx if none
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cluster_bits_next(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 nx,
+        int                 x,
+        int                 value)
 {
-  int i, diag;
+    uint64_t    word ;
+    int         w, pos ;
+
+    if (x >= nx) return nx ;
+    w = x >> 6 ;
+    word = value ? row[w] : ~row[w] ;
+    word &= ~(uint64_t)0 << (x & 63) ;
+    while (word == 0) {
+        if (++w >= nwords) return nx ;
+        word = value ? row[w] : ~row[w] ;
+    }
+#if defined(__GNUC__)
+    pos = 64 * w + __builtin_ctzll(word) ;
+#else
+    for (pos = 64 * w ; !(word & 1) ; word >>= 1) pos++ ;
+#endif
+    return pos < nx ? pos : nx ;
+}
 
-  if(nX<=nY)
-  {
-    for(i=0;i<n;i++)
-    {
-      diag=x[i]+y[i]+1;
-      if(diag<nX-1)
-      {
-        index[i]=diag*(diag+1)/2-x[i]-1;
-      }
-      else if(diag>=nX-1 && diag<nY)
-      {
-        index[i]=nX*(nX-1)/2+(diag-nX)*nX+nX-x[i]-1;
-      }
-      else if(diag>=nY)
-      {
-        index[i]=nX*nY-(nX+nY-diag)*(nX+nY-diag+1)/2+nX-x[i]-1;
-      }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the runs of selected pixels in a row
+  @param    row     The row words
+  @param    nwords  The number of words in the row
+  @param    nx      The number of pixels in the row
+  @param    x0      [out] The runs first pixels, or NULL
+  @param    x1      [out] The runs last pixels, or NULL
+  @return   The number of runs
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_cluster_bits_runs(
+        const uint64_t  *   row,
+        int                 nwords,
+        int                 nx,
+        int             *   x0,
+        int             *   x1)
+{
+    cpl_size    n ;
+    int         start, end ;
+
+    n = 0 ;
+    end = 0 ;
+    while ((start = cr2res_cluster_bits_next(row, nwords, nx, end, 1)) < nx) {
+        end = cr2res_cluster_bits_next(row, nwords, nx, start, 0) ;
+        if (x0 != NULL) x0[n] = start ;
+        if (x1 != NULL) x1[n] = end - 1 ;
+        n++ ;
     }
-  }
-  else
-  {
-    for(i=0;i<n;i++)
-    {
-      diag=x[i]+y[i]+1;
-      if(diag<nY)
-      {
-        index[i]=diag*(diag+1)/2-x[i]-1;
-      }
-      else if(diag>=nY && diag<=nX)
-      {
-        index[i]=nY*(nY-1)/2+(diag-nY)*nY+y[i];
-      }
-      else if(diag>nX)
-      {
-        index[i]=nX*nY-(nX+nY-diag)*(nX+nY-diag+1)/2+nX-x[i]-1;
-      }
+    return n ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Find the root of a union-find element
+  @param    parent  The union-find parents
+  @param    i       The element
+  @return   The root of i
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_cluster_find(
+        cpl_size    *   parent,
+        cpl_size        i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]] ;
+        i = parent[i] ;
     }
-  }
-  return index;
+    return i ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Merge two union-find sets, the smallest root is kept
+  @param    parent  The union-find parents
+  @param    size    The sets sizes, up to date for the roots
+  @param    a       An element of the first set
+  @param    b       An element of the second set
+  @return   The root of the merged set
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_cluster_union(
+        cpl_size    *   parent,
+        cpl_size    *   size,
+        cpl_size        a,
+        cpl_size        b)
+{
+    cpl_size    tmp ;
+
+    a = cr2res_cluster_find(parent, a) ;
+    b = cr2res_cluster_find(parent, b) ;
+    if (a == b) return a ;
+    if (b < a) {
+        tmp = a ;
+        a = b ;
+        b = tmp ;
+    }
+    parent[b] = a ;
+    size[a] += size[b] ;
+    return a ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare two cpl_size values, for qsort()
+  @param    a       The first value
+  @param    b       The second value
+  @return   -1, 0 or 1
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cluster_compare(const void * a, const void * b)
+{
+    cpl_size    va = *(const cpl_size *)a ;
+    cpl_size    vb = *(const cpl_size *)b ;
+    return (va > vb) - (va < vb) ;
 }
@@ -26,10 +26,42 @@
 
 #include <cpl.h>
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* Connected components of a mask, stored as runs of pixels */
+typedef struct _cr2res_cluster_labels_ cr2res_cluster_labels ;
+
 /*-----------------------------------------------------------------------------
                                        Prototypes
  -----------------------------------------------------------------------------*/
 
 cpl_table * cr2res_cluster_detect(cpl_mask *mask, int mincluster);
 
+cpl_mask * cr2res_cluster_opening_x(
+        const cpl_mask  *   mask,
+        int                 kernel_x) ;
+
+cr2res_cluster_labels * cr2res_cluster_labels_new(const cpl_mask * mask) ;
+void cr2res_cluster_labels_delete(cr2res_cluster_labels * labels) ;
+cpl_size cr2res_cluster_labels_get_size(const cr2res_cluster_labels * labels) ;
+cpl_size cr2res_cluster_labels_get_npix(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        label) ;
+int cr2res_cluster_labels_get_bbox(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        label,
+        int                         *   llx,
+        int                         *   lly,
+        int                         *   urx,
+        int                         *   ury) ;
+cpl_mask * cr2res_cluster_labels_get_mask(
+        const cr2res_cluster_labels *   labels,
+        cpl_size                        min_npix) ;
+cpl_table * cr2res_cluster_labels_get_table(
+        const cr2res_cluster_labels *   labels) ;
+cpl_image * cr2res_cluster_labels_get_image(
+        const cr2res_cluster_labels *   labels) ;
+
 #endif
@@ -26,17 +26,19 @@
  -----------------------------------------------------------------------------*/
 
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <cpl.h>
+#include "cr2res_utils.h"
 #include "cr2res_detlin.h"
+#include "cr2res_bpm.h"
 #include "cr2res_pfits.h"
 
 /*-----------------------------------------------------------------------------
                                    	Defines
  -----------------------------------------------------------------------------*/
 
-#define pow2(x) (x)*(x)
-#define pow3(x) (x)*(x)*(x)
-
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
@@ -44,6 +46,14 @@
 static int cr2res_detlin_frames_dit_compare(
         const cpl_frame *   in1,
         const cpl_frame *   in2) ;
+static int cr2res_detlin_fit_pixel(
+        const double    *   dits,
+        const double    *   adus,
+        int                 n,
+        int                 max_degree,
+        double          *   work,
+        double          *   coeffs,
+        double          *   errors) ;
 static void cr2res_matrix_fill_normal_vandermonde(cpl_matrix * self,
                                                cpl_matrix * mx,
                                                const cpl_vector * xhat,
@@ -86,8 +96,8 @@ int cr2res_detlin_correct(
     cpl_image           *   cur_ima ;
     double              *   pdata ;
     double              *   perr ;
+    double                  var ;
     int                     nx, ny ;
-    double                  correction_factor;
     int                     i, j ;
 
     /* Test entries */
@@ -138,15 +148,10 @@ int cr2res_detlin_correct(
         if (pdata[i] < CR2RES_DETLIN_THRESHOLD) continue ;
         
         // for each pixel p' = (a + b * p + c * p * p) * p
-        perr[i] = pow2(perra[i] * pdata[i]) + pow2(perrb[i] * pow2(pdata[i]))
-                + pow2(perrc[i] * pow3(pdata[i])) 
-                + pow2(perr[i] * (pima[i] + 2. * pimb[i] * pdata[i] 
-                + 3. * pimc[i] * pow2(pdata[i])));
-        perr[i] = sqrt(perr[i]);
-
-        correction_factor = pima[i] + \
-                ((pimb[i] + pimc[i] * pdata[i]) * pdata[i]);
-        pdata[i] = pdata[i] * correction_factor;
+        var = perr[i] * perr[i] ;
+        cr2res_detlin_correct_pixel(pima[i], perra[i], pimb[i], perrb[i],
+                pimc[i], perrc[i], &(pdata[i]), &var) ;
+        perr[i] = sqrt(var) ;
     }
     /* return */
     return 0 ;
@@ -328,6 +333,154 @@ int cr2res_detlin_compute(
     return 0 ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fits the response of all pixels of a detector
+  @param    imlist      The images, sorted by increasing DIT
+  @param    dits        The DIT values of the images
+  @param    trace_image The pixels to fit are > 0, or NULL for all pixels
+  @param    max_degree  Maximum degree for the fit
+  @param    coeffs      [out] max_degree+1 double images for the coefficients
+  @param    errors      [out] max_degree+1 double images for the errors
+  @param    bpm         [out] int image with the bad pixels
+  @param    nb_failed   [out] the number of failed fits, or NULL
+  @return   the number of successful fits, or -1 in error case
+
+  Same results as cr2res_detlin_compute() called on every pixel, with the
+  values rounded to float as in cr2res_cal_detlin. The fits that fail
+  and the pixels outside the traces have NaN coefficients and errors, and
+  are flagged CR2RES_BPM_DETLIN and CR2RES_BPM_OUTOFORDER in bpm.
+  The rows are processed in parallel, each pixel with preallocated
+  buffers.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detlin_compute_image(
+        const hdrl_imagelist    *   imlist,
+        const cpl_vector        *   dits,
+        const cpl_image         *   trace_image,
+        cpl_size                    max_degree,
+        cpl_imagelist           *   coeffs,
+        cpl_imagelist           *   errors,
+        cpl_image               *   bpm,
+        int                     *   nb_failed)
+{
+    const double        **  pima ;
+    double              **  pcoeffs ;
+    double              **  perrors ;
+    const int           *   pti ;
+    int                 *   pbpm ;
+    const double        *   pdits ;
+    cpl_size                nx, ny, nc, l ;
+    int                     n, j, nsuccess, nfailed ;
+
+    /* Test entries */
+    if (imlist == NULL || dits == NULL || coeffs == NULL || errors == NULL ||
+            bpm == NULL || max_degree < 0) return -1 ;
+    n = cpl_vector_get_size(dits) ;
+    nc = max_degree + 1 ;
+    if (hdrl_imagelist_get_size(imlist) != n ||
+            cpl_imagelist_get_size(coeffs) != nc ||
+            cpl_imagelist_get_size(errors) != nc) {
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+    nx = hdrl_imagelist_get_size_x(imlist) ;
+    ny = hdrl_imagelist_get_size_y(imlist) ;
+    if (cpl_image_get_size_x(bpm) != nx || cpl_image_get_size_y(bpm) != ny ||
+            (trace_image != NULL && (cpl_image_get_size_x(trace_image) != nx
+            || cpl_image_get_size_y(trace_image) != ny))) {
+        cpl_msg_error(__func__, "Incompatible sizes") ;
+        return -1 ;
+    }
+
+    /* Initialise */
+    pdits = cpl_vector_get_data_const(dits) ;
+    pti = trace_image != NULL ? cpl_image_get_data_int_const(trace_image) :
+        NULL ;
+    pbpm = cpl_image_get_data_int(bpm) ;
+    pima = cpl_malloc(n * sizeof(double *)) ;
+    for (j=0 ; j<n ; j++)
+        pima[j] = cpl_image_get_data_double_const(hdrl_image_get_image_const(
+                    hdrl_imagelist_get_const(imlist, j))) ;
+    pcoeffs = cpl_malloc(nc * sizeof(double *)) ;
+    perrors = cpl_malloc(nc * sizeof(double *)) ;
+    for (l=0 ; l<nc ; l++) {
+        pcoeffs[l] = cpl_image_get_data_double(cpl_imagelist_get(coeffs, l)) ;
+        perrors[l] = cpl_image_get_data_double(cpl_imagelist_get(errors, l)) ;
+    }
+    nsuccess = nfailed = 0 ;
+
+    /* Loop on the rows */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(cr2res_thread_budget()) \
+    reduction(+:nsuccess,nfailed)
+#endif
+    {
+        double  *   block ;
+        double  *   work ;
+        double  *   vals ;
+        double  *   cur_coeffs ;
+        double  *   cur_errors ;
+        cpl_size    i, idx, m ;
+        int         jj, k ;
+
+        /* Per thread buffers: one row of all images, and the fit */
+        block = cpl_malloc(n * nx * sizeof(double)) ;
+        work = cpl_malloc((4 * n + 3 * nc * nc + 4 * nc) * sizeof(double)) ;
+        vals = cpl_malloc(n * sizeof(double)) ;
+        cur_coeffs = cpl_malloc(nc * sizeof(double)) ;
+        cur_errors = cpl_malloc(nc * sizeof(double)) ;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,8)
+#endif
+        for (jj=0 ; jj<ny ; jj++) {
+            /* Gather the row of all images */
+            for (k=0 ; k<n ; k++) {
+                for (i=0 ; i<nx ; i++)
+                    block[k*nx+i] = (float)(pima[k][jj*nx+i]) ;
+            }
+
+            for (i=0 ; i<nx ; i++) {
+                idx = i + jj*nx ;
+                if (pti != NULL && pti[idx] <= 0) {
+                    /* Outside the orders */
+                    for (m=0 ; m<nc ; m++)
+                        pcoeffs[m][idx] = perrors[m][idx] = 0.0/0.0 ;
+                    pbpm[idx] = CR2RES_BPM_OUTOFORDER ;
+                    continue ;
+                }
+                for (k=0 ; k<n ; k++) vals[k] = block[k*nx+i] ;
+                if (cr2res_detlin_fit_pixel(pdits, vals, n, (int)max_degree,
+                            work, cur_coeffs, cur_errors)) {
+                    nfailed++ ;
+                    for (m=0 ; m<nc ; m++)
+                        pcoeffs[m][idx] = perrors[m][idx] = 0.0/0.0 ;
+                    pbpm[idx] = CR2RES_BPM_DETLIN ;
+                } else {
+                    nsuccess++ ;
+                    for (m=0 ; m<nc ; m++) {
+                        pcoeffs[m][idx] = cur_coeffs[m] ;
+                        perrors[m][idx] = fabs(cur_errors[m]) ;
+                    }
+                    pbpm[idx] = 0 ;
+                }
+            }
+        }
+        cpl_free(block) ;
+        cpl_free(work) ;
+        cpl_free(vals) ;
+        cpl_free(cur_coeffs) ;
+        cpl_free(cur_errors) ;
+    }
+    cpl_free(pima) ;
+    cpl_free(pcoeffs) ;
+    cpl_free(perrors) ;
+
+    if (nb_failed != NULL) *nb_failed = nfailed ;
+    return nsuccess ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Sort the frames by increaing DIT
@@ -389,6 +542,181 @@ static int cr2res_detlin_frames_dit_compare(
     return 0 ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fits the response of one pixel without any allocation
+  @param    dits        The DIT values, sorted increasing
+  @param    adus        The corresponding values (ADU)
+  @param    n           The number of values
+  @param    max_degree  Maximum degree for the fit
+  @param    work        Buffer of 4*n + 3*nc*nc + 4*nc doubles, nc=degree+1
+  @param    coeffs      [out] The nc fitted coefficients
+  @param    errors      [out] The nc errors
+  @return   0 if ok, -1 if the fit failed
+
+  The steps of cr2res_detlin_compute() on plain arrays. The fit is done
+  as in cpl_polynomial_fit(): normal equations on the mean-subtracted
+  values, a Cholesky solve, and a shift back to the origin. The errors
+  are computed from the same matrix as cr2res_detlin_compute() builds
+  with cr2res_matrix_fill_normal_vandermonde(). That matrix has only its
+  upper triangle filled, so the diagonal of its inverse is 1/H(i,i).
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_detlin_fit_pixel(
+        const double    *   dits,
+        const double    *   adus,
+        int                 n,
+        int                 max_degree,
+        double          *   work,
+        double          *   coeffs,
+        double          *   errors)
+{
+    double          *   rate ;
+    double          *   y ;
+    double          *   xhat ;
+    double          *   phat ;
+    double          *   hankel ;
+    double          *   chol ;
+    double          *   rhs ;
+    double          *   sums ;
+    double              amin, amax, med, xmean, sum, tmp, resid ;
+    int                 nc, nloc, count_linear, count_satur, ndistinct,
+                        i, j, k ;
+
+    /* Initialise */
+    nc = max_degree + 1 ;
+    rate = work ;
+    y = rate + n ;
+    xhat = y + n ;
+    phat = xhat + n ;
+    hankel = phat + n ;
+    chol = hankel + nc * nc ;
+    rhs = chol + nc * nc ;
+    sums = rhs + nc ;
+
+    /* Determine true ADU/s by assuming it is linear up to threshold */
+    amin = amax = adus[0] ;
+    count_linear = count_satur = 0 ;
+    for (i=0 ; i<n ; i++) {
+        if (adus[i] < amin) amin = adus[i] ;
+        if (adus[i] > amax) amax = adus[i] ;
+        if (adus[i] < CR2RES_DETLIN_THRESHOLD) count_linear++ ;
+        if (adus[i] > CR2RES_DETLIN_MAXFIT) count_satur++ ;
+    }
+    if (amin > CR2RES_DETLIN_THRESHOLD) return -1 ;
+    if (amax < CR2RES_DETLIN_THRESHOLD) return -1 ;
+    nloc = n - count_satur ;
+    if (nloc < 1 || count_linear >= nloc) return -1 ;
+
+    /* Median of the first count_linear+1 rates, sorted by insertion */
+    for (i=0 ; i<nloc ; i++) rate[i] = adus[i] / dits[i] ;
+    for (i=0 ; i<=count_linear ; i++) {
+        tmp = rate[i] ;
+        for (j=i ; j>0 && y[j-1] > tmp ; j--) y[j] = y[j-1] ;
+        y[j] = tmp ;
+    }
+    if ((count_linear + 1) % 2)
+        med = y[count_linear / 2] ;
+    else
+        med = (y[count_linear / 2] + y[count_linear / 2 + 1]) / 2.0 ;
+
+    /* We fit the ratio of true ADU/s over the measured ones */
+    for (i=0 ; i<nloc ; i++) y[i] = med / rate[i] ;
+
+    /* The fit needs nc distinct positions */
+    ndistinct = 0 ;
+    for (i=0 ; i<nloc ; i++) {
+        for (j=0 ; j<i && adus[j] != adus[i] ; j++) ;
+        if (j == i) ndistinct++ ;
+    }
+    if (ndistinct < nc) return -1 ;
+
+    /* Normal equations on the mean-subtracted positions */
+    sum = 0.0 ;
+    for (i=0 ; i<nloc ; i++) sum += adus[i] ;
+    xmean = sum / nloc ;
+    for (i=0 ; i<nloc ; i++) {
+        xhat[i] = adus[i] - xmean ;
+        phat[i] = 1.0 ;
+    }
+    for (k=0 ; k<2*nc-1 ; k++) {
+        sum = 0.0 ;
+        tmp = 0.0 ;
+        for (i=0 ; i<nloc ; i++) {
+            if (k > 0) phat[i] *= xhat[i] ;
+            sum += phat[i] ;
+            if (k < nc) tmp += phat[i] * y[i] ;
+        }
+        for (i=0 ; i<nc ; i++)
+            if (k-i >= 0 && k-i < nc) hankel[i*nc+k-i] = sum ;
+        if (k < nc) rhs[k] = tmp ;
+    }
+
+    /* Cholesky solve */
+    for (j=0 ; j<nc ; j++) {
+        for (i=j ; i<nc ; i++) {
+            sum = hankel[i*nc+j] ;
+            for (k=0 ; k<j ; k++) sum -= chol[i*nc+k] * chol[j*nc+k] ;
+            if (i == j) {
+                if (sum <= 0.0) return -1 ;
+                chol[j*nc+j] = sqrt(sum) ;
+            } else {
+                chol[i*nc+j] = sum / chol[j*nc+j] ;
+            }
+        }
+    }
+    for (i=0 ; i<nc ; i++) {
+        sum = rhs[i] ;
+        for (k=0 ; k<i ; k++) sum -= chol[i*nc+k] * coeffs[k] ;
+        coeffs[i] = sum / chol[i*nc+i] ;
+    }
+    for (i=nc-1 ; i>=0 ; i--) {
+        sum = coeffs[i] ;
+        for (k=i+1 ; k<nc ; k++) sum -= chol[k*nc+i] * coeffs[k] ;
+        coeffs[i] = sum / chol[i*nc+i] ;
+    }
+
+    /* Shift the polynomial back to the origin */
+    for (j=0 ; j<nc-1 ; j++)
+        for (i=nc-2 ; i>=j ; i--)
+            coeffs[i] -= xmean * coeffs[i+1] ;
+
+    /* Sanity check */
+    tmp = coeffs[nc-1] ;
+    for (i=nc-2 ; i>=0 ; i--) tmp = tmp * 20000.0 + coeffs[i] ;
+    if (tmp < 1.0 || tmp > 1.2) return -1 ;
+
+    /* Compute the error */
+    if (nc >= nloc) {
+        for (i=0 ; i<nc ; i++) errors[i] = 0.0 ;
+    } else {
+        /* Sum of the absolute residuals */
+        sum = 0.0 ;
+        for (i=0 ; i<nloc ; i++) {
+            resid = coeffs[nc-1] ;
+            for (k=nc-2 ; k>=0 ; k--) resid = resid * adus[i] + coeffs[k] ;
+            sum += fabs(y[i] - resid) ;
+        }
+        /* H(i,i) is the sum of adus^(2i) */
+        for (i=0 ; i<nloc ; i++) phat[i] = adus[i] ;
+        sums[0] = (double)nloc ;
+        for (k=1 ; k<=2*(nc-1) ; k++) {
+            tmp = 0.0 ;
+            for (i=0 ; i<nloc ; i++) {
+                if (k > 1) phat[i] *= adus[i] ;
+                tmp += phat[i] ;
+            }
+            if (k % 2 == 0) sums[k/2] = tmp ;
+        }
+        for (i=0 ; i<nc ; i++)
+            errors[i] = sqrt(1.0 / sums[i] * (sum / (double)(nloc - nc))) ;
+    }
+
+    /* Check Result - Polynomial coefficients are NaN sometimes */
+    for (i=0 ; i<nc ; i++) if (isnan(coeffs[i])) return -1 ;
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @internal
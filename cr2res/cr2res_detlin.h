@@ -34,6 +34,48 @@
 #define CR2RES_DETLIN_THRESHOLD 3000.0 // ADU up to which linear response
 #define CR2RES_DETLIN_MAXFIT    45000.0 // Ignore ADU values above this
 
+/*-----------------------------------------------------------------------------
+                                Inline functions
+ -----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Correct one pixel for the detector non-linearity
+  @param    a       the a coefficient of the pixel
+  @param    ea      the error of a
+  @param    b       the b coefficient of the pixel
+  @param    eb      the error of b
+  @param    c       the c coefficient of the pixel
+  @param    ec      the error of c
+  @param    d       [in/out] the pixel value
+  @param    v       [in/out] the pixel variance
+  @return   nothing
+
+  p' = (a + b * p + c * p * p) * p, with the variance propagated from p,
+  a, b and c. The caller only applies it above CR2RES_DETLIN_THRESHOLD.
+  Shared by cr2res_detlin_correct() and the one pass calibration.
+  Branch free and without square root, so that the loops calling it can
+  be vectorized.
+ */
+/*----------------------------------------------------------------------------*/
+static inline void cr2res_detlin_correct_pixel(
+        double      a,
+        double      ea,
+        double      b,
+        double      eb,
+        double      c,
+        double      ec,
+        double  *   d,
+        double  *   v)
+{
+    double  p = *d ;
+    double  g = a + 2. * b * p + 3. * c * p * p ;
+
+    *v = (ea * p) * (ea * p) + (eb * p * p) * (eb * p * p)
+        + (ec * p * p * p) * (ec * p * p * p) + *v * g * g ;
+    *d = p * (a + ((b + c * p) * p)) ;
+}
+
 /*-----------------------------------------------------------------------------
                                 Prototypes
  -----------------------------------------------------------------------------*/
@@ -49,6 +91,16 @@ int cr2res_detlin_compute(
         cpl_polynomial      **  fitted,
         cpl_vector          **  error) ;
 
+int cr2res_detlin_compute_image(
+        const hdrl_imagelist    *   imlist,
+        const cpl_vector        *   dits,
+        const cpl_image         *   trace_image,
+        cpl_size                    max_degree,
+        cpl_imagelist           *   coeffs,
+        cpl_imagelist           *   errors,
+        cpl_image               *   bpm,
+        int                     *   nb_failed) ;
+
 cpl_frameset * cr2res_detlin_sort_frames(
         const cpl_frameset  *   in) ;
 
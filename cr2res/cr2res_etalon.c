@@ -31,6 +31,7 @@
 #include "cr2res_etalon.h"
 #include "cr2res_wave.h"
 #include "cr2res_pfits.h"
+#include "cr2res_cluster.h"
 
 /*-----------------------------------------------------------------------------
                                    Defines
@@ -73,7 +74,7 @@ static cpl_vector * cr2res_etalon_get_peaks_gaussian(
 cpl_image * cr2res_etalon_computation(const cpl_image * in)
 {
     cpl_mask        *   mask ;
-    cpl_size            nlabels ;
+    cr2res_cluster_labels   *   blobs ;
     cpl_image       *   labels ;
     cpl_apertures   *   aperts ;
 
@@ -87,14 +88,17 @@ cpl_image * cr2res_etalon_computation(const cpl_image * in)
     cpl_mask_save(mask, "mask.fits", NULL, CPL_IO_CREATE) ;
 
     /* Labelise the different detected apertures */
-    if ((labels = cpl_image_labelise_mask_create(mask, &nlabels))==NULL) {
+    if ((blobs = cr2res_cluster_labels_new(mask)) == NULL) {
         cpl_msg_error(cpl_func, "Cannot Labelise") ;
         cpl_mask_delete(mask) ;
         return NULL ;
     }
     cpl_mask_delete(mask) ;
 
-    cpl_msg_debug(__func__, "Number of Apertures: %"CPL_SIZE_FORMAT, nlabels) ;
+    cpl_msg_debug(__func__, "Number of Apertures: %"CPL_SIZE_FORMAT,
+            cr2res_cluster_labels_get_size(blobs)) ;
+    labels = cr2res_cluster_labels_get_image(blobs) ;
+    cr2res_cluster_labels_delete(blobs) ;
 
     /* Create the detected apertures list */
     if ((aperts = cpl_apertures_new_from_image(in, labels)) == NULL) {
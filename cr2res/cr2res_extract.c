@@ -17,8 +17,6 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
  */
 
-#pragma GCC optimize("O0")
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -27,6 +25,12 @@
                                    Includes
  -----------------------------------------------------------------------------*/
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <cpl.h>
 #include "cr2res_dfs.h"
 #include "cr2res_trace.h"
@@ -42,32 +46,202 @@ typedef unsigned char byte;
 #define min(a,b) (((a)<(b))?(a):(b))
 #define max(a,b) (((a)>(b))?(a):(b))
 #define signum(a) (((a)>0)?1:((a)<0)?-1:0)
-#define zeta_index(x, y, z) (z * ncols * nrows) + (y * ncols) + x
-#define mzeta_index(x, y) (y * ncols) + x
-#define xi_index(x, y, z) (z * ncols * ny) + (y * ncols) + x
 
+/* Compact index type of the convolution tensor */
+typedef unsigned short zeta_idx;
+#define CR2RES_EXTRACT_ZETA_IDX_MAX     USHRT_MAX
+
+/*
+   Convolution tensor of one swath: the subpixels {x, iy} contributing to
+   each detector pixel and their weights. Stored as structure of arrays,
+   the nb[p] entries of the pixel p=y*ncols+x start at p*mmax.
+   The weights are kept either in double or in single precision (wf).
+ */
+typedef struct {
+    int             ncols ;
+    int             nrows ;
+    int             mmax ;  /* Max. nb of entries per pixel 3*(osample+1) */
+    zeta_idx    *   x ;     /* Contributing subpixel x,iy [nrows][ncols][mmax] */
+    zeta_idx    *   iy ;
+    double      *   w ;     /* Contribution weight <= 1/osample, or NULL */
+    float       *   wf ;    /* Same in single precision, or NULL */
+    zeta_idx    *   nb ;    /* Nb of entries per pixel [nrows][ncols] */
+} zeta_tensor ;
+
+/* Kernels built for AVX-512, AVX2 and the baseline, chosen at run time */
+#if defined(__GNUC__) && __GNUC__ >= 6 && !defined(__clang__) && \
+    defined(__x86_64__) && defined(__linux__)
+#define CR2RES_EXTRACT_SIMD \
+    __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define CR2RES_EXTRACT_SIMD
+#endif
+
+/* Swath window of a rectified order, addressed in place */
 typedef struct {
-    int     x ;
-    int     y ;     /* Coordinates of target pixel x,y  */
-    double  w ;     /* Contribution weight <= 1/osample */
-} xi_ref;
+    const double        *   img ;       /* First pixel of the swath */
+    const double        *   err ;
+    const cpl_binary    *   bpm ;       /* NULL if there are no bad pixels */
+    int                     stride ;    /* Pixels between two rows */
+} swath_view ;
 
+/* Scratch memory of one worker decomposing curved swaths */
 typedef struct {
-    int     x ;
-    int     iy ;    /* Contributing subpixel  x,iy      */
-    double  w;      /* Contribution weight <= 1/osample */
-} zeta_ref;
+    int                 swath ;
+    int             *   mask ;
+    double          *   ycen ;
+    int             *   ycen_offset ;
+    cpl_polynomial  **  slitcurves ;
+    double          *   sP_old ;
+    double          *   l_Aij ;
+    double          *   p_Aij ;
+    double          *   l_bj ;
+    double          *   p_bj ;
+    double          *   loc ;
+    cpl_image       *   img_mad ;
+    zeta_tensor     *   zeta ;
+} slitdec_workspace ;
+
+/* Maximum size in bytes of the tensors cached by an extraction plan */
+#define CR2RES_EXTRACT_PLAN_CACHE_MAX   (128*1024*1024)
+
+/* Image independent geometry of one trace */
+typedef struct {
+    int                 height ;
+    int                 swath ;
+    int                 oversample ;
+    int                 delta_x ;
+    int                 nswaths ;
+    double              trace_height ;
+    cpl_vector      *   ycen ;
+    double          *   ycen_rest ;
+    cpl_vector      *   bins_begin ;
+    cpl_vector      *   bins_end ;
+    cpl_polynomial  *   slitcurve_A ;   /* NULL for the vertical slit */
+    cpl_polynomial  *   slitcurve_B ;
+    cpl_polynomial  *   slitcurve_C ;
+    zeta_tensor     **  zeta ;          /* Per swath, NULL if not cached */
+    int                 single ;        /* Single precision tensor weights */
+} trace_geometry ;
+
+/* Model of one trace, restricted to the detector rows it covers */
+typedef struct {
+    cpl_image       *   rect ;  /* Model in rectified rows [height][lenx] */
+    int             *   y0 ;    /* Detector row (0 based) of row 0 [lenx] */
+} model_tile ;
+
+struct _cr2res_extract_plan_ {
+    cpl_table           *   traces ;
+    cr2res_extr_method      extr_method ;
+    int                     extr_height ;
+    int                     swath_width ;
+    int                     oversample ;
+    cpl_size                lenx ;
+    cpl_size                leny ;
+    int                 *   selected ;  /* Per trace table row */
+    trace_geometry      **  geom ;      /* Per trace table row, or NULL */
+    int                     warm_start ;
+} ;
 
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
+static int cr2res_extract_trace(
+        const hdrl_image            *   img,
+        const cr2res_extract_plan   *   plan,
+        int                             idx,
+        const cpl_table             *   slit_func_in,
+        double                          smooth_slit,
+        double                          smooth_spec,
+        cpl_vector                  **  slit_func,
+        cpl_bivector                **  spectrum,
+        model_tile                  **  model) ;
+
+static void cr2res_extract_report_iterations(
+        int                 order,
+        int                 trace_id,
+        const int       *   niter,
+        int                 nswaths) ;
+
+static model_tile * cr2res_extract_model_tile_new(
+        cpl_image           *   rect,
+        const cpl_vector    *   ycen,
+        int                     offset) ;
+
+static model_tile * cr2res_extract_model_tile_rank1(
+        const cpl_vector    *   spc,
+        const cpl_vector    *   slitfu,
+        const cpl_vector    *   ycen) ;
+
+static void cr2res_extract_model_tile_delete(model_tile * tile) ;
+
+static int cr2res_extract_model_tile_paste(
+        const model_tile    *   tile,
+        hdrl_image          *   model) ;
+
+static cpl_image * cr2res_extract_model_tile_image(
+        const model_tile    *   tile,
+        cpl_size                leny) ;
+
+static hdrl_image * cr2res_extract_model_rect_insert(
+        const cpl_image     *   model_rect,
+        const cpl_vector    *   ycen,
+        cpl_size                leny) ;
+
+static trace_geometry * cr2res_extract_geometry_new(
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        cpl_size                lenx,
+        cpl_size                leny,
+        int                     curved) ;
+
+static void cr2res_extract_geometry_delete(trace_geometry * g) ;
+
+static void cr2res_extract_geometry_swath(
+        const trace_geometry    *   g,
+        int                         swath_nb,
+        double                  *   ycen_sw,
+        int                     *   ycen_offset_sw,
+        cpl_polynomial          **  slitcurves) ;
+
+static void cr2res_extract_geometry_cache(trace_geometry * g) ;
+
+static int cr2res_extract_slitdec_vert_geom(
+        const hdrl_image        *   img_hdrl,
+        const trace_geometry    *   g,
+        const cpl_vector        *   slit_func_vec_in,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         warm_start,
+        cpl_vector              **  slit_func,
+        cpl_bivector            **  spec,
+        int                     *   niter,
+        cpl_image               **  model_rect) ;
+
+static int cr2res_extract_slitdec_curved_geom(
+        const hdrl_image        *   img_hdrl,
+        const trace_geometry    *   g,
+        const cpl_vector        *   slit_func_vec_in,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         warm_start,
+        cpl_vector              **  slit_func,
+        cpl_bivector            **  spec,
+        int                     *   niter,
+        cpl_image               **  model_rect) ;
+
 static int cr2res_extract_slit_func_vert(
         int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         double  *   sL,
@@ -78,14 +252,22 @@ static int cr2res_extract_slit_func_vert(
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double * slit_func_in) ;
+        const double * slit_func_in,
+        const double * sL_guess,
+        int         *   niter) ;
+
+static int cr2res_extract_slitdec_converged(
+        double      sP_change,
+        double  *   sP_change_prev,
+        double      sP_tol) ;
 
 static int cr2res_extract_slit_func_curved(
         int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         int     *   ycen_offset,
@@ -102,28 +284,112 @@ static int cr2res_extract_slit_func_curved(
         double      sP_stop,
         int         maxiter,
         const double   *  slit_func_in,
+        const double   *  sL_guess,
+        int       *  niter,
         double    *  sP_old,
         double    *  l_Aij,
         double    *  p_Aij,
         double    *  l_bj,
         double    *  p_bj,
+        double    *  loc,
         cpl_image *  img_mad,
-        xi_ref    *  xi,
-        zeta_ref  *  zeta,
-        int       *  m_zeta) ;
-
-static int cr2res_extract_xi_zeta_tensors(
+        const zeta_tensor * zeta) ;
+
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_fill_sL(
+        const zeta_tensor   *   zeta,
+        const double        *   im,
+        int                     stride,
+        const int           *   mask,
+        const double        *   sP,
+        int                     ny,
+        int                     ml,
+        double              *   l_Aij,
+        double              *   l_bj,
+        double              *   loc) ;
+
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_fill_sP(
+        const zeta_tensor   *   zeta,
+        const double        *   im,
+        int                     stride,
+        const int           *   mask,
+        const double        *   sL,
+        int                     mp,
+        double              *   p_Aij,
+        double              *   p_bj,
+        double              *   loc) ;
+
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_model(
+        const zeta_tensor   *   zeta,
+        const double        *   sP,
+        const double        *   sL,
+        double              *   model) ;
+
+static slitdec_workspace * cr2res_extract_slitdec_workspace_new(
+        int     swath,
+        int     height,
+        int     oversample,
+        int     delta_x,
+        int     single) ;
+
+static void cr2res_extract_slitdec_workspace_delete(slitdec_workspace * ws) ;
+
+static int cr2res_extract_swath_view(
+        const cpl_image     *   img_rect,
+        const cpl_image     *   err_rect,
+        int                     sw_start,
+        swath_view          *   view) ;
+
+static void cr2res_extract_swath_mask(
+        const swath_view    *   view,
+        int                     ncols,
+        int                     nrows,
+        int                 *   mask) ;
+
+static int cr2res_extract_slitdec_reject_bad(
+        cpl_image           *   img_rect,
+        cpl_image           *   err_rect) ;
+
+static int cr2res_extract_slitdec_curved_swath(
+        slitdec_workspace       *   ws,
+        const trace_geometry    *   g,
+        const cpl_image         *   img_rect,
+        const cpl_image         *   err_rect,
+        const double            *   slit_func_in,
+        const double            *   sL_guess,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         swath_nb,
+        cpl_vector              **  spec_sw,
+        double                  *   unc_sw,
+        double                  *   slitfu_sw,
+        double                  *   model_sw,
+        int                     *   niter) ;
+
+static zeta_tensor * cr2res_extract_zeta_tensor_new(
+        int     ncols,
+        int     nrows,
+        int     osample,
+        int     single) ;
+
+static void cr2res_extract_zeta_tensor_delete(zeta_tensor * zeta) ;
+
+static void cr2res_extract_zeta_add(
+        zeta_tensor *   zeta,
+        int             x,
+        int             iy,
+        int             xx,
+        int             yy,
+        double          w) ;
+
+static int cr2res_extract_zeta_tensor(
         int         ncols,
         int         nrows,
-        int         ny,
         double  *   ycen,
         int     *   ycen_offset,
         int         y_lower_lim,
         int         osample,
         cpl_polynomial ** slitcurves,
-        xi_ref   *  xi,
-        zeta_ref *  zeta,
-        int      *  m_zeta) ;
+        zeta_tensor *   zeta) ;
 
 static int cr2res_extract_slitdec_adjust_swath(
         cpl_vector  *   ycen,
@@ -138,8 +404,9 @@ static int cr2res_extract_slitdec_adjust_swath(
 static int debug_output(int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         int     *   ycen_offset,
@@ -168,15 +435,20 @@ static int debug_output(int         ncols,
   @param    oversample      factor for oversampling
   @param    smooth_slit     smoothing along slit
   @param    smooth_spec     smoothing along spectrum
+  @param    nthreads        number of traces extracted in parallel (<1: all)
   @param    display         Flag to allow display
   @param    disp_order_idx  The order index to display
   @param    disp_trace      The trace number to display
-  @param    extracted       [out] the extracted spectra 
+  @param    extracted       [out] the extracted spectra
   @param    slit_func       [out] the slit functions
-  @param    model_master    [out] the model
+  @param    model_master    [out] the model, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (contining many orders), and a traces table.
+  It builds an extraction plan for the image and applies it once. To
+  extract several images with the same traces table, build the plan with
+  cr2res_extract_plan_new() and apply it to each image with
+  cr2res_extract_plan_apply() instead.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract_traces(
@@ -191,171 +463,398 @@ int cr2res_extract_traces(
         int                     oversample,
         double                  smooth_slit,
         double                  smooth_spec,
+        int                     nthreads,
         int                     display,
         int                     disp_order_idx,
         int                     disp_trace,
         cpl_table           **  extracted,
         cpl_table           **  slit_func,
         hdrl_image          **  model_master)
+{
+    cr2res_extract_plan *   plan ;
+    int                     ret ;
+
+    /* Check Entries */
+    if (img == NULL || traces == NULL) return -1 ;
+
+    /* Compute the geometry of the traces */
+    if ((plan = cr2res_extract_plan_new(traces, reduce_order, reduce_trace,
+                    extr_method, extr_height, swath_width, oversample,
+                    hdrl_image_get_size_x(img), hdrl_image_get_size_y(img),
+                    0)) == NULL) {
+        cpl_msg_error(__func__, "Cannot create the extraction plan") ;
+        return -1 ;
+    }
+
+    /* Extract */
+    ret = cr2res_extract_plan_apply(img, plan, slit_func_in, smooth_slit,
+            smooth_spec, nthreads, display, disp_order_idx, disp_trace,
+            extracted, slit_func, model_master) ;
+    cr2res_extract_plan_delete(plan) ;
+    return ret ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the image independent extraction geometry of the traces
+  @param    traces          The traces table
+  @param    reduce_order    The order to extract (-1 for all)
+  @param    reduce_trace    The Trace to extract (-1 for all)
+  @param    extr_method     The wished extraction method
+  @param    extr_height     number of pix above and below mid-line or -1
+  @param    swath_width     width per swath
+  @param    oversample      factor for oversampling
+  @param    lenx            X size of the images to extract
+  @param    leny            Y size of the images to extract
+  @param    cache_tensors   Flag to also keep the zeta tensors
+  @return   the newly allocated plan or NULL in error case
+
+  The trace centers, the swath bins and the slit curvature of the selected
+  traces only depend on the traces table and on the extraction parameters.
+  They are computed once here, and shared by all the images the plan is
+  applied to with cr2res_extract_plan_apply().
+
+  With cache_tensors, the zeta geometry tensors of the curved slit
+  decomposition are computed as well, trace by trace as long as they fit
+  in CR2RES_EXTRACT_PLAN_CACHE_MAX bytes. This only pays off if the plan
+  is applied to more than one image.
+
+  A trace whose geometry cannot be computed fails when the plan is
+  applied, like it would in cr2res_extract_traces().
+  The returned plan must be deallocated with cr2res_extract_plan_delete()
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_extract_plan * cr2res_extract_plan_new(
+        const cpl_table     *   traces,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        cpl_size                lenx,
+        cpl_size                leny,
+        int                     cache_tensors)
+{
+    cr2res_extract_plan *   plan ;
+    trace_geometry      *   g ;
+    int                 *   cached ;
+    cpl_size                cache_size, trace_size ;
+    int                     nb_traces, i, order, trace_id ;
+
+    /* Check Entries */
+    if (traces == NULL || lenx < 1 || leny < 1) return NULL ;
+
+    /* Initialise */
+    nb_traces = cpl_table_get_nrow(traces) ;
+
+    plan = cpl_malloc(sizeof(cr2res_extract_plan)) ;
+    plan->traces = cpl_table_duplicate(traces) ;
+    plan->extr_method = extr_method ;
+    plan->extr_height = extr_height ;
+    plan->swath_width = swath_width ;
+    plan->oversample = oversample ;
+    plan->lenx = lenx ;
+    plan->leny = leny ;
+    plan->warm_start = 0 ;
+    plan->selected = cpl_malloc(nb_traces * sizeof(int)) ;
+    plan->geom = cpl_malloc(nb_traces * sizeof(trace_geometry *)) ;
+
+    /* Select the traces */
+    for (i=0 ; i<nb_traces ; i++) {
+        plan->geom[i] = NULL ;
+        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
+        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
+        plan->selected[i] = 1 ;
+        if (reduce_order > -1 && order != reduce_order)
+            plan->selected[i] = 0 ;
+        if (reduce_trace > -1 && trace_id != reduce_trace)
+            plan->selected[i] = 0 ;
+    }
+
+    /* Only the slit decomposition has a geometry to precompute */
+    if (extr_method != CR2RES_EXTR_OPT_VERT &&
+            extr_method != CR2RES_EXTR_OPT_CURV) return plan ;
+
+    /* Compute the geometry of the selected traces */
+    for (i=0 ; i<nb_traces ; i++) {
+        if (!plan->selected[i]) continue ;
+        order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
+        trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
+        if ((plan->geom[i] = cr2res_extract_geometry_new(traces, order,
+                        trace_id, extr_height, swath_width, oversample, lenx,
+                        leny, extr_method == CR2RES_EXTR_OPT_CURV)) == NULL) {
+            cpl_msg_warning(__func__,
+                    "Cannot compute the geometry of Order %d/Trace %d",
+                    order, trace_id) ;
+            cpl_error_reset() ;
+        }
+    }
+
+    /* Cache the tensors of the curved slit decomposition */
+    if (!cache_tensors || extr_method != CR2RES_EXTR_OPT_CURV) return plan ;
+
+    cached = cpl_calloc(nb_traces, sizeof(int)) ;
+    cache_size = 0 ;
+    for (i=0 ; i<nb_traces ; i++) {
+        if ((g = plan->geom[i]) == NULL) continue ;
+        trace_size = (cpl_size)g->nswaths * g->swath * g->height *
+            (3 * (g->oversample + 1) * (2 * sizeof(zeta_idx) +
+                sizeof(double)) + sizeof(zeta_idx)) ;
+        if (cache_size + trace_size > CR2RES_EXTRACT_PLAN_CACHE_MAX) break ;
+        cache_size += trace_size ;
+        cached[i] = 1 ;
+    }
+    cpl_msg_debug(__func__, "Cache %lld bytes of geometry tensors",
+            cache_size) ;
+
+    /* The tensors of the different traces are independent */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(dynamic,1)
+#endif
+    for (i=0 ; i<nb_traces ; i++) {
+        if (cached[i]) cr2res_extract_geometry_cache(plan->geom[i]) ;
+    }
+    cpl_free(cached) ;
+    return plan ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Set the warm start of the slit decomposition of a plan
+  @param    plan        The plan
+  @param    warm_start  Flag to warm start the slit decomposition
+  @return   0 if ok, -1 otherwise
+
+  By default, every swath of the slit decomposition starts from a flat
+  slit function, and an input slit_func is used as is.
+  With the warm start, every swath starts from the slit function of the
+  previous swath. An input slit_func, for example the SLIT_FUNC of a
+  previous exposure, is then only the starting guess of the first swath,
+  and is refined like the others. The iterations also stop as soon as
+  the spectrum is within the tolerance of its converged value, as
+  estimated from the rate at which its changes decrease. A swath that
+  did not converge does not seed the next one.
+  The swaths of a trace are then solved in order, the traces are still
+  extracted in parallel.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_plan_set_warm_start(
+        cr2res_extract_plan *   plan,
+        int                     warm_start)
+{
+    if (plan == NULL) return -1 ;
+    plan->warm_start = (warm_start != 0) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Set the precision of the curved slit decomposition of a plan
+  @param    plan        The plan
+  @param    single      Flag to use single precision tensor weights
+  @return   0 if ok, -1 otherwise
+
+  The zeta tensors of the curved slit decomposition are read for every
+  detector pixel in every iteration. In single precision, their weights
+  take half of the memory, and the tensors are built and read faster.
+  The images, the systems of equations and all the sums stay in double
+  precision. The extracted spectra then differ from the double precision
+  ones by less than 1e-6 relatively, far below the noise of the data.
+  The tensors already cached in the plan are recomputed.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_plan_set_single_precision(
+        cr2res_extract_plan *   plan,
+        int                     single)
+{
+    trace_geometry  *   g ;
+    int                 i, j, nb_traces ;
+
+    if (plan == NULL) return -1 ;
+    single = (single != 0) ;
+    nb_traces = cpl_table_get_nrow(plan->traces) ;
+
+    /* The tensors of the different traces are independent */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(dynamic,1) private(g,j)
+#endif
+    for (i=0 ; i<nb_traces ; i++) {
+        if ((g = plan->geom[i]) == NULL || g->single == single) continue ;
+        g->single = single ;
+        if (g->zeta == NULL) continue ;
+        for (j=0 ; j<g->nswaths ; j++)
+            cr2res_extract_zeta_tensor_delete(g->zeta[j]) ;
+        cpl_free(g->zeta) ;
+        g->zeta = NULL ;
+        cr2res_extract_geometry_cache(g) ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate an extraction plan
+  @param    plan    The plan to delete
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_extract_plan_delete(cr2res_extract_plan * plan)
+{
+    int     i ;
+
+    if (plan == NULL) return ;
+    for (i=0 ; i<cpl_table_get_nrow(plan->traces) ; i++)
+        cr2res_extract_geometry_delete(plan->geom[i]) ;
+    cpl_free(plan->geom) ;
+    cpl_free(plan->selected) ;
+    cpl_table_delete(plan->traces) ;
+    cpl_free(plan) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Extracts all the traces of a plan from an image
+  @param    img             Full detector image
+  @param    plan            The extraction plan
+  @param    slit_func_in    The input slit_func or NULL, only the starting
+                            guess with cr2res_extract_plan_set_warm_start()
+  @param    smooth_slit     smoothing along slit
+  @param    smooth_spec     smoothing along spectrum
+  @param    nthreads        number of traces extracted in parallel (<1: all)
+  @param    display         Flag to allow display
+  @param    disp_order_idx  The order index to display
+  @param    disp_trace      The trace number to display
+  @param    extracted       [out] the extracted spectra
+  @param    slit_func       [out] the slit functions
+  @param    model_master    [out] the model, or NULL if not needed
+  @return   0 if ok, -1 otherwise
+
+  The image size must be the one the plan was created for.
+  The traces are independent and are extracted concurrently by up to
+  nthreads workers (if built with OpenMP). The threads left by these
+  workers (see cr2res_thread_budget()) solve the swaths of each trace,
+  so that the extraction never runs more threads than the machine has
+  cores, whatever nthreads is. The per-trace results are
+  stored by trace table row, and the model is composited in row order,
+  so the products do not depend on the number of threads.
+  Each trace model is kept as a tile covering the trace rows only, and
+  is pasted into the full frame model over these rows. Without
+  model_master, no model is computed at all.
+  The plan is not modified, and can be applied to any number of images.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_plan_apply(
+        const hdrl_image            *   img,
+        const cr2res_extract_plan   *   plan,
+        const cpl_table             *   slit_func_in,
+        double                          smooth_slit,
+        double                          smooth_spec,
+        int                             nthreads,
+        int                             display,
+        int                             disp_order_idx,
+        int                             disp_trace,
+        cpl_table                   **  extracted,
+        cpl_table                   **  slit_func,
+        hdrl_image                  **  model_master)
 {
     cpl_bivector        **  spectrum ;
-    cpl_vector          *   slit_func_in_vec ;
     cpl_vector          **  slit_func_vec ;
+    const cpl_table     *   traces ;
     cpl_table           *   slit_func_loc ;
     cpl_table           *   extract_loc ;
     hdrl_image          *   model_loc ;
-    hdrl_image          *   model_loc_one ;
+    model_tile          *   model_tile_one ;
     int                     nb_traces, i, order, trace_id ;
-    int                     badpix;
-    cpl_size                x, y;
-    hdrl_value              pixval;
 
     /* Check Entries */
-    if (img == NULL || traces == NULL) return -1 ;
+    if (img == NULL || plan == NULL) return -1 ;
+    if (hdrl_image_get_size_x(img) != plan->lenx ||
+            hdrl_image_get_size_y(img) != plan->leny) {
+        cpl_msg_error(__func__, "The image size does not match the plan") ;
+        return -1 ;
+    }
 
     /* Initialise */
+    traces = plan->traces ;
     nb_traces = cpl_table_get_nrow(traces) ;
+#ifdef _OPENMP
+    if (nthreads < 1 || nthreads > cr2res_thread_budget())
+        nthreads = cr2res_thread_budget() ;
+    if (nthreads > nb_traces) nthreads = CPL_MAX(nb_traces, 1) ;
+#else
+    nthreads = 1 ;
+#endif
 
     /* Allocate Data containers */
     spectrum = cpl_malloc(nb_traces * sizeof(cpl_bivector *)) ;
     slit_func_vec = cpl_malloc(nb_traces * sizeof(cpl_vector *)) ;
-    model_loc = hdrl_image_duplicate(img) ;
-    hdrl_image_mul_scalar(model_loc, (hdrl_value){0.0, 0.0}) ;
+    for (i=0 ; i<nb_traces ; i++) {
+        slit_func_vec[i] = NULL ;
+        spectrum[i] = NULL ;
+    }
+    model_loc = NULL ;
+    if (model_master != NULL) {
+        model_loc = hdrl_image_duplicate(img) ;
+        hdrl_image_mul_scalar(model_loc, (hdrl_value){0.0, 0.0}) ;
+    }
+
+    if (nthreads > 1)
+        cpl_msg_info(__func__, "Extract the traces with %d threads", nthreads);
 
     /* Loop over the traces and extract them */
+    cr2res_msg_indent_more() ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,1) ordered \
+    private(order,trace_id,model_tile_one)
+#endif
     for (i=0 ; i<nb_traces ; i++) {
         /* Initialise */
-        slit_func_vec[i] = NULL ;
-        spectrum[i] = NULL ;
-        model_loc_one = NULL ;
+        model_tile_one = NULL ;
+
+        /* Check if this trace needs to be skipped */
+        if (!plan->selected[i]) continue ;
 
         /* Get Order and trace id */
         order = cpl_table_get(traces, CR2RES_COL_ORDER, i, NULL) ;
         trace_id = cpl_table_get(traces, CR2RES_COL_TRACENB, i, NULL) ;
 
-        /* Check if this order needs to be skipped */
-        if (reduce_order > -1 && order != reduce_order) continue ;
-
-        /* Check if this trace needs to be skipped */
-        if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
-
         cpl_msg_info(__func__, "Process Order %d/Trace %d",order,trace_id) ;
-        cpl_msg_indent_more() ;
-        
-        /* Get the input slit_func if available */
-        if (slit_func_in != NULL) {
-            /* Load the proper slit function vector */
-            cr2res_extract_SLIT_FUNC_get_vector(slit_func_in, order,
-                    trace_id, &slit_func_in_vec) ;
-        } else {
-            slit_func_in_vec = NULL ;
-        }
 
         /* Call the Extraction */
-        if (extr_method == CR2RES_EXTR_SUM) {
-            if (cr2res_extract_sum_vert(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_MEDIAN) {
-            if (cr2res_extract_median(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (median-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_TILTSUM) {
-            if (cr2res_extract_sum_tilt(img, traces, order,
-                        trace_id, extr_height, &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__, "Cannot (tiltsum-)extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_VERT) {
-            if (cr2res_extract_slitdec_vert(img, traces, slit_func_in_vec,
-                        order, trace_id, extr_height, swath_width,
-                        oversample, smooth_slit, smooth_spec, 
-                        &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__,
-                        "Cannot (slitdec-vert-) extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
-        } else if (extr_method == CR2RES_EXTR_OPT_CURV) {
-            if (cr2res_extract_slitdec_curved(img, traces, slit_func_in_vec,
-                        order, trace_id, extr_height, swath_width,
-                        oversample, smooth_slit, smooth_spec,
-                        &(slit_func_vec[i]),
-                        &(spectrum[i]), &model_loc_one) != 0) {
-                cpl_msg_error(__func__,
-                        "Cannot (slitdec-curved-) extract the trace") ;
-                if (slit_func_in_vec != NULL) 
-                    cpl_vector_delete(slit_func_in_vec) ;
-                slit_func_vec[i] = NULL ;
-                spectrum[i] = NULL ;
-                model_loc_one = NULL ;
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
+        if (cr2res_extract_trace(img, plan, i, slit_func_in, smooth_slit,
+                    smooth_spec, &(slit_func_vec[i]), &(spectrum[i]),
+                    model_loc == NULL ? NULL : &model_tile_one) != 0) {
+            slit_func_vec[i] = NULL ;
+            spectrum[i] = NULL ;
+            model_tile_one = NULL ;
+            cpl_error_reset() ;
+            continue ;
         }
-        if (slit_func_in_vec != NULL) cpl_vector_delete(slit_func_in_vec) ;
-
-        /* Update the model global image */
-        if (model_loc_one != NULL) {
-            //hdrl_image_add_image(model_loc, model_loc_one) ;
-            for (x = 1; x <= hdrl_image_get_size_x(model_loc); x++){
-                for (y = 1; y <= hdrl_image_get_size_y(model_loc); y++){
-                    pixval = hdrl_image_get_pixel(model_loc_one, 
-                                                    x, y, &badpix);
-                    if (pixval.data != 0 & badpix == 0){
-                        hdrl_image_set_pixel(model_loc, x, y, pixval);
-                    }
-                }
-            }
 
-            hdrl_image_delete(model_loc_one) ;
-        }
+        /* Merge the results in the trace table order */
+#ifdef _OPENMP
+#pragma omp ordered
+#endif
+        {
+            /* Update the model global image over the trace rows */
+            if (model_tile_one != NULL) {
+                cr2res_extract_model_tile_paste(model_tile_one, model_loc) ;
+                cr2res_extract_model_tile_delete(model_tile_one) ;
+            }
 
-        /* Plot the Spectrum */
-        if (display && disp_order_idx==order && disp_trace==trace_id) {
-            cpl_plot_vector(
-            "set grid;set xlabel 'pixels';set ylabel 'Flux (ADU)';",
-            "t 'Extracted Specrum' w lines", "",
-            cpl_bivector_get_x_const(spectrum[i])) ;
+            /* Plot the Spectrum */
+            if (display && disp_order_idx==order && disp_trace==trace_id) {
+                cpl_plot_vector(
+                "set grid;set xlabel 'pixels';set ylabel 'Flux (ADU)';",
+                "t 'Extracted Specrum' w lines", "",
+                cpl_bivector_get_x_const(spectrum[i])) ;
+            }
         }
-        cpl_msg_indent_less() ;
     }
+    cr2res_msg_indent_less() ;
 
     /* Create the slit_func_tab for the current detector */
     if ((slit_func_loc = cr2res_extract_SLITFUNC_create(slit_func_vec,
@@ -367,12 +866,12 @@ int cr2res_extract_traces(
         }
         cpl_free(spectrum) ;
         cpl_free(slit_func_vec) ;
-        hdrl_image_delete(model_loc) ;
-        return -1; 
+        if (model_loc != NULL) hdrl_image_delete(model_loc) ;
+        return -1;
     }
 
     /* Create the extracted_tab for the current detector */
-    if ((extract_loc = cr2res_extract_EXTRACT1D_create(spectrum, traces)) 
+    if ((extract_loc = cr2res_extract_EXTRACT1D_create(spectrum, traces))
                 == NULL) {
         for (i=0 ; i<nb_traces ; i++) {
             if (slit_func_vec[i] != NULL) cpl_vector_delete(slit_func_vec[i]) ;
@@ -380,7 +879,7 @@ int cr2res_extract_traces(
         }
         cpl_free(spectrum) ;
         cpl_free(slit_func_vec) ;
-        hdrl_image_delete(model_loc) ;
+        if (model_loc != NULL) hdrl_image_delete(model_loc) ;
         cpl_table_delete(slit_func_loc);
         return -1;
     }
@@ -396,107 +895,500 @@ int cr2res_extract_traces(
     /* Return  */
     *extracted = extract_loc ;
     *slit_func = slit_func_loc ;
-    *model_master = model_loc;
+    if (model_master != NULL) *model_master = model_loc;
     return 0 ;
 }
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Simple extraction function
-  @param    img_in      full detector image
-  @param    trace_tab   The traces table
-  @param    order       The order to extract
-  @param    trace_id    The Trace to extract
-  @param    height      number of pix above and below mid-line or -1
-  @param    slit_func   the returned slit function, normalized to sum=1
-  @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @brief    Extract one trace of a plan with the wished method
+  @param    img             Full detector image
+  @param    plan            The extraction plan
+  @param    idx             The traces table row of the trace
+  @param    slit_func_in    The input slit_func or NULL
+  @param    smooth_slit     smoothing along slit
+  @param    smooth_spec     smoothing along spectrum
+  @param    slit_func       [out] the slit function
+  @param    spectrum        [out] the extracted spectrum
+  @param    model           [out] the model tile, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
-  This func takes a single image (containing many orders), a trace table,
-  the order and trace numbers to extract (one each), and the extraction
-  height.
-  It uses the trace to shift the image columns by integer values,
-  thereby straightening the order. The output spectra and slit
-  function are then the collapsed image in x and y, respectively.
-  Also returned is the "model", i.e. an image reconstruction from
-  the two extracted vectors.
-
+  Only reads the shared inputs, and can be called concurrently for
+  different traces.
  */
 /*----------------------------------------------------------------------------*/
-int cr2res_extract_sum_vert(
-        const hdrl_image    *   hdrl_in,
-        const cpl_table     *   trace_tab,
-        int                     order,
-        int                     trace_id,
-        int                     height,
-        cpl_vector          **  slit_func,
-        cpl_bivector        **  spec,
-        hdrl_image          **  model)
+static int cr2res_extract_trace(
+        const hdrl_image            *   img,
+        const cr2res_extract_plan   *   plan,
+        int                             idx,
+        const cpl_table             *   slit_func_in,
+        double                          smooth_slit,
+        double                          smooth_spec,
+        cpl_vector                  **  slit_func,
+        cpl_bivector                **  spectrum,
+        model_tile                  **  model)
 {
-    int             *   ycen_int;
-    cpl_vector      *   ycen ;
-    cpl_image       *   img_tmp;
-    cpl_image       *   img_1d;
-    const cpl_image       *   img_in;
-    const cpl_image       *   err_in;
-    cpl_vector      *   spc;
-    cpl_vector      *   slitfu;
-    cpl_vector      *   sigma;
-    cpl_size            lenx, leny;
-    int                 i, j, y;
-    int                 ymin, ymax;
-    int                 empty_bottom = 0;
-    double              trace_cen, trace_height ;
-    cpl_type            imtyp;
-
-    /* Check Entries */
-    if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
-
-    img_in = hdrl_image_get_image_const(hdrl_in);
-    err_in = hdrl_image_get_error_const(hdrl_in);
+    cpl_vector          *   slit_func_in_vec ;
+    cpl_vector          *   ycen ;
+    cpl_image           *   model_rect ;
+    const trace_geometry *  g ;
+    int                 *   niter ;
+    int                     order, trace_id, ret ;
 
-    /* use the same type as input for temp images below */
-    imtyp = cpl_image_get_type(img_in);
-    lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
+    /* Initialise */
+    order = cpl_table_get(plan->traces, CR2RES_COL_ORDER, idx, NULL) ;
+    trace_id = cpl_table_get(plan->traces, CR2RES_COL_TRACENB, idx, NULL) ;
+    g = plan->geom[idx] ;
+
+    /* Get the input slit_func if available */
+    if (slit_func_in != NULL) {
+        /* Load the proper slit function vector */
+        cr2res_extract_SLIT_FUNC_get_vector(slit_func_in, order,
+                trace_id, &slit_func_in_vec) ;
+    } else {
+        slit_func_in_vec = NULL ;
+    }
 
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
+    /* Call the Extraction */
+    /* The full frame models are not built, only the model tiles */
+    ret = -1 ;
+    model_rect = NULL ;
+    niter = NULL ;
+    if (plan->extr_method == CR2RES_EXTR_SUM) {
+        ret = cr2res_extract_sum_vert(img, plan->traces, order, trace_id,
+                plan->extr_height, slit_func, spectrum, NULL) ;
+        if (ret != 0)
+            cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
+    } else if (plan->extr_method == CR2RES_EXTR_MEDIAN) {
+        ret = cr2res_extract_median(img, plan->traces, order, trace_id,
+                plan->extr_height, slit_func, spectrum, NULL) ;
+        if (ret != 0)
+            cpl_msg_error(__func__, "Cannot (median-)extract the trace") ;
+    } else if (plan->extr_method == CR2RES_EXTR_TILTSUM) {
+        ret = cr2res_extract_sum_tilt(img, plan->traces, order, trace_id,
+                plan->extr_height, slit_func, spectrum, NULL) ;
+        if (ret != 0)
+            cpl_msg_error(__func__, "Cannot (tiltsum-)extract the trace") ;
+    } else if (plan->extr_method == CR2RES_EXTR_OPT_VERT) {
+        if (g != NULL) {
+            niter = cpl_calloc(g->nswaths, sizeof(int)) ;
+            ret = cr2res_extract_slitdec_vert_geom(img, g, slit_func_in_vec,
+                    smooth_slit, smooth_spec, plan->warm_start, slit_func,
+                    spectrum, niter, model == NULL ? NULL : &model_rect) ;
+        }
+        if (ret != 0)
+            cpl_msg_error(__func__,
+                    "Cannot (slitdec-vert-) extract the trace") ;
+    } else if (plan->extr_method == CR2RES_EXTR_OPT_CURV) {
+        if (g != NULL) {
+            niter = cpl_calloc(g->nswaths, sizeof(int)) ;
+            ret = cr2res_extract_slitdec_curved_geom(img, g, slit_func_in_vec,
+                    smooth_slit, smooth_spec, plan->warm_start, slit_func,
+                    spectrum, niter, model == NULL ? NULL : &model_rect) ;
         }
+        if (ret != 0)
+            cpl_msg_error(__func__,
+                    "Cannot (slitdec-curved-) extract the trace") ;
     }
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
-        return -1 ;
+    if (slit_func_in_vec != NULL) cpl_vector_delete(slit_func_in_vec) ;
+    if (niter != NULL) {
+        if (ret == 0)
+            cr2res_extract_report_iterations(order, trace_id, niter,
+                    g->nswaths) ;
+        cpl_free(niter) ;
     }
-    trace_cen = cpl_vector_get(ycen, cpl_vector_get_size(ycen)/2) ;
-    trace_height = (double)cr2res_trace_get_height(trace_tab, order, trace_id) ;
-    cpl_msg_info(__func__, "Y position of the trace: %g -> %g", 
-            trace_cen-(trace_height/2), trace_cen+(trace_height/2)) ;
+    if (ret != 0 || model == NULL) return ret ;
 
-    img_tmp = cr2res_image_cut_rectify(img_in, ycen, height);
-    if (img_tmp == NULL) {
-        cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
-        return -1;
+    /* Create the model tile */
+    if (model_rect != NULL) {
+        /* Slit decomposition: rows of cr2res_image_cut_rectify() */
+        *model = cr2res_extract_model_tile_new(model_rect, g->ycen, -1) ;
+        if (*model == NULL) cpl_image_delete(model_rect) ;
+    } else {
+        /* Simple extractions: spectrum times slit function */
+        ycen = cr2res_trace_get_ycen(plan->traces, order, trace_id,
+                plan->lenx) ;
+        *model = cr2res_extract_model_tile_rank1(
+                cpl_bivector_get_x_const(*spectrum), *slit_func, ycen) ;
+        if (ycen != NULL) cpl_vector_delete(ycen) ;
     }
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_rectorder.fits", imtyp,
-                NULL, CPL_IO_CREATE);
+    if (*model == NULL) {
+        cpl_msg_error(__func__, "Cannot create the model of the trace") ;
+        cpl_vector_delete(*slit_func) ;
+        cpl_bivector_delete(*spectrum) ;
+        *slit_func = NULL ;
+        *spectrum = NULL ;
+        return -1 ;
     }
-    img_1d = cpl_image_collapse_create(img_tmp, 0); // sum of rows
-    spc = cpl_vector_new_from_image_row(img_1d, 1);
-    cpl_image_delete(img_1d);
+    return ret ;
+}
 
-    img_1d = cpl_image_collapse_create(img_tmp, 1); // sum of columns
-    slitfu = cpl_vector_new_from_image_column(img_1d, 1);
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Report the slit decomposition iterations of a trace
+  @param    order       The order
+  @param    trace_id    The trace number
+  @param    niter       The number of iterations per swath [nswaths]
+  @param    nswaths     The number of swaths
+  @return   nothing
+
+  The total is reported at the info level, the swaths at the debug level.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_report_iterations(
+        int                 order,
+        int                 trace_id,
+        const int       *   niter,
+        int                 nswaths)
+{
+    char    *   str ;
+    char    *   tmp ;
+    int         i, total ;
+
+    total = 0 ;
+    for (i=0 ; i<nswaths ; i++) total += niter[i] ;
+    cpl_msg_info(__func__,
+            "Order %d/Trace %d: %d iterations in %d swaths (%.1f per swath)",
+            order, trace_id, total, nswaths,
+            nswaths > 0 ? (double)total / nswaths : 0.0) ;
+
+    if (cpl_msg_get_level() != CPL_MSG_DEBUG) return ;
+    str = cpl_strdup("") ;
+    for (i=0 ; i<nswaths ; i++) {
+        tmp = cpl_sprintf("%s %d", str, niter[i]) ;
+        cpl_free(str) ;
+        str = tmp ;
+    }
+    cpl_msg_debug(__func__, "Order %d/Trace %d: iterations per swath:%s",
+            order, trace_id, str) ;
+    cpl_free(str) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the model tile of a trace
+  @param    rect    The model in rectified rows [height][lenx], CPL_TYPE_DOUBLE
+  @param    ycen    The trace center [lenx]
+  @param    offset  Row offset of the rectification
+  @return   the newly allocated tile or NULL in error case
+
+  The tile takes the ownership of rect. The row j (0 based) of the column
+  x is at the detector row (0 based) ycen[x]-height/2+offset+j.
+  The tile must be deallocated with cr2res_extract_model_tile_delete()
+ */
+/*----------------------------------------------------------------------------*/
+static model_tile * cr2res_extract_model_tile_new(
+        cpl_image           *   rect,
+        const cpl_vector    *   ycen,
+        int                     offset)
+{
+    model_tile  *   tile ;
+    cpl_size        x, lenx, height ;
+
+    /* Check Entries */
+    if (rect == NULL || ycen == NULL) return NULL ;
+    if (cpl_image_get_type(rect) != CPL_TYPE_DOUBLE) return NULL ;
+    lenx = cpl_image_get_size_x(rect) ;
+    height = cpl_image_get_size_y(rect) ;
+    if (cpl_vector_get_size(ycen) != lenx) return NULL ;
+
+    tile = cpl_malloc(sizeof(model_tile)) ;
+    tile->rect = rect ;
+    tile->y0 = cr2res_vector_get_int(ycen) ;
+    for (x=0 ; x<lenx ; x++) tile->y0[x] += offset - height/2 ;
+    return tile ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the model tile of the simple extractions
+  @param    spc     The spectrum [lenx]
+  @param    slitfu  The slit function [height]
+  @param    ycen    The trace center [lenx]
+  @return   the newly allocated tile or NULL in error case
+
+  The model is the outer product of the spectrum and the slit function,
+  with the slit function starting at the detector row ycen-height/2+1.
+ */
+/*----------------------------------------------------------------------------*/
+static model_tile * cr2res_extract_model_tile_rank1(
+        const cpl_vector    *   spc,
+        const cpl_vector    *   slitfu,
+        const cpl_vector    *   ycen)
+{
+    model_tile      *   tile ;
+    cpl_image       *   rect ;
+    double          *   pdata ;
+    const double    *   pspc ;
+    const double    *   pslit ;
+    cpl_size            x, j, lenx, height ;
+
+    /* Check Entries */
+    if (spc == NULL || slitfu == NULL || ycen == NULL) return NULL ;
+
+    lenx = cpl_vector_get_size(spc) ;
+    height = cpl_vector_get_size(slitfu) ;
+    pspc = cpl_vector_get_data_const(spc) ;
+    pslit = cpl_vector_get_data_const(slitfu) ;
+    rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE) ;
+    pdata = cpl_image_get_data_double(rect) ;
+    for (j=0 ; j<height ; j++)
+        for (x=0 ; x<lenx ; x++)
+            pdata[j*lenx+x] = pspc[x] * pslit[j] ;
+
+    if ((tile = cr2res_extract_model_tile_new(rect, ycen, 0)) == NULL)
+        cpl_image_delete(rect) ;
+    return tile ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a model tile
+  @param    tile    the tile
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_model_tile_delete(model_tile * tile)
+{
+    if (tile == NULL) return ;
+    cpl_image_delete(tile->rect) ;
+    cpl_free(tile->y0) ;
+    cpl_free(tile) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Paste a model tile into the full frame model
+  @param    tile    the tile
+  @param    model   the full frame model, updated
+  @return   0 if ok, -1 otherwise
+
+  Only the rows covered by the trace are visited. The non-zero good pixels
+  of the tile overwrite the model, with a zero error, and are flagged as
+  good. The parts of the tile outside of the frame are ignored.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_model_tile_paste(
+        const model_tile    *   tile,
+        hdrl_image          *   model)
+{
+    cpl_image       *   img ;
+    cpl_image       *   err ;
+    const cpl_mask  *   bpm ;
+    const double    *   prect ;
+    const cpl_binary *  prect_bpm ;
+    double          *   pimg ;
+    double          *   perr ;
+    cpl_binary      *   pimg_bpm ;
+    cpl_binary      *   perr_bpm ;
+    cpl_size            x, y, j, lenx, leny, height, idx ;
+
+    /* Check Entries */
+    if (tile == NULL || model == NULL) return -1 ;
+    img = hdrl_image_get_image(model) ;
+    err = hdrl_image_get_error(model) ;
+    lenx = cpl_image_get_size_x(img) ;
+    leny = cpl_image_get_size_y(img) ;
+    height = cpl_image_get_size_y(tile->rect) ;
+    if (cpl_image_get_size_x(tile->rect) != lenx) return -1 ;
+    pimg = cpl_image_get_data_double(img) ;
+    perr = cpl_image_get_data_double(err) ;
+    if (pimg == NULL || perr == NULL) return -1 ;
+
+    /* Only touch the bad pixel maps that exist */
+    prect = cpl_image_get_data_double_const(tile->rect) ;
+    bpm = cpl_image_get_bpm_const(tile->rect) ;
+    prect_bpm = bpm == NULL ? NULL : cpl_mask_get_data_const(bpm) ;
+    pimg_bpm = cpl_image_get_bpm_const(img) == NULL ? NULL :
+        cpl_mask_get_data(cpl_image_get_bpm(img)) ;
+    perr_bpm = cpl_image_get_bpm_const(err) == NULL ? NULL :
+        cpl_mask_get_data(cpl_image_get_bpm(err)) ;
+
+    for (j=0 ; j<height ; j++) {
+        for (x=0 ; x<lenx ; x++) {
+            y = tile->y0[x] + j ;
+            if (y < 0 || y >= leny) continue ;
+            if (prect[j*lenx+x] == 0) continue ;
+            if (prect_bpm != NULL && prect_bpm[j*lenx+x]) continue ;
+            idx = y*lenx+x ;
+            pimg[idx] = prect[j*lenx+x] ;
+            perr[idx] = 0.0 ;
+            if (pimg_bpm != NULL) pimg_bpm[idx] = CPL_BINARY_0 ;
+            if (perr_bpm != NULL) perr_bpm[idx] = CPL_BINARY_0 ;
+        }
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the full frame image of a model tile
+  @param    tile    the tile
+  @param    leny    Y size of the frame
+  @return   the newly allocated image or NULL in error case
+
+  The pixels outside of the trace are 0.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_image * cr2res_extract_model_tile_image(
+        const model_tile    *   tile,
+        cpl_size                leny)
+{
+    cpl_image       *   out ;
+    double          *   pout ;
+    const double    *   prect ;
+    cpl_size            x, y, j, lenx, height ;
+
+    /* Check Entries */
+    if (tile == NULL || leny < 1) return NULL ;
+
+    lenx = cpl_image_get_size_x(tile->rect) ;
+    height = cpl_image_get_size_y(tile->rect) ;
+    prect = cpl_image_get_data_double_const(tile->rect) ;
+    out = cpl_image_new(lenx, leny, CPL_TYPE_DOUBLE) ;
+    pout = cpl_image_get_data_double(out) ;
+    for (j=0 ; j<height ; j++) {
+        for (x=0 ; x<lenx ; x++) {
+            y = tile->y0[x] + j ;
+            if (y < 0 || y >= leny) continue ;
+            pout[y*lenx+x] = prect[j*lenx+x] ;
+        }
+    }
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Insert a rectified slit decomposition model in the full frame
+  @param    model_rect  The rectified model [height][lenx]
+  @param    ycen        The trace center [lenx]
+  @param    leny        Y size of the frame
+  @return   the newly allocated model or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+static hdrl_image * cr2res_extract_model_rect_insert(
+        const cpl_image     *   model_rect,
+        const cpl_vector    *   ycen,
+        cpl_size                leny)
+{
+    hdrl_image      *   model ;
+    cpl_image       *   img_out ;
+
+    /* Check Entries */
+    if (model_rect == NULL || ycen == NULL || leny < 1) return NULL ;
+
+    img_out = cpl_image_new(cpl_image_get_size_x(model_rect), leny,
+            CPL_TYPE_DOUBLE) ;
+    if (cr2res_image_insert_rect(model_rect, ycen, img_out) == -1) {
+        cpl_msg_error(__func__, "failed to reinsert model swath into model image");
+        cpl_image_delete(img_out) ;
+        return NULL ;
+    }
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        cpl_image_save(img_out, "debug_model_all.fits", CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+    }
+    model = hdrl_image_create(img_out, NULL) ;
+    cpl_image_delete(img_out) ;
+    return model ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Simple extraction function
+  @param    img_in      full detector image
+  @param    trace_tab   The traces table
+  @param    order       The order to extract
+  @param    trace_id    The Trace to extract
+  @param    height      number of pix above and below mid-line or -1
+  @param    slit_func   the returned slit function, normalized to sum=1
+  @param    spec        the returned spectrum, sum of rows
+  @param    model       the reconstructed image, or NULL if not needed
+  @return   0 if ok, -1 otherwise
+
+  This func takes a single image (containing many orders), a trace table,
+  the order and trace numbers to extract (one each), and the extraction
+  height.
+  It uses the trace to shift the image columns by integer values,
+  thereby straightening the order. The output spectra and slit
+  function are then the collapsed image in x and y, respectively.
+  Also returned is the "model", i.e. an image reconstruction from
+  the two extracted vectors.
+
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_sum_vert(
+        const hdrl_image    *   hdrl_in,
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        cpl_vector          **  slit_func,
+        cpl_bivector        **  spec,
+        hdrl_image          **  model)
+{
+    model_tile      *   tile;
+    cpl_vector      *   ycen ;
+    cpl_image       *   img_tmp;
+    cpl_image       *   img_1d;
+    const cpl_image       *   img_in;
+    const cpl_image       *   err_in;
+    cpl_vector      *   spc;
+    cpl_vector      *   slitfu;
+    cpl_vector      *   sigma;
+    cpl_size            lenx, leny;
+    int                 ymin, ymax;
+    int                 empty_bottom = 0;
+    double              trace_cen, trace_height ;
+    cpl_type            imtyp;
+
+    /* Check Entries */
+    if (hdrl_in == NULL || trace_tab == NULL) return -1 ;
+
+    img_in = hdrl_image_get_image_const(hdrl_in);
+    err_in = hdrl_image_get_error_const(hdrl_in);
+
+    /* use the same type as input for temp images below */
+    imtyp = cpl_image_get_type(img_in);
+    lenx = cpl_image_get_size_x(img_in);
+    leny = cpl_image_get_size_y(img_in);
+
+    /* Compute height if not given */
+    if (height <= 0) {
+        height = cr2res_trace_get_height(trace_tab, order, trace_id);
+        if (height <= 0) {
+            cpl_msg_error(__func__, "Cannot compute height");
+            return -1;
+        }
+    }
+    /* Get ycen */
+    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
+                    trace_id, lenx)) == NULL) {
+        cpl_msg_error(__func__, "Cannot get ycen");
+        return -1 ;
+    }
+    trace_cen = cpl_vector_get(ycen, cpl_vector_get_size(ycen)/2) ;
+    trace_height = (double)cr2res_trace_get_height(trace_tab, order, trace_id) ;
+    cpl_msg_info(__func__, "Y position of the trace: %g -> %g", 
+            trace_cen-(trace_height/2), trace_cen+(trace_height/2)) ;
+
+    img_tmp = cr2res_image_cut_rectify(img_in, ycen, height);
+    if (img_tmp == NULL) {
+        cpl_msg_error(__func__, "Cannot rectify order");
+        cpl_vector_delete(ycen);
+        return -1;
+    }
+
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        cpl_image_save(img_tmp, "debug_rectorder.fits", imtyp,
+                NULL, CPL_IO_CREATE);
+    }
+    img_1d = cpl_image_collapse_create(img_tmp, 0); // sum of rows
+    spc = cpl_vector_new_from_image_row(img_1d, 1);
+    cpl_image_delete(img_1d);
+
+    img_1d = cpl_image_collapse_create(img_tmp, 1); // sum of columns
+    slitfu = cpl_vector_new_from_image_column(img_1d, 1);
     cpl_vector_divide_scalar(slitfu, cpl_vector_get_sum(slitfu));
     cpl_image_delete(img_1d);
     cpl_image_delete(img_tmp);
@@ -509,29 +1401,22 @@ int cr2res_extract_sum_vert(
     cpl_image_delete(img_1d);
 
     // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            y = ycen_int[i-1]-(height/2)+j;
-            if ((y <=0) || (y > leny)){ continue; }
-            cpl_image_set(img_tmp, i, y,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
+    if (model != NULL) {
+        tile = cr2res_extract_model_tile_rank1(spc, slitfu, ycen);
+        img_tmp = cr2res_extract_model_tile_image(tile, leny);
+        cr2res_extract_model_tile_delete(tile);
+
+        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+            cpl_image_save(img_tmp, "debug_model.fits", imtyp,
+                    NULL, CPL_IO_CREATE);
         }
+        *model = hdrl_image_create(img_tmp, NULL);
+        cpl_image_delete(img_tmp);
     }
     cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
 
     if (cpl_error_get_code() != CPL_ERROR_NONE){
         cpl_msg_error(__func__, "Error in the vertical sum extraction %s", 
@@ -553,7 +1438,7 @@ int cr2res_extract_sum_vert(
   @param    height      number of pix above and below mid-line or -1
   @param    slit_func   the returned slit function, normalized to sum=1
   @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @param    model       the reconstructed image, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (containing many orders), a trace table,
@@ -578,7 +1463,7 @@ int cr2res_extract_median(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    int             *   ycen_int;
+    model_tile      *   tile;
     cpl_vector      *   ycen ;
     cpl_image       *   img_tmp;
     cpl_image       *   img_1d;
@@ -588,7 +1473,6 @@ int cr2res_extract_median(
     cpl_vector      *   slitfu;
     cpl_vector      *   sigma;
     cpl_size            lenx, leny;
-    int                 i, j;
     int                 ymin, ymax;
     int                 empty_bottom = 0;
     double              trace_cen, trace_height ;
@@ -656,27 +1540,22 @@ int cr2res_extract_median(
     cpl_image_delete(img_1d);
 
     // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            cpl_image_set(img_tmp, i, ycen_int[i-1]-(height/2)+j,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
+    if (model != NULL) {
+        tile = cr2res_extract_model_tile_rank1(spc, slitfu, ycen);
+        img_tmp = cr2res_extract_model_tile_image(tile, leny);
+        cr2res_extract_model_tile_delete(tile);
+
+        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+            cpl_image_save(img_tmp, "debug_model.fits", imtyp,
+                    NULL, CPL_IO_CREATE);
         }
+        *model = hdrl_image_create(img_tmp, NULL);
+        cpl_image_delete(img_tmp);
     }
     cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
 
     return 0;
 }
@@ -691,7 +1570,7 @@ int cr2res_extract_median(
   @param    height      number of pix above and below mid-line or -1
   @param    slit_func   the returned slit function, normalized to sum=1
   @param    spec        the returned spectrum, sum of rows
-  @param    model       the reconstructed image
+  @param    model       the reconstructed image, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (containing many orders), a trace table,
@@ -716,7 +1595,7 @@ int cr2res_extract_sum_tilt(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    int             *   ycen_int;
+    model_tile      *   tile;
     cpl_vector      *   ycen ;
     cpl_image       *   img_tmp;
     cpl_image       *   img_1d;
@@ -919,27 +1798,22 @@ int cr2res_extract_sum_tilt(
     cpl_image_delete(img_1d);
 
     // reconstruct the 2d image with the "model"
-    img_tmp = cpl_image_new(lenx, leny, imtyp);
-    ycen_int = cr2res_vector_get_int(ycen);
-    for (i=1;i<=lenx;i++){
-        for (j=1;j<=height;j++){
-            cpl_image_set(img_tmp, i, ycen_int[i-1]-(height/2)+j,
-                cpl_vector_get(spc,i-1)*cpl_vector_get(slitfu,j-1) );
+    if (model != NULL) {
+        tile = cr2res_extract_model_tile_rank1(spc, slitfu, ycen);
+        img_tmp = cr2res_extract_model_tile_image(tile, leny);
+        cr2res_extract_model_tile_delete(tile);
+
+        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+            cpl_image_save(img_tmp, "debug_model.fits", imtyp,
+                    NULL, CPL_IO_CREATE);
         }
+        *model = hdrl_image_create(img_tmp, NULL);
+        cpl_image_delete(img_tmp);
     }
     cpl_vector_delete(ycen);
-    cpl_free(ycen_int);
-
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        cpl_image_save(img_tmp, "debug_model.fits", imtyp,
-                NULL, CPL_IO_CREATE);
-    }
-
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, sigma);
-    *model = hdrl_image_create(img_tmp, NULL);
-    cpl_image_delete(img_tmp);
 
     return 0;
 }
@@ -1251,7 +2125,7 @@ int cr2res_extract_SLIT_FUNC_get_vector(
   @param    smooth_spec smoothing along spectrum
   @param    slit_func   the returned slit function
   @param    spec        the returned spectrum
-  @param    model       the returned model
+  @param    model       the returned model, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (contining many orders), and a *single*
@@ -1272,6 +2146,9 @@ int cr2res_extract_SLIT_FUNC_get_vector(
     -calculate the errors and return them. This is done by comparing the
         variance of (im-model) to the poisson-statistics of the spectrum.
 
+  The image independent part (trace center, swath bins) is computed by
+  cr2res_extract_geometry_new(), and can be shared through an extraction
+  plan, see cr2res_extract_plan_new().
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract_slitdec_vert(
@@ -1289,28 +2166,95 @@ int cr2res_extract_slitdec_vert(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    cpl_polynomial  **  traces ;
-    int             *   ycen_int;
-    double          *   ycen_rest;
+    trace_geometry  *   g ;
+    cpl_image       *   model_rect ;
+    int                 ret ;
+
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+
+    /* Compute the geometry of the trace */
+    if ((g = cr2res_extract_geometry_new(trace_tab, order, trace_id, height,
+                    swath, oversample, hdrl_image_get_size_x(img_hdrl),
+                    hdrl_image_get_size_y(img_hdrl), 0)) == NULL) return -1 ;
+
+    /* Decompose */
+    ret = cr2res_extract_slitdec_vert_geom(img_hdrl, g, slit_func_vec_in,
+            smooth_slit, smooth_spec, 0, slit_func, spec, NULL,
+            model == NULL ? NULL : &model_rect) ;
+
+    /* Insert the rectified model into the full frame */
+    if (ret == 0 && model != NULL) {
+        *model = cr2res_extract_model_rect_insert(model_rect, g->ycen,
+                hdrl_image_get_size_y(img_hdrl)) ;
+        cpl_image_delete(model_rect) ;
+        if (*model == NULL) {
+            cpl_msg_error(__func__, "Cannot insert the model") ;
+            cpl_vector_delete(*slit_func) ;
+            cpl_bivector_delete(*spec) ;
+            ret = -1 ;
+        }
+    }
+    cr2res_extract_geometry_delete(g) ;
+    return ret ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Vertical slit decomposition of a trace with known geometry
+  @param    img_hdrl    full detector image
+  @param    g           The trace geometry
+  @param    slit_func_vec_in    The input slit_func vector or NULL
+  @param    smooth_slit smoothing along slit
+  @param    smooth_spec smoothing along spectrum
+  @param    warm_start  Flag to seed each swath with the previous one
+  @param    slit_func   the returned slit function
+  @param    spec        the returned spectrum
+  @param    niter       [out] the iterations per swath [nswaths], or NULL
+  @param    model_rect_out  [out] the rectified model [height][lenx], or
+                            NULL if not needed
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_slitdec_vert(). The geometry is only read.
+  The row j (0 based) of the rectified model covers the detector row
+  ycen-height/2+j (1 based), see cr2res_image_insert_rect().
+
+  With warm_start, the slit function of each swath starts from the
+  one of the previous swath, and the input slit_func, if any, is only
+  the starting guess of the first swath. A swath that did not converge
+  does not seed the next one, which then starts from scratch.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_vert_geom(
+        const hdrl_image        *   img_hdrl,
+        const trace_geometry    *   g,
+        const cpl_vector        *   slit_func_vec_in,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         warm_start,
+        cpl_vector              **  slit_func,
+        cpl_bivector            **  spec,
+        int                     *   niter,
+        cpl_image               **  model_rect_out)
+{
+    const double    *   ycen_rest;
     double          *   ycen_sw;
-    double          *   img_sw_data;
-    double          *   err_sw_data;
+    double          *   col_data;
+    double          *   model_rect_data;
     double          *   spec_sw_data;
     double          *   slitfu_sw_data;
     double          *   model_sw;
     int             *   mask_sw;
     double          *   unc_sw_data;
     const double    *   slit_func_in;
+    const double    *   sL_guess;
     const cpl_image *   img_in;
     const cpl_image *   err_in;
-    cpl_image       *   err_sw;
-    cpl_image       *   img_sw;
     cpl_image       *   img_rect;
     cpl_image       *   err_rect;
     cpl_image       *   model_rect;
-    cpl_vector      *   ycen ;
+    const cpl_vector *  ycen ;
     cpl_image       *   img_tmp;
-    cpl_image       *   img_out;
     cpl_vector      *   spec_sw;
     cpl_vector      *   slitfu_sw;
     cpl_vector      *   spc;
@@ -1318,63 +2262,42 @@ int cr2res_extract_slitdec_vert(
     cpl_vector      *   unc_sw;
     cpl_vector      *   weights_sw;
     cpl_vector      *   tmp_vec;
+    cpl_vector      *   col_vec;
     cpl_vector      *   bins_begin;
     cpl_vector      *   bins_end;
     cpl_vector      *   unc_decomposition;
-    cpl_size            lenx, leny, size;
+    cpl_size            lenx, size;
     cpl_type            imtyp;
-    double              pixval, errval, img_median, unc, model_unc, img_unc, 
-                        norm;
-    double              trace_cen, trace_height ;
-    int                 i, j, k, nswaths, row, col, x, y, ny_os,
-                        sw_start, sw_end, badpix;
+    swath_view          view;
+    double              trace_cen ;
+    int                 i, j, k, nswaths, col, y, ny_os, prev_ok,
+                        sw_start, sw_end, height, swath, oversample;
 
     /* Check Entries */
-    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+    if (img_hdrl == NULL || g == NULL) return -1 ;
 
     /* Initialise */
     img_in = hdrl_image_get_image_const(img_hdrl);
     err_in = hdrl_image_get_error_const(img_hdrl);
     imtyp = cpl_image_get_type(img_in);
     lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
-
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    if (height > leny) {
-        height = leny;
-        cpl_msg_warning(__func__,
-                "Given height larger than image, clipping height");
-    }
 
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
-        return -1 ;
-    }
+    ycen = g->ycen ;
+    ycen_rest = g->ycen_rest ;
+    height = g->height ;
+    swath = g->swath ;
+    oversample = g->oversample ;
+    nswaths = g->nswaths ;
     trace_cen = cpl_vector_get(ycen, cpl_vector_get_size(ycen)/2) ;
-    trace_height = (double)cr2res_trace_get_height(trace_tab, order, trace_id) ;
     cpl_msg_info(__func__, "Y position of the trace: %g -> %g", 
-            trace_cen-(trace_height/2), trace_cen+(trace_height/2)) ;
-
-    if (oversample <= 0) oversample = 1;
+            trace_cen-(g->trace_height/2), trace_cen+(g->trace_height/2)) ;
 
     /* Number of rows after oversampling */
     ny_os = oversample*(height+1) +1;
-    if ((swath = cr2res_extract_slitdec_adjust_swath(ycen, height, leny, swath, 
-                    lenx, 0, &bins_begin, &bins_end)) == -1){
-        cpl_msg_error(__func__, "Cannot calculate swath size");
-        cpl_vector_delete(ycen);
-        return -1;
-    }
-    nswaths = cpl_vector_get_size(bins_begin);
+
+    /* The bins are modified below when merging the swaths */
+    bins_begin = cpl_vector_duplicate(g->bins_begin) ;
+    bins_end = cpl_vector_duplicate(g->bins_end) ;
 
     /* Use existing slitfunction if given */
     slit_func_in = NULL;
@@ -1393,7 +2316,6 @@ int cr2res_extract_slitdec_vert(
     img_rect = cr2res_image_cut_rectify(img_in, ycen, height);
     if (img_rect == NULL){
         cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
         cpl_vector_delete(bins_begin);
         cpl_vector_delete(bins_end);
         return -1;
@@ -1403,7 +2325,13 @@ int cr2res_extract_slitdec_vert(
                 NULL, CPL_IO_CREATE);
     }
     err_rect = cr2res_image_cut_rectify(err_in, ycen, height);
-    ycen_rest = cr2res_vector_get_rest(ycen);
+    if (err_rect == NULL){
+        cpl_msg_error(__func__, "Cannot rectify order errors");
+        cpl_image_delete(img_rect);
+        cpl_vector_delete(bins_begin);
+        cpl_vector_delete(bins_end);
+        return -1;
+    }
 
     // Work vectors
     slitfu_sw = cpl_vector_new(ny_os);
@@ -1414,8 +2342,8 @@ int cr2res_extract_slitdec_vert(
     mask_sw = cpl_malloc(height*swath*sizeof(int));
     model_sw = cpl_malloc(height*swath*sizeof(double));
     ycen_sw = cpl_malloc(swath*sizeof(double));
-    img_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    err_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
+    col_data = cpl_malloc(height*sizeof(double));
+    col_vec = cpl_vector_wrap(height, col_data);
     unc_sw = cpl_vector_new(swath);
     weights_sw = cpl_vector_new(swath);
 
@@ -1435,61 +2363,53 @@ int cr2res_extract_slitdec_vert(
         cpl_vector_set(spc, j, 0.);
         cpl_vector_set(unc_decomposition, j, 0.);
     }
-    img_out = cpl_image_new(lenx, leny, CPL_TYPE_DOUBLE);
     model_rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
+    model_rect_data = cpl_image_get_data_double(model_rect);
 
 
+    prev_ok = 0;
     for (i=0;i<nswaths;i++){
         sw_start = cpl_vector_get(bins_begin, i);
         sw_end = cpl_vector_get(bins_end, i);
 
 
-        // Copy swath image into seperate image
-        for(col=1; col<=swath; col++){      // col is x-index in swath
-            x = sw_start + col;          // coords in large image
-            for(y=1;y<=height;y++){
-                pixval = cpl_image_get(img_rect, x, y, &badpix);
-                errval = cpl_image_get(err_rect, x, y, &badpix);
-                cpl_image_set(img_sw, col, y, pixval);
-                cpl_image_set(err_sw, col, y, errval);
-                if(cpl_error_get_code() != CPL_ERROR_NONE)
-                    cpl_msg_error(__func__, "%d %d %s",
-                            x, y, cpl_error_get_where());
-                // raw index for mask, start with 0!
-                j = (y-1)*swath + (col-1) ;
-                if (badpix == 0) mask_sw[j] = 1;
-                else mask_sw[j] = 0;
-            }
+        // The swath is used in place, only the mask is copied
+        if (cr2res_extract_swath_view(img_rect, err_rect, sw_start, &view)) {
+            cpl_error_set_message(__func__, CPL_ERROR_ILLEGAL_INPUT,
+                    "Cannot access swath %d", i);
+            break;
         }
+        cr2res_extract_swath_mask(&view, swath, height, mask_sw);
 
-        img_sw_data = cpl_image_get_data_double(img_sw);
-        err_sw_data = cpl_image_get_data_double(err_sw);
-        img_tmp = cpl_image_collapse_median_create(img_sw, 0, 0, 0);
-        spec_sw = cpl_vector_new_from_image_row(img_tmp,1);
-        unc_sw_data = cpl_vector_get_data(unc_sw);
-
-        cpl_image_delete(img_tmp);
+        // Initial guess of the spectrum: median of each column
+        spec_sw = cpl_vector_new(swath);
         spec_sw_data = cpl_vector_get_data(spec_sw);
+        for (col=0; col<swath; col++) {
+            for (y=0; y<height; y++)
+                col_data[y] = view.img[(cpl_size)y * view.stride + col];
+            spec_sw_data[col] = cpl_vector_get_median(col_vec);
+        }
+        unc_sw_data = cpl_vector_get_data(unc_sw);
         for (j=sw_start;j<sw_end;j++) ycen_sw[j-sw_start] = ycen_rest[j];
 
-
         /* Finally ready to call the slit-decomp */
-        cr2res_extract_slit_func_vert(swath, height, oversample, img_sw_data, 
-                err_sw_data, mask_sw, ycen_sw, slitfu_sw_data, spec_sw_data,
-                model_sw, unc_sw_data, smooth_spec, smooth_slit, 1.0e-5, 20,
-                slit_func_in);
-
-        for(col=1; col<=swath; col++){   // col is x-index in cut-out
-            x = sw_start + col;          // coords in large image
-            for(y=1;y<=height;y++){
-                // raw index for mask, start with 0!
-                j = (y-1)*swath + (col-1) ;
-                cpl_image_set(model_rect, x, y, model_sw[j]);
-                if(cpl_error_get_code() != CPL_ERROR_NONE)
-                    cpl_msg_error(__func__, "%d %d %s", x, y,
-                            cpl_error_get_where());
-            }
-        }
+        /* The previous swath result is still in slitfu_sw */
+        /* A swath that did not converge does not seed the next one */
+        if (!warm_start) sL_guess = NULL;
+        else if (i == 0) sL_guess = slit_func_in;
+        else if (prev_ok) sL_guess = slitfu_sw_data;
+        else sL_guess = NULL;
+        prev_ok = cr2res_extract_slit_func_vert(swath, height, oversample,
+                view.img, view.err, view.stride, mask_sw, ycen_sw,
+                slitfu_sw_data, spec_sw_data, model_sw, unc_sw_data,
+                smooth_spec, smooth_slit, 1.0e-5, 20,
+                warm_start ? NULL : slit_func_in, sL_guess,
+                niter == NULL ? NULL : niter + i) == 0;
+
+        // Copy the swath model into the rectified model, row by row
+        for (y=0; y<height; y++)
+            memcpy(model_rect_data + (cpl_size)y * lenx + sw_start,
+                    model_sw + y * swath, swath * sizeof(double));
 
         // add up slit-functions, divide by nswaths below to get average
         if (i==0) cpl_vector_copy(slitfu, slitfu_sw);
@@ -1508,8 +2428,11 @@ int cr2res_extract_slitdec_vert(
             cpl_image_save(img_tmp, "debug_model_sw.fits", CPL_TYPE_DOUBLE,
                     NULL, CPL_IO_CREATE);
             cpl_image_unwrap(img_tmp);
-            cpl_image_save(img_sw, "debug_img_sw.fits", CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
+            img_tmp = cpl_image_extract(img_rect, sw_start + 1, 1,
+                    sw_start + swath, height);
+            cpl_image_save(img_tmp, "debug_img_sw.fits", CPL_TYPE_DOUBLE,
+                    NULL, CPL_IO_CREATE);
+            cpl_image_delete(img_tmp);
         }
 
 
@@ -1578,20 +2501,14 @@ int cr2res_extract_slitdec_vert(
     cpl_free(mask_sw);
     cpl_free(model_sw);
     cpl_free(ycen_sw);
-    cpl_image_delete(img_sw);
-    cpl_image_delete(err_sw);
-
-    // insert model_rect into large frame
-    cr2res_image_insert_rect(model_rect, ycen, img_out);
+    cpl_vector_unwrap(col_vec);
+    cpl_free(col_data);
 
     // divide by nswaths to make the slitfu into the average over all swaths.
     cpl_vector_divide_scalar(slitfu, nswaths);
 
     cpl_image_delete(img_rect);
-    cpl_image_delete(model_rect);
     cpl_image_delete(err_rect);
-    cpl_vector_delete(ycen);
-    cpl_free(ycen_rest);
 
     if (cpl_error_get_code() != CPL_ERROR_NONE){
         cpl_msg_error(__func__, 
@@ -1600,14 +2517,14 @@ int cr2res_extract_slitdec_vert(
         cpl_vector_delete(slitfu);
         cpl_vector_delete(spc);
         cpl_vector_delete(unc_decomposition);
-        cpl_image_delete(img_out);
+        cpl_image_delete(model_rect);
         return -1;
     }
 
     *slit_func = slitfu;
     *spec = cpl_bivector_wrap_vectors(spc, unc_decomposition);
-    *model = hdrl_image_create(img_out, NULL);
-    cpl_image_delete(img_out);
+    if (model_rect_out != NULL) *model_rect_out = model_rect;
+    else cpl_image_delete(model_rect);
 
     return 0;
 }
@@ -1627,7 +2544,7 @@ int cr2res_extract_slitdec_vert(
   @param    smooth_spec smoothing along spectrum
   @param    slit_func   the returned slit function
   @param    spec        the returned spectrum
-  @param    model       the returned model
+  @param    model       the returned model, or NULL if not needed
   @return   0 if ok, -1 otherwise
 
   This func takes a single image (contining many orders), and a *single*
@@ -1639,14 +2556,21 @@ int cr2res_extract_slitdec_vert(
     -cut out the relevant pixels of the order
     -shift im in y integers, so that nrows becomes minimal,
         adapt ycen accordingly
-    -loop over swaths, in half-steps
+    -loop over swaths, in half-steps. The swaths are solved concurrently,
+        each worker using its own scratch memory, by the threads left
+        to the caller (see cr2res_thread_budget())
     -derive a good starting guess for the spectrum, by median-filter
         average along slit, beware of cosmics
-    -run cr2res_extract_slit_func_vert()
-    -merge overlapping swath results by linear weights from swath-width to edge.
+    -run cr2res_extract_slit_func_curved()
+    -merge overlapping swath results by linear weights from swath-width to
+        edge, in swath order.
     -return re-assembled model image, slit-fu, spectrum, new mask.
     -calculate the errors and return them. This is done by comparing the
         variance of (im-model) to the poisson-statistics of the spectrum.
+
+  The image independent part (trace center, swath bins, slit curvature)
+  is computed by cr2res_extract_geometry_new(), and can be shared through
+  an extraction plan, see cr2res_extract_plan_new().
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_extract_slitdec_curved(
@@ -1664,66 +2588,107 @@ int cr2res_extract_slitdec_curved(
         cpl_bivector        **  spec,
         hdrl_image          **  model)
 {
-    double          *   ycen_rest;
-    double          *   ycen_sw;
-    int             *   ycen_offset_sw;
-    double          *   img_sw_data;
-    double          *   err_sw_data;
-    double          *   spec_sw_data;
-    double          *   slitfu_sw_data;
-    double          *   model_sw;
-    double          *   unc_sw_data;
+    trace_geometry  *   g ;
+    cpl_image       *   model_rect ;
+    int                 ret ;
+
+    /* Check Entries */
+    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+
+    /* Compute the geometry of the trace */
+    if ((g = cr2res_extract_geometry_new(trace_tab, order, trace_id, height,
+                    swath, oversample, hdrl_image_get_size_x(img_hdrl),
+                    hdrl_image_get_size_y(img_hdrl), 1)) == NULL) return -1 ;
+
+    /* Decompose */
+    ret = cr2res_extract_slitdec_curved_geom(img_hdrl, g, slit_func_vec_in,
+            smooth_slit, smooth_spec, 0, slit_func, spec, NULL,
+            model == NULL ? NULL : &model_rect) ;
+
+    /* Insert the rectified model into the full frame */
+    if (ret == 0 && model != NULL) {
+        *model = cr2res_extract_model_rect_insert(model_rect, g->ycen,
+                hdrl_image_get_size_y(img_hdrl)) ;
+        cpl_image_delete(model_rect) ;
+        if (*model == NULL) {
+            cpl_msg_error(__func__, "Cannot insert the model") ;
+            cpl_vector_delete(*slit_func) ;
+            cpl_bivector_delete(*spec) ;
+            ret = -1 ;
+        }
+    }
+    cr2res_extract_geometry_delete(g) ;
+    return ret ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Curved slit decomposition of a trace with known geometry
+  @param    img_hdrl    full detector image
+  @param    g           The trace geometry
+  @param    slit_func_vec_in    The input slit_func vector or NULL
+  @param    smooth_slit smoothing along slit
+  @param    smooth_spec smoothing along spectrum
+  @param    warm_start  Flag to seed each swath with the previous one
+  @param    slit_func   the returned slit function
+  @param    spec        the returned spectrum
+  @param    niter       [out] the iterations per swath [nswaths], or NULL
+  @param    model_rect_out  [out] the rectified model [height][lenx], or
+                            NULL if not needed
+  @return   0 if ok, -1 otherwise
+
+  See cr2res_extract_slitdec_curved(). The geometry is only read.
+  The row j (0 based) of the rectified model covers the detector row
+  ycen-height/2+j (1 based), see cr2res_image_insert_rect().
+
+  With warm_start, the slit function of each swath starts from the
+  one of the previous swath, and the input slit_func, if any, is only
+  the starting guess of the first swath. The swaths then depend on
+  each other and are solved in order.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_curved_geom(
+        const hdrl_image        *   img_hdrl,
+        const trace_geometry    *   g,
+        const cpl_vector        *   slit_func_vec_in,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         warm_start,
+        cpl_vector              **  slit_func,
+        cpl_bivector            **  spec,
+        int                     *   niter,
+        cpl_image               **  model_rect_out)
+{
+    double          **  model_sw;
+    double          *   model_rect_data;
+    double          *   model_row;
     const double    *   slit_func_in;
-    int             *   mask_sw;
     const cpl_image *   img_in;
     const cpl_image *   err_in;
-    cpl_image       *   img_sw;
-    cpl_image       *   err_sw;
     cpl_image       *   img_rect;
     cpl_image       *   err_rect;
     cpl_image       *   model_rect;
-    cpl_vector      *   ycen ;
+    const cpl_vector *  ycen ;
     cpl_image       *   img_tmp;
-    cpl_image       *   img_out;
-    cpl_vector      *   spec_sw;
-    cpl_vector      *   slitfu_sw;
-    cpl_vector      *   unc_sw;
+    cpl_vector      **  spec_sw;
+    cpl_vector      **  slitfu_sw;
+    cpl_vector      **  unc_sw;
     cpl_vector      *   spc;
     cpl_vector      *   slitfu;
-    cpl_vector      *   spec_tmp;
-    cpl_vector      *   slitfu_tmp;
     cpl_vector      *   weights_sw;
-    cpl_vector      *   tmp_vec;
     cpl_vector      *   bins_begin;
     cpl_vector      *   bins_end;
     cpl_vector      *   unc_decomposition;
-    cpl_size            lenx, leny, pow, size;
+    cpl_size            lenx, size;
     cpl_type            imtyp;
-    cpl_polynomial      *slitcurve_A, *slitcurve_B, *slitcurve_C;
-    cpl_polynomial  **  slitcurves_sw;
-    hdrl_image      *   model_out;
     cpl_bivector    *   spectrum_loc;
-    double          *   sP_old;
-    double          *   l_Aij;
-    double          *   p_Aij;
-    double          *   l_bj;
-    double          *   p_bj;
-    cpl_image       *   img_mad;
-    xi_ref          *   xi;
-    zeta_ref        *   zeta;
-    int             *   m_zeta;
-    char            *   path;
-    double              pixval, errval, img_median, norm, model_unc, img_unc,
-                        unc, delta_tmp, a, b, c, yc;
-    double              trace_cen, trace_height ;
-    int                 i, j, k, nswaths, halfswath, row, col, x, y, ny_os,
-                        sw_start, sw_end, badpix, y_lower_limit, y_upper_limit,
-                        delta_x;
-    int                 ny, nx;
+    double              trace_cen ;
+    int                 i, j, k, nswaths, y, ny_os, sw_start, sw_end,
+                        delta_x, nfailed, height, swath, oversample;
   
 
     /* Check Entries */
-    if (img_hdrl == NULL || trace_tab == NULL) return -1 ;
+    if (img_hdrl == NULL || g == NULL) return -1 ;
 
     img_in = hdrl_image_get_image_const(img_hdrl);
     err_in = hdrl_image_get_error_const(img_hdrl);
@@ -1731,38 +2696,21 @@ int cr2res_extract_slitdec_curved(
     /* Initialise */
     imtyp = cpl_image_get_type(img_in);
     lenx = cpl_image_get_size_x(img_in);
-    leny = cpl_image_get_size_y(img_in);
    
-    /* Compute height if not given */
-    if (height <= 0) {
-        height = cr2res_trace_get_height(trace_tab, order, trace_id);
-        if (height <= 0) {
-            cpl_msg_error(__func__, "Cannot compute height");
-            return -1;
-        }
-    }
-    if (height > leny){
-        height = leny;
-        cpl_msg_warning(__func__,
-                "Given height larger than image, clipping height");
-    }
-
-    /* Get ycen */
-    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
-                    trace_id, lenx)) == NULL) {
-        cpl_msg_error(__func__, "Cannot get ycen");
-        return -1 ;
-    }
+    ycen = g->ycen ;
+    height = g->height ;
+    swath = g->swath ;
+    oversample = g->oversample ;
+    delta_x = g->delta_x ;
+    nswaths = g->nswaths ;
     trace_cen = cpl_vector_get(ycen, cpl_vector_get_size(ycen)/2) ;
-    trace_height = (double)cr2res_trace_get_height(trace_tab, order, trace_id) ;
     cpl_msg_info(__func__, "Y position of the trace: %g -> %g", 
-            trace_cen-(trace_height/2), trace_cen+(trace_height/2)) ;
+            trace_cen-(g->trace_height/2), trace_cen+(g->trace_height/2)) ;
 
     // Get cut-out rectified order
     img_rect = cr2res_image_cut_rectify(img_in, ycen, height);
     if (img_rect == NULL){
         cpl_msg_error(__func__, "Cannot rectify order");
-        cpl_vector_delete(ycen);
         return -1;
     }
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -1770,82 +2718,19 @@ int cr2res_extract_slitdec_curved(
                 NULL, CPL_IO_CREATE);
     }
     err_rect = cr2res_image_cut_rectify(err_in, ycen, height);
-    ycen_rest = cr2res_vector_get_rest(ycen);
-
-    /* Retrieve the polynomials that describe the slit tilt and curvature*/
-    slitcurve_A = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_A,
-                    order, trace_id);
-    slitcurve_B = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_B,
-                    order, trace_id);
-    slitcurve_C = cr2res_get_trace_wave_poly(trace_tab, CR2RES_COL_SLIT_CURV_C,
-                    order, trace_id);
-    if ((slitcurve_A == NULL) || (slitcurve_B == NULL) || (slitcurve_C == NULL))
-    {
-        cpl_msg_error(__func__, 
-                "No (or incomplete) slitcurve data found in trace table");
-        cpl_vector_delete(ycen);
-        cpl_free(ycen_rest) ;
-        cpl_image_delete(err_rect) ;
-        cpl_image_delete(img_rect) ;
-        cpl_polynomial_delete(slitcurve_A);
-        cpl_polynomial_delete(slitcurve_B);
-        cpl_polynomial_delete(slitcurve_C);
-        return -1;
-    }
-
-    /* Maximum horizontal shift in detector pixels due to slit image curv. */
-    delta_x=0;
-    for (i=1; i<=lenx; i+=swath/2){
-        /* Do a coarse sweep through the order and evaluate the slitcurve */
-        /* polynomials at  +- height/2, update the value. */
-        /* Note: The index i is subtracted from a because the polys have */
-        /* their origin at the edge of the full frame */
-        a = cpl_polynomial_eval_1d(slitcurve_A, i, NULL);
-        b = cpl_polynomial_eval_1d(slitcurve_B, i, NULL);
-        c = cpl_polynomial_eval_1d(slitcurve_C, i, NULL);
-        yc = cpl_vector_get(ycen, i-1);
-
-        // Shift polynomial to local frame
-        // We fix a to 0, see comment later on, when we create the
-        // polynomials for the extraction
-        a = 0; 
-        b += 2 * yc * c;
-
-        delta_tmp = max( fabs(a + (c*height/2. + b)*height/2.),
-                fabs(a + (c*height/-2. + b)*height/-2.));
-        if (delta_tmp > delta_x) delta_x = (int)ceil(delta_tmp);
-    }
-    delta_x += 1;
-    cpl_msg_debug(__func__, "Max delta_x from slit curv: %d pix.", delta_x);
-
-    if (delta_x >= swath / 4){
-        cpl_msg_error(__func__, 
-            "Curvature is larger than the swath, try again with a larger swath size");
-        cpl_vector_delete(ycen);
-        cpl_free(ycen_rest) ;
-        cpl_image_delete(err_rect) ;
-        cpl_image_delete(img_rect) ;
-        cpl_polynomial_delete(slitcurve_A);
-        cpl_polynomial_delete(slitcurve_B);
-        cpl_polynomial_delete(slitcurve_C);
+    if (cr2res_extract_slitdec_reject_bad(img_rect, err_rect) != 0) {
+        cpl_msg_error(__func__, "Cannot flag the bad pixels of the order");
+        cpl_image_delete(img_rect);
+        if (err_rect != NULL) cpl_image_delete(err_rect);
         return -1;
     }
 
     /* Number of rows after oversampling */
     ny_os = oversample*(height+1) +1;
-    if ((swath = cr2res_extract_slitdec_adjust_swath(ycen, height, leny, swath, 
-                    lenx, delta_x, &bins_begin, &bins_end)) == -1){
-        cpl_msg_error(__func__, "Cannot calculate swath size");
-        cpl_vector_delete(ycen);
-        cpl_free(ycen_rest) ;
-        cpl_image_delete(err_rect) ;
-        cpl_image_delete(img_rect) ;
-        cpl_polynomial_delete(slitcurve_A);
-        cpl_polynomial_delete(slitcurve_B);
-        cpl_polynomial_delete(slitcurve_C);
-        return -1;
-    }
-    nswaths = cpl_vector_get_size(bins_begin);
+
+    /* The bins are modified below when merging the swaths */
+    bins_begin = cpl_vector_duplicate(g->bins_begin) ;
+    bins_end = cpl_vector_duplicate(g->bins_end) ;
 
     /* Use existing slitfunction if given */
     slit_func_in = NULL;
@@ -1860,17 +2745,18 @@ int cr2res_extract_slitdec_curved(
         }
     }
    
-    /* Allocate */
-    mask_sw = cpl_malloc(height * swath*sizeof(int));
-    model_sw = cpl_malloc(height * swath*sizeof(double));
-    unc_sw = cpl_vector_new(swath);
-    img_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    err_sw = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-    ycen_sw = cpl_malloc(swath*sizeof(double));
-    ycen_offset_sw = cpl_malloc(swath * sizeof(int));
-
-    slitcurves_sw = cpl_malloc(swath * sizeof(cpl_polynomial*));
-    for (i=0; i<swath; i++) slitcurves_sw[i]= cpl_polynomial_new(1);
+    /* Allocate the per-swath results */
+    spec_sw = cpl_malloc(nswaths * sizeof(cpl_vector *));
+    unc_sw = cpl_malloc(nswaths * sizeof(cpl_vector *));
+    slitfu_sw = cpl_malloc(nswaths * sizeof(cpl_vector *));
+    model_sw = cpl_malloc(nswaths * sizeof(double *));
+    for (i=0; i<nswaths; i++) {
+        spec_sw[i] = NULL;
+        unc_sw[i] = cpl_vector_new(swath);
+        slitfu_sw[i] = cpl_vector_new(ny_os);
+        cpl_vector_fill(slitfu_sw[i], 0.);
+        model_sw[i] = cpl_calloc(height * swath, sizeof(double));
+    }
 
     // Local versions of return data
     slitfu = cpl_vector_new(ny_os);
@@ -1881,14 +2767,10 @@ int cr2res_extract_slitdec_curved(
         cpl_vector_set(spc, j, 0.);
         cpl_vector_set(unc_decomposition, j, 0.);
     }
-    model_out = hdrl_image_new(lenx, leny);
-    img_out = hdrl_image_get_image(model_out);
     model_rect = cpl_image_new(lenx, height, CPL_TYPE_DOUBLE);
+    model_rect_data = cpl_image_get_data_double(model_rect);
 
     // Work vectors
-    slitfu_sw = cpl_vector_new(ny_os);
-    for (j=0; j < ny_os; j++) cpl_vector_set(slitfu_sw, j, 0);
-    slitfu_sw_data = cpl_vector_get_data(slitfu_sw);
     weights_sw = cpl_vector_new(swath);
     for (i = 0; i < swath; i++) cpl_vector_set(weights_sw, i, 0);
 
@@ -1902,195 +2784,65 @@ int cr2res_extract_slitdec_curved(
     cpl_vector_divide_scalar(weights_sw, swath/2 - delta_x + 1);
 
     // assert cpl_vector_get_sum(weights_sw) == swath / 2 - delta_x
-    // Assign memory for extract_curved algorithm
-    // Since the arrays always have the same size, we can reuse allocated memory
-    ny = oversample * (height + 1) + 1;
-    nx = 4 * delta_x + 1;
-    if(nx < 3) nx = 3;
-
-    sP_old = cpl_malloc(swath * sizeof(double));
-    l_Aij  = cpl_malloc(ny * (4*oversample+1) * sizeof(double));
-    p_Aij  = cpl_malloc(swath * nx * sizeof(double));
-    l_bj   = cpl_malloc(ny * sizeof(double));
-    p_bj   = cpl_malloc(swath * sizeof(double));
-    img_mad = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
-
-    /*
-       Convolution tensor telling the coordinates of detector pixels on which
-       {x, iy} element falls and the corresponding projections. [ncols][ny][4]
-    */
-    xi = cpl_malloc(swath * ny * 4 * sizeof(xi_ref));
-
-    /* Convolution tensor telling the coordinates of subpixels {x, iy}
-       contributing to detector pixel {x, y}. [ncols][nrows][3*(osample+1)]
-    */
-    zeta = cpl_malloc(swath * height * 3 * (oversample + 1)
-                                    * sizeof(zeta_ref));
 
-    /* The actual number of contributing elements in zeta  [ncols][nrows]  */
-    m_zeta = cpl_malloc(swath * height * sizeof(int));
+    /* Solve the swaths, they are independent of each other */
+    /* Each worker reuses its own scratch memory for all its swaths */
+    /* The debug output uses fixed file names, so stay serial then */
+    /* With the warm start, each swath needs the previous one */
+    nfailed = 0 ;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(cr2res_thread_budget()) \
+    if(nswaths > 1 && !warm_start && cpl_msg_get_level() != CPL_MSG_DEBUG)
+#endif
+    {
+        slitdec_workspace   *   ws ;
+        const double        *   sL_guess ;
+        int                     isw, prev_ok, ret ;
+
+        ws = cr2res_extract_slitdec_workspace_new(swath, height, oversample,
+                delta_x, g->single) ;
+        /* A failed or unconverged swath does not seed the next one */
+        prev_ok = 0 ;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,1)
+#endif
+        for (isw=0 ; isw<nswaths ; isw++) {
+            if (!warm_start) sL_guess = NULL ;
+            else if (isw == 0) sL_guess = slit_func_in ;
+            else if (prev_ok) sL_guess = cpl_vector_get_data(slitfu_sw[isw-1]);
+            else sL_guess = NULL ;
+            ret = cr2res_extract_slitdec_curved_swath(ws, g, img_rect,
+                    err_rect, warm_start ? NULL : slit_func_in, sL_guess,
+                    smooth_slit, smooth_spec, isw,
+                    &(spec_sw[isw]), cpl_vector_get_data(unc_sw[isw]),
+                    cpl_vector_get_data(slitfu_sw[isw]), model_sw[isw],
+                    niter == NULL ? NULL : niter + isw) ;
+            prev_ok = (ret == 0) ;
+            if (ret < 0) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+                nfailed++ ;
+            }
+        }
+        cr2res_extract_slitdec_workspace_delete(ws) ;
+    }
+    /* The error states of the workers are not visible here */
+    if (nfailed > 0) cpl_error_set_message(__func__, CPL_ERROR_ILLEGAL_OUTPUT,
+            "%d swath(s) failed", nfailed) ;
 
+    /* Merge the swaths in order */
     for (i=0;i<nswaths;i++){
         sw_start = cpl_vector_get(bins_begin, i);
         sw_end = cpl_vector_get(bins_end, i);
 
-        /* Prepare swath cut-outs and auxiliary data */
-        for(col=1; col<=swath; col++){   // col is x-index in swath
-            x = sw_start + col;          // coords in large image
-
-            /* prepare signal, error and mask */
-            for(y=1;y<=height;y++){
-                errval = cpl_image_get(err_rect, x, y, &badpix);
-                if (isnan(errval) | badpix){
-                    // default to errval of 1 instead of 0
-                    // this avoids division by 0
-                    errval = 1;
-                }
-                pixval = cpl_image_get(img_rect, x, y, &badpix);
-                if (isnan(pixval) | badpix){
-                    // We set bad pixels to neg. infinity, to make sure they are
-                    // rejected in the extraction
-                    // The algorithm does not like NANs!
-                    badpix = 1;
-                    pixval = -DBL_MAX;
-                    errval = 1;
-                } 
-                cpl_image_set(img_sw, col, y, pixval);
-                cpl_image_set(err_sw, col, y, errval);
-                if (badpix){
-                    // Reject the pixel here, so it is not used for the initial
-                    // guess of the spectrum
-                    cpl_image_reject(img_sw, col, y);
-                }
-                
-                // raw index for mask, start with 0!
-                j = (y-1)*swath + (col-1) ;
-                // The mask value is inverted for the extraction
-                // 1 for good pixel and 0 for bad pixel
-                mask_sw[j] = !badpix;
-            }
-
-            /* set slit curvature polynomials */
-            /* subtract col because we want origin relative to here */
-            pow = 2;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_C, x, NULL));
-            pow = 1;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_B, x, NULL));
-            pow = 0;
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow,
-                cpl_polynomial_eval_1d(slitcurve_A, x, NULL) - x);
-
-            // Shift polynomial to local frame
-            // -------------------------------
-            // The slit curvature has been determined in the global reference
-            // frame, with the a coefficient set to 0 in the local frame.
-            // The following transformation will shift it into the local frame
-            // again and should result in a = 0.
-            //      a - x + yc * b + yc * yc * c
-            // However this only works, as long as ycen
-            // is the same ycen that was used for the slitcurvature. If e.g. we
-            // switch traces, then ycen will change and a will be unequal 0.
-            // in fact a will be the offset due to the curvature between the
-            // old ycen and the new. This will then cause an offset in the
-            // pixels used for the extraction, so that all traces will have the
-            // same spectrum, with no relative offsets.
-            // Which would be great, if we didn't have an offset in the
-            // wavelength calibration of the different traces.
-            // Therefore we force a to be 0 in the local frame regardless of
-            // ycen. For the extraction we only need the b and c coefficient
-            // anyways.
-            // Note that this means, we use the curvature a few pixels offset.
-            // Usually this is no problem, since it only varies slowly over the
-            // order.
-            cpl_polynomial_shift_1d(slitcurves_sw[col-1], 0,
-                                            cpl_vector_get(ycen, x-1));
-            cpl_polynomial_set_coeff(slitcurves_sw[col-1], &pow, 0);
-        }
-
-        for (j=0; j< height * swath; j++) model_sw[j] = 0;
-        img_sw_data = cpl_image_get_data_double(img_sw);
-        err_sw_data = cpl_image_get_data_double(err_sw);
-        unc_sw_data = cpl_vector_get_data(unc_sw);      
-        // First guess for the spectrum
-        // img_tmp = cpl_image_collapse_median_create(img_sw, 0, 0, 0);
-        img_tmp = cpl_image_collapse_create(img_sw, 0);
-        spec_tmp = cpl_vector_new_from_image_row(img_tmp, 1);
-        spec_sw = cpl_vector_filter_median_create(spec_tmp, 1);
-        cpl_vector_delete(spec_tmp);
-        cpl_image_delete(img_tmp);
-        spec_sw_data = cpl_vector_get_data(spec_sw);
-
-        for (j=sw_start;j<sw_end;j++){
-            ycen_sw[j-sw_start] = ycen_rest[j];
-            ycen_offset_sw[j-sw_start] = (int) cpl_vector_get(ycen, j);
-        }
-        y_lower_limit = height / 2;
-
-        if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-            img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
-            cpl_image_save(img_tmp, "debug_mask_before_sw.fits", CPL_TYPE_INT, 
-                    NULL, CPL_IO_CREATE);
-            cpl_image_unwrap(img_tmp);
-
-            cpl_vector_save(spec_sw, "debug_spc_initial_guess.fits",
-                    CPL_TYPE_DOUBLE, NULL, CPL_IO_CREATE);
-        }
-        /* Finally ready to call the slit-decomp */
-        cr2res_extract_slit_func_curved(swath, height, oversample, img_sw_data,
-                err_sw_data, mask_sw, ycen_sw, ycen_offset_sw, y_lower_limit,
-                slitcurves_sw, delta_x,
-                slitfu_sw_data, spec_sw_data, model_sw, unc_sw_data, smooth_spec,
-                smooth_slit, 1e-5, 10, slit_func_in, sP_old, l_Aij, p_Aij,
-                l_bj, p_bj, img_mad, xi, zeta, m_zeta);
-
         // add up slit-functions, divide by nswaths below to get average
-        if (i==0) cpl_vector_copy(slitfu,slitfu_sw);
-        else cpl_vector_add(slitfu,slitfu_sw);
+        if (i==0) cpl_vector_copy(slitfu,slitfu_sw[i]);
+        else cpl_vector_add(slitfu,slitfu_sw[i]);
 
         if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-            path = cpl_sprintf("debug_spc_%i.fits", i);
-            cpl_vector_save(spec_sw, path , CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_mask_%i.fits", i);
-            img_tmp = cpl_image_wrap_int(swath, height, mask_sw);
-            cpl_image_save(img_tmp, path, CPL_TYPE_INT, NULL, CPL_IO_CREATE);
-            cpl_free(path);
-            cpl_image_unwrap(img_tmp);
-
-            tmp_vec = cpl_vector_wrap(swath, ycen_sw);
-            path = cpl_sprintf("debug_ycen_%i.fits", i);
-            cpl_vector_save(tmp_vec, path, CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_vector_unwrap(tmp_vec);
-            cpl_free(path);
-
             cpl_vector_save(weights_sw, "debug_weights.fits", CPL_TYPE_DOUBLE,
                     NULL, CPL_IO_CREATE);
-            path = cpl_sprintf("debug_slitfu_%i.fits", i);
-            cpl_vector_save(slitfu_sw, path, CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_model_%i.fits", i);
-            img_tmp = cpl_image_wrap_double(swath, height, model_sw);
-            cpl_image_save(img_tmp, path, CPL_TYPE_DOUBLE,
-                    NULL, CPL_IO_CREATE);
-            cpl_image_unwrap(img_tmp);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_img_sw_%i.fits", i);
-            cpl_image_save(img_sw, path, CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_free(path);
-
-            path = cpl_sprintf("debug_img_mad_%i.fits", i);
-            cpl_image_save(img_mad, path,  CPL_TYPE_DOUBLE, NULL,
-                    CPL_IO_CREATE);
-            cpl_free(path);
         }
 
         // The last bins are shifted, overwriting the first k values
@@ -2103,10 +2855,11 @@ int cr2res_extract_slitdec_curved(
                 cpl_vector_get(bins_begin, i) - swath / 2 - delta_x;
 
             for (j = 0; j < swath - k; j++){
-                cpl_vector_set(spec_sw, j, cpl_vector_get(spec_sw, j + k));
-                cpl_vector_set(unc_sw, j, cpl_vector_get(unc_sw, j + k));
+                cpl_vector_set(spec_sw[i], j,
+                        cpl_vector_get(spec_sw[i], j + k));
+                cpl_vector_set(unc_sw[i], j, cpl_vector_get(unc_sw[i], j + k));
                 for (y = 0; y < height; y++)
-                    model_sw[y * swath + j] = model_sw[y * swath + j + k];
+                    model_sw[i][y * swath + j] = model_sw[i][y * swath + j + k];
             }
             sw_start = cpl_vector_get(bins_begin, i-1) + swath / 2 - delta_x;
             cpl_vector_set(bins_begin, i, sw_start);
@@ -2118,49 +2871,49 @@ int cr2res_extract_slitdec_curved(
         if (i==0){
             for (j = 0; j < delta_x; j++)
             {
-                cpl_vector_set(spec_sw, j, 0);
-                cpl_vector_set(unc_sw, j, 0.);
-                for (y = 0; y < height; y++) model_sw[y * swath + j] = 0;
+                cpl_vector_set(spec_sw[i], j, 0);
+                cpl_vector_set(unc_sw[i], j, 0.);
+                for (y = 0; y < height; y++) model_sw[i][y * swath + j] = 0;
             }
             for (j = swath/2; j < swath; j++) {
-                cpl_vector_set(spec_sw, j,
-                    cpl_vector_get(spec_sw,j) * cpl_vector_get(weights_sw,j));
-                cpl_vector_set(unc_sw, j,
-                    cpl_vector_get(unc_sw, j) * cpl_vector_get(weights_sw, j));
+                cpl_vector_set(spec_sw[i], j,
+                    cpl_vector_get(spec_sw[i],j)*cpl_vector_get(weights_sw,j));
+                cpl_vector_set(unc_sw[i], j,
+                    cpl_vector_get(unc_sw[i],j)*cpl_vector_get(weights_sw,j));
                 for (y = 0; y < height; y++) {
-                    model_sw[y * swath + j] *= cpl_vector_get(weights_sw, j);
+                    model_sw[i][y * swath + j] *= cpl_vector_get(weights_sw, j);
                 }
             }
         } else if (i == nswaths - 1) {
             for (j = sw_end-sw_start-1; j >= sw_end-sw_start-delta_x-1; j--)
             {
-                cpl_vector_set(spec_sw, j, 0);
-                cpl_vector_set(unc_sw, j, 0);
-                for (y = 0; y < height; y++) model_sw[y * swath + j] = 0;
+                cpl_vector_set(spec_sw[i], j, 0);
+                cpl_vector_set(unc_sw[i], j, 0);
+                for (y = 0; y < height; y++) model_sw[i][y * swath + j] = 0;
             }
             for (j = 0; j < swath / 2; j++) {
-                cpl_vector_set(spec_sw, j,
-                    cpl_vector_get(spec_sw,j) * cpl_vector_get(weights_sw,j));
-                cpl_vector_set(unc_sw, j,
-                    cpl_vector_get(unc_sw,j) * cpl_vector_get(weights_sw,j));
+                cpl_vector_set(spec_sw[i], j,
+                    cpl_vector_get(spec_sw[i],j)*cpl_vector_get(weights_sw,j));
+                cpl_vector_set(unc_sw[i], j,
+                    cpl_vector_get(unc_sw[i],j)*cpl_vector_get(weights_sw,j));
                 for (y = 0; y < height; y++) {
-                    model_sw[y * swath + j] *= cpl_vector_get(weights_sw,j);
+                    model_sw[i][y * swath + j] *= cpl_vector_get(weights_sw,j);
                 }
             }
         } else {
             /* Multiply by weights and add to output array */
-            cpl_vector_multiply(spec_sw, weights_sw);
-            cpl_vector_multiply(unc_sw, weights_sw);
+            cpl_vector_multiply(spec_sw[i], weights_sw);
+            cpl_vector_multiply(unc_sw[i], weights_sw);
             for (y = 0; y < height; y++) {
                 for (j = 0; j < swath; j++){
-                    model_sw[y * swath + j] *= cpl_vector_get(weights_sw,j);
+                    model_sw[i][y * swath + j] *= cpl_vector_get(weights_sw,j);
                 }
             }
         }
 
         if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-            img_tmp = cpl_image_wrap_double(swath, height, model_sw);
-            cpl_image_save(img_tmp, "debug_model_after_sw.fits", CPL_TYPE_DOUBLE, 
+            img_tmp = cpl_image_wrap_double(swath, height, model_sw[i]);
+            cpl_image_save(img_tmp, "debug_model_after_sw.fits", CPL_TYPE_DOUBLE,
                     NULL, CPL_IO_CREATE);
             cpl_image_unwrap(img_tmp);
         }
@@ -2168,91 +2921,55 @@ int cr2res_extract_slitdec_curved(
         // Save swath to output vector
         for (j=sw_start;j<sw_end;j++) {
             cpl_vector_set(spc, j,
-                cpl_vector_get(spec_sw, j-sw_start) + cpl_vector_get(spc, j));
+                cpl_vector_get(spec_sw[i], j-sw_start) + cpl_vector_get(spc, j));
             // just add weighted errors (instead of squared sum)
             // as they are not independent
-            cpl_vector_set(unc_decomposition, j, 
-                cpl_vector_get(unc_sw, j - sw_start)
+            cpl_vector_set(unc_decomposition, j,
+                cpl_vector_get(unc_sw[i], j - sw_start)
                 + cpl_vector_get(unc_decomposition, j));
-
-            for(y = 0; y < height; y++){
-                cpl_image_set(model_rect, j+1, y+1, 
-                    cpl_image_get(model_rect, j+1, y+1, &badpix)
-                    + model_sw[y * swath + j - sw_start]);
-                if (badpix) cpl_image_reject(model_rect, j+1, y+1);
-            }
+        }
+        // Add the swath model to the rectified model, row by row
+        for (y = 0; y < height; y++) {
+            model_row = model_rect_data + (cpl_size)y * lenx;
+            for (j = sw_start; j < sw_end; j++)
+                model_row[j] += model_sw[i][y * swath + j - sw_start];
         }
 
         if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
             cpl_image_save(model_rect, "debug_model_after_merge.fits",
                 CPL_TYPE_DOUBLE, NULL, CPL_IO_CREATE);
         }
-
-        cpl_vector_delete(spec_sw);
     } // End loop over swaths
 
     // divide by nswaths to make the slitfu into the average over all swaths.
     cpl_vector_divide_scalar(slitfu, nswaths);
 
     // Deallocate loop memory
-    cpl_image_delete(img_mad);
-    cpl_free(sP_old);
-    cpl_free(l_Aij);
-    cpl_free(p_Aij);
-    cpl_free(l_bj);
-    cpl_free(p_bj);
-
-    cpl_free(xi);
-    cpl_free(zeta);
-    cpl_free(m_zeta);
+    for (i=0; i<nswaths; i++) {
+        cpl_vector_delete(spec_sw[i]);
+        cpl_vector_delete(unc_sw[i]);
+        cpl_vector_delete(slitfu_sw[i]);
+        cpl_free(model_sw[i]);
+    }
+    cpl_free(spec_sw);
+    cpl_free(unc_sw);
+    cpl_free(slitfu_sw);
+    cpl_free(model_sw);
 
     cpl_image_delete(img_rect);
     cpl_image_delete(err_rect);
-    cpl_image_delete(img_sw);
-    cpl_image_delete(err_sw);
-
-    cpl_free(mask_sw);
-    cpl_free(model_sw);
-    cpl_vector_delete(unc_sw);
-    cpl_free(ycen_rest);
-    cpl_free(ycen_sw);
-    cpl_free(ycen_offset_sw);
 
     cpl_vector_delete(bins_begin);
     cpl_vector_delete(bins_end);
-    cpl_vector_delete(slitfu_sw);
     cpl_vector_delete(weights_sw);
 
-    cpl_polynomial_delete(slitcurve_A);
-    cpl_polynomial_delete(slitcurve_B);
-    cpl_polynomial_delete(slitcurve_C);
-    for (i=0; i<swath; i++) cpl_polynomial_delete(slitcurves_sw[i]);
-    cpl_free(slitcurves_sw);
-
-    // insert model_rect into large frame
-    if (cr2res_image_insert_rect(model_rect, ycen, img_out) == -1) {
-        // Cancel
-        cpl_msg_error(__func__, "failed to reinsert model swath into model image");
-        cpl_image_delete(model_rect);
-        hdrl_image_delete(model_out);
-        cpl_vector_delete(ycen);
-        cpl_bivector_delete(spectrum_loc);
-        cpl_vector_delete(slitfu);
-        return -1; 
-    }
-
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
         cpl_image_save(model_rect, "debug_model_rect.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
-        cpl_image_save(img_out, "debug_model_all.fits", CPL_TYPE_DOUBLE,
-                NULL, CPL_IO_CREATE);
         cpl_vector_save(spc, "debug_spc_all.fits", CPL_TYPE_DOUBLE,
                 NULL, CPL_IO_CREATE);
     }
 
-    cpl_image_delete(model_rect);
-    cpl_vector_delete(ycen);
-
     if (cpl_error_get_code() != CPL_ERROR_NONE){
         cpl_msg_error(__func__, 
             "Something went wrong in the extraction. Error Code: %i, loc: %s", 
@@ -2260,13 +2977,14 @@ int cr2res_extract_slitdec_curved(
         cpl_error_reset();
         cpl_vector_delete(slitfu);
         cpl_bivector_delete(spectrum_loc);
-        hdrl_image_delete(model_out);
+        cpl_image_delete(model_rect);
         return -1;
     }
 
     *slit_func = slitfu;
     *spec = spectrum_loc;
-    *model = model_out;
+    if (model_rect_out != NULL) *model_rect_out = model_rect;
+    else cpl_image_delete(model_rect);
     return 0;
 }
 
@@ -2352,7 +3070,7 @@ int cr2res_extract2d_traces(
         if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
 
         cpl_msg_info(__func__, "Process Order %d/Trace %d",order,trace_id) ;
-        cpl_msg_indent_more() ;
+        cr2res_msg_indent_more() ;
 
         /* Call the Extraction */
         if (cr2res_extract2d_trace(img, traces, order, trace_id,
@@ -2365,10 +3083,10 @@ int cr2res_extract2d_traces(
             wavelength[i] = NULL ;
             slit_fraction[i] = NULL ;
             cpl_error_reset() ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             continue ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
 
     /* Create the extracted_tab for the current detector */
@@ -2657,6 +3375,44 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
 
 /** @} */
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the convergence of the spectrum of a slit decomposition
+  @param    sP_change       Largest change of the spectrum in this iteration
+  @param    sP_change_prev  [in/out] The change of the previous iteration,
+                            negative before the first one
+  @param    sP_tol          Tolerance on the spectrum
+  @return   1 if converged, 0 otherwise
+
+  The sL/sP iterations converge linearly: the change of the spectrum
+  decreases by a roughly constant rate r = sP_change / sP_change_prev.
+  The distance to the converged spectrum is then sP_change * r / (1-r).
+  The iterations stop once it is below the tolerance. A fast convergence
+  thus stops before the change itself is below the tolerance, and a
+  slow one goes on after. While the change does not decrease, no rate
+  can be estimated and the iterations go on.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_converged(
+        double      sP_change,
+        double  *   sP_change_prev,
+        double      sP_tol)
+{
+    double  rate ;
+    int     converged ;
+
+    if (sP_change <= 0.0) {
+        converged = 1 ;
+    } else if (*sP_change_prev <= 0.0 || sP_change >= *sP_change_prev) {
+        converged = 0 ;
+    } else {
+        rate = sP_change / *sP_change_prev ;
+        converged = sP_change * rate <= sP_tol * (1.0 - rate) ;
+    }
+    *sP_change_prev = sP_change ;
+    return converged ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Slit-decomposition of a single swath, assuming vertical slit
@@ -2664,7 +3420,9 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
   @param    nrows       Extraction slit height in pixels
   @param    osample     Subpixel ovsersampling factor
   @param    im          Image to be decomposed
-  @param    mask        int mask of same dimension as image
+  @param    pix_unc     Uncertainties of the image pixels
+  @param    stride      Row stride of im and pix_unc in pixels (>= ncols)
+  @param    mask        int mask [nrows][ncols]
   @param    ycen        Order centre line offset from pixel row boundary
   @param    sL          Slit function resulting from decomposition, start
                         guess is input, gets overwriteten with result
@@ -2674,15 +3432,26 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
   @param    lambda_sL   Smoothing parameter for the slit function, usually >0
   @param    sP_stop     Fraction of spectyrum change, stop condition
   @param    maxiter     Max number of iterations
-  @return
+  @param    slit_func_in    Fixed slit function [ny], or NULL
+  @param    sL_guess    Starting guess of the slit function [ny], or NULL
+  @param    niter       [out] the number of iterations, or NULL
+  @return   0 if converged, 1 if maxiter was reached, -1 if the spectrum
+            or the slit function is not finite
+
+  The iterations stop when the spectrum changes by less than sP_stop
+  (relative). With sL_guess, the first iteration only solves for the
+  spectrum, and the slit function is refined from there on. The
+  iterations then stop once the spectrum is within sP_stop of its
+  converged value, see cr2res_extract_slitdec_converged().
  */
 /*----------------------------------------------------------------------------*/
 static int cr2res_extract_slit_func_vert(
         int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         double  *   sL,
@@ -2693,32 +3462,42 @@ static int cr2res_extract_slit_func_vert(
         double      lambda_sL,
         double      sP_stop,
         int         maxiter,
-        const double * slit_func_in)
+        const double * slit_func_in,
+        const double * sL_guess,
+        int         *   niter)
 {
-    int x, y, iy, jy, iy1, iy2, ny, nd, i, j;
+    int x, y, iy, jy, iy1, iy2, ny, nd, i, j, k, l, nw;
     double step, d1, d2, sum, norm, dev, lambda, diag_tot, sP_change, sP_max;
-    int info, iter, isum;
+    double ww, msp, sP_change_prev;
+    const double * w;
+    int info, iter, isum, converged;
     /* Initialise */
-    nd=2*osample+1;
+    nd=osample+1;   /* Lower half of the band, including the diagonal */
     ny=osample*(nrows+1)+1; /* The size of the sf array */
     step=1.e0/osample;
     double * E = cpl_malloc(ncols*sizeof(double)); // double E[ncols];
     double * sP_old = cpl_malloc(ncols*sizeof(double)); // double sP_old[ncols];
-    double * Aij = cpl_malloc(ny*(2 * osample + 1)*sizeof(double)); //double Aij[ny*ny];
+    // Aij and Adiag only store the lower half of their symmetric band
+    double * Aij = cpl_malloc(ny*nd*sizeof(double)); // double Aij[ny][nd];
     double * bj = cpl_malloc(ny*sizeof(double)); // double bj[ny];
-    // double Adiag[ncols*3];
-    double * Adiag = cpl_malloc(ncols*3*sizeof(double));
-    // double omega[ny][nrows][ncols];
-    double * omega = cpl_malloc(ny*nrows*ncols*sizeof(double));
-    // index as: [iy+(y*ny)+(x*ny*nrows)]
+    // double Adiag[ncols][2];
+    double * Adiag = cpl_malloc(ncols*2*sizeof(double));
+    // Compact omega: the nw non-zero weights of each column [ncols][nw]
+    nw = osample + 1;
+    double * omega = cpl_malloc(ncols*nw*sizeof(double));
+    // and the subpixel of the first weight in row 0 [ncols]
+    int * omega_iy = cpl_malloc(ncols*sizeof(int));
     double *p_bj   = cpl_malloc(ncols * sizeof(double));
 
     /*
-      Construct the omega tensor. Normally it has the dimensionality of
-      ny*nrows*ncols.
-      The tensor is mostly empty and can be easily compressed to ny*nx, but
-      this will complicate matrix operations at later stages. I will keep
-      it as it is for now.
+      Construct the omega tensor. In its dense form it has the
+      dimensionality of ny*nrows*ncols, but each detector pixel {x, y} only
+      receives light from the osample+1 subpixels iy1..iy2 with the weights
+      d1, step, ..., step, d2. These weights only depend on the column, and
+      going one row up shifts iy1 by osample. So we store for each column
+      the nw=osample+1 weights and the first subpixel of row 0:
+        omega[iy][y][x] = omega[x*nw + iy - (omega_iy[x] + y*osample)]
+      All the loops below only run over these non-zero elements.
       Note, that omega is used in in the equations for sL, sP and for the model
       but it does not involve the data, only the geometry. Thus it can be
       pre-computed once.
@@ -2732,24 +3511,20 @@ static int cr2res_extract_slit_func_vert(
             d1 = step;
         d2 = step - d1;
 
-        for(y=0; y<nrows; y++) {
-            iy1+=osample;
-            iy2+=osample;
-            for(iy=0; iy<ny; iy++) {
-                if(iy<iy1)                omega[iy+(y*ny)+(x*ny*nrows)] = 0.;
-                else if(iy==iy1)          omega[iy+(y*ny)+(x*ny*nrows)] = d1;
-                else if(iy>iy1 && iy<iy2) omega[iy+(y*ny)+(x*ny*nrows)] = step;
-                else if(iy==iy2)          omega[iy+(y*ny)+(x*ny*nrows)] = d2;
-                else                      omega[iy+(y*ny)+(x*ny*nrows)] = 0.;
-            }
-        }
+        // Row 0 covers iy1+osample .. iy2+osample
+        omega_iy[x] = iy1 + osample;
+        omega[x*nw] = d1;
+        for (k=1; k<nw-1; k++) omega[x*nw+k] = step;
+        omega[x*nw+nw-1] = d2;
     }
 
-    if (slit_func_in != NULL){
+    // A fixed slit function takes precedence over a starting guess
+    if (slit_func_in != NULL) sL_guess = NULL;
+    if (slit_func_in != NULL || sL_guess != NULL){
         // Normalize the input just in case
         norm = 0.e0;
         for(iy = 0; iy < ny; iy++) {
-            sL[iy] = slit_func_in[iy];
+            sL[iy] = slit_func_in != NULL ? slit_func_in[iy] : sL_guess[iy];
             norm += sL[iy];
         }
         norm /= osample;
@@ -2757,51 +3532,52 @@ static int cr2res_extract_slit_func_vert(
     }
 
     /* Loop through sL , sP reconstruction until convergence is reached */
+    /* A guessed sL is only refined after the first spectrum */
     iter=0;
+    sP_change_prev=-1;
     do {
-        if (slit_func_in == NULL){
+        if (slit_func_in == NULL && (iter > 0 || sL_guess == NULL)){
             /* Compute slit function sL */
 
             /* Fill in SLE arrays */
-            diag_tot=0.e0;
-            for(iy=0; iy<ny; iy++) {
-                bj[iy]=0.e0;
-                for(jy=max(iy-osample,0); jy<=min(iy+osample,ny-1); jy++) {
-                    Aij[iy+ny*(jy-iy+osample)]=0.e0;
-                    for(x=0; x<ncols; x++) {
-                        sum=0.e0;
-                        for(y=0; y<nrows; y++)
-                            sum+=omega[iy+(y*ny)+(x*ny*nrows)] *
-                                omega[jy+(y*ny)+(x*ny*nrows)]*mask[y*ncols+x];
-                        Aij[iy+ny*(jy-iy+osample)]+=sum*sP[x]*sP[x];
+            for(iy=0; iy<ny*nd; iy++) Aij[iy]=0.e0;
+            for(iy=0; iy<ny; iy++) bj[iy]=0.e0;
+            for(x=0; x<ncols; x++) {
+                w = omega + x*nw;
+                for(y=0; y<nrows; y++) {
+                    if (!mask[y*ncols+x]) continue;
+                    // Subpixels iy..iy+osample are all within osample
+                    // of each other, i.e. inside the band of Aij
+                    iy1 = omega_iy[x] + y*osample;
+                    msp = sP[x]*sP[x];
+                    for(k=0; k<nw; k++) {
+                        iy = iy1 + k;
+                        ww = w[k]*msp;
+                        for(l=0; l<=k; l++) {
+                            jy = iy1 + l;
+                            Aij[iy*nd+jy-iy+osample]+=ww*w[l];
+                        }
+                        bj[iy]+=w[k]*im[y*stride+x]*sP[x];
                     }
                 }
-                for(x=0; x<ncols; x++) {
-                    sum=0.e0;
-                    for(y=0; y<nrows; y++)
-                        sum+=omega[iy+(y*ny)+(x*ny*nrows)]*
-                            mask[y*ncols+x]*im[y*ncols+x];
-                    bj[iy]+=sum*sP[x];
-                }
-                diag_tot+=Aij[iy+ny*osample];
             }
+            diag_tot=0.e0;
+            for(iy=0; iy<ny; iy++) diag_tot+=Aij[iy*nd+osample];
 
             /* Scale regularization parameters */
             lambda=lambda_sL*diag_tot/ny;
 
             /* Add regularization parts for the slit function */
-            Aij[ny*osample]    +=lambda;           /* Main diagonal  */
-            Aij[ny*(osample+1)]-=lambda;           /* Upper diagonal */
+            Aij[osample]           +=lambda;       /* Main diagonal  */
             for(iy=1; iy<ny-1; iy++) {
-                Aij[iy+ny*(osample-1)]-=lambda;      /* Lower diagonal */
-                Aij[iy+ny*osample    ]+=lambda*2.e0; /* Main diagonal  */
-                Aij[iy+ny*(osample+1)]-=lambda;      /* Upper diagonal */
+                Aij[iy*nd+osample-1]-=lambda;      /* Lower diagonal */
+                Aij[iy*nd+osample  ]+=lambda*2.e0; /* Main diagonal  */
             }
-            Aij[ny-1+ny*(osample-1)]-=lambda;      /* Lower diagonal */
-            Aij[ny-1+ny*osample]    +=lambda;      /* Main diagonal  */
+            Aij[(ny-1)*nd+osample-1]-=lambda;      /* Lower diagonal */
+            Aij[(ny-1)*nd+osample]  +=lambda;      /* Main diagonal  */
 
             /* Solve the system of equations */
-            info=cr2res_extract_slitdec_bandsol(Aij, bj, ny, nd, lambda);
+            info=cr2res_extract_slitdec_bandsol_spd(Aij, bj, ny, osample);
             if(info) cpl_msg_warning(__func__, "Bandsol exited with %d", info);
 
             /* Normalize the slit function */
@@ -2816,19 +3592,18 @@ static int cr2res_extract_slit_func_vert(
 
         /* Compute spectrum sP */
         for(x=0; x<ncols; x++) {
-            Adiag[x]=0.e0;
-            Adiag[x+ncols]=0.e0;
-            Adiag[x+2 *ncols]=0.e0;
+            Adiag[2*x]=0.e0;
+            Adiag[2*x+1]=0.e0;
 
             E[x]=0.e0;
+            w = omega + x*nw;
             for(y=0; y<nrows; y++) {
+                iy1 = omega_iy[x] + y*osample;
                 sum=0.e0;
-                for(iy=0; iy<ny; iy++) {
-                    sum+=omega[iy+(y*ny)+(x*ny*nrows)]*sL[iy];
-                }
+                for(k=0; k<nw; k++) sum+=w[k]*sL[iy1+k];
 
-                Adiag[x+ncols]+=sum*sum*mask[y*ncols+x];
-                E[x]+=sum*im[y*ncols+x]*mask[y*ncols+x];
+                Adiag[2*x+1]+=sum*sum*mask[y*ncols+x];
+                E[x]+=sum*im[y*stride+x]*mask[y*ncols+x];
             }
         }
         if(lambda_sP>0.e0) {
@@ -2839,33 +3614,30 @@ static int cr2res_extract_slit_func_vert(
             }
             norm/=ncols;
             lambda=lambda_sP*norm;
-            Adiag[0        ]  = 0.e0;
-            Adiag[0+ncols  ] += lambda;
-            Adiag[0+ncols*2] -= lambda;
+            Adiag[1] += lambda;
             for(x=1; x<ncols-1; x++) {
-                Adiag[x]=-lambda;
-                Adiag[x+ncols  ]+= 2.e0*lambda;
-                Adiag[x+ncols*2] =-lambda;
+                Adiag[2*x  ] =-lambda;
+                Adiag[2*x+1]+= 2.e0*lambda;
             }
-            Adiag[ncols - 1            ] -= lambda;
-            Adiag[ncols - 1 +     ncols] += lambda;
-            Adiag[ncols - 1 + 2 * ncols] = 0.e0;
+            Adiag[2*(ncols-1)  ] =-lambda;
+            Adiag[2*(ncols-1)+1]+= lambda;
 
-            info=cr2res_extract_slitdec_bandsol(Adiag, E, ncols, 3, lambda);
+            info=cr2res_extract_slitdec_bandsol_spd(Adiag, E, ncols, 1);
             for(x=0; x<ncols; x++) sP[x]=E[x];
         } else {
             for(x=0; x<ncols; x++) {
                 sP_old[x]=sP[x];
-                sP[x]=E[x]/Adiag[x+ncols];
+                sP[x]=E[x]/Adiag[2*x+1];
             }
         }
 
         /* Compute the model */
         for(y=0; y<nrows; y++) {
             for(x=0; x<ncols; x++) {
+                w = omega + x*nw;
+                iy1 = omega_iy[x] + y*osample;
                 sum=0.e0;
-                for(iy=0; iy<ny; iy++)
-                    sum+=omega[iy+(y*ny)+(x*ny*nrows)]*sL[iy];
+                for(k=0; k<nw; k++) sum+=w[k]*sL[iy1+k];
                 model[y*ncols+x]=sum*sP[x];
             }
         }
@@ -2875,8 +3647,8 @@ static int cr2res_extract_slit_func_vert(
         isum=0;
         for(y=0; y<nrows; y++) {
             for(x=0;x<ncols; x++) {
-                sum+=mask[y*ncols+x]*(model[y*ncols+x]-im[y*ncols+x]) *
-                                (model[y*ncols+x]-im[y*ncols+x]);
+                sum+=mask[y*ncols+x]*(model[y*ncols+x]-im[y*stride+x]) *
+                                (model[y*ncols+x]-im[y*stride+x]);
                 isum+=mask[y*ncols+x];
             }
         }
@@ -2885,7 +3657,7 @@ static int cr2res_extract_slit_func_vert(
         /* Adjust the mask marking outlyers */
         for(y=0; y<nrows; y++) {
             for(x=0;x<ncols; x++) {
-                if(fabs(model[y*ncols+x]-im[y*ncols+x])>6.*dev)
+                if(fabs(model[y*ncols+x]-im[y*stride+x])>6.*dev)
                     mask[y*ncols+x]=0;
                 else mask[y*ncols+x]=1;
             }
@@ -2898,8 +3670,13 @@ static int cr2res_extract_slit_func_vert(
             if(sP[x]>sP_max) sP_max=sP[x];
             if(fabs(sP[x]-sP_old[x])>sP_change) sP_change=fabs(sP[x]-sP_old[x]);
         }
-        /* Check the convergence */
-    } while(iter++ < maxiter && sP_change > sP_stop*sP_max);
+        /* Check the convergence, from a guess adaptively */
+        if (sL_guess != NULL)
+            converged = cr2res_extract_slitdec_converged(sP_change,
+                    &sP_change_prev, sP_stop*sP_max);
+        else converged = sP_change <= sP_stop*sP_max;
+    } while(iter++ < maxiter && !converged);
+    if (niter != NULL) *niter = iter;
 
     /* Uncertainty estimate */
     for (x = 0; x < ncols; x++) {
@@ -2909,10 +3686,10 @@ static int cr2res_extract_slit_func_vert(
     for (x = 0; x < ncols; x++) {
         // Loop through all pixels contributing to x
         for (y = 0; y < nrows; y++) {
-            unc[x] += (im[y * ncols + x] - model[y * ncols + x]) *
-                (im[y * ncols + x] - model[y * ncols + x]) *
+            unc[x] += (im[y * stride + x] - model[y * ncols + x]) *
+                (im[y * stride + x] - model[y * ncols + x]) *
                 sL[y] * mask[y * ncols + x];
-            unc[x] += pix_unc[y * ncols + x] * pix_unc[y * ncols + x] *
+            unc[x] += pix_unc[y * stride + x] * pix_unc[y * stride + x] *
                 sL[y] * mask[y * ncols + x];
             // Norm
             p_bj[x] += sL[y] * mask[y * ncols + x];
@@ -2927,12 +3704,15 @@ static int cr2res_extract_slit_func_vert(
     cpl_free(E);
     cpl_free(sP_old);
     cpl_free(omega);
+    cpl_free(omega_iy);
     cpl_free(Aij);
     cpl_free(bj);
     cpl_free(Adiag);
     cpl_free(p_bj);
 
-    return 0;
+    for (x = 0; x < ncols; x++) if (!isfinite(sP[x])) return -1;
+    for (iy = 0; iy < ny; iy++) if (!isfinite(sL[iy])) return -1;
+    return converged ? 0 : 1;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -2940,84 +3720,46 @@ static int cr2res_extract_slit_func_vert(
   @brief    Helper function for cr2res_extract_slit_func_curved
   @param ncols          Swath width in pixels
   @param nrows          Extraction slit height in pixels
-  @param ny             Size of the slit function array: ny=osample(nrows+1)+1
   @param ycen           Order centre line offset from pixel row boundary
   @param ycen_offset    Order image column shift
   @param y_lower_lim    Number of detector pixels below the pixel
                         containing the central line yc
   @param osample        Subpixel ovsersampling factor
-  @param PSF_curve      Parabolic fit to the slit image curvature
-                        For column d_x = PSF_curve[ncols][0] +
-                                        PSF_curve[ncols][1] *d_y +
-                                        PSF_curve[ncols][2] *d_y^2
-                        where d_y is the offset from the central line ycen.
-                        Thus central subpixel of omega[x][y'][delta_x][iy']
-                        does not stick out of column x
-  @param xi[ncols][ny][4]   Convolution tensor telling the coordinates
-                            of detector pixels on which {x, iy} element
-                            falls and the corresponding projections
-  @param zeta[ncols][nrows][3 * (osample + 1)]
-                        Convolution tensor telling the coordinates
+  @param slitcurves     Slit curvature polynomials of each column [ncols]
+                        giving the horizontal shift d_x as function of the
+                        offset d_y from the central line ycen
+  @param zeta           [out] Convolution tensor telling the coordinates
                         of subpixels {x, iy} contributing to detector pixel
-                        {x, y}
-  @param m_zeta[ncols][nrows]
-                        The actual number of contributing elements in zeta
+                        {x, y}, allocated for ncols, nrows and osample
+  @return   0
 
-  @return
+  The transposed tensor (xi, the detector pixels on which the subpixel
+  {x, iy} falls) is not kept: the equations for sL and sP are summed over
+  the detector pixels and only need zeta.
  */
 /*----------------------------------------------------------------------------*/
-static int cr2res_extract_xi_zeta_tensors(
+static int cr2res_extract_zeta_tensor(
         int         ncols,
         int         nrows,
-        int         ny,
         double  *   ycen,
         int     *   ycen_offset,
         int         y_lower_lim,
         int         osample,
         cpl_polynomial ** slitcurves,
-        xi_ref   *  xi,
-        zeta_ref *  zeta,
-        int      *  m_zeta)
+        zeta_tensor *   zeta)
 {
-    int x, xx, y, yy, ix, ix1, ix2, iy, iy1, iy2, m;
+    int x, xx, y, yy, ix1, ix2, iy, iy1, iy2;
     double step, delta, dy, w, d1, d2;
     step = 1.e0 / osample;
 
-    /* Clean xi */
-    for (x = 0; x < ncols; x++)
-    {
-        for (iy = 0; iy < ny; iy++)
-        {
-            for (m = 0; m < 4; m++)
-            {
-                xi[xi_index(x, iy, m)].x = -1;
-                xi[xi_index(x, iy, m)].y = -1;
-                xi[xi_index(x, iy, m)].w = 0.;
-            }
-        }
-    }
-
     /* Clean zeta */
-    for (x = 0; x < ncols; x++)
-    {
-        for (y = 0; y < nrows; y++)
-        {
-            m_zeta[mzeta_index(x, y)] = 0;
-            for (ix = 0; ix < 3 * (osample + 1); ix++)
-            {
-                zeta[zeta_index(x, y, ix)].x = -1;
-                zeta[zeta_index(x, y, ix)].iy = -1;
-                zeta[zeta_index(x, y, ix)].w = 0.;
-            }
-        }
-    }
+    for (x = 0; x < ncols * nrows; x++) zeta->nb[x] = 0;
 
     /*
-    Construct the xi and zeta tensors. They contain pixel references and contribution. 
-    values going from a given subpixel to other pixels (xi) and coming from other subpixels
-    to a given detector pixel (zeta).
-    Note, that xi and zeta are used in the equations for sL, sP and for the model but they
-    do not involve the data, only the geometry. Thus it can be pre-computed once.
+    Construct the zeta tensor. It contains pixel references and contribution
+    values coming from other subpixels to a given detector pixel.
+    Note, that zeta is used in the equations for sL, sP and for the model but it
+    does not involve the data, only the geometry. Thus it can be pre-computed once.
     */
     for (x = 0; x < ncols; x++)
     {
@@ -3039,345 +3781,1162 @@ static int cr2res_extract_xi_zeta_tensors(
         incrementing them by osample. 
         */
 
-        iy2 = osample - floor(ycen[x] * osample);
-        iy1 = iy2 - osample;
+        iy2 = osample - floor(ycen[x] * osample);
+        iy1 = iy2 - osample;
+
+        /*
+        Handling partial subpixels cut by detector pixel rows is again tricky. Here we have three
+        cases (mostly because of the decision to assume that we always have osample+1 subpixels
+        per one detector pixel). Here d1 is the fraction of the subpixel iy1 inside detector pixel y.
+        d2 is then the fraction of subpixel iy2 inside detector pixel y. By definition d1+d2==step.
+        Case 1: ycen falls on the top boundary of each detector pixel (ycen == 1). Here we conclude
+                that the first subpixel is fully contained inside pixel y and d1 is set to step.
+        Case 2: ycen falls on the bottom boundary of each detector pixel (ycen == 0). Here we conclude
+                that the first subpixel is totally outside of pixel y and d1 is set to 0.
+        Case 3: ycen falls inside of each pixel (0>ycen>1). In this case d1 is set to the fraction of
+                the first step contained inside of each pixel.
+        And BTW, this also means that central line coinsides with the upper boundary of subpixel iy2
+        when the y loop reaches pixel y_lower_lim. In other words:
+
+        dy=(iy-(y_lower_lim+ycen[x])*osample)*step-0.5*step
+        */
+
+        d1 = fmod(ycen[x], step);
+        if (d1 == 0)
+            d1 = step;
+        d2 = step - d1;
+
+        /*
+        The final hurdle for 2D slit decomposition is to construct two 3D reference tensors. We proceed
+        similar to 1D case except that now each iy subpixel can be shifted left or right following
+        the curvature of the slit image on the detector. We assume for now that each subpixel is
+        exactly 1 detector pixel wide. This may not be exactly true if the curvature changes accross
+        the focal plane but will deal with it when the necessity will become apparent. For now we
+        just assume that a shift delta the weight w assigned to subpixel iy is divided between
+        ix1=int(delta) and ix2=int(delta)+signum(delta) as (1-|delta-ix1|)*w and |delta-ix1|*w.
+
+        The curvature is given by a quadratic polynomial evaluated from an approximation for column
+        x: delta = PSF_curve[x][0] + PSF_curve[x][1] * (y-yc[x]) + PSF_curve[x][2] * (y-yc[x])^2.
+        It looks easy except that y and yc are set in the global detector coordinate system rather than
+        in the shifted and cropped swath passed to slit_func_2d. One possible solution I will try here
+        is to modify PSF_curve before the call such as:
+        delta = PSF_curve'[x][0] + PSF_curve'[x][1] * (y'-ycen[x]) + PSF_curve'[x][2] * (y'-ycen[x])^2
+        where y' = y - floor(yc).
+        */
+
+        /* Define initial distance from ycen       */
+        /* It is given by the center of the first  */
+        /* subpixel falling into pixel y_lower_lim */
+        dy = ycen[x] - floor((y_lower_lim + ycen[x]) / step) * step - step;
+
+        /*
+        Now we go detector pixels x and y incrementing subpixels looking for their controibutions
+        to the current and adjacent pixels. Note that the curvature/tilt of the projected slit
+        image could be so large that subpixel iy may no contribute to column x at all. On the
+        other hand, subpixels around ycen by definition must contribute to pixel x,y. 
+        The corners of pixel xx,y are: 0:LL, 1:LR, 2:UL, 3:UR.
+        */
+        for (y = 0; y < nrows; y++) {
+            iy1 += osample; // Bottom subpixel falling in row y
+            iy2 += osample; // Top subpixel falling in row y
+            dy -= step;
+            for (iy = iy1; iy <= iy2; iy++) {
+                if (iy == iy1)      w = d1;
+                else if (iy == iy2) w = d2;
+                else                w = step;
+                dy += step;
+                delta = cpl_polynomial_eval_1d(slitcurves[x], dy - ycen[x], NULL);
+                ix1 = delta;
+                ix2 = ix1 + signum(delta);
+
+                /* Three cases: subpixel on the bottom boundary of row y, intermediate subpixels and top boundary */
+
+                if (iy == iy1) /* Case A: Subpixel iy is entering detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x  */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Upper right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                            xx = x + ix2; /* Upper left corner of subpixel iy */
+                            // This offset is required because the iy subpixel
+                            // is going to contribute to the yy row in xx column
+                            // of detector pixels where yy and y are in the same
+                            // row. In the packed array this is not necessarily true.
+                            // Instead, what we know is that:
+                            // y+ycen_offset[x] == yy+ycen_offset[xx]
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Upper left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                            xx = x + ix1; /* Upper right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                        }
+                    }
+                    else
+                    {
+                        if (x + ix1 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix1; /* Subpixel iy stays inside column x */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w);
+                        }
+                    }
+                }
+                else if (iy == iy2) /* Case C: Subpixel iy is leaving detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                        }
+                    }
+                    else /* Subpixel iy stays inside column x        */
+                    {
+                        if (x + ix1 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix1;
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w);
+                        }
+                    }
+                }
+                else /* CASE B: Subpixel iy is fully inside detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x      */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, fabs(delta - ix1) * w);
+                            xx = x + ix1; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w - fabs(delta - ix1) * w);
+                        }
+                    }
+                    else /* Subpixel iy stays inside column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix2;
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            cr2res_extract_zeta_add(zeta, x, iy, xx, yy, w);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Allocate the convolution tensor of a swath
+  @param    ncols       Swath width in pixels
+  @param    nrows       Extraction slit height in pixels
+  @param    osample     Subpixel ovsersampling factor
+  @param    single      Flag to store the weights in single precision
+  @return   the newly allocated tensor
+ */
+/*----------------------------------------------------------------------------*/
+static zeta_tensor * cr2res_extract_zeta_tensor_new(
+        int     ncols,
+        int     nrows,
+        int     osample,
+        int     single)
+{
+    zeta_tensor     *   zeta ;
+    cpl_size            size ;
+
+    zeta = cpl_malloc(sizeof(zeta_tensor)) ;
+    zeta->ncols = ncols ;
+    zeta->nrows = nrows ;
+    zeta->mmax = 3 * (osample + 1) ;
+    size = (cpl_size)ncols * nrows * zeta->mmax ;
+    zeta->x = cpl_malloc(size * sizeof(zeta_idx)) ;
+    zeta->iy = cpl_malloc(size * sizeof(zeta_idx)) ;
+    zeta->w = single ? NULL : cpl_malloc(size * sizeof(double)) ;
+    zeta->wf = single ? cpl_malloc(size * sizeof(float)) : NULL ;
+    zeta->nb = cpl_calloc(ncols * nrows, sizeof(zeta_idx)) ;
+    return zeta ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a convolution tensor
+  @param    zeta    the tensor
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_zeta_tensor_delete(zeta_tensor * zeta)
+{
+    if (zeta == NULL) return ;
+    cpl_free(zeta->x) ;
+    cpl_free(zeta->iy) ;
+    cpl_free(zeta->w) ;
+    cpl_free(zeta->wf) ;
+    cpl_free(zeta->nb) ;
+    cpl_free(zeta) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Add the contribution of a subpixel to a detector pixel
+  @param    zeta    The convolution tensor
+  @param    x       Column of the contributing subpixel
+  @param    iy      Index of the contributing subpixel
+  @param    xx      Column of the detector pixel
+  @param    yy      Row of the detector pixel
+  @param    w       Contribution weight
+  @return   nothing
+
+  Contributions falling outside of the swath, or without weight, are
+  ignored.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_zeta_add(
+        zeta_tensor *   zeta,
+        int             x,
+        int             iy,
+        int             xx,
+        int             yy,
+        double          w)
+{
+    int     p, k ;
+
+    if (xx < 0 || xx >= zeta->ncols || yy < 0 || yy >= zeta->nrows ||
+            !(w > 0)) return ;
+    p = yy * zeta->ncols + xx ;
+    if (zeta->nb[p] >= zeta->mmax) return ;
+    k = p * zeta->mmax + zeta->nb[p] ;
+    zeta->x[k] = x ;
+    zeta->iy[k] = iy ;
+    if (zeta->wf != NULL) zeta->wf[k] = (float)w ;
+    else zeta->w[k] = w ;
+    zeta->nb[p]++ ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fill the system of equations of the slit function
+  @param    zeta    Convolution tensor of the swath
+  @param    im      Swath image [nrows][stride]
+  @param    stride  Row stride of im in pixels
+  @param    mask    Good pixels mask [nrows][ncols]
+  @param    sP      Current spectrum [ncols]
+  @param    ny      Size of the slit function
+  @param    ml      Number of sub-diagonals of the system
+  @param    l_Aij   [out] Lower half of the band matrix [ny][ml+1]
+  @param    l_bj    [out] Right hand side [ny]
+  @param    loc     Scratch memory [ny]
+  @return   nothing
+
+  Each detector pixel adds a(iy)*a(jy) to A(iy,jy) and a(iy)*im to b(iy),
+  where a(iy) is the sum of sP[x]*w over the zeta entries {x, iy, w} of
+  the pixel. The a(iy) are gathered in loc first, the outer product is
+  then accumulated with unit stride along the rows of the band.
+ */
+/*----------------------------------------------------------------------------*/
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_fill_sL(
+        const zeta_tensor   *   zeta,
+        const double        *   im,
+        int                     stride,
+        const int           *   mask,
+        const double        *   sP,
+        int                     ny,
+        int                     ml,
+        double              *   l_Aij,
+        double              *   l_bj,
+        double              *   loc)
+{
+    const zeta_idx  *   zx ;
+    const zeta_idx  *   ziy ;
+    const double    *   zw ;
+    const float     *   zwf ;
+    double          *   row ;
+    double              a, imp ;
+    int                 p, m, n, i, j, x, y, iy0, iy1 ;
+
+    for (i = 0; i < ny * (ml + 1); i++) l_Aij[i] = 0.e0;
+    for (i = 0; i < ny; i++) l_bj[i] = 0.e0;
+
+    for (y = 0; y < zeta->nrows; y++) {
+        for (x = 0; x < zeta->ncols; x++) {
+            p = y * zeta->ncols + x;
+            n = zeta->nb[p];
+            if (n == 0 || !mask[p]) continue;
+            zx = zeta->x + p * zeta->mmax;
+            ziy = zeta->iy + p * zeta->mmax;
+            imp = im[y * stride + x];
+
+            /* Range of the contributing subpixels */
+            iy0 = iy1 = ziy[0];
+            for (m = 1; m < n; m++) {
+                if (ziy[m] < iy0) iy0 = ziy[m];
+                if (ziy[m] > iy1) iy1 = ziy[m];
+            }
+            for (i = 0; i <= iy1 - iy0; i++) loc[i] = 0.e0;
+            if (zeta->wf != NULL) {
+                zwf = zeta->wf + p * zeta->mmax;
+                for (m = 0; m < n; m++)
+                    loc[ziy[m] - iy0] += sP[zx[m]] * zwf[m];
+            } else {
+                zw = zeta->w + p * zeta->mmax;
+                for (m = 0; m < n; m++)
+                    loc[ziy[m] - iy0] += sP[zx[m]] * zw[m];
+            }
+
+            for (i = 0; i <= iy1 - iy0; i++) {
+                a = loc[i];
+                /* row[j] is A(iy0+i, iy0+j) */
+                row = l_Aij + (iy0 + i) * (ml + 1) + ml - i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+                for (j = max(0, i - ml); j <= i; j++) row[j] += a * loc[j];
+                l_bj[iy0 + i] += a * imp;
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Fill the system of equations of the spectrum
+  @param    zeta    Convolution tensor of the swath
+  @param    im      Swath image [nrows][stride]
+  @param    stride  Row stride of im in pixels
+  @param    mask    Good pixels mask [nrows][ncols]
+  @param    sL      Current slit function [ny]
+  @param    mp      Number of sub-diagonals of the system
+  @param    p_Aij   [out] Lower half of the band matrix [ncols][mp+1]
+  @param    p_bj    [out] Right hand side [ncols]
+  @param    loc     Scratch memory [ncols]
+  @return   nothing
+
+  Same as cr2res_extract_slitdec_fill_sL() with the roles of the
+  columns x and the subpixels iy exchanged.
+ */
+/*----------------------------------------------------------------------------*/
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_fill_sP(
+        const zeta_tensor   *   zeta,
+        const double        *   im,
+        int                     stride,
+        const int           *   mask,
+        const double        *   sL,
+        int                     mp,
+        double              *   p_Aij,
+        double              *   p_bj,
+        double              *   loc)
+{
+    const zeta_idx  *   zx ;
+    const zeta_idx  *   ziy ;
+    const double    *   zw ;
+    const float     *   zwf ;
+    double          *   row ;
+    double              a, imp ;
+    int                 p, m, n, i, j, x, y, x0, x1 ;
+
+    for (i = 0; i < zeta->ncols * (mp + 1); i++) p_Aij[i] = 0.e0;
+    for (i = 0; i < zeta->ncols; i++) p_bj[i] = 0.e0;
+
+    for (y = 0; y < zeta->nrows; y++) {
+        for (x = 0; x < zeta->ncols; x++) {
+            p = y * zeta->ncols + x;
+            n = zeta->nb[p];
+            if (n == 0 || !mask[p]) continue;
+            zx = zeta->x + p * zeta->mmax;
+            ziy = zeta->iy + p * zeta->mmax;
+            imp = im[y * stride + x];
+
+            /* Range of the contributing columns */
+            x0 = x1 = zx[0];
+            for (m = 1; m < n; m++) {
+                if (zx[m] < x0) x0 = zx[m];
+                if (zx[m] > x1) x1 = zx[m];
+            }
+            for (i = 0; i <= x1 - x0; i++) loc[i] = 0.e0;
+            if (zeta->wf != NULL) {
+                zwf = zeta->wf + p * zeta->mmax;
+                for (m = 0; m < n; m++)
+                    loc[zx[m] - x0] += sL[ziy[m]] * zwf[m];
+            } else {
+                zw = zeta->w + p * zeta->mmax;
+                for (m = 0; m < n; m++)
+                    loc[zx[m] - x0] += sL[ziy[m]] * zw[m];
+            }
+
+            for (i = 0; i <= x1 - x0; i++) {
+                a = loc[i];
+                /* row[j] is A(x0+i, x0+j) */
+                row = p_Aij + (x0 + i) * (mp + 1) + mp - i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+                for (j = max(0, i - mp); j <= i; j++) row[j] += a * loc[j];
+                p_bj[x0 + i] += a * imp;
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the model of the swath
+  @param    zeta    Convolution tensor of the swath
+  @param    sP      Spectrum [ncols]
+  @param    sL      Slit function [ny]
+  @param    model   [out] Model [nrows][ncols]
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static CR2RES_EXTRACT_SIMD void cr2res_extract_slitdec_model(
+        const zeta_tensor   *   zeta,
+        const double        *   sP,
+        const double        *   sL,
+        double              *   model)
+{
+    const zeta_idx  *   zx ;
+    const zeta_idx  *   ziy ;
+    const double    *   zw ;
+    const float     *   zwf ;
+    double              sum ;
+    int                 p, m, n ;
+
+    for (p = 0; p < zeta->ncols * zeta->nrows; p++) {
+        n = zeta->nb[p];
+        zx = zeta->x + p * zeta->mmax;
+        ziy = zeta->iy + p * zeta->mmax;
+        sum = 0.e0;
+        if (zeta->wf != NULL) {
+            zwf = zeta->wf + p * zeta->mmax;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:sum)
+#endif
+            for (m = 0; m < n; m++) sum += sP[zx[m]] * sL[ziy[m]] * zwf[m];
+        } else {
+            zw = zeta->w + p * zeta->mmax;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:sum)
+#endif
+            for (m = 0; m < n; m++) sum += sP[zx[m]] * sL[ziy[m]] * zw[m];
+        }
+        model[p] = sum;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the image independent geometry of a trace
+  @param    trace_tab   The traces table
+  @param    order       The order of the trace
+  @param    trace_id    The trace number
+  @param    height      number of pix above and below mid-line or -1
+  @param    swath       width per swath
+  @param    oversample  factor for oversampling
+  @param    lenx        X size of the images to extract
+  @param    leny        Y size of the images to extract
+  @param    curved      Flag to compute the slit curvature
+  @return   the newly allocated geometry or NULL in error case
+
+  The zeta tensors are not computed here, see
+  cr2res_extract_geometry_cache().
+ */
+/*----------------------------------------------------------------------------*/
+static trace_geometry * cr2res_extract_geometry_new(
+        const cpl_table     *   trace_tab,
+        int                     order,
+        int                     trace_id,
+        int                     height,
+        int                     swath,
+        int                     oversample,
+        cpl_size                lenx,
+        cpl_size                leny,
+        int                     curved)
+{
+    trace_geometry  *   g ;
+    cpl_vector      *   ycen ;
+    cpl_vector      *   bins_begin ;
+    cpl_vector      *   bins_end ;
+    cpl_polynomial      *slitcurve_A, *slitcurve_B, *slitcurve_C;
+    double              delta_tmp, a, b, c, yc;
+    int                 i, delta_x ;
+
+    /* Compute height if not given */
+    if (height <= 0) {
+        height = cr2res_trace_get_height(trace_tab, order, trace_id);
+        if (height <= 0) {
+            cpl_msg_error(__func__, "Cannot compute height");
+            return NULL;
+        }
+    }
+    if (height > leny) {
+        height = leny;
+        cpl_msg_warning(__func__,
+                "Given height larger than image, clipping height");
+    }
+    if (oversample <= 0) oversample = 1;
+
+    /* Get ycen */
+    if ((ycen = cr2res_trace_get_ycen(trace_tab, order,
+                    trace_id, lenx)) == NULL) {
+        cpl_msg_error(__func__, "Cannot get ycen");
+        return NULL ;
+    }
+
+    slitcurve_A = slitcurve_B = slitcurve_C = NULL ;
+    delta_x = 0 ;
+    if (curved) {
+        /* Retrieve the polynomials that describe the slit tilt and curv. */
+        slitcurve_A = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_A, order, trace_id);
+        slitcurve_B = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_B, order, trace_id);
+        slitcurve_C = cr2res_get_trace_wave_poly(trace_tab,
+                CR2RES_COL_SLIT_CURV_C, order, trace_id);
+        if ((slitcurve_A == NULL) || (slitcurve_B == NULL) ||
+                (slitcurve_C == NULL)) {
+            cpl_msg_error(__func__, 
+                    "No (or incomplete) slitcurve data found in trace table");
+            cpl_vector_delete(ycen);
+            cpl_polynomial_delete(slitcurve_A);
+            cpl_polynomial_delete(slitcurve_B);
+            cpl_polynomial_delete(slitcurve_C);
+            return NULL;
+        }
+
+        /* Maximum horizontal shift in detector pixels due to slit curv. */
+        for (i=1; i<=lenx; i+=swath/2){
+            /* Do a coarse sweep through the order and evaluate the */
+            /* slitcurve polynomials at  +- height/2, update the value. */
+            /* Note: The index i is subtracted from a because the polys */
+            /* have their origin at the edge of the full frame */
+            a = cpl_polynomial_eval_1d(slitcurve_A, i, NULL);
+            b = cpl_polynomial_eval_1d(slitcurve_B, i, NULL);
+            c = cpl_polynomial_eval_1d(slitcurve_C, i, NULL);
+            yc = cpl_vector_get(ycen, i-1);
+
+            // Shift polynomial to local frame
+            // We fix a to 0, see comment in cr2res_extract_geometry_swath()
+            a = 0; 
+            b += 2 * yc * c;
+
+            delta_tmp = max( fabs(a + (c*height/2. + b)*height/2.),
+                    fabs(a + (c*height/-2. + b)*height/-2.));
+            if (delta_tmp > delta_x) delta_x = (int)ceil(delta_tmp);
+        }
+        delta_x += 1;
+        cpl_msg_debug(__func__, "Max delta_x from slit curv: %d pix.",
+                delta_x);
+
+        if (delta_x >= swath / 4){
+            cpl_msg_error(__func__, 
+                "Curvature is larger than the swath, try again with a larger swath size");
+            cpl_vector_delete(ycen);
+            cpl_polynomial_delete(slitcurve_A);
+            cpl_polynomial_delete(slitcurve_B);
+            cpl_polynomial_delete(slitcurve_C);
+            return NULL;
+        }
+    }
+
+    /* Swath bins */
+    if ((swath = cr2res_extract_slitdec_adjust_swath(ycen, height, leny, swath, 
+                    lenx, delta_x, &bins_begin, &bins_end)) == -1){
+        cpl_msg_error(__func__, "Cannot calculate swath size");
+        cpl_vector_delete(ycen);
+        cpl_polynomial_delete(slitcurve_A);
+        cpl_polynomial_delete(slitcurve_B);
+        cpl_polynomial_delete(slitcurve_C);
+        return NULL;
+    }
+
+    /* The convolution tensor uses compact indices */
+    if (curved && (swath > CR2RES_EXTRACT_ZETA_IDX_MAX ||
+                oversample * (height + 1) + 1 > CR2RES_EXTRACT_ZETA_IDX_MAX)) {
+        cpl_msg_error(__func__, "Swath or oversampled height too large");
+        cpl_vector_delete(ycen);
+        cpl_vector_delete(bins_begin);
+        cpl_vector_delete(bins_end);
+        cpl_polynomial_delete(slitcurve_A);
+        cpl_polynomial_delete(slitcurve_B);
+        cpl_polynomial_delete(slitcurve_C);
+        return NULL;
+    }
+
+    g = cpl_malloc(sizeof(trace_geometry)) ;
+    g->height = height ;
+    g->swath = swath ;
+    g->oversample = oversample ;
+    g->delta_x = delta_x ;
+    g->nswaths = cpl_vector_get_size(bins_begin) ;
+    g->trace_height = (double)cr2res_trace_get_height(trace_tab, order,
+            trace_id) ;
+    g->ycen = ycen ;
+    g->ycen_rest = cr2res_vector_get_rest(ycen) ;
+    g->bins_begin = bins_begin ;
+    g->bins_end = bins_end ;
+    g->slitcurve_A = slitcurve_A ;
+    g->slitcurve_B = slitcurve_B ;
+    g->slitcurve_C = slitcurve_C ;
+    g->zeta = NULL ;
+    g->single = 0 ;
+    return g ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a trace geometry
+  @param    g       the geometry
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_geometry_delete(trace_geometry * g)
+{
+    int     i ;
+
+    if (g == NULL) return ;
+    if (g->zeta != NULL) {
+        for (i=0 ; i<g->nswaths ; i++)
+            cr2res_extract_zeta_tensor_delete(g->zeta[i]) ;
+        cpl_free(g->zeta) ;
+    }
+    cpl_vector_delete(g->ycen) ;
+    cpl_free(g->ycen_rest) ;
+    cpl_vector_delete(g->bins_begin) ;
+    cpl_vector_delete(g->bins_end) ;
+    cpl_polynomial_delete(g->slitcurve_A) ;
+    cpl_polynomial_delete(g->slitcurve_B) ;
+    cpl_polynomial_delete(g->slitcurve_C) ;
+    cpl_free(g) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the per column geometry of one swath with curved slit
+  @param    g               The trace geometry
+  @param    swath_nb        The swath number
+  @param    ycen_sw         [out] Trace center offset from the pixel row
+                            boundary [swath]
+  @param    ycen_offset_sw  [out] Integer trace center [swath]
+  @param    slitcurves      [out] Slit curvature in the local frame [swath]
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_geometry_swath(
+        const trace_geometry    *   g,
+        int                         swath_nb,
+        double                  *   ycen_sw,
+        int                     *   ycen_offset_sw,
+        cpl_polynomial          **  slitcurves)
+{
+    cpl_size            pow;
+    int                 j, col, x, sw_start, sw_end;
+
+    sw_start = cpl_vector_get(g->bins_begin, swath_nb);
+    sw_end = cpl_vector_get(g->bins_end, swath_nb);
+
+    for(col=1; col<=g->swath; col++){   // col is x-index in swath
+        x = sw_start + col;             // coords in large image
+
+        /* set slit curvature polynomials */
+        /* subtract col because we want origin relative to here */
+        pow = 2;
+        cpl_polynomial_set_coeff(slitcurves[col-1], &pow,
+            cpl_polynomial_eval_1d(g->slitcurve_C, x, NULL));
+        pow = 1;
+        cpl_polynomial_set_coeff(slitcurves[col-1], &pow,
+            cpl_polynomial_eval_1d(g->slitcurve_B, x, NULL));
+        pow = 0;
+        cpl_polynomial_set_coeff(slitcurves[col-1], &pow,
+            cpl_polynomial_eval_1d(g->slitcurve_A, x, NULL) - x);
+
+        // Shift polynomial to local frame
+        // -------------------------------
+        // The slit curvature has been determined in the global reference
+        // frame, with the a coefficient set to 0 in the local frame.
+        // The following transformation will shift it into the local frame
+        // again and should result in a = 0.
+        //      a - x + yc * b + yc * yc * c
+        // However this only works, as long as ycen
+        // is the same ycen that was used for the slitcurvature. If e.g. we
+        // switch traces, then ycen will change and a will be unequal 0.
+        // in fact a will be the offset due to the curvature between the
+        // old ycen and the new. This will then cause an offset in the
+        // pixels used for the extraction, so that all traces will have the
+        // same spectrum, with no relative offsets.
+        // Which would be great, if we didn't have an offset in the
+        // wavelength calibration of the different traces.
+        // Therefore we force a to be 0 in the local frame regardless of
+        // ycen. For the extraction we only need the b and c coefficient
+        // anyways.
+        // Note that this means, we use the curvature a few pixels offset.
+        // Usually this is no problem, since it only varies slowly over the
+        // order.
+        cpl_polynomial_shift_1d(slitcurves[col-1], 0,
+                                        cpl_vector_get(g->ycen, x-1));
+        cpl_polynomial_set_coeff(slitcurves[col-1], &pow, 0);
+    }
+
+    for (j=sw_start;j<sw_end;j++){
+        ycen_sw[j-sw_start] = g->ycen_rest[j];
+        ycen_offset_sw[j-sw_start] = (int) cpl_vector_get(g->ycen, j);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute and keep the zeta tensors of all the swaths
+  @param    g       The trace geometry with curved slit
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_geometry_cache(trace_geometry * g)
+{
+    double          *   ycen_sw ;
+    int             *   ycen_offset_sw ;
+    cpl_polynomial  **  slitcurves ;
+    int                 i ;
+
+    if (g == NULL || g->zeta != NULL) return ;
+
+    /* Allocate */
+    ycen_sw = cpl_malloc(g->swath * sizeof(double));
+    ycen_offset_sw = cpl_malloc(g->swath * sizeof(int));
+    slitcurves = cpl_malloc(g->swath * sizeof(cpl_polynomial*));
+    for (i=0; i<g->swath; i++) slitcurves[i] = cpl_polynomial_new(1);
+    g->zeta = cpl_malloc(g->nswaths * sizeof(zeta_tensor *));
+
+    for (i=0 ; i<g->nswaths ; i++) {
+        g->zeta[i] = cr2res_extract_zeta_tensor_new(g->swath, g->height,
+                g->oversample, g->single);
+        cr2res_extract_geometry_swath(g, i, ycen_sw, ycen_offset_sw,
+                slitcurves);
+        cr2res_extract_zeta_tensor(g->swath, g->height, ycen_sw,
+                ycen_offset_sw, g->height / 2, g->oversample, slitcurves,
+                g->zeta[i]);
+    }
+
+    for (i=0; i<g->swath; i++) cpl_polynomial_delete(slitcurves[i]);
+    cpl_free(slitcurves);
+    cpl_free(ycen_offset_sw);
+    cpl_free(ycen_sw);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Allocate the scratch memory to decompose curved swaths
+  @param    swath       Swath width in pixels
+  @param    height      Extraction slit height in pixels
+  @param    oversample  Subpixel ovsersampling factor
+  @param    delta_x     Maximum horizontal shift due to the slit curvature
+  @param    single      Flag for single precision tensor weights
+  @return   the newly allocated workspace
+
+  One workspace is used by a single worker, for all the swaths it solves.
+ */
+/*----------------------------------------------------------------------------*/
+static slitdec_workspace * cr2res_extract_slitdec_workspace_new(
+        int     swath,
+        int     height,
+        int     oversample,
+        int     delta_x,
+        int     single)
+{
+    slitdec_workspace   *   ws ;
+    int                     i, ny, nx ;
+
+    ny = oversample * (height + 1) + 1;
+    nx = 4 * delta_x + 1;
+    if(nx < 3) nx = 3;
+
+    ws = cpl_malloc(sizeof(slitdec_workspace)) ;
+    ws->mask = cpl_malloc(height * swath * sizeof(int));
+    ws->ycen = cpl_malloc(swath * sizeof(double));
+    ws->ycen_offset = cpl_malloc(swath * sizeof(int));
+    ws->slitcurves = cpl_malloc(swath * sizeof(cpl_polynomial*));
+    for (i=0; i<swath; i++) ws->slitcurves[i] = cpl_polynomial_new(1);
+
+    ws->sP_old = cpl_malloc(swath * sizeof(double));
+    ws->l_Aij  = cpl_malloc(ny * (2*oversample+1) * sizeof(double));
+    ws->p_Aij  = cpl_malloc(swath * (nx/2+1) * sizeof(double));
+    ws->l_bj   = cpl_malloc(ny * sizeof(double));
+    ws->p_bj   = cpl_malloc(swath * sizeof(double));
+    ws->loc    = cpl_malloc(max(ny, swath) * sizeof(double));
+    ws->img_mad = cpl_image_new(swath, height, CPL_TYPE_DOUBLE);
+
+    /* Convolution tensor telling the coordinates of subpixels {x, iy}
+       contributing to detector pixel {x, y} */
+    ws->zeta = cr2res_extract_zeta_tensor_new(swath, height, oversample,
+            single);
+    ws->swath = swath ;
+    return ws ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a slit decomposition workspace
+  @param    ws      the workspace
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_slitdec_workspace_delete(slitdec_workspace * ws)
+{
+    int     i ;
+
+    if (ws == NULL) return ;
+    cpl_free(ws->mask);
+    cpl_free(ws->ycen);
+    cpl_free(ws->ycen_offset);
+    for (i=0; i<ws->swath; i++) cpl_polynomial_delete(ws->slitcurves[i]);
+    cpl_free(ws->slitcurves);
+    cpl_free(ws->sP_old);
+    cpl_free(ws->l_Aij);
+    cpl_free(ws->p_Aij);
+    cpl_free(ws->l_bj);
+    cpl_free(ws->p_bj);
+    cpl_free(ws->loc);
+    cpl_image_delete(ws->img_mad);
+    cr2res_extract_zeta_tensor_delete(ws->zeta);
+    cpl_free(ws);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the strided view of a swath inside a rectified order
+  @param    img_rect    The rectified order (CPL_TYPE_DOUBLE)
+  @param    err_rect    The rectified order errors (CPL_TYPE_DOUBLE)
+  @param    sw_start    First column of the swath (0 based)
+  @param    view        [out] the swath view
+  @return   0 if ok, -1 otherwise
+
+  The view points into the pixel buffers of the images, no data is
+  copied. It is valid as long as the images are neither modified nor
+  deleted. The bad pixels are the ones of img_rect.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_swath_view(
+        const cpl_image     *   img_rect,
+        const cpl_image     *   err_rect,
+        int                     sw_start,
+        swath_view          *   view)
+{
+    const cpl_mask  *   bpm ;
+    const double    *   img ;
+    const double    *   err ;
+
+    /* Check Entries */
+    if (img_rect == NULL || err_rect == NULL || view == NULL) return -1 ;
+    if (sw_start < 0 || sw_start >= cpl_image_get_size_x(img_rect)) return -1;
+    if (cpl_image_get_size_x(err_rect) != cpl_image_get_size_x(img_rect))
+        return -1 ;
+
+    img = cpl_image_get_data_double_const(img_rect) ;
+    err = cpl_image_get_data_double_const(err_rect) ;
+    if (img == NULL || err == NULL) return -1 ;
+
+    view->stride = cpl_image_get_size_x(img_rect) ;
+    view->img = img + sw_start ;
+    view->err = err + sw_start ;
+    bpm = cpl_image_get_bpm_const(img_rect) ;
+    view->bpm = bpm == NULL ? NULL : cpl_mask_get_data_const(bpm) + sw_start ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Create the extraction mask of a swath
+  @param    view    The swath view
+  @param    ncols   Swath width in pixels
+  @param    nrows   Swath height in pixels
+  @param    mask    [out] 1 for good, 0 for bad pixels [nrows][ncols]
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_swath_mask(
+        const swath_view    *   view,
+        int                     ncols,
+        int                     nrows,
+        int                 *   mask)
+{
+    const cpl_binary    *   bpm_row ;
+    int                     x, y ;
+
+    if (view->bpm == NULL) {
+        for (x = 0; x < ncols * nrows; x++) mask[x] = 1;
+        return ;
+    }
+    for (y = 0; y < nrows; y++) {
+        bpm_row = view->bpm + (cpl_size)y * view->stride ;
+        for (x = 0; x < ncols; x++)
+            mask[y * ncols + x] = bpm_row[x] == CPL_BINARY_0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Flag the bad pixels of a rectified order for the extraction
+  @param    img_rect    The rectified order (CPL_TYPE_DOUBLE)
+  @param    err_rect    The rectified order errors (CPL_TYPE_DOUBLE)
+  @return   0 if ok, -1 otherwise
 
-        /*
-        Handling partial subpixels cut by detector pixel rows is again tricky. Here we have three
-        cases (mostly because of the decision to assume that we always have osample+1 subpixels
-        per one detector pixel). Here d1 is the fraction of the subpixel iy1 inside detector pixel y.
-        d2 is then the fraction of subpixel iy2 inside detector pixel y. By definition d1+d2==step.
-        Case 1: ycen falls on the top boundary of each detector pixel (ycen == 1). Here we conclude
-                that the first subpixel is fully contained inside pixel y and d1 is set to step.
-        Case 2: ycen falls on the bottom boundary of each detector pixel (ycen == 0). Here we conclude
-                that the first subpixel is totally outside of pixel y and d1 is set to 0.
-        Case 3: ycen falls inside of each pixel (0>ycen>1). In this case d1 is set to the fraction of
-                the first step contained inside of each pixel.
-        And BTW, this also means that central line coinsides with the upper boundary of subpixel iy2
-        when the y loop reaches pixel y_lower_lim. In other words:
+  The curved slit decomposition does not like NANs. The bad or NAN pixels
+  are set to -DBL_MAX, to make sure they are rejected in the extraction,
+  and flagged in the bad pixel mask of img_rect. Their errors, and the
+  NAN errors, are set to 1 instead of 0 to avoid divisions by 0.
+  This is done once for the whole order, the swaths are then used in
+  place with cr2res_extract_swath_view().
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_reject_bad(
+        cpl_image           *   img_rect,
+        cpl_image           *   err_rect)
+{
+    const cpl_mask  *   err_bpm ;
+    const cpl_binary *  ebpm ;
+    cpl_binary      *   ibpm ;
+    double          *   img ;
+    double          *   err ;
+    cpl_size            i, npix ;
 
-        dy=(iy-(y_lower_lim+ycen[x])*osample)*step-0.5*step
-        */
+    /* Check Entries */
+    if (img_rect == NULL || err_rect == NULL) return -1 ;
+    npix = cpl_image_get_size_x(img_rect) * cpl_image_get_size_y(img_rect) ;
+    if (cpl_image_get_size_x(err_rect) * cpl_image_get_size_y(err_rect)
+            != npix) return -1 ;
+    img = cpl_image_get_data_double(img_rect) ;
+    err = cpl_image_get_data_double(err_rect) ;
+    if (img == NULL || err == NULL) return -1 ;
+
+    ibpm = cpl_mask_get_data(cpl_image_get_bpm(img_rect)) ;
+    err_bpm = cpl_image_get_bpm_const(err_rect) ;
+    ebpm = err_bpm == NULL ? NULL : cpl_mask_get_data_const(err_bpm) ;
+
+    for (i = 0; i < npix; i++) {
+        if (isnan(err[i]) || (ebpm != NULL && ebpm[i])) err[i] = 1;
+        if (isnan(img[i]) || ibpm[i]) {
+            img[i] = -DBL_MAX;
+            err[i] = 1;
+            ibpm[i] = CPL_BINARY_1;
+        }
+    }
+    return 0 ;
+}
 
-        d1 = fmod(ycen[x], step);
-        if (d1 == 0)
-            d1 = step;
-        d2 = step - d1;
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Decompose one swath of a rectified order with curved slit
+  @param    ws          The workspace of the calling worker
+  @param    g           The trace geometry
+  @param    img_rect    The rectified order, with the bad pixels flagged by
+                        cr2res_extract_slitdec_reject_bad()
+  @param    err_rect    The rectified order errors
+  @param    slit_func_in    The input slit_func or NULL
+  @param    sL_guess    The starting guess of the slit function or NULL
+  @param    smooth_slit smoothing along slit
+  @param    smooth_spec smoothing along spectrum
+  @param    swath_nb    Swath number
+  @param    spec_sw     [out] the swath spectrum
+  @param    unc_sw      [out] the swath spectrum uncertainties [swath]
+  @param    slitfu_sw   [out] the swath slit function [ny]
+  @param    model_sw    [out] the swath model [height][swath]
+  @param    niter       [out] the number of iterations, or NULL
+  @return   0 if ok, 1 if the decomposition did not converge, -1 if the
+            swath failed
+
+  Only reads the shared inputs, so different swaths can be solved
+  concurrently as long as each worker has its own workspace.
+  The zeta tensors cached in the geometry are used if available,
+  otherwise they are computed in the workspace.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_slitdec_curved_swath(
+        slitdec_workspace       *   ws,
+        const trace_geometry    *   g,
+        const cpl_image         *   img_rect,
+        const cpl_image         *   err_rect,
+        const double            *   slit_func_in,
+        const double            *   sL_guess,
+        double                      smooth_slit,
+        double                      smooth_spec,
+        int                         swath_nb,
+        cpl_vector              **  spec_sw,
+        double                  *   unc_sw,
+        double                  *   slitfu_sw,
+        double                  *   model_sw,
+        int                     *   niter)
+{
+    cpl_image       *   img_tmp;
+    cpl_vector      *   spec_tmp;
+    cpl_vector      *   tmp_vec;
+    char            *   path;
+    const zeta_tensor   *   zeta;
+    swath_view          view;
+    int                 j, y_lower_limit, sw_start, swath, height, oversample,
+                        converged;
 
-        /*
-        The final hurdle for 2D slit decomposition is to construct two 3D reference tensors. We proceed
-        similar to 1D case except that now each iy subpixel can be shifted left or right following
-        the curvature of the slit image on the detector. We assume for now that each subpixel is
-        exactly 1 detector pixel wide. This may not be exactly true if the curvature changes accross
-        the focal plane but will deal with it when the necessity will become apparent. For now we
-        just assume that a shift delta the weight w assigned to subpixel iy is divided between
-        ix1=int(delta) and ix2=int(delta)+signum(delta) as (1-|delta-ix1|)*w and |delta-ix1|*w.
+    /* Initialise */
+    swath = g->swath;
+    height = g->height;
+    oversample = g->oversample;
+    sw_start = cpl_vector_get(g->bins_begin, swath_nb);
+    y_lower_limit = height / 2;
+
+    /* Start from a clean bad pixel state */
+    cpl_image_accept_all(ws->img_mad);
+
+    /* The swath is used in place, the bad pixels of the rectified order */
+    /* are already flagged by cr2res_extract_slitdec_reject_bad() */
+    if (cr2res_extract_swath_view(img_rect, err_rect, sw_start, &view)) {
+        cpl_msg_error(__func__, "Cannot access swath %d", swath_nb);
+        cpl_error_reset();
+        return -1 ;
+    }
+    // The mask value is inverted for the extraction
+    // 1 for good pixel and 0 for bad pixel
+    cr2res_extract_swath_mask(&view, swath, height, ws->mask);
+
+    for (j=0; j< height * swath; j++) model_sw[j] = 0;
+    // First guess for the spectrum, the bad pixels are not used
+    img_tmp = cpl_image_collapse_window_create(img_rect, sw_start + 1, 1,
+            sw_start + swath, height, 0);
+    spec_tmp = cpl_vector_new_from_image_row(img_tmp, 1);
+    *spec_sw = cpl_vector_filter_median_create(spec_tmp, 1);
+    cpl_vector_delete(spec_tmp);
+    cpl_image_delete(img_tmp);
+    if (*spec_sw == NULL) {
+        cpl_msg_error(__func__, "Cannot compute the initial guess of swath %d",
+                swath_nb);
+        cpl_error_reset();
+        return -1 ;
+    }
 
-        The curvature is given by a quadratic polynomial evaluated from an approximation for column
-        x: delta = PSF_curve[x][0] + PSF_curve[x][1] * (y-yc[x]) + PSF_curve[x][2] * (y-yc[x])^2.
-        It looks easy except that y and yc are set in the global detector coordinate system rather than
-        in the shifted and cropped swath passed to slit_func_2d. One possible solution I will try here
-        is to modify PSF_curve before the call such as:
-        delta = PSF_curve'[x][0] + PSF_curve'[x][1] * (y'-ycen[x]) + PSF_curve'[x][2] * (y'-ycen[x])^2
-        where y' = y - floor(yc).
-        */
+    /* Geometry of the swath */
+    cr2res_extract_geometry_swath(g, swath_nb, ws->ycen, ws->ycen_offset,
+            ws->slitcurves);
+    if (g->zeta != NULL) {
+        zeta = g->zeta[swath_nb];
+    } else {
+        cr2res_extract_zeta_tensor(swath, height, ws->ycen, ws->ycen_offset,
+                y_lower_limit, oversample, ws->slitcurves, ws->zeta);
+        zeta = ws->zeta;
+    }
 
-        /* Define initial distance from ycen       */
-        /* It is given by the center of the first  */
-        /* subpixel falling into pixel y_lower_lim */
-        dy = ycen[x] - floor((y_lower_lim + ycen[x]) / step) * step - step;
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        img_tmp = cpl_image_wrap_int(swath, height, ws->mask);
+        cpl_image_save(img_tmp, "debug_mask_before_sw.fits", CPL_TYPE_INT,
+                NULL, CPL_IO_CREATE);
+        cpl_image_unwrap(img_tmp);
 
-        /*
-        Now we go detector pixels x and y incrementing subpixels looking for their controibutions
-        to the current and adjacent pixels. Note that the curvature/tilt of the projected slit
-        image could be so large that subpixel iy may no contribute to column x at all. On the
-        other hand, subpixels around ycen by definition must contribute to pixel x,y. 
-        3rd index in xi refers corners of pixel xx,y: 0:LL, 1:LR, 2:UL, 3:UR.
-        */
-        for (y = 0; y < nrows; y++) {
-            iy1 += osample; // Bottom subpixel falling in row y
-            iy2 += osample; // Top subpixel falling in row y
-            dy -= step;
-            for (iy = iy1; iy <= iy2; iy++) {
-                if (iy == iy1)      w = d1;
-                else if (iy == iy2) w = d2;
-                else                w = step;
-                dy += step;
-                delta = cpl_polynomial_eval_1d(slitcurves[x], dy - ycen[x], NULL);
-                ix1 = delta;
-                ix2 = ix1 + signum(delta);
+        cpl_vector_save(*spec_sw, "debug_spc_initial_guess.fits",
+                CPL_TYPE_DOUBLE, NULL, CPL_IO_CREATE);
+    }
+    /* Finally ready to call the slit-decomp */
+    converged = cr2res_extract_slit_func_curved(swath, height, oversample,
+            view.img, view.err, view.stride, ws->mask, ws->ycen,
+            ws->ycen_offset, y_lower_limit, ws->slitcurves, g->delta_x,
+            slitfu_sw, cpl_vector_get_data(*spec_sw), model_sw, unc_sw,
+            smooth_spec, smooth_slit, 1e-5, 10, slit_func_in, sL_guess,
+            niter, ws->sP_old,
+            ws->l_Aij, ws->p_Aij, ws->l_bj, ws->p_bj, ws->loc, ws->img_mad,
+            zeta) == 0;
+    if (cpl_error_get_code() != CPL_ERROR_NONE) {
+        cpl_msg_error(__func__, "Swath %d failed: %s", swath_nb,
+                cpl_error_get_message());
+        cpl_error_reset();
+        return -1 ;
+    }
 
-                /* Three cases: subpixel on the bottom boundary of row y, intermediate subpixels and top boundary */
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        path = cpl_sprintf("debug_spc_%i.fits", swath_nb);
+        cpl_vector_save(*spec_sw, path , CPL_TYPE_DOUBLE, NULL,
+                CPL_IO_CREATE);
+        cpl_free(path);
+
+        path = cpl_sprintf("debug_mask_%i.fits", swath_nb);
+        img_tmp = cpl_image_wrap_int(swath, height, ws->mask);
+        cpl_image_save(img_tmp, path, CPL_TYPE_INT, NULL, CPL_IO_CREATE);
+        cpl_free(path);
+        cpl_image_unwrap(img_tmp);
+
+        tmp_vec = cpl_vector_wrap(swath, ws->ycen);
+        path = cpl_sprintf("debug_ycen_%i.fits", swath_nb);
+        cpl_vector_save(tmp_vec, path, CPL_TYPE_DOUBLE, NULL,
+                CPL_IO_CREATE);
+        cpl_vector_unwrap(tmp_vec);
+        cpl_free(path);
+
+        tmp_vec = cpl_vector_wrap(oversample * (height + 1) + 1, slitfu_sw);
+        path = cpl_sprintf("debug_slitfu_%i.fits", swath_nb);
+        cpl_vector_save(tmp_vec, path, CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+        cpl_vector_unwrap(tmp_vec);
+        cpl_free(path);
 
-                if (iy == iy1) /* Case A: Subpixel iy is entering detector row y */
-                {
-                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x  */
-                    {
-                        if (x + ix1 >= 0 && x + ix2 < ncols)
-                        {
-                            xx = x + ix1; /* Upper right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 3)].x = xx;
-                            xi[xi_index(x, iy, 3)].y = yy;
-                            xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 3)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix2; /* Upper left corner of subpixel iy */
-                            // This offset is required because the iy subpixel
-                            // is going to contribute to the yy row in xx column
-                            // of detector pixels where yy and y are in the same
-                            // row. In the packed array this is not necessarily true.
-                            // Instead, what we know is that:
-                            // y+ycen_offset[x] == yy+ycen_offset[xx]
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
+        path = cpl_sprintf("debug_model_%i.fits", swath_nb);
+        img_tmp = cpl_image_wrap_double(swath, height, model_sw);
+        cpl_image_save(img_tmp, path, CPL_TYPE_DOUBLE,
+                NULL, CPL_IO_CREATE);
+        cpl_image_unwrap(img_tmp);
+        cpl_free(path);
+
+        path = cpl_sprintf("debug_img_sw_%i.fits", swath_nb);
+        img_tmp = cpl_image_extract(img_rect, sw_start + 1, 1,
+                sw_start + swath, height);
+        cpl_image_save(img_tmp, path, CPL_TYPE_DOUBLE, NULL,
+                CPL_IO_CREATE);
+        cpl_image_delete(img_tmp);
+        cpl_free(path);
 
-                            xi[xi_index(x, iy, 2)].x = xx;
-                            xi[xi_index(x, iy, 2)].y = yy;
-                            xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 2)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
-                    {
-                        if (x + ix2 >= 0 && x + ix1 < ncols)
-                        {
-                            xx = x + ix2; /* Upper left corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 2)].x = xx;
-                            xi[xi_index(x, iy, 2)].y = yy;
-                            xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 2)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix1; /* Upper right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 3)].x = xx;
-                            xi[xi_index(x, iy, 3)].y = yy;
-                            xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 3)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (x + ix1 >= 0 && x + ix1 < ncols)
-                        {
-                            xx = x + ix1; /* Subpixel iy stays inside column x */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 2)].x = xx;
-                            xi[xi_index(x, iy, 2)].y = yy;
-                            xi[xi_index(x, iy, 2)].w = w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                }
-                else if (iy == iy2) /* Case C: Subpixel iy is leaving detector row y */
-                {
-                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x */
-                    {
-                        if (x + ix1 >= 0 && x + ix2 < ncols)
-                        {
-                            xx = x + ix1; /* Bottom right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 1)].x = xx;
-                            xi[xi_index(x, iy, 1)].y = yy;
-                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix2; /* Bottom left corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
-                    {
-                        if (x + ix2 >= 0 && x + ix1 < ncols)
-                        {
-                            xx = x + ix2; /* Bottom left corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix1; /* Bottom right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 1)].x = xx;
-                            xi[xi_index(x, iy, 1)].y = yy;
-                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else /* Subpixel iy stays inside column x        */
-                    {
-                        if (x + ix1 >= 0 && x + ix1 < ncols)
-                        {
-                            xx = x + ix1;
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                }
-                else /* CASE B: Subpixel iy is fully inside detector row y */
-                {
-                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x      */
-                    {
-                        if (x + ix1 >= 0 && x + ix2 < ncols)
-                        {
-                            xx = x + ix1; /* Bottom right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 1)].x = xx;
-                            xi[xi_index(x, iy, 1)].y = yy;
-                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix2; /* Bottom left corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
-                    {
-                        if (x + ix2 >= 0 && x + ix1 < ncols)
-                        {
-                            xx = x + ix2; /* Bottom right corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 1)].x = xx;
-                            xi[xi_index(x, iy, 1)].y = yy;
-                            xi[xi_index(x, iy, 1)].w = fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                            xx = x + ix1; /* Bottom left corner of subpixel iy */
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = w - fabs(delta - ix1) * w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                    else /* Subpixel iy stays inside column x */
-                    {
-                        if (x + ix2 >= 0 && x + ix2 < ncols)
-                        {
-                            xx = x + ix2;
-                            yy = y + ycen_offset[x] - ycen_offset[xx];
-                            xi[xi_index(x, iy, 0)].x = xx;
-                            xi[xi_index(x, iy, 0)].y = yy;
-                            xi[xi_index(x, iy, 0)].w = w;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
-                            {
-                                m = m_zeta[mzeta_index(xx, yy)];
-                                zeta[zeta_index(xx, yy, m)].x = x;
-                                zeta[zeta_index(xx, yy, m)].iy = iy;
-                                zeta[zeta_index(xx, yy, m)].w = w;
-                                m_zeta[mzeta_index(xx, yy)]++;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        path = cpl_sprintf("debug_img_mad_%i.fits", swath_nb);
+        cpl_image_save(ws->img_mad, path,  CPL_TYPE_DOUBLE, NULL,
+                CPL_IO_CREATE);
+        cpl_free(path);
     }
-    return 0;
+    return converged ? 0 : 1 ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -3386,8 +4945,9 @@ static int cr2res_extract_xi_zeta_tensors(
   @param ncols      Swath width in pixels
   @param nrows      Extraction slit height in pixels
   @param osample    Subpixel ovsersampling factor
-  @param im         Image to be decomposed [nrows][ncols]
-  @param pix_unc
+  @param im         Image to be decomposed [nrows][stride]
+  @param pix_unc    Uncertainties of the image pixels [nrows][stride]
+  @param stride     Row stride of im and pix_unc in pixels (>= ncols)
   @param mask       Initial and final mask for the swath [nrows][ncols]
   @param ycen       Order centre line offset from pixel row boundary [ncols]
   @param ycen_offset    Order image column shift     [ncols]
@@ -3404,15 +4964,28 @@ static int cr2res_extract_xi_zeta_tensors(
   @param lambda_sL  Smoothing parameter for the slit function, usually>0
   @param sP_stop
   @param maxiter
-  @return
+  @param slit_func_in   Fixed slit function [ny], or NULL
+  @param sL_guess   Starting guess of the slit function [ny], or NULL
+  @param niter      [out] the number of iterations, or NULL
+  @param loc        Scratch memory [max(ny, ncols)]
+  @param zeta       Convolution tensor of the swath
+  @return   0 if converged, 1 if maxiter was reached, -1 if the spectrum
+            or the slit function is not finite
+
+  The tensor is computed beforehand with cr2res_extract_zeta_tensor().
+  The iterations stop when the cost changes by less than sP_stop.
+  With sL_guess, the first iteration only solves for the spectrum, and
+  the iterations also stop once the spectrum is within sP_stop (relative)
+  of its converged value, see cr2res_extract_slitdec_converged().
  */
 /*----------------------------------------------------------------------------*/
 static int cr2res_extract_slit_func_curved(
         int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         int     *   ycen_offset,
@@ -3428,37 +5001,45 @@ static int cr2res_extract_slit_func_curved(
         double      sP_stop,
         int         maxiter,
         const double  *   slit_func_in,
+        const double  *   sL_guess,
+        int       *  niter,
         double    *  sP_old,
         double    *  l_Aij,
         double    *  p_Aij,
         double    *  l_bj,
         double    *  p_bj,
+        double    *  loc,
         cpl_image *  img_mad,
-        xi_ref    *  xi,
-        zeta_ref  *  zeta,
-        int       *  m_zeta)
+        const zeta_tensor * zeta)
 {
-    int         x, xx, xxx, y, yy, iy, jy, n, m, ny, i, nx;
-    double      sum, norm, dev, lambda, diag_tot, ww, www, sP_change, sP_max;
-    double      tmp, mad, median, cost, cost_old, std;
-    int         info, iter, isum;
+    int         x, xx, y, iy, n, m, ny, nx, ml, mp;
+    double      sum, norm, dev, lambda, diag_tot, ww, sP_change, sP_max;
+    double      tmp, mad, median, cost, cost_old, std, sP_change_prev;
+    double  *   mad_data;
+    cpl_binary * mad_bpm;
+    int         info, iter, isum, converged;
 
+    /* The residuals are written in place, only the window is used */
+    mad_data = cpl_image_get_data_double(img_mad);
+    mad_bpm = cpl_mask_get_data(cpl_image_get_bpm(img_mad));
 
     /* The size of the sL array. */
     /* Extra osample is because ycen can be between 0 and 1. */
     ny = osample * (nrows + 1) + 1;
     nx = 4 * delta_x + 1;
     if(nx < 3) nx = 3;
-
-    i = cr2res_extract_xi_zeta_tensors(ncols, nrows, ny, ycen, ycen_offset,
-            y_lower_lim, osample, slitcurves, xi, zeta, m_zeta);
+    /* Half bandwidths, only the lower half of the bands is stored */
+    ml = 2 * osample;
+    mp = nx / 2;
 
     // If a slit func is given, use that instead of recalculating it
-    if (slit_func_in != NULL){
+    // A guess is only the starting point, and is refined below
+    if (slit_func_in != NULL) sL_guess = NULL;
+    if (slit_func_in != NULL || sL_guess != NULL){
         // Normalize the input just in case
         norm = 0.e0;
         for(iy = 0; iy < ny; iy++) {
-            sL[iy] = slit_func_in[iy];
+            sL[iy] = slit_func_in != NULL ? slit_func_in[iy] : sL_guess[iy];
             norm += sL[iy];
         }
         norm /= osample;
@@ -3468,68 +5049,35 @@ static int cr2res_extract_slit_func_curved(
     /* Loop through sL , sP reconstruction until convergence is reached */
     iter = 0;
     cost = 0;
+    sP_change_prev = -1;
+    converged = 0;
     do {
         cost_old = cost;
-        if (slit_func_in == NULL){
+        if (slit_func_in == NULL && (iter > 0 || sL_guess == NULL)){
             /* Compute slit function sL */
-            /* Prepare the RHS and the matrix */
-            for (iy = 0; iy < ny; iy++) {
-                l_bj[iy] = 0.e0;
-                /* Clean RHS                */
-                for (jy = 0; jy <= 4 * osample; jy++)
-                    l_Aij[iy + ny * jy] = 0.e0;
-            }
             /* Fill in SLE arrays for slit function */
+            cr2res_extract_slitdec_fill_sL(zeta, im, stride, mask, sP, ny, ml, l_Aij,
+                    l_bj, loc);
             diag_tot = 0.e0;
-            for (iy = 0; iy < ny; iy++) {
-                for (x = 0; x < ncols; x++) {
-                    for (n = 0; n < 4; n++) {
-                        ww = xi[xi_index(x,iy,n)].w;
-                        if (ww > 0) {
-                            xx = xi[xi_index(x,iy,n)].x;
-                            yy = xi[xi_index(x,iy,n)].y;
-                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows) {
-                                if (m_zeta[mzeta_index(xx,yy)] > 0){
-                                    for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
-                                        xxx = zeta[zeta_index(xx,yy,m)].x;
-                                        jy = zeta[zeta_index(xx,yy,m)].iy;
-                                        www = zeta[zeta_index(xx,yy,m)].w;
-                                        l_Aij[iy + ny * (jy - iy + 2 * osample)] +=
-                                            sP[xxx] * sP[x] * www * ww * mask[yy *
-                                            ncols + xx];
-                                    }
-                                    l_bj[iy] += im[yy * ncols + xx] * mask[yy * ncols +
-                                        xx] * sP[x] * ww;
-                                }
-                            }
-                        }
-                    }
-                }
-                diag_tot += l_Aij[iy + ny * 2 * osample];
-            }
+            for (iy = 0; iy < ny; iy++) diag_tot += l_Aij[iy * (ml + 1) + ml];
             /* Scale regularization parameters */
             lambda = lambda_sL * diag_tot / ny;
             /* Add regularization parts for the SLE matrix */
             /* Main diagonal  */
-            l_Aij[ny * 2 * osample] += lambda;
-            /* Upper diagonal */
-            l_Aij[ny * (2 * osample + 1)] -= lambda;
+            l_Aij[ml] += lambda;
             for (iy = 1; iy < ny - 1; iy++) {
                 /* Lower diagonal */
-                l_Aij[iy + ny * (2 * osample - 1)] -= lambda;
+                l_Aij[iy * (ml + 1) + ml - 1] -= lambda;
                 /* Main diagonal  */
-                l_Aij[iy + ny * 2 * osample] += lambda * 2.e0;
-                /* Upper diagonal */
-                l_Aij[iy + ny * (2 * osample + 1)] -= lambda;
+                l_Aij[iy * (ml + 1) + ml] += lambda * 2.e0;
             }
             /* Lower diagonal */
-            l_Aij[ny - 1 + ny * (2 * osample - 1)] -= lambda;
+            l_Aij[(ny - 1) * (ml + 1) + ml - 1] -= lambda;
             /* Main diagonal  */
-            l_Aij[ny - 1 + ny * 2 * osample] += lambda;
+            l_Aij[(ny - 1) * (ml + 1) + ml] += lambda;
 
             /* Solve the system of equations */
-            info = cr2res_extract_slitdec_bandsol(l_Aij, l_bj, ny,
-                4 * osample + 1, lambda);
+            info = cr2res_extract_slitdec_bandsol_spd(l_Aij, l_bj, ny, ml);
             if (info) cpl_msg_error(__func__, "info(sL)=%d\n", info);
 
             /* Normalize the slit function */
@@ -3543,36 +5091,8 @@ static int cr2res_extract_slit_func_curved(
         }
 
         /*  Compute spectrum sP */
-        for (x = 0; x < ncols; x++) {
-            for (xx = 0; xx < nx; xx++) p_Aij[xx * ncols + x] = 0.;
-            p_bj[x] = 0;
-        }
-        for (x = 0; x < ncols; x++) {
-            for (iy = 0; iy < ny; iy++) {
-                for (n=0; n < 4; n++) {
-                    ww = xi[xi_index(x,iy,n)].w;
-                    if (ww > 0) {
-                        xx = xi[xi_index(x,iy,n)].x;
-                        yy = xi[xi_index(x,iy,n)].y;
-                        if (xx >= 0 && 
-                            xx < ncols && yy >= 0 && yy < nrows) {
-                            if (m_zeta[mzeta_index(xx,yy)] > 0){
-                                for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
-                                    xxx = zeta[zeta_index(xx,yy,m)].x;
-                                    jy = zeta[zeta_index(xx,yy,m)].iy;
-                                    www = zeta[zeta_index(xx,yy,m)].w;
-                                    p_Aij[x + ncols * (xxx - x + 2 * delta_x)] += 
-                                        sL[jy] * sL[iy] * www * ww * 
-                                        mask[yy * ncols + xx];
-                                }
-                                p_bj[x] += im[yy * ncols + xx] * mask[yy * ncols +
-                                    xx] * sL[iy] * ww;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        cr2res_extract_slitdec_fill_sP(zeta, im, stride, mask, sL, mp, p_Aij, p_bj,
+                loc);
 
         for (x = 0; x < ncols; x++) sP_old[x] = sP[x];
         lambda = 1;
@@ -3583,48 +5103,33 @@ static int cr2res_extract_slit_func_curved(
             }
             norm /= ncols;
             lambda = lambda_sP * norm; /* Scale regularization parameter */
-            p_Aij[ncols * (2 * delta_x)] += lambda; /* Main diagonal  */
-            p_Aij[ncols * (2 * delta_x + 1)] -= lambda; /* Upper diagonal */
+            p_Aij[mp] += lambda; /* Main diagonal  */
             for (x = 1; x < ncols - 1; x++) {
                 /* Lower diagonal */
-                p_Aij[x + ncols * (2 * delta_x - 1)] -= lambda;
+                p_Aij[x * (mp + 1) + mp - 1] -= lambda;
                 /* Main diagonal  */
-                p_Aij[x + ncols * (2 * delta_x)] += lambda * 2.e0;
-                /* Upper diagonal */
-                p_Aij[x + ncols * (2 * delta_x + 1)] -= lambda;
+                p_Aij[x * (mp + 1) + mp] += lambda * 2.e0;
             }
             /* Lower diagonal */
-            p_Aij[ncols - 1 + ncols * (2 * delta_x - 1)] -= lambda;
+            p_Aij[(ncols - 1) * (mp + 1) + mp - 1] -= lambda;
             /* Main diagonal  */
-            p_Aij[ncols - 1 + ncols * (2 * delta_x)] += lambda;
+            p_Aij[(ncols - 1) * (mp + 1) + mp] += lambda;
         }
 
         /* Solve the system of equations */
-        info = cr2res_extract_slitdec_bandsol(p_Aij, p_bj, ncols, nx, lambda);
+        info = cr2res_extract_slitdec_bandsol_spd(p_Aij, p_bj, ncols, mp);
         if (info) cpl_msg_error(__func__, "info(sP)=%d\n", info);
         for (x = 0; x < ncols; x++) sP[x] = p_bj[x];
 
         if ((isnan(sP[0]) || (sP[ncols/2] == 0)) 
                 && (cpl_msg_get_level() == CPL_MSG_DEBUG) ){
-            debug_output(ncols, nrows, osample, im, pix_unc, mask, ycen,
+            debug_output(ncols, nrows, osample, im, pix_unc, stride, mask, ycen,
                 ycen_offset, y_lower_lim, slitcurves);
             cpl_msg_error(__func__, "Swath failed");
         }
 
         /* Compute the model */
-        for (y = 0; y < nrows * ncols; y++) {
-                model[y] = 0.;
-        }
-        for (y = 0; y < nrows; y++) {
-            for (x = 0; x < ncols; x++) {
-                for (m = 0; m < m_zeta[mzeta_index(x,y)]; m++) {
-                    xx = zeta[zeta_index(x,y,m)].x;
-                    iy = zeta[zeta_index(x,y,m)].iy;
-                    ww = zeta[zeta_index(x,y,m)].w;
-                    model[y * ncols + x] += sP[xx] * sL[iy] * ww;
-                }
-            }
-        }
+        cr2res_extract_slitdec_model(zeta, sP, sL, model);
         /* Compare model and data */
         // We use a simple standard deviation here (which is NOT robust to
         // outliers), since it is less strict than a more robust measurement
@@ -3641,8 +5146,8 @@ static int cr2res_extract_slit_func_curved(
             {
                 if (mask[y * ncols + x])
                 {
-                    tmp = model[y * ncols + x] - im[y * ncols + x];
-                    tmp /= max(pix_unc[y * ncols + x], 1);
+                    tmp = model[y * ncols + x] - im[y * stride + x];
+                    tmp /= max(pix_unc[y * stride + x], 1);
                     cost += tmp * tmp;
                     isum++;
                 }
@@ -3652,10 +5157,11 @@ static int cr2res_extract_slit_func_curved(
 
         for (y = 0; y < nrows; y++) {
             for (x = delta_x; x < ncols - delta_x; x++) {
-                cpl_image_set(img_mad, x+1, y+1, (model[y * ncols + x] -
-                        im[y * ncols + x]));
-                if ((mask[y * ncols + x] == 0) | (im[y * ncols + x] == 0))
-                    cpl_image_reject(img_mad, x+1, y+1);
+                mad_data[y * ncols + x] = model[y * ncols + x] -
+                        im[y * stride + x];
+                mad_bpm[y * ncols + x] = (mask[y * ncols + x] == 0) |
+                        (im[y * stride + x] == 0) ? CPL_BINARY_1 :
+                        CPL_BINARY_0;
             }
         }
         // Ignore the outer delta_x pixels on each side, as they are unreliable
@@ -3678,7 +5184,7 @@ static int cr2res_extract_slit_func_curved(
             for (x = 0; x < ncols; x++) {
                 // We order it like this, to account for NaN values
                 // They evaluate to False, and should be masked
-                if (fabs(model[y * ncols + x] - im[y * ncols + x]) < 40. * mad)
+                if (fabs(model[y * ncols + x] - im[y * stride + x]) < 40. * mad)
                     mask[y * ncols + x] = 1;
                 else
                     mask[y * ncols + x] = 0;
@@ -3702,9 +5208,15 @@ static int cr2res_extract_slit_func_curved(
             iter, mad, cost, sP_change);
 
         iter++;
-    } while (iter == 1 || (iter < maxiter 
-                        && fabs(cost - cost_old) > sP_stop)
-                        );//sP_change > sP_stop * sP_max));
+        // Starting from a guess, the spectrum is usually already
+        // converged when the cost is still settling
+        if (sL_guess != NULL)
+            converged = cr2res_extract_slitdec_converged(sP_change,
+                    &sP_change_prev, sP_stop * sP_max);
+        if (!converged && iter > 1)
+            converged = fabs(cost - cost_old) <= sP_stop;
+    } while (!converged && iter < maxiter);
+    if (niter != NULL) *niter = iter;
 
     /* Uncertainty estimate */
     for (x = 0; x < ncols; x++) {
@@ -3714,15 +5226,16 @@ static int cr2res_extract_slit_func_curved(
     for (y = 0; y < nrows; y++) {
         for (x = 0; x < ncols; x++) {
             // Loop through all pixels contributing to x,y
-            for (m = 0; m < m_zeta[mzeta_index(x,y)]; m++) {
+            n = (y * ncols + x) * zeta->mmax;
+            for (m = 0; m < zeta->nb[y * ncols + x]; m++) {
                 if (mask[y * ncols + x]){
-                    xx = zeta[zeta_index(x,y,m)].x;
-                    iy = zeta[zeta_index(x,y,m)].iy;
-                    ww = zeta[zeta_index(x,y,m)].w;
-                    unc[xx] += (im[y * ncols + x] - model[y * ncols + x]) *
-                        (im[y * ncols + x] - model[y * ncols + x]) * ww ;
-                    unc[xx] += pix_unc[y * ncols + x] * 
-                                pix_unc[y * ncols + x] * ww ;
+                    xx = zeta->x[n + m];
+                    ww = zeta->wf != NULL ? zeta->wf[n + m] :
+                        zeta->w[n + m];
+                    unc[xx] += (im[y * stride + x] - model[y * ncols + x]) *
+                        (im[y * stride + x] - model[y * ncols + x]) * ww ;
+                    unc[xx] += pix_unc[y * stride + x] * 
+                                pix_unc[y * stride + x] * ww ;
                     // Norm
                     p_bj[xx] += ww;
                 }
@@ -3732,7 +5245,10 @@ static int cr2res_extract_slit_func_curved(
     for (x = 0; x < ncols; x++) {
         unc[x] = sqrt(unc[x] / p_bj[x] * nrows);
     }
-    return 0;
+
+    for (x = 0; x < ncols; x++) if (!isfinite(sP[x])) return -1;
+    for (iy = 0; iy < ny; iy++) if (!isfinite(sL[iy])) return -1;
+    return converged ? 0 : 1;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -3810,6 +5326,106 @@ int cr2res_extract_slitdec_bandsol(
     return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Solve a symmetric positive definite band system in place
+  @param    ab  lower half of the band, row major [n][m+1], overwritten
+  @param    r   array of RHS of size n, overwritten with the solution
+  @param    n   number of equations
+  @param    m   number of sub-diagonals (1 for tri-diagonal system)
+  @return   0 on success, -1 on incorrect size and -4 on degenerate matrix
+
+  Only the lower half of the symmetric band is stored and used. Row i
+  holds A(i,i-m) .. A(i,i) in ab[i*(m+1)] .. ab[i*(m+1)+m], the diagonal
+  is the last element of each row and the first m elements of row 0
+  (and m-i of row i < m) are not used. For m=2:
+                    / 0 0 X \
+                    | 0 X X |
+             ab =   | X X X |
+                    | X X X |
+                    \ X X X /
+
+  The matrix is factorised as L D L^T, so no pivoting and no square roots
+  are needed. The rows of L are contiguous, all inner loops are short
+  unit stride dot products. The caller owns ab and r, the solver does not
+  allocate any memory and they can be reused from one call to the next.
+  Pivots that are not positive (e.g. rows without any data) are replaced
+  by a tiny value relative to the largest diagonal element.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_extract_slitdec_bandsol_spd(
+        double  *   ab,
+        double  *   r,
+        int         n,
+        int         m)
+{
+    double      *   ri ;
+    double      *   rj ;
+    double          s, u, d, dmax, tiny ;
+    int             i, j, k, k0, w ;
+
+    if (ab == NULL || r == NULL || n < 1 || m < 0) return -1 ;
+    w = m + 1 ;
+
+    /* Scale of the pivots */
+    dmax = 0.0 ;
+    for (i=0 ; i<n ; i++) if (fabs(ab[i*w+m]) > dmax) dmax = fabs(ab[i*w+m]);
+    if (dmax == 0.0) return -4 ;
+    tiny = n * DBL_EPSILON * dmax ;
+
+    /* Factorisation, row by row: A(i,j) = sum_k L(i,k) D(k) L(j,k) */
+    for (i=0 ; i<n ; i++) {
+        ri = ab + i*w - i + m ;         /* ri[j] is A(i,j)  */
+        k0 = i > m ? i - m : 0 ;
+        d = 0.0 ;
+        for (j=k0 ; j<i ; j++) {
+            rj = ab + j*w - j + m ;     /* rj[k] is L(j,k)  */
+            /* u = A(i,j) - sum_k L(i,k) D(k) L(j,k), ri[k] is L(i,k) D(k) */
+            s = 0.0 ;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s)
+#endif
+            for (k=k0 ; k<j ; k++) s += ri[k] * rj[k] ;
+            u = ri[j] - s ;
+            ri[j] = u ;
+            /* rj[j] is D(j) */
+            d += u * u / rj[j] ;
+        }
+        /* Turn the row into L(i,.) */
+        for (j=k0 ; j<i ; j++) ri[j] /= ab[j*w+m] ;
+        d = ri[i] - d ;
+        if (!(d > tiny)) d = tiny ;
+        ri[i] = d ;
+    }
+
+    /* Forward substitution L y = r */
+    for (i=1 ; i<n ; i++) {
+        ri = ab + i*w - i + m ;
+        k0 = i > m ? i - m : 0 ;
+        s = 0.0 ;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s)
+#endif
+        for (k=k0 ; k<i ; k++) s += ri[k] * r[k] ;
+        r[i] -= s ;
+    }
+
+    /* Diagonal */
+    for (i=0 ; i<n ; i++) r[i] /= ab[i*w+m] ;
+
+    /* Backward substitution L^T x = y */
+    for (i=n-1 ; i>0 ; i--) {
+        ri = ab + i*w - i + m ;
+        k0 = i > m ? i - m : 0 ;
+        u = r[i] ;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+        for (k=k0 ; k<i ; k++) r[k] -= ri[k] * u ;
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief   Adjust the swath width to match the length of detector
@@ -3898,8 +5514,9 @@ static int debug_output(
         int         ncols,
         int         nrows,
         int         osample,
-        double  *   im,
-        double  *   pix_unc,
+        const double  *   im,
+        const double  *   pix_unc,
+        int         stride,
         int     *   mask,
         double  *   ycen,
         int     *   ycen_offset,
@@ -3907,6 +5524,7 @@ static int debug_output(
         cpl_polynomial  ** slitcurves)
 {
     cpl_image * img;
+    cpl_image * unc;
     cpl_vector * vec;
     cpl_propertylist * pl;
 
@@ -3914,20 +5532,26 @@ static int debug_output(
     cpl_propertylist_append_int(pl, "osample", osample);
     cpl_propertylist_append_int(pl, "y_lower_lim", y_lower_lim);
 
-    img = cpl_image_wrap_double(ncols, nrows, im);
+    img = cpl_image_new(ncols, nrows, CPL_TYPE_DOUBLE);
+    unc = cpl_image_new(ncols, nrows, CPL_TYPE_DOUBLE);
+    for (int y = 0; y < nrows; y++) {
+        memcpy(cpl_image_get_data_double(img) + y * ncols, im + y * stride,
+            ncols * sizeof(double));
+        memcpy(cpl_image_get_data_double(unc) + y * ncols,
+            pix_unc + y * stride, ncols * sizeof(double));
+    }
     cpl_image_save(img, "debug_image_at_error.fits", CPL_TYPE_DOUBLE, pl,
         CPL_IO_CREATE);
-    cpl_image_unwrap(img);
+    cpl_image_delete(img);
 
     img = cpl_image_wrap_int(ncols, nrows, mask);
     cpl_image_save(img, "debug_mask_after_error.fits", CPL_TYPE_INT, NULL,
         CPL_IO_CREATE);
     cpl_image_unwrap(img);
 
-    img = cpl_image_wrap_double(ncols, nrows, pix_unc);
-    cpl_image_save(img, "debug_unc_at_error.fits", CPL_TYPE_DOUBLE, NULL,
+    cpl_image_save(unc, "debug_unc_at_error.fits", CPL_TYPE_DOUBLE, NULL,
         CPL_IO_CREATE);
-    cpl_image_unwrap(img);
+    cpl_image_delete(unc);
 
     vec = cpl_vector_wrap(ncols, ycen);
     cpl_vector_save(vec, "debug_ycen_after_error.fits", CPL_TYPE_DOUBLE, NULL,
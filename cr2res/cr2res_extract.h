@@ -39,6 +39,9 @@ typedef enum {
     CR2RES_EXTR_OPT_CURV,
 } cr2res_extr_method ;
 
+/* Image independent extraction geometry of a trace table */
+typedef struct _cr2res_extract_plan_ cr2res_extract_plan ;
+
 /*-----------------------------------------------------------------------------
                                        Prototypes
  -----------------------------------------------------------------------------*/
@@ -55,6 +58,7 @@ int cr2res_extract_traces(
         int                     oversample,
         double                  smooth_slit,
         double                  smooth_spec,
+        int                     nthreads,
         int                     display,
         int                     disp_order_idx,
         int                     disp_trace,
@@ -62,6 +66,42 @@ int cr2res_extract_traces(
         cpl_table           **  slit_func,
         hdrl_image          **  model_master) ;
 
+cr2res_extract_plan * cr2res_extract_plan_new(
+        const cpl_table     *   traces,
+        int                     reduce_order,
+        int                     reduce_trace,
+        cr2res_extr_method      extr_method,
+        int                     extr_height,
+        int                     swath_width,
+        int                     oversample,
+        cpl_size                lenx,
+        cpl_size                leny,
+        int                     cache_tensors) ;
+
+int cr2res_extract_plan_set_warm_start(
+        cr2res_extract_plan *   plan,
+        int                     warm_start) ;
+
+int cr2res_extract_plan_set_single_precision(
+        cr2res_extract_plan *   plan,
+        int                     single) ;
+
+void cr2res_extract_plan_delete(cr2res_extract_plan * plan) ;
+
+int cr2res_extract_plan_apply(
+        const hdrl_image            *   img,
+        const cr2res_extract_plan   *   plan,
+        const cpl_table             *   slit_func_in,
+        double                          smooth_slit,
+        double                          smooth_spec,
+        int                             nthreads,
+        int                             display,
+        int                             disp_order_idx,
+        int                             disp_trace,
+        cpl_table                   **  extracted,
+        cpl_table                   **  slit_func,
+        hdrl_image                  **  model_master) ;
+
 int cr2res_extract_sum_vert(
         const hdrl_image    *   hdrl_in,
         const cpl_table     *   trace_tab,
@@ -171,5 +211,6 @@ cpl_table * cr2res_extract_EXTRACT2D_create(
         const cpl_table *   trace_table) ;
 
 int cr2res_extract_slitdec_bandsol(double *, double *, int, int, double) ;
+int cr2res_extract_slitdec_bandsol_spd(double *, double *, int, int) ;
 
 #endif
@@ -25,8 +25,24 @@
                                    Includes
  -----------------------------------------------------------------------------*/
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <cpl.h>
 
@@ -38,10 +54,155 @@
 #include "cr2res_dfs.h"
 #include "cr2res_pfits.h"
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* Number of files whose extension numbers are remembered */
+#define CR2RES_IO_EXT_CACHE_SIZE    64
+
+/* Sub-second part of the modification time, where the system has it */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+#define CR2RES_IO_MTIME_NSEC(st)    ((long)(st)->st_mtim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMENSEC)
+#define CR2RES_IO_MTIME_NSEC(st)    ((long)(st)->st_mtimensec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+#define CR2RES_IO_MTIME_NSEC(st)    ((long)(st)->st_mtimespec.tv_nsec)
+#else
+#define CR2RES_IO_MTIME_NSEC(st)    0L
+#endif
+
+/* Extension numbers of the detectors of one file */
+typedef struct {
+    char    *   filename ;
+    time_t      mtime ;
+    long        mtime_nsec ;
+    off_t       size ;
+    ino_t       inode ;
+    int         ext_idx[CR2RES_NB_DETECTORS][2] ;   /* [det-1][1-data] */
+} cr2res_io_ext_cache_entry ;
+
+/* FITS blocks and header cards sizes */
+#define CR2RES_IO_FITS_BLOCK        2880
+#define CR2RES_IO_FITS_CARD         80
+
+/* Keywords of one HDU that locate and describe its data */
+typedef struct {
+    int         image ;     /* 1 for the primary or an IMAGE extension */
+    int         bitpix ;
+    int         naxis ;
+    cpl_size    naxes[3] ;
+    cpl_size    npix ;      /* Product of all the NAXISn */
+    cpl_size    pcount ;
+    cpl_size    gcount ;
+    double      bscale ;
+    double      bzero ;
+    int         blank ;     /* 1 if BLANK is set */
+    size_t      data ;      /* Offset of the data in the file */
+} cr2res_io_raw_hdu ;
+
+struct _cr2res_io_raw_ {
+    void                *   map ;       /* Read-only mapping of the file */
+    size_t                  map_size ;
+    const unsigned char *   pixels ;    /* First pixel, big endian */
+    int                     bitpix ;
+    cpl_size                nx ;
+    cpl_size                ny ;
+    double                  bscale ;
+    double                  bzero ;
+} ;
+
+/* Number of products waiting to be written before the recipe blocks */
+#define CR2RES_IO_WRITER_MAX_JOBS   4
+
+typedef enum {
+    CR2RES_IO_JOB_IMAGE,
+    CR2RES_IO_JOB_IMAGELIST,
+    CR2RES_IO_JOB_TABLE
+} cr2res_io_job_type ;
+
+/* A product queued for the writer thread, with copies of its inputs */
+typedef struct _cr2res_io_job_ {
+    cr2res_io_job_type          job_type ;
+    char                    *   filename ;
+    cpl_frameset            *   target ;        /* The recipe frames */
+    cpl_frameset            *   allframes ;     /* Copy, gets the product */
+    cpl_size                    nb_allframes ;
+    cpl_frameset            *   inframes ;
+    const cpl_parameterlist *   parlist ;
+    hdrl_image              *   images[CR2RES_NB_DETECTORS] ;
+    hdrl_imagelist          *   lists[CR2RES_NB_DETECTORS] ;
+    cpl_table               *   tables[CR2RES_NB_DETECTORS] ;
+    cpl_propertylist        *   qc_list ;
+    cpl_propertylist        *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_type                    type ;
+    char                    *   recipe ;
+    char                    *   procatg ;
+    char                    *   protype ;
+    int                         status ;
+    struct _cr2res_io_job_  *   next ;
+} cr2res_io_job ;
+
+/*-----------------------------------------------------------------------------
+                                Static variables
+ -----------------------------------------------------------------------------*/
+
+/* Shared by all threads, only accessed in the cr2res_io_ext_cache section */
+static cr2res_io_ext_cache_entry cr2res_io_ext_cache[CR2RES_IO_EXT_CACHE_SIZE];
+static int cr2res_io_ext_cache_next = 0 ;
+
+#ifdef HAVE_PTHREAD_H
+/* Products queue, filled by the recipe and emptied by the writer thread */
+static struct {
+    int                 active ;
+    int                 stop ;
+    int                 nb_pending ;
+    cr2res_io_job   *   jobs ;      /* All jobs, in the submission order */
+    cr2res_io_job   *   last ;
+    cr2res_io_job   *   todo ;      /* First job not yet written */
+    pthread_t           thread ;
+    pthread_mutex_t     lock ;
+    pthread_cond_t      cond ;
+} cr2res_io_writer ;
+#endif
+
 /*-----------------------------------------------------------------------------
                                 Functions prototypes
  -----------------------------------------------------------------------------*/
 
+static int cr2res_io_scan_ext_idx(
+        const char  *   filename,
+        int             ext_idx[CR2RES_NB_DETECTORS][2]) ;
+static int cr2res_io_ext_cache_get(
+        const char          *   filename,
+        const struct stat   *   st,
+        int                     ext_idx[CR2RES_NB_DETECTORS][2]) ;
+static void cr2res_io_ext_cache_set(
+        const char          *   filename,
+        const struct stat   *   st,
+        int                     ext_idx[CR2RES_NB_DETECTORS][2]) ;
+static int cr2res_io_raw_read_hdu(
+        const unsigned char *   buf,
+        size_t                  size,
+        size_t              *   pos,
+        cr2res_io_raw_hdu   *   hdu) ;
+#ifdef HAVE_PTHREAD_H
+static int cr2res_io_writer_push(
+        cr2res_io_job_type          job_type,
+        const char              *   filename,
+        cpl_frameset            *   allframes,
+        cpl_frameset            *   inframes,
+        const cpl_parameterlist *   parlist,
+        void                    **  data,
+        const cpl_propertylist  *   qc_list,
+        cpl_propertylist        **  ext_plist,
+        cpl_type                    type,
+        const char              *   recipe,
+        const char              *   procatg,
+        const char              *   protype) ;
+static void * cr2res_io_writer_run(void * arg) ;
+static void cr2res_io_job_delete(cr2res_io_job * job) ;
+#endif
 static int cr2res_io_set_bpm_as_NaNs(
         cpl_image   *   in) ;
 static int cr2res_io_set_NaNs_as_bpm(
@@ -557,6 +718,10 @@ char * cr2res_io_create_extname(
   @param    detector    The wished detector (1 to CR2RES_NB_DETECTORS)
   @param    data        1 for the data image, 0 for the error
   @return   the Extension number or -1 in error case
+
+  The extension numbers of all detectors are read in one pass on the
+  headers, and kept for the next calls on the same file. A file that is
+  modified (date, size or inode) is read again.
  */
 /*----------------------------------------------------------------------------*/
 int cr2res_io_get_ext_idx(
@@ -564,34 +729,22 @@ int cr2res_io_get_ext_idx(
         int             detector,
         int             data)
 {
-    const char          *   extname ;
-    char                *   wished_extname ;
-    int                     wished_ext_nb = -1 ;
-    cpl_propertylist    *   pl ;
-    int                     nb_ext, i ;
+    struct stat             st ;
+    int                     ext_idx[CR2RES_NB_DETECTORS][2] ;
+    int                     wished_ext_nb ;
 
     /* Check entries */
     if (filename == NULL) return -1 ;
     if (detector < 1 || detector > CR2RES_NB_DETECTORS) return -1 ;
 
-    /* Create wished EXTNAME */
-    wished_extname = cr2res_io_create_extname(detector, data) ;
-
-    /* Get the number of extensions */
-    nb_ext = cpl_fits_count_extensions(filename) ;
-
-    /* Loop on the extensions */
-    for (i=1 ; i<=nb_ext ; i++) {
-        /* Get the header */
-        pl = cpl_propertylist_load(filename, i) ;
-        /* Read the EXTNAME */
-        extname = cpl_propertylist_get_string(pl, "EXTNAME");
-
-        /* Compare to the wished one */
-        if (strcmp(extname, wished_extname)==0) wished_ext_nb = i ;
-        cpl_propertylist_delete(pl) ;
+    /* Read all EXTNAMEs once per file version */
+    if (stat(filename, &st) != 0) {
+        cr2res_io_scan_ext_idx(filename, ext_idx) ;
+    } else if (!cr2res_io_ext_cache_get(filename, &st, ext_idx)) {
+        if (cr2res_io_scan_ext_idx(filename, ext_idx) == 0)
+            cr2res_io_ext_cache_set(filename, &st, ext_idx) ;
     }
-    cpl_free(wished_extname) ;
+    wished_ext_nb = ext_idx[detector-1][data ? 0 : 1] ;
 
     /* EXTNAME expectation */
     if (wished_ext_nb < 0) {
@@ -626,12 +779,20 @@ hdrl_image * cr2res_io_load_image(
     hdrl_image      *   out ;
     cpl_image       *   data ;
     cpl_image       *   err ;
+    cr2res_io_raw   *   raw ;
     int                 ext_nr_data, ext_nr_err ;
 
     /* Check entries */
     if (in == NULL) return NULL ;
     if (detector < 1 || detector > CR2RES_NB_DETECTORS) return NULL ;
 
+    /* Uncompressed raw frames are converted from the file mapping */
+    if ((raw = cr2res_io_raw_open(in, detector)) != NULL) {
+        out = cr2res_io_raw_load_image(raw) ;
+        cr2res_io_raw_close(raw) ;
+        return out ;
+    }
+
     /* Get the extension numbers for this detector */
     ext_nr_data = cr2res_io_get_ext_idx(in, detector, 1) ;
     ext_nr_err = cr2res_io_get_ext_idx(in, detector, 0) ;
@@ -658,6 +819,137 @@ hdrl_image * cr2res_io_load_image(
     return out ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load some rows of an hdrl image from a image file
+  @param    in          The input file name
+  @param    detector    The wished detector (1 to CR2RES_NB_DETECTORS)
+  @param    ymin        The first row to load (1 for the first)
+  @param    ymax        The last row to load
+  @return   A hdrl image of ymax-ymin+1 rows or NULL in error case.
+            The returned object needs to be deallocated
+  Same as cr2res_io_load_image() on the full width of the rows ymin to
+  ymax only.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_io_load_image_window(
+        const char  *   in,
+        int             detector,
+        int             ymin,
+        int             ymax)
+{
+    hdrl_image          *   out ;
+    cpl_image           *   data ;
+    cpl_image           *   err ;
+    cpl_propertylist    *   plist ;
+    int                     ext_nr_data, ext_nr_err, nx ;
+
+    /* Check entries */
+    if (in == NULL) return NULL ;
+    if (detector < 1 || detector > CR2RES_NB_DETECTORS) return NULL ;
+    if (ymin < 1 || ymax < ymin) return NULL ;
+
+    /* Get the extension numbers for this detector */
+    ext_nr_data = cr2res_io_get_ext_idx(in, detector, 1) ;
+    ext_nr_err = cr2res_io_get_ext_idx(in, detector, 0) ;
+
+    /* The wished extension was not found */
+    if (ext_nr_data < 0) return NULL ;
+
+    /* Get the width */
+    if ((plist = cpl_propertylist_load(in, ext_nr_data)) == NULL) return NULL ;
+    nx = cpl_propertylist_get_int(plist, CR2RES_HEADER_NAXIS1) ;
+    cpl_propertylist_delete(plist) ;
+
+    /* Load the rows */
+    data = cpl_image_load_window(in, CPL_TYPE_DOUBLE, 0, ext_nr_data,
+            1, ymin, nx, ymax) ;
+    if (ext_nr_err >= 0)
+        err = cpl_image_load_window(in, CPL_TYPE_DOUBLE, 0, ext_nr_err,
+                1, ymin, nx, ymax) ;
+    else
+        err = NULL ;
+
+    /* Set the NaN pixels as bad  */
+    cr2res_io_set_NaNs_as_bpm(data) ;
+
+    /* Create output hdrl image */
+    out = hdrl_image_create(data, err) ;
+
+    /* Return  */
+    if (data != NULL) cpl_image_delete(data) ;
+    if (err != NULL) cpl_image_delete(err) ;
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load an hdrl image from a image file, reading some rows only
+  @param    in          The input file name
+  @param    detector    The wished detector (1 to CR2RES_NB_DETECTORS)
+  @param    ymin        The first row to read (1 for the first, -1 for all)
+  @param    ymax        The last row to read (-1 for all)
+  @return   A hdrl image or NULL in error case.
+            The returned object needs to be deallocated
+  Same as cr2res_io_load_image(), but only the rows ymin to ymax are read
+  from the file. The returned image has the full detector size, so that
+  the pixel coordinates are unchanged. The other rows are set to 0 and
+  are not flagged as bad.
+  The window is clipped to the image. Use it when only these rows are
+  needed, e.g. with the window of cr2res_trace_get_rows().
+  This saves the reading and the conversion of the other rows, not the
+  memory: the returned image is as large as the full one. Callers that
+  can work with an offset use cr2res_io_load_image_window() instead,
+  whose row 1 is the detector row ymin.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_io_load_image_rows(
+        const char  *   in,
+        int             detector,
+        int             ymin,
+        int             ymax)
+{
+    hdrl_image          *   out ;
+    hdrl_image          *   stripe ;
+    cpl_propertylist    *   plist ;
+    int                     ext_nr_data, nx, ny ;
+
+    /* Check entries */
+    if (in == NULL) return NULL ;
+    if (detector < 1 || detector > CR2RES_NB_DETECTORS) return NULL ;
+
+    /* No window */
+    if (ymin < 0 && ymax < 0) return cr2res_io_load_image(in, detector) ;
+
+    /* Get the image size */
+    if ((ext_nr_data = cr2res_io_get_ext_idx(in, detector, 1)) < 0)
+        return NULL ;
+    if ((plist = cpl_propertylist_load_regexp(in, ext_nr_data,
+                    "^NAXIS[12]$", 0)) == NULL) return NULL ;
+    nx = cpl_propertylist_get_int(plist, CR2RES_HEADER_NAXIS1) ;
+    ny = cpl_propertylist_get_int(plist, CR2RES_HEADER_NAXIS2) ;
+    cpl_propertylist_delete(plist) ;
+    if (cpl_error_get_code()) return NULL ;
+
+    /* Clip the window */
+    if (ymin < 1) ymin = 1 ;
+    if (ymax < 1 || ymax > ny) ymax = ny ;
+    if (ymin > ymax) return NULL ;
+    if (ymin == 1 && ymax == ny) return cr2res_io_load_image(in, detector) ;
+
+    /* Read the rows and put them in place */
+    if ((stripe = cr2res_io_load_image_window(in, detector, ymin,
+                    ymax)) == NULL) return NULL ;
+    out = hdrl_image_new(nx, ny) ;
+    if (hdrl_image_copy(out, stripe, 1, ymin) != CPL_ERROR_NONE) {
+        hdrl_image_delete(stripe) ;
+        hdrl_image_delete(out) ;
+        return NULL ;
+    }
+    hdrl_image_delete(stripe) ;
+    return out ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Load an hdrl image list from a cube file
@@ -721,6 +1013,11 @@ hdrl_imagelist * cr2res_io_load_image_list(
   for a given detector from a list of input image frames
   This function load imageѕ files (also where the error is missing)
   with the proper EXTNAME convention
+  The frames are read concurrently by the threads left to the caller
+  (see cr2res_thread_budget()), the list keeps the order of the frameset.
+  If frames cannot be loaded, the error of the first of them is set with
+  its index in the frameset. The uncompressed raw frames
+  are converted from their file mapping, see cr2res_io_raw_open().
  */
 /*----------------------------------------------------------------------------*/
 hdrl_imagelist * cr2res_io_load_image_list_from_set(
@@ -731,8 +1028,12 @@ hdrl_imagelist * cr2res_io_load_image_list_from_set(
     hdrl_imagelist  *   out ;
     cpl_imagelist   *   data ;
     cpl_imagelist   *   err ;
-    cpl_size            i ;
-    int                 ext_nr_data, ext_nr_err ;
+    cpl_image       **  data_ima ;
+    cpl_image       **  err_ima ;
+    char                failed_msg[CPL_ERROR_MAX_MESSAGE_LENGTH] ;
+    cpl_error_code      failed_code ;
+    cpl_size            i, nframes, failed_idx ;
+    int                 ext_nr_data, ext_nr_err, nthreads, failed ;
 
     /* Check entries */
     if (in == NULL) return NULL ;
@@ -746,27 +1047,405 @@ hdrl_imagelist * cr2res_io_load_image_list_from_set(
 
     /* The wished extension was not found */
     if (ext_nr_data < 0) return NULL ;
-    
-    /* Load the image list */
-    data = cpl_imagelist_load_frameset(in, CPL_TYPE_DOUBLE, 1, ext_nr_data) ;
-    if (ext_nr_err >= 0) 
-        err = cpl_imagelist_load_frameset(in, CPL_TYPE_DOUBLE, 1, ext_nr_err) ;
-    else 
-        err = NULL ;
 
-    /* Set the NaN pixels as bad  */
-    for (i=0 ; i<cpl_imagelist_get_size(data) ; i++) 
-        cr2res_io_set_NaNs_as_bpm(cpl_imagelist_get(data, i)) ;
+    /* Initialise */
+    nframes = cpl_frameset_get_size(in) ;
+    data_ima = cpl_calloc(nframes, sizeof(cpl_image *)) ;
+    err_ima = cpl_calloc(nframes, sizeof(cpl_image *)) ;
+    failed = 0 ;
+    failed_idx = nframes ;
+    failed_code = CPL_ERROR_NONE ;
+    failed_msg[0] = '\0' ;
+    nthreads = cr2res_thread_budget() ;
+    if (nthreads > nframes) nthreads = (int)nframes ;
+
+    /* Load the frames concurrently, the latency of each file overlaps */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic,1) \
+    if(nthreads > 1)
+#endif
+    for (i=0 ; i<nframes ; i++) {
+        const char      *   fname ;
+        cr2res_io_raw   *   raw ;
+
+        fname = cpl_frame_get_filename(cpl_frameset_get_position_const(in,i));
+
+        /* Uncompressed raw frames are converted from the file mapping */
+        if (ext_nr_err < 0 &&
+                (raw = cr2res_io_raw_open(fname, detector)) != NULL) {
+            data_ima[i] = cpl_image_new(cr2res_io_raw_get_size_x(raw),
+                    cr2res_io_raw_get_size_y(raw), CPL_TYPE_DOUBLE) ;
+            if (cr2res_io_raw_get_rows(raw, 1, cr2res_io_raw_get_size_y(raw),
+                        cpl_image_get_data_double(data_ima[i]))) {
+                cpl_image_delete(data_ima[i]) ;
+                data_ima[i] = NULL ;
+            }
+            cr2res_io_raw_close(raw) ;
+        }
+        if (data_ima[i] == NULL)
+            data_ima[i] = cpl_image_load(fname, CPL_TYPE_DOUBLE, 0,
+                    ext_nr_data) ;
+        if (ext_nr_err >= 0)
+            err_ima[i] = cpl_image_load(fname, CPL_TYPE_DOUBLE, 0, ext_nr_err);
+        if (data_ima[i] == NULL || (ext_nr_err >= 0 && err_ima[i] == NULL)) {
+            cpl_msg_error(__func__, "Cannot load the frame %"CPL_SIZE_FORMAT
+                    " (%s)", i+1, fname) ;
+            /* Keep the error of the first failing frame, in any order */
+#ifdef _OPENMP
+#pragma omp critical(cr2res_io_load_failed)
+#endif
+            {
+                failed = 1 ;
+                if (i < failed_idx) {
+                    failed_idx = i ;
+                    failed_code = cpl_error_get_code() ;
+                    snprintf(failed_msg, sizeof(failed_msg), "%s: %s", fname,
+                            cpl_error_get_code() ? cpl_error_get_message() :
+                            "Cannot load the image") ;
+                }
+            }
+            cpl_error_reset() ;
+            continue ;
+        }
+
+        /* Set the NaN pixels as bad  */
+        cr2res_io_set_NaNs_as_bpm(data_ima[i]) ;
+    }
+
+    /* Assemble the lists in the input order */
+    data = err = NULL ;
+    if (!failed) {
+        data = cpl_imagelist_new() ;
+        if (ext_nr_err >= 0) err = cpl_imagelist_new() ;
+        for (i=0 ; i<nframes ; i++) {
+            if (cpl_imagelist_set(data, data_ima[i], i) != CPL_ERROR_NONE ||
+                    (err != NULL && cpl_imagelist_set(err, err_ima[i], i)
+                     != CPL_ERROR_NONE)) {
+                failed = 1 ;
+                break ;
+            }
+            data_ima[i] = err_ima[i] = NULL ;
+        }
+    }
+    for (i=0 ; i<nframes ; i++) {
+        if (data_ima[i] != NULL) cpl_image_delete(data_ima[i]) ;
+        if (err_ima[i] != NULL) cpl_image_delete(err_ima[i]) ;
+    }
+    cpl_free(data_ima) ;
+    cpl_free(err_ima) ;
+    if (failed) {
+        if (data != NULL) cpl_imagelist_delete(data) ;
+        if (err != NULL) cpl_imagelist_delete(err) ;
+        if (failed_idx < nframes)
+            cpl_error_set_message(__func__, failed_code != CPL_ERROR_NONE ?
+                    failed_code : CPL_ERROR_FILE_IO,
+                    "Frame %"CPL_SIZE_FORMAT" of %"CPL_SIZE_FORMAT", %s",
+                    failed_idx+1, nframes, failed_msg) ;
+        else if (!cpl_error_get_code())
+            cpl_error_set(__func__, CPL_ERROR_FILE_IO) ;
+        return NULL ;
+    }
 
     /* Create output hdrl image */
     out = hdrl_imagelist_create(data, err) ;
 
     /* Return  */
-    if (data != NULL) cpl_imagelist_delete(data) ;
+    cpl_imagelist_delete(data) ;
     if (err != NULL) cpl_imagelist_delete(err) ;
     return out ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load an hdrl image list from an images frameset, some rows only
+  @param    in          The input frame set
+  @param    detector    The wished detector (1 to CR2RES_NB_DETECTORS)
+  @param    ymin        The first row to read (1 for the first, -1 for all)
+  @param    ymax        The last row to read (-1 for all)
+  @return   A hdrl imagelist or NULL in error case. The returned object
+              needs to be deallocated
+  Same as cr2res_io_load_image_list_from_set(), with the images loaded
+  by cr2res_io_load_image_rows(). The images have the full detector
+  size, with the rows out of the window set to 0.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_imagelist * cr2res_io_load_image_list_from_set_rows(
+        const cpl_frameset  *   in,
+        int                     detector,
+        int                     ymin,
+        int                     ymax)
+{
+    hdrl_imagelist  *   out ;
+    hdrl_image      *   ima ;
+    cpl_size            i ;
+
+    /* Check entries */
+    if (in == NULL) return NULL ;
+    if (cpl_frameset_get_size(in) < 1) return NULL ;
+    if (detector < 1 || detector > CR2RES_NB_DETECTORS) return NULL ;
+
+    /* No window */
+    if (ymin < 0 && ymax < 0)
+        return cr2res_io_load_image_list_from_set(in, detector) ;
+
+    /* Load the images */
+    out = hdrl_imagelist_new() ;
+    for (i=0 ; i<cpl_frameset_get_size(in) ; i++) {
+        if ((ima = cr2res_io_load_image_rows(cpl_frame_get_filename(
+                            cpl_frameset_get_position_const(in, i)),
+                        detector, ymin, ymax)) == NULL) {
+            hdrl_imagelist_delete(out) ;
+            return NULL ;
+        }
+        hdrl_imagelist_set(out, ima, i) ;
+    }
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Map the raw pixels of a detector for a direct access
+  @param    filename    The FITS file name
+  @param    detector    The wished detector (1 to CR2RES_NB_DETECTORS)
+  @return   The mapped raw image or NULL if it cannot be mapped.
+            The returned object needs to be deallocated with
+            cr2res_io_raw_close()
+
+  The file is mapped read-only and its pixels are accessed in their FITS
+  representation, so the frames read by several recipes share the page
+  cache and are never copied by CFITSIO. Only the uncompressed image
+  extensions without error extension and without BLANK can be mapped,
+  NULL is returned without error otherwise, and the caller falls back
+  on cr2res_io_load_image().
+  The mapping is private. The headers are only read within the file size
+  and the data sizes they give are checked against it, so that a
+  truncated file is not mapped. The file must not be truncated while it
+  is mapped: accessing the lost pages would raise SIGBUS.
+ */
+/*----------------------------------------------------------------------------*/
+cr2res_io_raw * cr2res_io_raw_open(
+        const char  *   filename,
+        int             detector)
+{
+#ifdef HAVE_SYS_MMAN_H
+    cr2res_io_raw       *   raw ;
+    cr2res_io_raw_hdu       hdu ;
+    struct stat             st ;
+    void                *   map ;
+    size_t                  pos, nbytes ;
+    int                     fd, ext_nr, i ;
+
+    /* Check entries */
+    if (filename == NULL) return NULL ;
+    if (detector < 1 || detector > CR2RES_NB_DETECTORS) return NULL ;
+
+    /* The error extensions are loaded with CPL */
+    if ((ext_nr = cr2res_io_get_ext_idx(filename, detector, 1)) < 0)
+        return NULL ;
+    if (cr2res_io_get_ext_idx(filename, detector, 0) >= 0) return NULL ;
+
+    /* Map the whole file */
+    if ((fd = open(filename, O_RDONLY)) < 0) return NULL ;
+    if (fstat(fd, &st) != 0 || st.st_size < CR2RES_IO_FITS_BLOCK) {
+        close(fd) ;
+        return NULL ;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+    close(fd) ;
+    if (map == MAP_FAILED) return NULL ;
+
+    /* Skip the HDUs up to the wished one */
+    pos = 0 ;
+    for (i=0 ; i<=ext_nr ; i++) {
+        if (cr2res_io_raw_read_hdu(map, (size_t)st.st_size, &pos, &hdu)) {
+            munmap(map, (size_t)st.st_size) ;
+            return NULL ;
+        }
+    }
+
+    /* Only plain images are mapped, the first plane of a cube is used */
+    nbytes = (size_t)(abs(hdu.bitpix) / 8) * hdu.naxes[0] * hdu.naxes[1] ;
+    if (!hdu.image || hdu.blank || hdu.naxis < 2 || hdu.naxis > 3 ||
+            (hdu.bitpix != 8 && hdu.bitpix != 16 && hdu.bitpix != 32 &&
+             hdu.bitpix != 64 && hdu.bitpix != -32 && hdu.bitpix != -64) ||
+            hdu.naxes[0] < 1 || hdu.naxes[1] < 1 ||
+            hdu.data + nbytes > (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size) ;
+        return NULL ;
+    }
+
+    /* Create the raw image */
+    raw = cpl_malloc(sizeof(cr2res_io_raw)) ;
+    raw->map = map ;
+    raw->map_size = (size_t)st.st_size ;
+    raw->pixels = (const unsigned char *)map + hdu.data ;
+    raw->bitpix = hdu.bitpix ;
+    raw->nx = hdu.naxes[0] ;
+    raw->ny = hdu.naxes[1] ;
+    raw->bscale = hdu.bscale ;
+    raw->bzero = hdu.bzero ;
+#ifdef MADV_SEQUENTIAL
+    madvise(map, raw->map_size, MADV_SEQUENTIAL) ;
+#endif
+    return raw ;
+#else
+    (void)filename ;
+    (void)detector ;
+    return NULL ;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of columns of a mapped raw image
+  @param    raw     The mapped raw image
+  @return   NAXIS1 or -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size cr2res_io_raw_get_size_x(const cr2res_io_raw * raw)
+{
+    if (raw == NULL) return -1 ;
+    return raw->nx ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of rows of a mapped raw image
+  @param    raw     The mapped raw image
+  @return   NAXIS2 or -1 in error case
+ */
+/*----------------------------------------------------------------------------*/
+cpl_size cr2res_io_raw_get_size_y(const cr2res_io_raw * raw)
+{
+    if (raw == NULL) return -1 ;
+    return raw->ny ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Convert some rows of a mapped raw image to double
+  @param    raw     The mapped raw image
+  @param    ymin    The first row to convert (1 for the first)
+  @param    ymax    The last row to convert
+  @param    out     [out] The (ymax-ymin+1)*NAXIS1 converted values
+  @return   0 if ok, -1 in error case
+
+  The pixels are converted from big endian and scaled with BSCALE and
+  BZERO as CFITSIO does. Only the touched rows are read from the file,
+  so the conversion can be done where the values are needed.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_io_raw_get_rows(
+        const cr2res_io_raw *   raw,
+        cpl_size                ymin,
+        cpl_size                ymax,
+        double              *   out)
+{
+    const unsigned char *   p ;
+    uint64_t                u ;
+    float                   f ;
+    double                  d ;
+    cpl_size                i, j, npix ;
+
+    /* Check entries */
+    if (raw == NULL || out == NULL) return -1 ;
+    if (ymin < 1 || ymax > raw->ny || ymin > ymax) return -1 ;
+
+    /* Initialise */
+    npix = (ymax - ymin + 1) * raw->nx ;
+    p = raw->pixels + (size_t)(abs(raw->bitpix) / 8) * (ymin - 1) * raw->nx ;
+
+    /* Convert the pixels */
+    switch (raw->bitpix) {
+        case 8:
+            for (i=0 ; i<npix ; i++) out[i] = p[i] ;
+            break ;
+        case 16:
+            for (i=0 ; i<npix ; i++, p+=2)
+                out[i] = (int16_t)(((uint16_t)p[0] << 8) | p[1]) ;
+            break ;
+        case 32:
+            for (i=0 ; i<npix ; i++, p+=4)
+                out[i] = (int32_t)(((uint32_t)p[0] << 24) |
+                        ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+            break ;
+        case -32:
+            for (i=0 ; i<npix ; i++, p+=4) {
+                uint32_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                    ((uint32_t)p[2] << 8) | p[3] ;
+                memcpy(&f, &v, sizeof(f)) ;
+                out[i] = f ;
+            }
+            break ;
+        case 64:
+        case -64:
+            for (i=0 ; i<npix ; i++, p+=8) {
+                for (u=0, j=0 ; j<8 ; j++) u = (u << 8) | p[j] ;
+                if (raw->bitpix == 64) out[i] = (double)(int64_t)u ;
+                else {
+                    memcpy(&d, &u, sizeof(d)) ;
+                    out[i] = d ;
+                }
+            }
+            break ;
+        default:
+            return -1 ;
+    }
+
+    /* Physical values */
+    if (raw->bscale != 1.0 || raw->bzero != 0.0)
+        for (i=0 ; i<npix ; i++) out[i] = raw->bscale * out[i] + raw->bzero ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Convert a mapped raw image to an hdrl image
+  @param    raw     The mapped raw image
+  @return   A hdrl image or NULL in error case.
+            The returned object needs to be deallocated
+  Same as cr2res_io_load_image() on the mapped extension: the errors are
+  0 and the NaN pixels are bad.
+ */
+/*----------------------------------------------------------------------------*/
+hdrl_image * cr2res_io_raw_load_image(const cr2res_io_raw * raw)
+{
+    hdrl_image      *   out ;
+    cpl_image       *   data ;
+
+    /* Check entries */
+    if (raw == NULL) return NULL ;
+
+    /* Convert directly in the output buffer */
+    out = hdrl_image_new(raw->nx, raw->ny) ;
+    data = hdrl_image_get_image(out) ;
+    if (cr2res_io_raw_get_rows(raw, 1, raw->ny,
+                cpl_image_get_data_double(data))) {
+        hdrl_image_delete(out) ;
+        return NULL ;
+    }
+
+    /* Set the NaN pixels as bad  */
+    cr2res_io_set_NaNs_as_bpm(data) ;
+    return out ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Unmap a raw image
+  @param    raw     The mapped raw image to close
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_io_raw_close(cr2res_io_raw * raw)
+{
+    if (raw == NULL) return ;
+#ifdef HAVE_SYS_MMAN_H
+    munmap(raw->map, raw->map_size) ;
+#endif
+    cpl_free(raw) ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Load the table accordingly
@@ -1309,6 +1988,106 @@ cpl_table * cr2res_io_load_EXTRACT_2D(
 /*----------------------------------------------------------------------------*/
 /* TODO ? set frame levels to mark temp, intermediate and final frames?       */
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Start writing the products in a background thread
+  @return   0 if ok, -1 if the products are written synchronously
+
+  Until cr2res_io_writer_join(), the cr2res_io_save_*() functions of the
+  multi extension products copy their inputs in a queue and return
+  immediately. A background thread writes them in the submission order,
+  so the recipe computes while the files are written. The caller keeps
+  the ownership of its objects, as with the synchronous saving.
+
+  The writer is a plain pthread that calls CPL while the recipe thread
+  also does. This assumes, as the OpenMP loops of the recipes do, that
+  CPL is built thread-safe (with OpenMP) and CFITSIO reentrant: CPL
+  keeps its error state per thread and protects its shared state (the
+  FITS files cache, the messaging) with OpenMP constructs, which libgomp
+  implements with thread-local storage and mutexes that also hold for
+  threads not created by OpenMP. Without OpenMP, the products are
+  written synchronously.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_io_writer_start(void)
+{
+#if defined(HAVE_PTHREAD_H) && defined(_OPENMP)
+    if (cr2res_io_writer.active) return 0 ;
+    cr2res_io_writer.jobs = cr2res_io_writer.last = NULL ;
+    cr2res_io_writer.todo = NULL ;
+    cr2res_io_writer.nb_pending = 0 ;
+    cr2res_io_writer.stop = 0 ;
+    if (pthread_mutex_init(&cr2res_io_writer.lock, NULL)) return -1 ;
+    if (pthread_cond_init(&cr2res_io_writer.cond, NULL)) {
+        pthread_mutex_destroy(&cr2res_io_writer.lock) ;
+        return -1 ;
+    }
+    if (pthread_create(&cr2res_io_writer.thread, NULL, cr2res_io_writer_run,
+                NULL)) {
+        cpl_msg_warning(__func__, "Cannot start the writer thread") ;
+        pthread_cond_destroy(&cr2res_io_writer.cond) ;
+        pthread_mutex_destroy(&cr2res_io_writer.lock) ;
+        return -1 ;
+    }
+    cr2res_io_writer.active = 1 ;
+    return 0 ;
+#else
+    return -1 ;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Wait for the products queued since cr2res_io_writer_start()
+  @return   0 if ok, -1 if a product could not be written
+
+  The written products are added to the recipe frames in the submission
+  order. Nothing is done if the writer was not started.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_io_writer_join(void)
+{
+#ifdef HAVE_PTHREAD_H
+    cr2res_io_job   *   job ;
+    const cpl_frame *   product ;
+    cpl_size            i ;
+    int                 ret ;
+
+    if (!cr2res_io_writer.active) return 0 ;
+
+    /* Let the thread write the remaining jobs */
+    pthread_mutex_lock(&cr2res_io_writer.lock) ;
+    cr2res_io_writer.stop = 1 ;
+    pthread_cond_broadcast(&cr2res_io_writer.cond) ;
+    pthread_mutex_unlock(&cr2res_io_writer.lock) ;
+    pthread_join(cr2res_io_writer.thread, NULL) ;
+    pthread_cond_destroy(&cr2res_io_writer.cond) ;
+    pthread_mutex_destroy(&cr2res_io_writer.lock) ;
+    cr2res_io_writer.active = 0 ;
+
+    /* Register the products */
+    ret = 0 ;
+    while ((job = cr2res_io_writer.jobs) != NULL) {
+        cr2res_io_writer.jobs = job->next ;
+        if (job->status) {
+            cpl_msg_error(__func__, "Cannot save %s", job->filename) ;
+            ret = -1 ;
+        }
+        for (i=job->nb_allframes ; i<cpl_frameset_get_size(job->allframes) ;
+                i++) {
+            product = cpl_frameset_get_position_const(job->allframes, i) ;
+            cpl_frameset_insert(job->target, cpl_frame_duplicate(product)) ;
+        }
+        cr2res_io_job_delete(job) ;
+    }
+    cr2res_io_writer.last = NULL ;
+    if (ret) cpl_error_set(__func__, CPL_ERROR_FILE_IO) ;
+    return ret ;
+#else
+    return 0 ;
+#endif
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Save PHOTO_FLUX file
@@ -1339,6 +2118,9 @@ int cr2res_io_save_PHOTO_FLUX(
     mjd_obs = cr2res_mjd_obs_now() ;
 	cpl_propertylist_append_double(plist, CR2RES_HEADER_MJD_OBS, mjd_obs) ;
 
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     if (cpl_dfs_save_table(set, NULL, parlist, set, NULL, out_table,
                 NULL, recipe, plist, NULL,
                 PACKAGE "/" PACKAGE_VERSION, filename) != CPL_ERROR_NONE) {
@@ -1390,6 +2172,9 @@ int cr2res_io_save_EMISSION_LINES(
                 setting_string) ;
     }
 
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     if (cpl_dfs_save_table(set, NULL, parlist, set, NULL, out_table,
                 NULL, recipe, plist, NULL,
                 PACKAGE "/" PACKAGE_VERSION, filename) != CPL_ERROR_NONE) {
@@ -2040,6 +2825,275 @@ static int cr2res_io_set_bpm_as_NaNs(
     }
     return 0 ;
 }
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Read the extension numbers of all detectors in a file
+  @param    filename    The FITS file name
+  @param    ext_idx     [out] The extension numbers, -1 if missing
+  @return   0 if ok, -1 if the file cannot be read
+
+  If an EXTNAME appears several times, the last extension is kept.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_io_scan_ext_idx(
+        const char  *   filename,
+        int             ext_idx[CR2RES_NB_DETECTORS][2])
+{
+    cpl_propertylist    *   pl ;
+    const char          *   extname ;
+    char                *   wished_extname ;
+    int                     nb_ext, i, det, data ;
+
+    /* Initialise */
+    for (det=0 ; det<CR2RES_NB_DETECTORS ; det++)
+        ext_idx[det][0] = ext_idx[det][1] = -1 ;
+
+    /* Get the number of extensions */
+    if ((nb_ext = cpl_fits_count_extensions(filename)) < 0) return -1 ;
+
+    /* Loop on the extensions */
+    for (i=1 ; i<=nb_ext ; i++) {
+        /* Only read the EXTNAME */
+        if ((pl = cpl_propertylist_load_regexp(filename, i, "^EXTNAME$",
+                        0)) == NULL) return -1 ;
+        if (!cpl_propertylist_has(pl, "EXTNAME")) {
+            cpl_propertylist_delete(pl) ;
+            continue ;
+        }
+        extname = cpl_propertylist_get_string(pl, "EXTNAME");
+
+        /* Compare to the wished ones */
+        for (det=0 ; det<CR2RES_NB_DETECTORS ; det++) {
+            for (data=0 ; data<2 ; data++) {
+                wished_extname = cr2res_io_create_extname(det+1, 1-data) ;
+                if (strcmp(extname, wished_extname)==0) ext_idx[det][data] = i;
+                cpl_free(wished_extname) ;
+            }
+        }
+        cpl_propertylist_delete(pl) ;
+    }
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the extension numbers of a file version from the cache
+  @param    filename    The FITS file name
+  @param    st          The file status
+  @param    ext_idx     [out] The extension numbers
+  @return   1 if found, 0 otherwise
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_io_ext_cache_get(
+        const char          *   filename,
+        const struct stat   *   st,
+        int                     ext_idx[CR2RES_NB_DETECTORS][2])
+{
+    cr2res_io_ext_cache_entry   *   entry ;
+    int                             i, found ;
+
+    found = 0 ;
+#ifdef _OPENMP
+#pragma omp critical(cr2res_io_ext_cache)
+#endif
+    for (i=0 ; i<CR2RES_IO_EXT_CACHE_SIZE && !found ; i++) {
+        entry = &(cr2res_io_ext_cache[i]) ;
+        if (entry->filename != NULL && entry->mtime == st->st_mtime &&
+                entry->mtime_nsec == CR2RES_IO_MTIME_NSEC(st) &&
+                entry->size == st->st_size && entry->inode == st->st_ino &&
+                !strcmp(entry->filename, filename)) {
+            memcpy(ext_idx, entry->ext_idx, sizeof(entry->ext_idx)) ;
+            found = 1 ;
+        }
+    }
+    return found ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Store the extension numbers of a file version in the cache
+  @param    filename    The FITS file name
+  @param    st          The file status
+  @param    ext_idx     The extension numbers
+  @return   void
+
+  An older version of the same file is replaced, otherwise the oldest
+  entry is.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_io_ext_cache_set(
+        const char          *   filename,
+        const struct stat   *   st,
+        int                     ext_idx[CR2RES_NB_DETECTORS][2])
+{
+    cr2res_io_ext_cache_entry   *   entry ;
+    int                             i, pos ;
+
+#ifdef _OPENMP
+#pragma omp critical(cr2res_io_ext_cache)
+#endif
+    {
+        pos = -1 ;
+        for (i=0 ; i<CR2RES_IO_EXT_CACHE_SIZE && pos < 0 ; i++) {
+            if (cr2res_io_ext_cache[i].filename != NULL &&
+                    !strcmp(cr2res_io_ext_cache[i].filename, filename))
+                pos = i ;
+        }
+        if (pos < 0) {
+            pos = cr2res_io_ext_cache_next ;
+            cr2res_io_ext_cache_next = (pos + 1) % CR2RES_IO_EXT_CACHE_SIZE ;
+        }
+        entry = &(cr2res_io_ext_cache[pos]) ;
+        cpl_free(entry->filename) ;
+        entry->filename = cpl_strdup(filename) ;
+        entry->mtime = st->st_mtime ;
+        entry->mtime_nsec = CR2RES_IO_MTIME_NSEC(st) ;
+        entry->size = st->st_size ;
+        entry->inode = st->st_ino ;
+        memcpy(entry->ext_idx, ext_idx, sizeof(entry->ext_idx)) ;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Remove a file from the extension numbers cache
+  @param    filename    The FITS file name
+  @return   void
+
+  Called before a file is written. Where the modification time has no
+  sub-second part, a file rewritten within the same second with the
+  same size would otherwise look unchanged.
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_io_ext_cache_forget(
+        const char          *   filename)
+{
+    int     i ;
+
+    if (filename == NULL) return ;
+#ifdef _OPENMP
+#pragma omp critical(cr2res_io_ext_cache)
+#endif
+    for (i=0 ; i<CR2RES_IO_EXT_CACHE_SIZE ; i++) {
+        if (cr2res_io_ext_cache[i].filename != NULL &&
+                !strcmp(cr2res_io_ext_cache[i].filename, filename)) {
+            cpl_free(cr2res_io_ext_cache[i].filename) ;
+            cr2res_io_ext_cache[i].filename = NULL ;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Empty the extension numbers cache
+  @return   void
+
+  Releases the memory of the cache, to be called when no more files are
+  read, e.g. at the end of a recipe or of a test.
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_io_ext_cache_clear(void)
+{
+    int     i ;
+
+#ifdef _OPENMP
+#pragma omp critical(cr2res_io_ext_cache)
+#endif
+    {
+        for (i=0 ; i<CR2RES_IO_EXT_CACHE_SIZE ; i++) {
+            cpl_free(cr2res_io_ext_cache[i].filename) ;
+            cr2res_io_ext_cache[i].filename = NULL ;
+        }
+        cr2res_io_ext_cache_next = 0 ;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Read the header of one HDU in a FITS buffer
+  @param    buf     The FITS file content
+  @param    size    The size of buf
+  @param    pos     [in/out] The HDU offset, then the next HDU offset
+  @param    hdu     [out] The keywords of the HDU
+  @return   0 if ok, -1 if the header is truncated or invalid
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_io_raw_read_hdu(
+        const unsigned char *   buf,
+        size_t                  size,
+        size_t              *   pos,
+        cr2res_io_raw_hdu   *   hdu)
+{
+    char            card[CR2RES_IO_FITS_CARD+1] ;
+    const char  *   value ;
+    size_t          p, nbytes, nval, bpp ;
+    long            axis ;
+    int             end ;
+
+    /* Initialise */
+    memset(hdu, 0, sizeof(cr2res_io_raw_hdu)) ;
+    hdu->image = (*pos == 0) ;
+    hdu->npix = 1 ;
+    hdu->gcount = 1 ;
+    hdu->bscale = 1.0 ;
+    p = *pos ;
+
+    /* Loop on the cards up to END */
+    for (end=0 ; !end ; p+=CR2RES_IO_FITS_CARD) {
+        if (p + CR2RES_IO_FITS_CARD > size) return -1 ;
+        memcpy(card, buf + p, CR2RES_IO_FITS_CARD) ;
+        card[CR2RES_IO_FITS_CARD] = '\0' ;
+        if (!strncmp(card, "END     ", 8)) {
+            end = 1 ;
+            continue ;
+        }
+        if (card[8] != '=') continue ;
+        value = card + 10 ;
+        if (!strncmp(card, "XTENSION", 8)) {
+            hdu->image = (strstr(value, "'IMAGE") != NULL) ;
+        } else if (!strncmp(card, "BITPIX  ", 8)) {
+            hdu->bitpix = atoi(value) ;
+        } else if (!strncmp(card, "NAXIS   ", 8)) {
+            hdu->naxis = atoi(value) ;
+        } else if (!strncmp(card, "NAXIS", 5)) {
+            axis = strtol(card + 5, NULL, 10) ;
+            if (axis < 1) return -1 ;
+            if (axis <= 3) hdu->naxes[axis-1] = atol(value) ;
+            hdu->npix *= atol(value) ;
+        } else if (!strncmp(card, "PCOUNT  ", 8)) {
+            hdu->pcount = atol(value) ;
+        } else if (!strncmp(card, "GCOUNT  ", 8)) {
+            hdu->gcount = atol(value) ;
+        } else if (!strncmp(card, "BSCALE  ", 8)) {
+            hdu->bscale = atof(value) ;
+        } else if (!strncmp(card, "BZERO   ", 8)) {
+            hdu->bzero = atof(value) ;
+        } else if (!strncmp(card, "BLANK   ", 8)) {
+            hdu->blank = 1 ;
+        }
+    }
+    if (hdu->bitpix == 0 || hdu->naxis < 0 || hdu->npix < 0 ||
+            hdu->pcount < 0 || hdu->gcount < 0) return -1 ;
+
+    /* The data start on the block after the header */
+    p = ((p + CR2RES_IO_FITS_BLOCK - 1) / CR2RES_IO_FITS_BLOCK) *
+        CR2RES_IO_FITS_BLOCK ;
+    hdu->data = p ;
+    if (hdu->naxis == 0) hdu->npix = 0 ;
+
+    /* The data must be in the file, the last padding may be missing */
+    bpp = abs(hdu->bitpix) / 8 ;
+    if (bpp == 0 || (size_t)hdu->npix > size || (size_t)hdu->pcount > size)
+        return -1 ;
+    nval = (size_t)(hdu->pcount + hdu->npix) ;
+    if (hdu->gcount > 0 && nval > size / bpp / (size_t)hdu->gcount) return -1;
+    nbytes = bpp * hdu->gcount * nval ;
+    if (p > size || nbytes > size - p) return -1 ;
+    *pos = p + ((nbytes + CR2RES_IO_FITS_BLOCK - 1) / CR2RES_IO_FITS_BLOCK) *
+        CR2RES_IO_FITS_BLOCK ;
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Set to bad the pixels whose value is nan
@@ -2072,6 +3126,195 @@ static int cr2res_io_set_NaNs_as_bpm(
     return 0 ;
 }
 
+#ifdef HAVE_PTHREAD_H
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Queue a multi extension product for the writer thread
+  @param    job_type    The kind of product
+  @param    filename    The FITS file name
+  @param    allframes   The recipe input frames
+  @param    inframes    The recipe used input frames
+  @param    parlist     The recipe input parameters
+  @param    data        The objects to save (1 per detector)
+  @param    qc_list     The QC parameters
+  @param    ext_plist   The extensions property lists
+  @param    type        CPL_TYPE_DOUBLE, CPL_TYPE_INT,...
+  @param    recipe      The recipe name
+  @param    procatg     PRO.CATG
+  @param    protype     PRO.TYPE
+  @return   0 if queued, 1 if the product must be saved now
+
+  The inputs are copied, the job keeps a private copy of allframes that
+  receives the product frame. The call blocks while
+  CR2RES_IO_WRITER_MAX_JOBS products are waiting, to bound the memory.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_io_writer_push(
+        cr2res_io_job_type          job_type,
+        const char              *   filename,
+        cpl_frameset            *   allframes,
+        cpl_frameset            *   inframes,
+        const cpl_parameterlist *   parlist,
+        void                    **  data,
+        const cpl_propertylist  *   qc_list,
+        cpl_propertylist        **  ext_plist,
+        cpl_type                    type,
+        const char              *   recipe,
+        const char              *   procatg,
+        const char              *   protype)
+{
+    cr2res_io_job   *   job ;
+    int                 det_nr ;
+
+    /* Only the recipe thread queues, the writer thread saves */
+    if (!cr2res_io_writer.active ||
+            pthread_equal(pthread_self(), cr2res_io_writer.thread))
+        return 1 ;
+    if (allframes == NULL || filename == NULL || ext_plist == NULL) return 1 ;
+
+    /* Copy the inputs */
+    job = cpl_calloc(1, sizeof(cr2res_io_job)) ;
+    job->job_type = job_type ;
+    job->filename = cpl_strdup(filename) ;
+    job->target = allframes ;
+    job->allframes = cpl_frameset_duplicate(allframes) ;
+    job->nb_allframes = cpl_frameset_get_size(allframes) ;
+    if (inframes != NULL) job->inframes = cpl_frameset_duplicate(inframes) ;
+    job->parlist = parlist ;
+    if (qc_list != NULL) job->qc_list = cpl_propertylist_duplicate(qc_list) ;
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        if (ext_plist[det_nr-1] != NULL)
+            job->ext_plist[det_nr-1] =
+                cpl_propertylist_duplicate(ext_plist[det_nr-1]) ;
+        if (data[det_nr-1] == NULL) continue ;
+        if (job_type == CR2RES_IO_JOB_IMAGE)
+            job->images[det_nr-1] = hdrl_image_duplicate(data[det_nr-1]) ;
+        else if (job_type == CR2RES_IO_JOB_IMAGELIST)
+            job->lists[det_nr-1] = hdrl_imagelist_duplicate(data[det_nr-1]);
+        else
+            job->tables[det_nr-1] = cpl_table_duplicate(data[det_nr-1]) ;
+    }
+    job->type = type ;
+    job->recipe = cpl_strdup(recipe) ;
+    job->procatg = cpl_strdup(procatg) ;
+    job->protype = cpl_strdup(protype) ;
+
+    /* Append to the queue */
+    pthread_mutex_lock(&cr2res_io_writer.lock) ;
+    while (cr2res_io_writer.nb_pending >= CR2RES_IO_WRITER_MAX_JOBS)
+        pthread_cond_wait(&cr2res_io_writer.cond, &cr2res_io_writer.lock) ;
+    if (cr2res_io_writer.last == NULL) cr2res_io_writer.jobs = job ;
+    else cr2res_io_writer.last->next = job ;
+    cr2res_io_writer.last = job ;
+    if (cr2res_io_writer.todo == NULL) cr2res_io_writer.todo = job ;
+    cr2res_io_writer.nb_pending++ ;
+    pthread_cond_broadcast(&cr2res_io_writer.cond) ;
+    pthread_mutex_unlock(&cr2res_io_writer.lock) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Write the queued products until cr2res_io_writer_join()
+  @param    arg     unused
+  @return   NULL
+
+  The objects of a job are released once written, the frames are kept
+  for cr2res_io_writer_join().
+ */
+/*----------------------------------------------------------------------------*/
+static void * cr2res_io_writer_run(void * arg)
+{
+    cr2res_io_job   *   job ;
+    int                 det_nr ;
+
+    (void)arg ;
+    for (;;) {
+        /* Wait for the next job */
+        pthread_mutex_lock(&cr2res_io_writer.lock) ;
+        while (cr2res_io_writer.todo == NULL && !cr2res_io_writer.stop)
+            pthread_cond_wait(&cr2res_io_writer.cond, &cr2res_io_writer.lock);
+        job = cr2res_io_writer.todo ;
+        if (job != NULL) cr2res_io_writer.todo = job->next ;
+        pthread_mutex_unlock(&cr2res_io_writer.lock) ;
+        if (job == NULL) break ;
+
+        /* Save */
+        if (job->job_type == CR2RES_IO_JOB_IMAGE)
+            job->status = cr2res_io_save_image(job->filename, job->allframes,
+                    job->inframes, job->parlist, job->images, job->qc_list,
+                    job->ext_plist, job->type, job->recipe, job->procatg,
+                    job->protype) ;
+        else if (job->job_type == CR2RES_IO_JOB_IMAGELIST)
+            job->status = cr2res_io_save_imagelist(job->filename,
+                    job->allframes, job->inframes, job->parlist, job->lists,
+                    job->qc_list, job->ext_plist, job->type, job->recipe,
+                    job->procatg, job->protype) ;
+        else
+            job->status = cr2res_io_save_table(job->filename, job->allframes,
+                    job->inframes, job->parlist, job->tables, job->qc_list,
+                    job->ext_plist, job->recipe, job->procatg, job->protype);
+        if (cpl_error_get_code() != CPL_ERROR_NONE) {
+            cpl_msg_error(__func__, "Error while writing %s: %s",
+                    job->filename, cpl_error_get_message()) ;
+            job->status = -1 ;
+            cpl_error_reset() ;
+        }
+
+        /* Release the objects */
+        for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+            if (job->images[det_nr-1] != NULL)
+                hdrl_image_delete(job->images[det_nr-1]) ;
+            if (job->lists[det_nr-1] != NULL)
+                hdrl_imagelist_delete(job->lists[det_nr-1]) ;
+            if (job->tables[det_nr-1] != NULL)
+                cpl_table_delete(job->tables[det_nr-1]) ;
+            job->images[det_nr-1] = NULL ;
+            job->lists[det_nr-1] = NULL ;
+            job->tables[det_nr-1] = NULL ;
+        }
+
+        pthread_mutex_lock(&cr2res_io_writer.lock) ;
+        cr2res_io_writer.nb_pending-- ;
+        pthread_cond_broadcast(&cr2res_io_writer.cond) ;
+        pthread_mutex_unlock(&cr2res_io_writer.lock) ;
+    }
+    return NULL ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate a writer job
+  @param    job     The job to delete
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_io_job_delete(cr2res_io_job * job)
+{
+    int                 det_nr ;
+
+    if (job == NULL) return ;
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        if (job->images[det_nr-1] != NULL)
+            hdrl_image_delete(job->images[det_nr-1]) ;
+        if (job->lists[det_nr-1] != NULL)
+            hdrl_imagelist_delete(job->lists[det_nr-1]) ;
+        if (job->tables[det_nr-1] != NULL)
+            cpl_table_delete(job->tables[det_nr-1]) ;
+        if (job->ext_plist[det_nr-1] != NULL)
+            cpl_propertylist_delete(job->ext_plist[det_nr-1]) ;
+    }
+    if (job->qc_list != NULL) cpl_propertylist_delete(job->qc_list) ;
+    if (job->allframes != NULL) cpl_frameset_delete(job->allframes) ;
+    if (job->inframes != NULL) cpl_frameset_delete(job->inframes) ;
+    cpl_free(job->filename) ;
+    cpl_free(job->recipe) ;
+    cpl_free(job->procatg) ;
+    cpl_free(job->protype) ;
+    cpl_free(job) ;
+}
+#endif
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Save a multi extension table
@@ -2108,6 +3351,16 @@ static int cr2res_io_save_table(
     /* Test entries */
     if (allframes == NULL || filename == NULL || ext_plist == NULL) return -1 ;
 
+#ifdef HAVE_PTHREAD_H
+    /* Hand over to the writer thread when it runs */
+    if (cr2res_io_writer_push(CR2RES_IO_JOB_TABLE, filename, allframes,
+                inframes, parlist, (void **)tab, qc_list, ext_plist,
+                CPL_TYPE_UNSPECIFIED, recipe, procatg, protype) == 0) return 0 ;
+#endif
+
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     /* Add the PRO keys */
     if (qc_list != NULL) pro_list = cpl_propertylist_duplicate(qc_list) ;
     else pro_list = cpl_propertylist_new() ;
@@ -2212,6 +3465,9 @@ static int cr2res_io_save_one_table(
     if (allframes == NULL || filename == NULL || ext_plist == NULL ||
             extname == NULL) return -1 ;
 
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     /* Add the PRO keys */
     if (qc_list != NULL) pro_list = cpl_propertylist_duplicate(qc_list) ;
     else pro_list = cpl_propertylist_new() ;
@@ -2275,6 +3531,13 @@ static int cr2res_io_save_image(
     char          		*   wished_extname ;
     int                     det_nr ;
 
+#ifdef HAVE_PTHREAD_H
+    /* Hand over to the writer thread when it runs */
+    if (cr2res_io_writer_push(CR2RES_IO_JOB_IMAGE, filename, allframes,
+                inframes, parlist, (void **)data, qc_list, ext_plist, type,
+                recipe, procatg, protype) == 0) return 0 ;
+#endif
+
     /* Create a local QC list and add the PRO.CATG */
     if (qc_list == NULL) {
         qclist_loc = cpl_propertylist_new();
@@ -2284,6 +3547,9 @@ static int cr2res_io_save_image(
     cpl_propertylist_update_string(qclist_loc, CPL_DFS_PRO_CATG, procatg);
     cpl_propertylist_update_string(qclist_loc, CPL_DFS_PRO_TYPE, protype);
 
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     /* Create the Primary Data Unit without data */
     if (cpl_dfs_save_propertylist(allframes, NULL, parlist, inframes, NULL, 
                 recipe, qclist_loc, NULL,
@@ -2372,6 +3638,13 @@ static int cr2res_io_save_imagelist(
     int                     det_nr ;
     cpl_size                i ;
 
+#ifdef HAVE_PTHREAD_H
+    /* Hand over to the writer thread when it runs */
+    if (cr2res_io_writer_push(CR2RES_IO_JOB_IMAGELIST, filename, allframes,
+                inframes, parlist, (void **)data, qc_list, ext_plist, type,
+                recipe, procatg, protype) == 0) return 0 ;
+#endif
+
     /* Create a local QC list and add the PRO.CATG */
     if (qc_list == NULL) {
         qclist_loc = cpl_propertylist_new();
@@ -2381,6 +3654,9 @@ static int cr2res_io_save_imagelist(
     cpl_propertylist_update_string(qclist_loc, CPL_DFS_PRO_CATG, procatg);
     cpl_propertylist_update_string(qclist_loc, CPL_DFS_PRO_TYPE, protype);
 
+    /* The extension numbers of the file may change */
+    cr2res_io_ext_cache_forget(filename) ;
+
     /* Create the Primary Data Unit without data */
     if (cpl_dfs_save_propertylist(allframes, NULL, parlist, inframes, NULL,
                 recipe, qclist_loc, NULL,
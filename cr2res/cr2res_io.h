@@ -29,6 +29,13 @@
 
 #include "cr2res_utils.h"
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* Pixels of a raw image mapped from its file */
+typedef struct _cr2res_io_raw_ cr2res_io_raw ;
+
 /*-----------------------------------------------------------------------------
                                    Functions prototypes
  -----------------------------------------------------------------------------*/
@@ -64,11 +71,25 @@ int cr2res_io_get_ext_idx(
         const char  *   filename,
         int             detector,
         int             data) ;
+void cr2res_io_ext_cache_forget(const char * filename) ;
+void cr2res_io_ext_cache_clear(void) ;
 
 hdrl_image * cr2res_io_load_image(
         const char  *   in,
         int             detector) ;
 
+hdrl_image * cr2res_io_load_image_window(
+        const char  *   in,
+        int             detector,
+        int             ymin,
+        int             ymax) ;
+
+hdrl_image * cr2res_io_load_image_rows(
+        const char  *   in,
+        int             detector,
+        int             ymin,
+        int             ymax) ;
+
 hdrl_imagelist * cr2res_io_load_image_list(
         const char  *   in,
         int             detector) ;
@@ -77,6 +98,28 @@ hdrl_imagelist * cr2res_io_load_image_list_from_set(
         const cpl_frameset  *   in,
         int                     detector) ;
 
+hdrl_imagelist * cr2res_io_load_image_list_from_set_rows(
+        const cpl_frameset  *   in,
+        int                     detector,
+        int                     ymin,
+        int                     ymax) ;
+
+int cr2res_io_writer_start(void) ;
+int cr2res_io_writer_join(void) ;
+
+cr2res_io_raw * cr2res_io_raw_open(
+        const char  *   filename,
+        int             detector) ;
+cpl_size cr2res_io_raw_get_size_x(const cr2res_io_raw * raw) ;
+cpl_size cr2res_io_raw_get_size_y(const cr2res_io_raw * raw) ;
+int cr2res_io_raw_get_rows(
+        const cr2res_io_raw *   raw,
+        cpl_size                ymin,
+        cpl_size                ymax,
+        double              *   out) ;
+hdrl_image * cr2res_io_raw_load_image(const cr2res_io_raw * raw) ;
+void cr2res_io_raw_close(cr2res_io_raw * raw) ;
+
 cpl_table * cr2res_load_table(
         const char  *   in,
         int             det_nr,
@@ -27,6 +27,9 @@
 
 #include <math.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <cpl.h>
 #include "cr2res_dfs.h"
@@ -41,6 +44,8 @@
                                    Defines
  -----------------------------------------------------------------------------*/
 #define min(a,b) (((a)<(b))?(a):(b))
+/* Rows per band in the streaming signal detection */
+#define CR2RES_TRACE_DETECT_BAND    128
 #define any(arr, f) ({  \
     int isError = FALSE;\
     for (cpl_size i = 0; i < cpl_array_get_size(arr); i++) \
@@ -79,6 +84,26 @@ static cpl_mask * cr2res_trace_signal_detect(
         int                 smooth_x,
         int                 smooth_y,
         double              thresh) ;
+static void cr2res_trace_smooth_row(
+        const double        *   in,
+        const cpl_binary    *   bad,
+        int                     nx,
+        int                     hx,
+        double              *   out) ;
+static void cr2res_trace_signal_detect_band(
+        const double        *   pimage,
+        const cpl_binary    *   pbpm,
+        int                     nx,
+        int                     ny,
+        int                     hx,
+        int                     hy,
+        double                  shift,
+        double                  thresh,
+        int                     row_start,
+        int                     row_end,
+        cpl_binary          *   pmask,
+        double              *   psmx,
+        double              *   psmxy) ;
 static cpl_table * cr2res_trace_fit_traces(
         cpl_table   *   clustertable,
         int             degree) ;
@@ -87,7 +112,11 @@ static cpl_array * cr2res_trace_fit_trace(
         int             degree) ;
 static cpl_table * cr2res_trace_restore_edge_traces(
         cpl_table   *   trace_table) ;
-static cpl_table * cr2res_trace_convert_labels_to_cluster(cpl_image * labels) ;
+static int cr2res_trace_cluster_offsets(
+        const int   *   pclusters,
+        cpl_size        nrow,
+        int             nclusters,
+        cpl_size    *   offsets) ;
 static cpl_mask * cr2res_trace_clean_blobs(
         cpl_mask    *   mask,
         int             min_cluster) ;
@@ -147,9 +176,9 @@ static double cr2res_trace_calculate_pixel_shift(
   @return The newly allocated trace table or NULL in error case
 
   A detection is applied to create a mask. This one is labelised.
-  The function converts the label image in the proper cluster table in
+  The function converts the labels in the proper cluster table in
   trace to call the traces fitting function.
-  The cluster table contains the label image information in the form of
+  The cluster table contains the labels information in the form of
   a table. One column per pixel. The columns are xs (pixel x position),
   ys (pixel y position) and cluster (label number).
   The returned table contains 1 line per trace. Each line has 3 polynomials
@@ -172,12 +201,12 @@ cpl_table * cr2res_trace(
 {
     cpl_mask        *   mask ;
     cpl_mask        *   mask_clean ;
-    cpl_image       *   labels ;
+    cr2res_cluster_labels   *   labels ;
+    cpl_image       *   label_image ;
     cpl_apertures   *   aperts ;
     cpl_table       *   clustertable ;
     cpl_table       *   trace_table ;
     cpl_table       *   restored_trace_table ;
-    cpl_size            nlabels ;
 
     /* Check Entries */
     if (ima == NULL) return NULL ;
@@ -205,35 +234,33 @@ cpl_table * cr2res_trace(
 
     /* Labelization */
     cpl_msg_info(__func__, "Labelise the traces") ;
-    if ((labels=cpl_image_labelise_mask_create(mask_clean, &nlabels)) == NULL) {
+    if ((labels = cr2res_cluster_labels_new(mask_clean)) == NULL) {
         cpl_msg_error(__func__, "Cannot labelise") ;
         cpl_mask_delete(mask_clean);
         return NULL ;
     }
     cpl_mask_delete(mask_clean);
 
-    /* Analyse and dump traces */
+    /* Create cluster table needed for fitting */
+    clustertable = cr2res_cluster_labels_get_table(labels) ;
+
+    /* Analyse and dump traces - the label image is only built for debug */
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-        if (cpl_image_get_max(labels) != 0){
-            aperts = cpl_apertures_new_from_image(ima, labels);
+        label_image = cr2res_cluster_labels_get_image(labels) ;
+        if (cr2res_cluster_labels_get_size(labels) > 0) {
+            aperts = cpl_apertures_new_from_image(ima, label_image);
             cpl_apertures_dump(aperts, stdout) ;
             cpl_apertures_delete(aperts) ;
         } else {
             cpl_msg_debug(__func__, "No labels found, can not create aperture");
         }
-    }
-
-    /* Create cluster table needed for fitting */
-    clustertable = cr2res_trace_convert_labels_to_cluster(labels) ;
-
-    /* Debug Saving */
-    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
-		cpl_image_save(labels, "debug_labels.fits",
+		cpl_image_save(label_image, "debug_labels.fits",
 				CPL_TYPE_INT, NULL, CPL_IO_CREATE);
+        cpl_image_delete(label_image) ;
         cpl_table_save(clustertable, NULL, NULL, "debug_cluster_table.fits",
                 CPL_IO_CREATE);
     }
-    cpl_image_delete(labels) ;
+    cr2res_cluster_labels_delete(labels) ;
 
     /* Fit the traces */
     cpl_msg_info(__func__, "Fit the trace edges") ;
@@ -283,7 +310,6 @@ cpl_mask * cr2res_trace_clean(
         int             opening,
         int             min_cluster)
 {
-    cpl_mask    *   mask_kernel ;
     cpl_mask    *   new_mask ;
     cpl_mask    *   diff_mask ;
     cpl_mask    *   clean_mask ;
@@ -295,12 +321,10 @@ cpl_mask * cr2res_trace_clean(
     /* Apply a opening to join horizontally the close clusters */
     if (opening) {
         cpl_msg_info(__func__, "Apply Opening to cleanup the traces") ;
-        mask_kernel = cpl_mask_new(5, 1) ;
-        cpl_mask_not(mask_kernel);
-        new_mask = cpl_mask_duplicate(mask) ;
-        cpl_mask_filter(new_mask, mask, mask_kernel, CPL_FILTER_OPENING,
-                CPL_BORDER_COPY) ;
-        cpl_mask_delete(mask_kernel) ;
+        if ((new_mask = cr2res_cluster_opening_x(mask, 5)) == NULL) {
+            cpl_msg_error(__func__, "Cannot apply the opening") ;
+            return NULL ;
+        }
 
         /* Compute the difference */
         diff_mask = cpl_mask_duplicate(mask) ;
@@ -816,6 +840,81 @@ int cr2res_trace_get_height(
     return height;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Computes the detector rows covered by some traces
+  @param    trace       TRACE table
+  @param    order_idx   the order_idx (-1 for all)
+  @param    trace_nb    the trace number (-1 for all)
+  @param    margin      number of rows added below and above
+  @param    size        the detector size
+  @param    ymin        [out] the first covered row (1 for the first)
+  @param    ymax        [out] the last covered row
+  @return   0 if ok, -1 in error case or if no trace is selected
+
+  The rows between the lower and the upper edges of the selected traces
+  over the columns 1 to size, widened by margin and clipped to 1..size.
+  The selection is the one of cr2res_extract_traces().
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_trace_get_rows(
+        const cpl_table *   trace,
+        int                 order_idx,
+        int                 trace_nb,
+        int                 margin,
+        int                 size,
+        int             *   ymin,
+        int             *   ymax)
+{
+    cpl_polynomial  *   poly_upper ;
+    cpl_polynomial  *   poly_lower ;
+    double              lo, up, val ;
+    cpl_size            i, x ;
+
+    /* Check entries */
+    if (trace == NULL || ymin == NULL || ymax == NULL || size < 1) return -1 ;
+
+    /* Loop on the selected traces */
+    lo = size + 1.0 ;
+    up = 0.0 ;
+    for (i=0 ; i<cpl_table_get_nrow(trace) ; i++) {
+        if (order_idx > -1 && cpl_table_get(trace, CR2RES_COL_ORDER, i,
+                    NULL) != order_idx) continue ;
+        if (trace_nb > -1 && cpl_table_get(trace, CR2RES_COL_TRACENB, i,
+                    NULL) != trace_nb) continue ;
+
+        /* Get the trace edges */
+        poly_upper = cr2res_convert_array_to_poly(cpl_table_get_array(trace,
+                    CR2RES_COL_UPPER, i)) ;
+        poly_lower = cr2res_convert_array_to_poly(cpl_table_get_array(trace,
+                    CR2RES_COL_LOWER, i)) ;
+        if (poly_upper == NULL || poly_lower == NULL) {
+            if (poly_upper != NULL) cpl_polynomial_delete(poly_upper) ;
+            if (poly_lower != NULL) cpl_polynomial_delete(poly_lower) ;
+            return -1 ;
+        }
+
+        /* Extreme positions over the detector width */
+        for (x=1 ; x<=size ; x++) {
+            val = cpl_polynomial_eval_1d(poly_lower, (double)x, NULL) ;
+            if (val < lo) lo = val ;
+            val = cpl_polynomial_eval_1d(poly_upper, (double)x, NULL) ;
+            if (val > up) up = val ;
+        }
+        cpl_polynomial_delete(poly_upper) ;
+        cpl_polynomial_delete(poly_lower) ;
+    }
+
+    /* No trace selected or traces out of the detector */
+    if (up < lo || up < 1.0 || lo > size) return -1 ;
+
+    *ymin = (int)floor(lo) - margin ;
+    *ymax = (int)ceil(up) + margin ;
+    if (*ymin < 1) *ymin = 1 ;
+    if (*ymax > size) *ymax = size ;
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Computes the positions between 2 trace polynomials
@@ -1657,7 +1756,7 @@ cpl_table * cr2res_trace_adjust(
             CPL_ERROR_NONE) {
         cpl_msg_error(__func__, "Failed to Collapse") ;
         hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return NULL ;
     }
     hdrl_imagelist_delete(imlist) ;
@@ -1670,7 +1769,7 @@ cpl_table * cr2res_trace_adjust(
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
         cpl_msg_error(__func__, "Failed compute the traces") ;
         hdrl_image_delete(collapsed) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return NULL ;
     }
     hdrl_image_delete(collapsed) ;
@@ -2115,8 +2214,16 @@ static cpl_array * cr2res_trace_get_slit_frac(
   @return   A newly allocated mask or NULL in error case.
 
   The returned mask identifies the pixels belonging to a trace
-  The input image is smoothed, subtracted to the result, and a simple
-  thresholding is applied. 
+  The input image is smoothed in x (running mean), shifted to counts > 1,
+  and smoothed again in y in the logarithmic domain. The pixels where the
+  x-smoothed image exceeds the xy-smoothed one by more than thresh are
+  selected. Both filters ignore the bad pixels and are truncated on the
+  image borders. The pixels without any good pixel in their window are
+  never selected.
+
+  The computation is done in one streaming pass over bands of rows, with
+  running sums over a buffer of kernel_y rows: no intermediate image is
+  created.
  */
 /*----------------------------------------------------------------------------*/
 static cpl_mask * cr2res_trace_signal_detect(
@@ -2125,19 +2232,17 @@ static cpl_mask * cr2res_trace_signal_detect(
         int                 smooth_y,
         double              thresh)
 {
-    cpl_image       *smx_image;
-    cpl_image       *smxy_image;
-    cpl_image       *tmp_image;
-    cpl_mask        *smxy_mask;
-    double          *smxy_data;
-    double          *img_column, *wgt_column;
-    cpl_binary      *smxy_mskdata;
-    int              kernel_x, kernel_y;
-    cpl_size         icol, ncols, irow, nrows;
-    cpl_mask        *kernel;
-    cpl_mask        *mask;
-    int              log, opt_filter;
-    int              options[3];
+    cpl_mask        *   mask ;
+    cpl_binary      *   pmask ;
+    const cpl_mask  *   bpm ;
+    const cpl_binary *  pbpm ;
+    const double    *   pimage ;
+    cpl_image       *   smx_image ;
+    cpl_image       *   smxy_image ;
+    double          *   psmx ;
+    double          *   psmxy ;
+    double              img_min, shift ;
+    int                 kernel_x, kernel_y, nx, ny, nbands, b ;
 
     /* Check Entries */
     if (image == NULL) return NULL;
@@ -2147,117 +2252,236 @@ static cpl_mask * cr2res_trace_signal_detect(
     }
     if (smooth_x < 0 || smooth_y < 0) return NULL;
 
-    /* Flags. TODO: decide whether to expose these to caller and/or user */    
-    log=1;
-    opt_filter=0;
-
     /* Prepare kernel */
     kernel_x = smooth_x;
     if (kernel_x % 2 == 0) kernel_x++;
     kernel_y = smooth_y ;
     if (kernel_y % 2 == 0) kernel_y++;
 
-    // Start with smooth in X
-    kernel = cpl_mask_new(kernel_x, 1);
-    cpl_mask_not(kernel);
-    
-    smx_image = cpl_image_duplicate(image);
-    if (cpl_image_filter_mask(smx_image, image, kernel, CPL_FILTER_AVERAGE_FAST,
-                CPL_BORDER_FILTER) != CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Cannot filter the image");
-        cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT);
-        cpl_mask_delete(kernel);
-        cpl_image_delete(smx_image);
-        return NULL;
+    /* Initialise */
+    nx = cpl_image_get_size_x(image) ;
+    ny = cpl_image_get_size_y(image) ;
+    pimage = cpl_image_get_data_double_const(image) ;
+    bpm = cpl_image_get_bpm_const(image) ;
+    pbpm = (bpm == NULL) ? NULL : cpl_mask_get_data_const(bpm) ;
+
+    /* Minimum of the x-smoothed image, to shift it to counts >1 */
+    img_min = DBL_MAX ;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(cr2res_thread_budget())
+#endif
+    {
+        double  *   row ;
+        double      loc_min ;
+        int         i, j ;
+
+        row = cpl_malloc(nx * sizeof(double)) ;
+        loc_min = DBL_MAX ;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (j=0 ; j<ny ; j++) {
+            cr2res_trace_smooth_row(pimage + (cpl_size)j*nx,
+                    pbpm == NULL ? NULL : pbpm + (cpl_size)j*nx, nx,
+                    kernel_x/2, row) ;
+            for (i=0 ; i<nx ; i++)
+                if (!isnan(row[i]) && row[i] < loc_min) loc_min = row[i] ;
+        }
+#ifdef _OPENMP
+#pragma omp critical (cr2res_trace_signal_detect_min)
+#endif
+        if (loc_min < img_min) img_min = loc_min ;
+        cpl_free(row) ;
     }
-    cpl_mask_delete(kernel);
 
-
-    if (log) {  // Filter log image instead of the original
-        /* Shift image to counts >1 so that log works */
-        double img_min = cpl_image_get_min(smx_image)-1.0;
-        cpl_image_subtract_scalar(smx_image, img_min);
-        smxy_image = cpl_image_logarithm_create(smx_image, CPL_MATH_E);
-    } else {
-        smxy_image = cpl_image_duplicate(smx_image);
+    /* Create the output mask */
+    mask = cpl_mask_new(nx, ny) ;
+    if (img_min == DBL_MAX) {
+        cpl_msg_warning(__func__, "No good pixel in the image") ;
+        return mask ;
     }
-    
-    if (opt_filter) {  /* Vertical filtering is done using optimal filter */
-        // TODO: Move filter preparation into own function and call this instead
-        /* Number of columns */
-        ncols = cpl_image_get_size_x(image);
-        nrows = cpl_image_get_size_y(image);
-        /* Set options */
-        options[0]=options[2]=0;
-        options[1]=1;
-        smxy_mask = cpl_image_get_bpm(smxy_image);
-        smxy_mskdata = cpl_mask_get_data(smxy_mask);
-        smxy_data = cpl_image_get_data_double(smxy_image);
-        img_column = (double *)cpl_malloc(nrows*sizeof(double));
-        wgt_column = (double *)cpl_malloc(nrows*sizeof(double));
-
-        for (icol=0; icol<ncols; icol++) {
-            for (irow=0; irow<nrows; irow++) {
-                img_column[irow] = smxy_data[icol+irow*ncols];
-                wgt_column[irow] = !smxy_mskdata[icol+irow*ncols];
-            }
-            if (cr2res_util_optimal_filter_1d(img_column, (double)smooth_y,
-                                    img_column, nrows, options,
-                                    NULL, wgt_column, 0.) != CPL_ERROR_NONE) {
-                cpl_msg_error(__func__, "Cannot filter the image");
-                cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT);
-                cpl_image_delete(smx_image);
-                cpl_image_delete(smxy_image);
-                cpl_free(img_column);
-                cpl_free(wgt_column);
-                return NULL;
-            }
-            for (irow=0; irow<nrows; irow++)
-                smxy_data[icol+irow*ncols] = img_column[irow];
-        }
-        cpl_free(img_column);
-        cpl_free(wgt_column);
-    }
-    else {     // Boxcar average instead of optimal filter
-        kernel = cpl_mask_new(1, kernel_y);
-        cpl_mask_not(kernel);
-        tmp_image = cpl_image_duplicate(smxy_image);
-        if (cpl_image_filter_mask(smxy_image, tmp_image, kernel,
-                    CPL_FILTER_AVERAGE_FAST,
-                    CPL_BORDER_FILTER) != CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Cannot filter the image");
-            cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT);
-            cpl_mask_delete(kernel);
-            cpl_image_delete(smx_image);
-            cpl_image_delete(tmp_image);
-            return NULL;
-        }
-        cpl_mask_delete(kernel);
-        cpl_image_delete(tmp_image);
-        }
-    
-    if (log) {
-    // Potentitating the filtered image before comparing to the original
-        if (cpl_image_exponential(smxy_image, CPL_MATH_E) != CPL_ERROR_NONE)
-            cpl_msg_error(__func__, "Cannot exponentiate the smxy_image");
+    pmask = cpl_mask_get_data(mask) ;
+    shift = img_min - 1.0 ;
+
+    /* The intermediate images are only needed for the debug output */
+    smx_image = smxy_image = NULL ;
+    psmx = psmxy = NULL ;
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
+        smx_image = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+        smxy_image = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+        psmx = cpl_image_get_data_double(smx_image) ;
+        psmxy = cpl_image_get_data_double(smxy_image) ;
     }
 
-    /* Subtract x-smoothed image from xy-smoothed */
-    cpl_image_subtract(smx_image, smxy_image);
+    /* Stream over the bands of rows */
+    nbands = (ny + CR2RES_TRACE_DETECT_BAND - 1) / CR2RES_TRACE_DETECT_BAND ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(dynamic,1)
+#endif
+    for (b=0 ; b<nbands ; b++) {
+        cr2res_trace_signal_detect_band(pimage, pbpm, nx, ny, kernel_x/2,
+                kernel_y/2, shift, thresh, b*CR2RES_TRACE_DETECT_BAND,
+                min(ny, (b+1)*CR2RES_TRACE_DETECT_BAND), pmask, psmx, psmxy) ;
+    }
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
         cpl_image_save(smxy_image, "debug_smxyimage.fits", CPL_TYPE_DOUBLE, NULL,
                 CPL_IO_CREATE);
         cpl_image_save(smx_image, "debug_smximage.fits", CPL_TYPE_DOUBLE, NULL,
                 CPL_IO_CREATE);
+        cpl_image_delete(smx_image) ;
+        cpl_image_delete(smxy_image) ;
     }
+    return mask ;
+}
 
-    /* Wanted pixels are where input image exceeds sm_image by thresh */
-    mask = cpl_mask_threshold_image_create(smx_image, thresh, DBL_MAX);
-    cpl_image_delete(smx_image);
-    cpl_image_delete(smxy_image);
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Running mean of an image row
+  @param in     The row values
+  @param bad    The row bad pixels flags, or NULL
+  @param nx     The row size
+  @param hx     Half width of the window
+  @param out    [out] The nx smoothed values, NAN without any good pixel
+  @return   void
+
+  The window is truncated on the row borders.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_trace_smooth_row(
+        const double        *   in,
+        const cpl_binary    *   bad,
+        int                     nx,
+        int                     hx,
+        double              *   out)
+{
+    double      sum ;
+    int         i, k, count ;
 
-    return mask ;
+    sum = 0.0 ;
+    count = 0 ;
+    for (k=0 ; k<=hx && k<nx ; k++) {
+        if (bad != NULL && bad[k]) continue ;
+        sum += in[k] ;
+        count++ ;
+    }
+    for (i=0 ; i<nx ; i++) {
+        out[i] = count > 0 ? sum / count : NAN ;
+
+        /* Slide the window */
+        k = i + hx + 1 ;
+        if (k < nx && (bad == NULL || !bad[k])) {
+            sum += in[k] ;
+            count++ ;
+        }
+        k = i - hx ;
+        if (k >= 0 && (bad == NULL || !bad[k])) {
+            sum -= in[k] ;
+            count-- ;
+            if (count == 0) sum = 0.0 ;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Detect the Traces signal on a band of rows
+  @param pimage     The input image data
+  @param pbpm       The input image bad pixels, or NULL
+  @param nx         The image x size
+  @param ny         The image y size
+  @param hx         Half width of the x kernel
+  @param hy         Half width of the y kernel
+  @param shift      Subtracted to the x-smoothed values (counts >1)
+  @param thresh     The threshold used for detection
+  @param row_start  First row of the band
+  @param row_end    Last row of the band (excluded)
+  @param pmask      [out] The detection mask
+  @param psmx       [out] The x-smoothed minus xy-smoothed image, or NULL
+  @param psmxy      [out] The xy-smoothed image, or NULL
+  @return   void
+
+  The x-smoothed rows entering the y window are kept in a ring buffer of
+  2*hy+1 rows, with their logarithms summed per column.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_trace_signal_detect_band(
+        const double        *   pimage,
+        const cpl_binary    *   pbpm,
+        int                     nx,
+        int                     ny,
+        int                     hx,
+        int                     hy,
+        double                  shift,
+        double                  thresh,
+        int                     row_start,
+        int                     row_end,
+        cpl_binary          *   pmask,
+        double              *   psmx,
+        double              *   psmxy)
+{
+    double      *   ring ;
+    double      *   ring_log ;
+    double      *   colsum ;
+    int         *   colcount ;
+    double      *   pval ;
+    double      *   plog ;
+    double          smxy ;
+    int             nring, first, next, i, j, k ;
+
+    nring = 2 * hy + 1 ;
+    ring = cpl_malloc((cpl_size)nring * nx * sizeof(double)) ;
+    ring_log = cpl_malloc((cpl_size)nring * nx * sizeof(double)) ;
+    colsum = cpl_calloc(nx, sizeof(double)) ;
+    colcount = cpl_calloc(nx, sizeof(int)) ;
+
+    first = next = (row_start - hy < 0) ? 0 : row_start - hy ;
+    for (j=row_start ; j<row_end ; j++) {
+        /* Remove the row leaving the window, its slot is reused below */
+        k = j - hy - 1 ;
+        if (k >= first) {
+            pval = ring + (cpl_size)(k % nring) * nx ;
+            plog = ring_log + (cpl_size)(k % nring) * nx ;
+            for (i=0 ; i<nx ; i++) {
+                if (isnan(pval[i])) continue ;
+                colsum[i] -= plog[i] ;
+                colcount[i]-- ;
+                if (colcount[i] == 0) colsum[i] = 0.0 ;
+            }
+        }
+
+        /* Add the rows entering the window */
+        for ( ; next <= j + hy && next < ny ; next++) {
+            pval = ring + (cpl_size)(next % nring) * nx ;
+            plog = ring_log + (cpl_size)(next % nring) * nx ;
+            cr2res_trace_smooth_row(pimage + (cpl_size)next*nx,
+                    pbpm == NULL ? NULL : pbpm + (cpl_size)next*nx, nx, hx,
+                    pval) ;
+            for (i=0 ; i<nx ; i++) {
+                if (isnan(pval[i])) continue ;
+                pval[i] -= shift ;
+                plog[i] = log(pval[i]) ;
+                colsum[i] += plog[i] ;
+                colcount[i]++ ;
+            }
+        }
+
+        /* Compare the x-smoothed row to the xy-smoothed one */
+        pval = ring + (cpl_size)(j % nring) * nx ;
+        for (i=0 ; i<nx ; i++) {
+            if (isnan(pval[i]) || colcount[i] == 0) continue ;
+            smxy = exp(colsum[i] / colcount[i]) ;
+            if (pval[i] - smxy > thresh)
+                pmask[(cpl_size)j*nx+i] = CPL_BINARY_1 ;
+            if (psmx != NULL) psmx[(cpl_size)j*nx+i] = pval[i] - smxy ;
+            if (psmxy != NULL) psmxy[(cpl_size)j*nx+i] = smxy ;
+        }
+    }
+    cpl_free(ring) ;
+    cpl_free(ring_log) ;
+    cpl_free(colsum) ;
+    cpl_free(colcount) ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -2385,6 +2609,12 @@ static cpl_table * cr2res_trace_restore_edge_traces(
   identifies the upper and lower edges and fits a polynomial to them. It
   also fits a polynomial using all the pixels of the trace.
 
+  The pixels are bucketed by label in a single pass: if the table rows
+  are already grouped by label (as returned by
+  cr2res_cluster_labels_get_table()), each trace is a contiguous
+  slice of the table, otherwise a grouped copy is made first. The traces
+  are then fitted in parallel.
+
   The returned table contains 1 line per trace. Each line has 3 polynomials
   (All, Upper and Lower).
  */
@@ -2393,14 +2623,21 @@ static cpl_table * cr2res_trace_fit_traces(
         cpl_table   *   clustertable,
         int             degree)
 {
-    cpl_array   *    fitparams_all;
-    cpl_array   *    fitparams_upper;
-    cpl_array   *    fitparams_lower;
+    cpl_array   **   fitparams_all;
+    cpl_array   **   fitparams_upper;
+    cpl_array   **   fitparams_lower;
     cpl_table   *    traces_table;
-    cpl_table   *    trace_table;
-    cpl_table   *    edge_upper_table;
-    cpl_table   *    edge_lower_table;
-    cpl_size         nclusters_cur;
+    cpl_table   *    grouped;
+    const cpl_table * source;
+    const int   *    pclusters;
+    const int   *    pxs;
+    const int   *    pys;
+    int         *    pgxs;
+    int         *    pgys;
+    int         *    pgclusters;
+    cpl_size    *    offsets;
+    cpl_size    *    cursor;
+    cpl_size         nrow, k;
     int              i, nclusters;
 
     /* Check entries */
@@ -2416,46 +2653,94 @@ static cpl_table * cr2res_trace_fit_traces(
             degree+1) ;
     cpl_table_new_column_array(traces_table, CR2RES_COL_LOWER, CPL_TYPE_DOUBLE,
             degree+1) ;
+    if (nclusters < 1) return traces_table ;
+
+    /* Bucket the pixels by label */
+    nrow = cpl_table_get_nrow(clustertable) ;
+    pclusters = cpl_table_get_data_int_const(clustertable,
+            CR2RES_COL_CLUSTERS) ;
+    offsets = cpl_malloc((nclusters+2) * sizeof(cpl_size)) ;
+    grouped = NULL ;
+    source = clustertable ;
+    if (!cr2res_trace_cluster_offsets(pclusters, nrow, nclusters, offsets)) {
+        /* Not grouped yet - scatter the rows into a grouped copy */
+        grouped = cpl_table_new(offsets[nclusters+1]) ;
+        cpl_table_new_column(grouped, CR2RES_COL_XS, CPL_TYPE_INT) ;
+        cpl_table_new_column(grouped, CR2RES_COL_YS, CPL_TYPE_INT) ;
+        cpl_table_new_column(grouped, CR2RES_COL_CLUSTERS, CPL_TYPE_INT) ;
+        pgxs = cpl_table_get_data_int(grouped, CR2RES_COL_XS) ;
+        pgys = cpl_table_get_data_int(grouped, CR2RES_COL_YS) ;
+        pgclusters = cpl_table_get_data_int(grouped, CR2RES_COL_CLUSTERS) ;
+        pxs = cpl_table_get_data_int_const(clustertable, CR2RES_COL_XS) ;
+        pys = cpl_table_get_data_int_const(clustertable, CR2RES_COL_YS) ;
+        cursor = cpl_malloc((nclusters+2) * sizeof(cpl_size)) ;
+        memcpy(cursor, offsets, (nclusters+2) * sizeof(cpl_size)) ;
+        for (k=0 ; k<nrow ; k++) {
+            if (pclusters[k] < 1 || pclusters[k] > nclusters) continue ;
+            pgxs[cursor[pclusters[k]]] = pxs[k] ;
+            pgys[cursor[pclusters[k]]] = pys[k] ;
+            pgclusters[cursor[pclusters[k]]] = pclusters[k] ;
+            cursor[pclusters[k]]++ ;
+        }
+        cpl_free(cursor) ;
+        source = grouped ;
+    }
 
-    /* Loop on the clusters */
+    /* Fit the traces, they are independent of each other */
+    fitparams_all = cpl_calloc(nclusters, sizeof(cpl_array *)) ;
+    fitparams_upper = cpl_calloc(nclusters, sizeof(cpl_array *)) ;
+    fitparams_lower = cpl_calloc(nclusters, sizeof(cpl_array *)) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(cr2res_thread_budget()) \
+    schedule(dynamic,1)
+#endif
     for (i=1 ; i<=nclusters ; i++) {
-        /* Select the pixels of the current cluster */
-        nclusters_cur = cpl_table_and_selected_int(clustertable,
-                CR2RES_COL_CLUSTERS, CPL_EQUAL_TO, i);
+        cpl_table   *   trace_table ;
+        cpl_table   *   edge_upper_table ;
+        cpl_table   *   edge_lower_table ;
+        cpl_size        nclusters_cur ;
+
+        nclusters_cur = offsets[i+1] - offsets[i] ;
         cpl_msg_debug(__func__, "Cluster %d has %"CPL_SIZE_FORMAT" pixels",
                 i, nclusters_cur);
+        if (nclusters_cur == 0) continue ;
 
         /* Extract the table with the current trace pixels */
-        trace_table = cpl_table_extract_selected(clustertable);
+        trace_table = cpl_table_extract(source, offsets[i], nclusters_cur);
 
         /* Fit the current trace */
-        fitparams_all = cr2res_trace_fit_trace(trace_table, degree);
-        cpl_table_set_array(traces_table, "All", i-1, fitparams_all);
-        cpl_array_delete(fitparams_all);
+        fitparams_all[i-1] = cr2res_trace_fit_trace(trace_table, degree);
 
         /* Extract the edges of the current trace pixels */
         cr2res_trace_extract_edges(trace_table, &edge_lower_table,
                 &edge_upper_table) ;
+        cpl_table_delete(trace_table);
 
-        /* Fit the upper edge of the current trace */
-        fitparams_upper = cr2res_trace_fit_trace(edge_upper_table, degree);
+        /* Fit the upper and lower edges of the current trace */
+        fitparams_upper[i-1] = cr2res_trace_fit_trace(edge_upper_table,
+                degree);
         cpl_table_delete(edge_upper_table);
-        cpl_table_set_array(traces_table, CR2RES_COL_UPPER, i-1,
-                fitparams_upper);
-        cpl_array_delete(fitparams_upper);
-
-        /* Fit the lower edge of the current trace */
-        fitparams_lower = cr2res_trace_fit_trace(edge_lower_table, degree);
+        fitparams_lower[i-1] = cr2res_trace_fit_trace(edge_lower_table,
+                degree);
         cpl_table_delete(edge_lower_table);
-        cpl_table_set_array(traces_table, CR2RES_COL_LOWER, i-1,
-                fitparams_lower);
-        cpl_array_delete(fitparams_lower);
-
-        cpl_table_delete(trace_table);
-
-        /* Reset the selection */
-        cpl_table_select_all(clustertable);
     }
+    if (grouped != NULL) cpl_table_delete(grouped) ;
+    cpl_free(offsets) ;
+
+    /* Store the results in order */
+    for (i=0 ; i<nclusters ; i++) {
+        cpl_table_set_array(traces_table, CR2RES_COL_ALL, i, fitparams_all[i]);
+        cpl_table_set_array(traces_table, CR2RES_COL_UPPER, i,
+                fitparams_upper[i]);
+        cpl_table_set_array(traces_table, CR2RES_COL_LOWER, i,
+                fitparams_lower[i]);
+        cpl_array_delete(fitparams_all[i]);
+        cpl_array_delete(fitparams_upper[i]);
+        cpl_array_delete(fitparams_lower[i]);
+    }
+    cpl_free(fitparams_all) ;
+    cpl_free(fitparams_upper) ;
+    cpl_free(fitparams_lower) ;
     return traces_table;
 }
 
@@ -2537,53 +2822,39 @@ static cpl_array * cr2res_trace_fit_trace(
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Convert Labels image to the cluster table
-  @param labels     The label image
-  @return   A newly allocated cluster table or NULL in error case
-
-  The cluster table contains the label image information in the form of
-  a table. One column per pixel. The columns are xs (pixel x position),
-  ys (pixel y position) and cluster (label number).
+  @brief    Compute the first row of each label in a cluster table
+  @param pclusters  The labels column
+  @param nrow       The number of rows
+  @param nclusters  The largest label
+  @param offsets    [out] nclusters+2 values
+  @return   1 if the rows are grouped by increasing label, 0 otherwise
+
+  Once grouped, the rows of label i are [offsets[i], offsets[i+1]).
+  offsets[nclusters+1] is the number of rows with a label in
+  [1, nclusters]; the other rows are ignored.
  */
 /*----------------------------------------------------------------------------*/
-static cpl_table * cr2res_trace_convert_labels_to_cluster(cpl_image * labels)
+static int cr2res_trace_cluster_offsets(
+        const int   *   pclusters,
+        cpl_size        nrow,
+        int             nclusters,
+        cpl_size    *   offsets)
 {
-    cpl_image   *   non_zero_image ;
-    const int   *   plabels ;
-    cpl_table   *   clustertable ;
-    int             nb_table_entries, nx, ny, i, j ;
-
-
-    if (labels == NULL) return NULL;
-    /* Count the number of pixels that are not 0 */
-    nb_table_entries = 0 ;
-    plabels = cpl_image_get_data_int_const(labels) ;
-    nx = cpl_image_get_size_x(labels) ;
-    ny = cpl_image_get_size_y(labels) ;
-    for (i=0 ; i<nx*ny ; i++)
-        if (plabels[i] > 0.5) nb_table_entries ++ ;
-    cpl_msg_debug(__func__, "Number of table entries: %d", nb_table_entries) ;
-
-    /* Create the output table */
-    clustertable = cpl_table_new(nb_table_entries);
-    cpl_table_new_column(clustertable, CR2RES_COL_XS, CPL_TYPE_INT) ;
-    cpl_table_new_column(clustertable, CR2RES_COL_YS, CPL_TYPE_INT) ;
-    cpl_table_new_column(clustertable, CR2RES_COL_CLUSTERS, CPL_TYPE_INT) ;
-    nb_table_entries = 0 ;
-    for (j=0 ; j<ny ; j++) {
-        for (i=0 ; i<nx ; i++) {
-            if (plabels[i+j*nx] > 0.5) {
-                cpl_table_set_int(clustertable, CR2RES_COL_XS, nb_table_entries,
-                        i+1) ;
-                cpl_table_set_int(clustertable, CR2RES_COL_YS, nb_table_entries,
-                        j+1) ;
-                cpl_table_set_int(clustertable, CR2RES_COL_CLUSTERS,
-                        nb_table_entries, plabels[i+j*nx]) ;
-                nb_table_entries ++ ;
-            }
+    cpl_size    k ;
+    int         i, grouped ;
+
+    grouped = 1 ;
+    for (i=0 ; i<nclusters+2 ; i++) offsets[i] = 0 ;
+    for (k=0 ; k<nrow ; k++) {
+        if (pclusters[k] < 1 || pclusters[k] > nclusters) {
+            grouped = 0 ;
+            continue ;
         }
+        if (k > 0 && pclusters[k] < pclusters[k-1]) grouped = 0 ;
+        offsets[pclusters[k]+1]++ ;
     }
-    return clustertable ;
+    for (i=1 ; i<=nclusters ; i++) offsets[i+1] += offsets[i] ;
+    return grouped ;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -2592,61 +2863,30 @@ static cpl_table * cr2res_trace_convert_labels_to_cluster(cpl_image * labels)
   @param mask           Input mask
   @param min_cluster    Size of clusters under which they need to be removed
   @return   A newly allocated mask or NULL in error case
+
+  The blobs sizes come from the labels runs, without any label image.
  */
 /*----------------------------------------------------------------------------*/
 static cpl_mask * cr2res_trace_clean_blobs(
         cpl_mask    *   mask,
         int             min_cluster)
 {
-    cpl_mask    *   new_mask ;
-    cpl_image   *   labels ;
-    cpl_size        nlabels ;
-    cpl_binary  *   pnew_mask ;
-    const int   *   plabels ;
-    int             i, curr_label, pix_count, npix ;
+    cr2res_cluster_labels   *   labels ;
+    cpl_mask                *   new_mask ;
 
     /* Check entries */
     if (mask == NULL) return NULL ;
     if (min_cluster < 0) return NULL;
 
     /* Labelise */
-    if ((labels = cpl_image_labelise_mask_create(mask, &nlabels)) == NULL) {
+    if ((labels = cr2res_cluster_labels_new(mask)) == NULL) {
         cpl_msg_error(__func__, "Failed to labelise") ;
         return NULL ;
     }
-    if (nlabels > 10000) {
-        cpl_msg_error(__func__, "Too many labels resulting from mask") ;
-        cpl_image_delete(labels) ;
-        return NULL ;
-    }
-    plabels = cpl_image_get_data_int_const(labels) ;
-
-    /* Number of pixels */
-    npix = cpl_mask_get_size_x(mask) * cpl_mask_get_size_y(mask) ;
-
-    /* Create Output mask */
-    new_mask=cpl_mask_new(cpl_mask_get_size_x(mask),cpl_mask_get_size_y(mask));
-    pnew_mask = cpl_mask_get_data(new_mask) ;
-
-    /* Loop on the labels */
-    for (curr_label=1 ; curr_label<=nlabels ; curr_label++) {
-        pix_count = 0 ;
-
-        /* Count ocurences of current label */
-        for (i=0 ; i<npix ; i++) {
-            if (plabels[i] == curr_label) pix_count++ ;
-            if (pix_count >= min_cluster) break;
-        }
-
-        /* Blob big enough ? */
-        if (pix_count >= min_cluster) {
-            /* Fill the new mask */
-            for (i=0 ; i<npix ; i++)
-                if (plabels[i] == curr_label) pnew_mask[i] = CPL_BINARY_1 ;
-        }
-    }
-    cpl_image_delete(labels) ;
 
+    /* Keep the blobs big enough */
+    new_mask = cr2res_cluster_labels_get_mask(labels, min_cluster) ;
+    cr2res_cluster_labels_delete(labels) ;
     return new_mask ;
 }
 
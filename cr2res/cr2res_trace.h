@@ -99,6 +99,15 @@ int cr2res_trace_get_height(
         cpl_size            order_idx,
         cpl_size            trace_nb) ;
 
+int cr2res_trace_get_rows(
+        const cpl_table *   trace,
+        int                 order_idx,
+        int                 trace_nb,
+        int                 margin,
+        int                 size,
+        int             *   ymin,
+        int             *   ymax) ;
+
 cpl_vector * cr2res_trace_compute_middle(
         cpl_polynomial  *   trace1,
         cpl_polynomial  *   trace2,
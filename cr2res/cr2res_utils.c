@@ -28,6 +28,9 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <cpl.h>
 
@@ -40,6 +43,55 @@
 #include "cr2res_extract.h"
 #include "cr2res_trace.h"
 
+/*-----------------------------------------------------------------------------
+                                   Define
+ -----------------------------------------------------------------------------*/
+
+/* Values of a sliding window, split in two halves around the median */
+typedef struct {
+    cpl_size        h ;         /* Rows of a window column */
+    cpl_size        w ;         /* Columns of the window */
+    double      *   val ;       /* [w*h] Value of each slot */
+    int         *   side ;      /* [w*h] Heap of each slot */
+    cpl_size    *   pos ;       /* [w*h] Position of each slot in its heap */
+    cpl_size    *   heap[2] ;   /* Lower half (max on top), upper half (min) */
+    cpl_size        n[2] ;      /* Sizes of the halves */
+    double          sum[2] ;    /* Sums of the halves */
+} cr2res_median_heap ;
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static cr2res_median_heap * cr2res_median_heap_new(
+        cpl_size    w,
+        cpl_size    h) ;
+static void cr2res_median_heap_delete(cr2res_median_heap * mh) ;
+static void cr2res_median_heap_reset(cr2res_median_heap * mh) ;
+static void cr2res_median_heap_slide(
+        cr2res_median_heap  *   mh,
+        const double        *   pimg,
+        const cpl_binary    *   pbpm,
+        cpl_size                nx,
+        cpl_size                xout,
+        cpl_size                xin,
+        cpl_size                lly,
+        cpl_size                ury) ;
+static void cr2res_median_heap_balance(cr2res_median_heap * mh) ;
+static void cr2res_median_heap_push(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                slot) ;
+static cpl_size cr2res_median_heap_pop(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                i) ;
+static void cr2res_median_heap_sift(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                i) ;
+static void cr2res_median_heap_refresh(cr2res_median_heap * mh) ;
+
 /*----------------------------------------------------------------------------*/
 /**
  * @defgroup cr2res_utils     Miscellaneous Utilities
@@ -1646,6 +1698,289 @@ cpl_image * cr2res_util_optimal_filter_2d(
 #undef aij_index
 #undef w_index
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Median and mean absolute deviation in a sliding window
+  @param    img     The input image
+  @param    hx      The half width of the window in x
+  @param    hy      The half width of the window in y
+  @param    median  [out] The local medians
+  @param    dev     [out] The local mean absolute deviations, or NULL
+  @return   0 if ok, -1 in error case
+
+  For each pixel, the statistics are computed on the good pixels of the
+  (2*hx+1)x(2*hy+1) window centered on it, clipped by the image borders.
+  They are the ones of cpl_image_get_median_dev_window(), the median of
+  an even number of values being the mean of the two central ones.
+  The pixels whose window has no good pixel are rejected in the outputs.
+
+  The window is kept in two heaps, the lower and the upper half of its
+  values, with their sums, while it slides along a row: moving by one
+  pixel replaces one column, each value in O(log n). The median is
+  on top of the heaps, and the sum of the absolute deviations is the sum
+  of the upper half minus the sum of the lower half. The sums are
+  computed again each time the window is renewed, to bound the rounding
+  errors. The rows are shared by the threads in bands.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_image_median_window(
+        const cpl_image *   img,
+        int                 hx,
+        int                 hy,
+        cpl_image       **  median,
+        cpl_image       **  dev)
+{
+    cpl_image       *   cast ;
+    const double    *   pimg ;
+    const cpl_binary *  pbpm ;
+    const cpl_mask  *   bpm ;
+    double          *   pmed ;
+    double          *   pdev ;
+    cpl_binary      *   pbad ;
+    cpl_size            nx, ny, j ;
+
+    /* Check Entries */
+    if (img == NULL || median == NULL) return -1 ;
+    if (hx < 0 || hy < 0) return -1 ;
+    *median = NULL ;
+    if (dev != NULL) *dev = NULL ;
+
+    /* Initialise */
+    nx = cpl_image_get_size_x(img) ;
+    ny = cpl_image_get_size_y(img) ;
+    cast = NULL ;
+    if (cpl_image_get_type(img) == CPL_TYPE_DOUBLE) {
+        pimg = cpl_image_get_data_double_const(img) ;
+    } else {
+        cast = cpl_image_cast(img, CPL_TYPE_DOUBLE) ;
+        pimg = cpl_image_get_data_double_const(cast) ;
+    }
+    bpm = cpl_image_get_bpm_const(img) ;
+    pbpm = bpm != NULL ? cpl_mask_get_data_const(bpm) : NULL ;
+    *median = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+    pmed = cpl_image_get_data_double(*median) ;
+    pdev = NULL ;
+    if (dev != NULL) {
+        *dev = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+        pdev = cpl_image_get_data_double(*dev) ;
+    }
+    pbad = cpl_mask_get_data(cpl_image_get_bpm(*median)) ;
+
+    /* Each thread slides its own window on a band of rows */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(cr2res_thread_budget())
+#endif
+    {
+        cr2res_median_heap  *   mh ;
+        double                  top ;
+        cpl_size                n, i, lly, ury ;
+
+        mh = cr2res_median_heap_new(2*hx+1, 2*hy+1) ;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (j=0 ; j<ny ; j++) {
+            lly = j-hy < 0 ? 0 : j-hy ;
+            ury = j+hy >= ny ? ny-1 : j+hy ;
+
+            /* First window of the row */
+            cr2res_median_heap_reset(mh) ;
+            for (i=0 ; i<=hx && i<nx ; i++)
+                cr2res_median_heap_slide(mh, pimg, pbpm, nx, -1, i, lly, ury);
+
+            for (i=0 ; i<nx ; i++) {
+                /* Slide by one column */
+                if (i > 0) {
+                    cr2res_median_heap_slide(mh, pimg, pbpm, nx,
+                            i-hx-1 >= 0 ? i-hx-1 : -1,
+                            i+hx < nx ? i+hx : -1, lly, ury) ;
+                    if (i % (2*hx+1) == 0) cr2res_median_heap_refresh(mh) ;
+                }
+
+                /* Statistics of the two halves */
+                n = mh->n[0] + mh->n[1] ;
+                if (n == 0) {
+                    pbad[i+j*nx] = CPL_BINARY_1 ;
+                    if (pdev != NULL) pdev[i+j*nx] = 0.0 ;
+                    continue ;
+                }
+                top = mh->val[mh->heap[0][0]] ;
+                if (n % 2) pmed[i+j*nx] = top ;
+                else pmed[i+j*nx] = 0.5 * (top + mh->val[mh->heap[1][0]]) ;
+                /* sum(|x-median|), the median being in the lower half */
+                if (pdev != NULL)
+                    pdev[i+j*nx] = (mh->sum[1] - mh->sum[0] +
+                            (n % 2 ? top : 0.0)) / n ;
+            }
+        }
+        cr2res_median_heap_delete(mh) ;
+    }
+
+    /* The deviation has the rejections of the median */
+    if (dev != NULL) cpl_image_reject_from_mask(*dev, cpl_image_get_bpm(*median));
+    if (cast != NULL) cpl_image_delete(cast) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of detectors to reduce concurrently
+  @param    reduce_det          The detector to reduce (0 for all)
+  @param    parallel_detectors  Flag to reduce the detectors concurrently
+  @return   The number of threads for the loop on the detectors
+
+  The detectors are only reduced concurrently when all of them are
+  requested and the pipeline is built with OpenMP. The debug mode stays
+  serial, as the debug files are written with fixed names.
+  The parallel regions nested in the reduction of one detector run on
+  the thread of that detector, unless nested parallelism is enabled.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detector_nthreads(int reduce_det, int parallel_detectors)
+{
+#ifdef _OPENMP
+    if (!parallel_detectors || reduce_det != 0) return 1 ;
+    if (cpl_msg_get_level() == CPL_MSG_DEBUG) return 1 ;
+    return CR2RES_NB_DETECTORS ;
+#else
+    (void)reduce_det ;
+    (void)parallel_detectors ;
+    return 1 ;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the prefix of the messages about a detector
+  @param    det_nr  The detector number
+  @return   "Detector n: " in a parallel region, "" otherwise
+
+  The messages of the detectors reduced concurrently are interleaved, the
+  prefix tells them apart. The returned string is static.
+ */
+/*----------------------------------------------------------------------------*/
+const char * cr2res_detector_prefix(int det_nr)
+{
+    static const char   *   prefixes[CR2RES_NB_DETECTORS] =
+        {"Detector 1: ", "Detector 2: ", "Detector 3: "} ;
+
+    if (det_nr < 1 || det_nr > CR2RES_NB_DETECTORS) return "" ;
+#ifdef _OPENMP
+    if (omp_in_parallel()) return prefixes[det_nr-1] ;
+#endif
+    return "" ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Increase the messages indentation, outside of parallel regions
+  @return   void
+
+  The indentation is shared by all threads: it is only changed by the
+  serial code, so that the concurrent reductions do not garble it.
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_msg_indent_more(void)
+{
+#ifdef _OPENMP
+    if (omp_in_parallel()) return ;
+#endif
+    cpl_msg_indent_more() ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Decrease the messages indentation, outside of parallel regions
+  @return   void
+  @see      cr2res_msg_indent_more()
+ */
+/*----------------------------------------------------------------------------*/
+void cr2res_msg_indent_less(void)
+{
+#ifdef _OPENMP
+    if (omp_in_parallel()) return ;
+#endif
+    cpl_msg_indent_less() ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the number of threads left to a new parallel region
+  @return   The number of threads, at least 1
+
+  The threads of the machine (omp_get_max_threads() at the outermost
+  level) are shared by the enclosing parallel regions: the number left
+  is divided by the size of the team at each enclosing level. A region
+  opened with num_threads(cr2res_thread_budget()) inside the loop on
+  the detectors or on the traces thus does not oversubscribe the cores.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_thread_budget(void)
+{
+#ifdef _OPENMP
+    int     nthreads, level ;
+
+    nthreads = omp_get_max_threads() ;
+    for (level=1 ; level<=omp_get_level() ; level++)
+        nthreads /= omp_get_team_size(level) ;
+    return nthreads < 1 ? 1 : nthreads ;
+#else
+    return 1 ;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Take the error state left by the reduction of a detector
+  @param    det_nr  The detector number
+  @return   The error code, CPL_ERROR_NONE if there is none
+
+  The CPL error state is private to each thread. The error left by the
+  reduction of a detector is reported and reset, so that it does not
+  leak into the next detector reduced by the same thread. It is raised
+  again in the calling thread by cr2res_detector_error_restore().
+ */
+/*----------------------------------------------------------------------------*/
+cpl_error_code cr2res_detector_error_save(int det_nr)
+{
+    cpl_error_code  code ;
+
+    code = cpl_error_get_code() ;
+    if (code != CPL_ERROR_NONE) {
+        cpl_msg_warning(__func__, "Detector %d: %s in %s", det_nr,
+                cpl_error_get_message(), cpl_error_get_where()) ;
+        cpl_error_reset() ;
+    }
+    return code ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Raise the error states of the detectors in the calling thread
+  @param    codes   The CR2RES_NB_DETECTORS error codes
+  @return   0 if no detector left an error, -1 otherwise
+
+  The first error in the detector order is set, unless an error is
+  already set in the calling thread.
+ */
+/*----------------------------------------------------------------------------*/
+int cr2res_detector_error_restore(const cpl_error_code * codes)
+{
+    int     det_nr ;
+
+    /* Check Entries */
+    if (codes == NULL) return -1 ;
+
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        if (codes[det_nr-1] == CPL_ERROR_NONE) continue ;
+        if (!cpl_error_get_code())
+            cpl_error_set_message(__func__, codes[det_nr-1],
+                    "Detector %d failed", det_nr) ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Get the pipeline copyright and license
@@ -1679,3 +2014,266 @@ const char * cr2res_get_license(void)
 }
 
 /**@}*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Allocate the heaps of a sliding window
+  @param    w       The number of columns of the window
+  @param    h       The number of rows of the window
+  @return   The empty heaps, to deallocate with cr2res_median_heap_delete()
+ */
+/*----------------------------------------------------------------------------*/
+static cr2res_median_heap * cr2res_median_heap_new(
+        cpl_size    w,
+        cpl_size    h)
+{
+    cr2res_median_heap  *   mh ;
+
+    mh = cpl_calloc(1, sizeof(cr2res_median_heap)) ;
+    mh->w = w ;
+    mh->h = h ;
+    mh->val = cpl_malloc(w * h * sizeof(double)) ;
+    mh->side = cpl_malloc(w * h * sizeof(int)) ;
+    mh->pos = cpl_malloc(w * h * sizeof(cpl_size)) ;
+    mh->heap[0] = cpl_malloc(w * h * sizeof(cpl_size)) ;
+    mh->heap[1] = cpl_malloc(w * h * sizeof(cpl_size)) ;
+    return mh ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Deallocate the heaps of a sliding window
+  @param    mh      The heaps
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_delete(cr2res_median_heap * mh)
+{
+    if (mh == NULL) return ;
+    cpl_free(mh->val) ;
+    cpl_free(mh->side) ;
+    cpl_free(mh->pos) ;
+    cpl_free(mh->heap[0]) ;
+    cpl_free(mh->heap[1]) ;
+    cpl_free(mh) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Empty the heaps of a sliding window
+  @param    mh      The heaps
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_reset(cr2res_median_heap * mh)
+{
+    mh->n[0] = mh->n[1] = 0 ;
+    mh->sum[0] = mh->sum[1] = 0.0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Replace a column of the window by another one
+  @param    mh      The heaps of the window
+  @param    pimg    The image pixels
+  @param    pbpm    The image bad pixels, or NULL
+  @param    nx      The image width
+  @param    xout    The column to remove (0 for the first), -1 for none
+  @param    xin     The column to insert, -1 for none, xout + w if both
+  @param    lly     The first row of the window (0 for the first)
+  @param    ury     The last row of the window
+  @return   nothing
+
+  The bad pixels and the NaN are not part of the window. The pixel (x,y)
+  has the slot (x % w) * h + y - lly: a removed pixel is found without a
+  search, and the inserted pixel of the same row takes its slot. Its
+  value is then only moved within the heaps, and exchanged with the top
+  of the other heap if it crosses the median. After the update, the
+  lower half has as many values as the upper half, or one more.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_slide(
+        cr2res_median_heap  *   mh,
+        const double        *   pimg,
+        const cpl_binary    *   pbpm,
+        cpl_size                nx,
+        cpl_size                xout,
+        cpl_size                xin,
+        cpl_size                lly,
+        cpl_size                ury)
+{
+    double          v ;
+    cpl_size        y, slot, a, b ;
+    int             out, in, k ;
+
+    for (y=lly ; y<=ury ; y++) {
+        out = xout >= 0 && (pbpm == NULL || !pbpm[xout+y*nx]) &&
+            !isnan(pimg[xout+y*nx]) ;
+        in = xin >= 0 && (pbpm == NULL || !pbpm[xin+y*nx]) &&
+            !isnan(pimg[xin+y*nx]) ;
+        slot = ((xin >= 0 ? xin : xout) % mh->w) * mh->h + y - lly ;
+
+        if (out && in) {
+            /* New value in the same slot */
+            v = pimg[xin+y*nx] ;
+            k = mh->side[slot] ;
+            mh->sum[k] += v - mh->val[slot] ;
+            mh->val[slot] = v ;
+            cr2res_median_heap_sift(mh, k, mh->pos[slot]) ;
+
+            /* Exchange the tops if they are no longer in order */
+            if (mh->n[1] > 0 &&
+                    mh->val[mh->heap[0][0]] > mh->val[mh->heap[1][0]]) {
+                a = mh->heap[0][0] ;
+                b = mh->heap[1][0] ;
+                mh->sum[0] += mh->val[b] - mh->val[a] ;
+                mh->sum[1] += mh->val[a] - mh->val[b] ;
+                mh->heap[0][0] = b ;
+                mh->side[b] = 0 ;
+                mh->heap[1][0] = a ;
+                mh->side[a] = 1 ;
+                cr2res_median_heap_sift(mh, 0, 0) ;
+                cr2res_median_heap_sift(mh, 1, 0) ;
+            }
+        } else if (out) {
+            cr2res_median_heap_pop(mh, mh->side[slot], mh->pos[slot]) ;
+            cr2res_median_heap_balance(mh) ;
+        } else if (in) {
+            v = pimg[xin+y*nx] ;
+            mh->val[slot] = v ;
+            if (mh->n[0] == 0 || v <= mh->val[mh->heap[0][0]])
+                cr2res_median_heap_push(mh, 0, slot) ;
+            else
+                cr2res_median_heap_push(mh, 1, slot) ;
+            cr2res_median_heap_balance(mh) ;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Move the top of a heap to the other one until they balance
+  @param    mh      The heaps
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_balance(cr2res_median_heap * mh)
+{
+    if (mh->n[0] > mh->n[1] + 1)
+        cr2res_median_heap_push(mh, 1, cr2res_median_heap_pop(mh, 0, 0)) ;
+    else if (mh->n[1] > mh->n[0])
+        cr2res_median_heap_push(mh, 0, cr2res_median_heap_pop(mh, 1, 0)) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Add a slot to one of the heaps
+  @param    mh      The heaps
+  @param    k       0 for the lower half, 1 for the upper half
+  @param    slot    The slot, its value is set
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_push(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                slot)
+{
+    mh->heap[k][mh->n[k]] = slot ;
+    mh->pos[slot] = mh->n[k] ;
+    mh->side[slot] = k ;
+    mh->sum[k] += mh->val[slot] ;
+    mh->n[k]++ ;
+    cr2res_median_heap_sift(mh, k, mh->n[k] - 1) ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Remove a slot from one of the heaps
+  @param    mh      The heaps
+  @param    k       0 for the lower half, 1 for the upper half
+  @param    i       The position of the slot in the heap (0 for the top)
+  @return   The removed slot
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_size cr2res_median_heap_pop(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                i)
+{
+    cpl_size        slot, last ;
+
+    slot = mh->heap[k][i] ;
+    mh->sum[k] -= mh->val[slot] ;
+    mh->n[k]-- ;
+    if (i < mh->n[k]) {
+        /* The last slot fills the hole */
+        last = mh->heap[k][mh->n[k]] ;
+        mh->heap[k][i] = last ;
+        mh->pos[last] = i ;
+        cr2res_median_heap_sift(mh, k, i) ;
+    }
+    return slot ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Move a slot up or down to its place in a heap
+  @param    mh      The heaps
+  @param    k       0 for the lower half (max on top), 1 for the upper half
+  @param    i       The position of the slot in the heap
+  @return   nothing
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_sift(
+        cr2res_median_heap  *   mh,
+        int                     k,
+        cpl_size                i)
+{
+    cpl_size    *   heap = mh->heap[k] ;
+    double          sign = k ? 1.0 : -1.0 ;
+    double          v = sign * mh->val[heap[i]] ;
+    cpl_size        slot = heap[i] ;
+    cpl_size        p, c ;
+
+    /* Up, while the parent comes after */
+    while (i > 0 && v < sign * mh->val[heap[p = (i-1)/2]]) {
+        heap[i] = heap[p] ;
+        mh->pos[heap[i]] = i ;
+        i = p ;
+    }
+
+    /* Down, while a child comes before */
+    while ((c = 2*i+1) < mh->n[k]) {
+        if (c+1 < mh->n[k] &&
+                sign * mh->val[heap[c+1]] < sign * mh->val[heap[c]]) c++ ;
+        if (sign * mh->val[heap[c]] >= v) break ;
+        heap[i] = heap[c] ;
+        mh->pos[heap[i]] = i ;
+        i = c ;
+    }
+    heap[i] = slot ;
+    mh->pos[slot] = i ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compute the sums of the halves again
+  @param    mh      The heaps
+  @return   nothing
+
+  The sums are updated at each insertion and removal, this drops their
+  rounding errors.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_median_heap_refresh(cr2res_median_heap * mh)
+{
+    cpl_size        i ;
+    int             k ;
+
+    for (k=0 ; k<2 ; k++) {
+        mh->sum[k] = 0.0 ;
+        for (i=0 ; i<mh->n[k] ; i++) mh->sum[k] += mh->val[mh->heap[k][i]] ;
+    }
+}
+
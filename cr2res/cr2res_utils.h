@@ -150,6 +150,21 @@ cpl_image * cr2res_util_optimal_filter_2d(
         double lam_x, 
         double lam_y);
 
+int cr2res_image_median_window(
+        const cpl_image *   img,
+        int                 hx,
+        int                 hy,
+        cpl_image       **  median,
+        cpl_image       **  dev) ;
+
+int cr2res_detector_nthreads(int reduce_det, int parallel_detectors) ;
+const char * cr2res_detector_prefix(int det_nr) ;
+void cr2res_msg_indent_more(void) ;
+void cr2res_msg_indent_less(void) ;
+int cr2res_thread_budget(void) ;
+cpl_error_code cr2res_detector_error_save(int det_nr) ;
+int cr2res_detector_error_restore(const cpl_error_code * codes) ;
+
 const char * cr2res_get_license(void) ;
 
 #endif
@@ -1128,7 +1128,7 @@ cpl_polynomial * cr2res_wave_xcorr(
     /* Clean the spectrum from the low frequency signal if requested */
     if (cleaning_filter_size > 0) {
         cpl_msg_info(__func__, "Low Frequency removal from spectrum") ;
-        cpl_msg_indent_more() ;
+        cr2res_msg_indent_more() ;
         /* Subtract the low frequency part */
         if ((filtered=cpl_vector_filter_median_create(
                         cpl_bivector_get_y(spectrum),
@@ -1140,7 +1140,7 @@ cpl_polynomial * cr2res_wave_xcorr(
             cpl_vector_subtract(spec_clean, filtered) ;
             cpl_vector_delete(filtered) ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     } else {
         spec_clean = cpl_vector_duplicate(cpl_bivector_get_y(spectrum)) ;
     }
@@ -1182,7 +1182,7 @@ cpl_polynomial * cr2res_wave_xcorr(
             "XCORR: Deg:%d - Err:%g nm (%g pix) - %d samples -> %g polys",
             degree_loc,wl_error_nm,wl_error_pix,nsamples,pow(nsamples,
                 degree_loc+1)) ;
-    cpl_msg_indent_more() ;
+    cr2res_msg_indent_more() ;
     if ((sol = keep_higher_degrees_flag ?
                 irplib_wlxcorr_best_poly_prop(spec_clean, lines_list_filtered,
                     degree_loc, sol_guess, wl_errors, nsamples, slit_width,
@@ -1197,7 +1197,7 @@ cpl_polynomial * cr2res_wave_xcorr(
         cpl_vector_delete(spec_clean) ;
         if (xcorrs != NULL) cpl_vector_delete(xcorrs) ;
         cpl_error_reset() ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return NULL ;
     }
     cpl_vector_delete(wl_errors) ;
@@ -1226,7 +1226,7 @@ cpl_polynomial * cr2res_wave_xcorr(
                 "", xcorrs) ;
     }
     if (xcorrs != NULL) cpl_vector_delete(xcorrs) ;
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     cpl_vector_delete(spec_clean) ;
     cpl_bivector_delete(lines_list_filtered) ;
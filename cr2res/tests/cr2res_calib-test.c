@@ -33,6 +33,7 @@
 #include <hdrl.h>
 #include <cr2res_dfs.h>
 #include <cr2res_calib.h>
+#include <cr2res_detlin.h>
 #include <cr2res_io.h>
 #include "cr2res_pfits.h"
 
@@ -55,6 +56,10 @@ static void test_cr2res_calib_flat(void);
 static void test_cr2res_calib_dark(void);
 static void test_cr2res_calib_bpm(void);
 static void test_cr2res_calib_detlin(void);
+static void test_cr2res_calib_imagelist(void);
+static void test_cr2res_calib_context_apply(void);
+static void test_cr2res_calib_context_apply_raw(void);
+static void test_cr2res_calib_stack(void);
 
 
 static void create_empty_fits()
@@ -1062,6 +1067,447 @@ static void test_cr2res_calib_detlin()
 
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the calibration of a list, with one context for all images
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_calib_imagelist()
+{
+    int nx = 5;
+    int ny = 5;
+    int nima = 4;
+    int chip = 1;
+    double dits[] = {10, 10, 20, 5};
+
+    char *my_path1 = cpl_sprintf("%s/TEST_master_flat.fits", localdir);
+    char *my_path2 = cpl_sprintf("%s/TEST_master_dark.fits", localdir);
+    char *my_path3 = cpl_sprintf("%s/TEST_bpm.fits", localdir);
+    cpl_frame * flat = create_master_flat(my_path1, nx, ny, 2, 0.1, NULL);
+    cpl_frame * dark = create_master_dark(my_path2, nx, ny, 10, 1, 10, NULL);
+    cpl_frame * bpm = create_bpm(my_path3, nx, ny, 0);
+    cpl_vector * dits_vec = cpl_vector_wrap(nima, dits);
+    hdrl_imagelist * in = hdrl_imagelist_new();
+    hdrl_imagelist * out;
+    hdrl_image * cmp;
+    cr2res_calib_context * ctx;
+    double num, num_err, value, error;
+
+    for (int i = 0; i < nima; i++)
+        hdrl_imagelist_set(in, cr2res_create_hdrl(nx, ny, 100 + 10 * i, 1), i);
+
+    // NULL input
+    cpl_test_null(cr2res_calib_imagelist(NULL, chip, 0, 0, flat, dark, bpm,
+        NULL, dits_vec));
+    cpl_test_null(cr2res_calib_context_new(0, 0, 0, flat, dark, bpm, NULL));
+    cpl_test_null(cr2res_calib_context_apply(NULL,
+        hdrl_imagelist_get(in, 0), dits[0]));
+
+    // The DITs are needed for the dark
+    cpl_test_null(cr2res_calib_imagelist(in, chip, 0, 0, flat, dark, bpm,
+        NULL, NULL));
+
+    // Each image is (in - dark * dit / 10) / flat, in the input order
+    // The dark error scales with the dit, and the errors add in quadrature
+    out = cr2res_calib_imagelist(in, chip, 0, 0, flat, dark, bpm, NULL,
+        dits_vec);
+    cpl_test_nonnull(out);
+    cpl_test_eq(hdrl_imagelist_get_size(out), nima);
+    ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, bpm, NULL);
+    cpl_test_nonnull(ctx);
+    for (int i = 0; i < nima; i++) {
+        num = 100 + 10 * i - 10 * dits[i] / 10;
+        num_err = sqrt(1 + pow2(dits[i] / 10));
+        value = num / 2;
+        error = sqrt(pow2(num_err / 2) + pow2(num * 0.1 / 4));
+        cmp = cr2res_create_hdrl(nx, ny, value, error);
+        cpl_test_image_abs(hdrl_image_get_image(cmp),
+            hdrl_image_get_image(hdrl_imagelist_get(out, i)), 1e-12);
+        cpl_test_image_abs(hdrl_image_get_error(cmp),
+            hdrl_image_get_error(hdrl_imagelist_get(out, i)), 1e-12);
+        cpl_test_eq(hdrl_image_count_rejected(hdrl_imagelist_get(out, i)),
+            0);
+        hdrl_image_delete(cmp);
+
+        cmp = cr2res_calib_context_apply(ctx, hdrl_imagelist_get(in, i),
+            dits[i]);
+        cpl_test_image_abs(hdrl_image_get_image(cmp),
+            hdrl_image_get_image(hdrl_imagelist_get(out, i)), 0);
+        hdrl_image_delete(cmp);
+    }
+    cr2res_calib_context_delete(ctx);
+    hdrl_imagelist_delete(out);
+
+    // A missing calibration fails for the whole list
+    cpl_frame_set_filename(dark, "TEST_tobeornottobe.fits");
+    cpl_test_null(cr2res_calib_imagelist(in, chip, 0, 0, flat, dark, bpm,
+        NULL, dits_vec));
+    cpl_error_reset();
+
+    cpl_vector_unwrap(dits_vec);
+    hdrl_imagelist_delete(in);
+    cpl_frame_delete(flat);
+    cpl_frame_delete(dark);
+    cpl_frame_delete(bpm);
+    cpl_free(my_path1);
+    cpl_free(my_path2);
+    cpl_free(my_path3);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the one pass calibration with the hdrl operations
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_calib_context_apply()
+{
+    int nx = 5;
+    int ny = 5;
+    int chip = 1;
+    double dit = 20;
+
+    char *my_path1 = cpl_sprintf("%s/TEST_master_flat.fits", localdir);
+    char *my_path2 = cpl_sprintf("%s/TEST_master_dark.fits", localdir);
+    cpl_frame * flat = create_master_flat(my_path1, nx, ny, 2, 0.1, NULL);
+    cpl_frame * dark = create_master_dark(my_path2, nx, ny, 10, 1, 10, NULL);
+    hdrl_image * in = cr2res_create_hdrl(nx, ny, 100, 2);
+    hdrl_image * ref_dark;
+    hdrl_image * ref_flat;
+    hdrl_image * ref;
+    hdrl_image * out;
+    cr2res_calib_context * ctx;
+
+    hdrl_image_set_pixel(in, 2, 3, (hdrl_value){250., 3.});
+    hdrl_image_reject(in, 4, 4);
+
+    // Reference with the hdrl operations
+    ref_dark = cr2res_io_load_MASTER_DARK(my_path2, chip);
+    ref_flat = cr2res_io_load_MASTER_FLAT(my_path1, chip);
+    ref = hdrl_image_duplicate(in);
+    hdrl_image_mul_scalar(ref_dark, (hdrl_value){dit / 10., 0.});
+    hdrl_image_sub_image(ref, ref_dark);
+    hdrl_image_div_image(ref, ref_flat);
+
+    ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, NULL, NULL);
+    cpl_test_nonnull(ctx);
+    cpl_test_nonnull(out = cr2res_calib_context_apply(ctx, in, dit));
+    cpl_test_image_abs(hdrl_image_get_image(out), hdrl_image_get_image(ref),
+        1e-12);
+    cpl_test_image_abs(hdrl_image_get_error(out), hdrl_image_get_error(ref),
+        1e-12);
+    cpl_test_eq(hdrl_image_count_rejected(out), 1);
+    cpl_test(hdrl_image_is_rejected(out, 4, 4));
+
+    cr2res_calib_context_delete(ctx);
+    hdrl_image_delete(out);
+    hdrl_image_delete(ref);
+    hdrl_image_delete(ref_dark);
+
+    // Non-linearity above the threshold, on the data and on the dark
+    hdrl_image * ima = cr2res_create_hdrl(nx, ny, 1, 0.01);
+    hdrl_image * imb = cr2res_create_hdrl(nx, ny, 2e-5, 1e-6);
+    hdrl_image * imc = cr2res_create_hdrl(nx, ny, 1e-9, 1e-10);
+    hdrl_imagelist * coeffs;
+    hdrl_image_set_pixel(imb, 1, 2, (hdrl_value){5e-5, 2e-6});
+    hdrl_image_set_pixel(imc, 2, 3, (hdrl_value){-3e-9, 1e-10});
+    char *my_path3 = cpl_sprintf("%s/TEST_detlin.fits", localdir);
+    cpl_frame * detlin = create_detlin(my_path3, ima, imb, imc);
+    hdrl_image_set_pixel(in, 1, 2, (hdrl_value){5000., 50.});
+    hdrl_image_set_pixel(in, 2, 3, (hdrl_value){3000., 40.});
+    hdrl_image_set_pixel(in, 5, 1, (hdrl_value){2999., 40.});
+    hdrl_image_set_pixel(in, 4, 4, (hdrl_value){8000., 60.});
+
+    coeffs = cr2res_io_load_DETLIN_COEFFS(my_path3, chip);
+    ref_dark = cr2res_io_load_MASTER_DARK(my_path2, chip);
+    cr2res_detlin_correct(ref_dark, coeffs);
+    ref = hdrl_image_duplicate(in);
+    cr2res_detlin_correct(ref, coeffs);
+    hdrl_image_mul_scalar(ref_dark, (hdrl_value){dit / 10., 0.});
+    hdrl_image_sub_image(ref, ref_dark);
+    hdrl_image_div_image(ref, ref_flat);
+
+    ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, NULL, detlin);
+    cpl_test_nonnull(ctx);
+    cpl_test_nonnull(out = cr2res_calib_context_apply(ctx, in, dit));
+    cpl_test_image_abs(hdrl_image_get_image(out), hdrl_image_get_image(ref),
+        1e-12);
+    cpl_test_image_abs(hdrl_image_get_error(out), hdrl_image_get_error(ref),
+        1e-12);
+    cpl_test_rel(hdrl_image_get_pixel(out, 1, 2, NULL).data,
+        (detlin(5000., 1., 5e-5, 1e-9) - 10. * 2.) / 2., 1e-12);
+    cpl_test_eq(hdrl_image_count_rejected(out), 1);
+    cpl_test(hdrl_image_is_rejected(out, 4, 4));
+
+    cr2res_calib_context_delete(ctx);
+    hdrl_image_delete(out);
+    hdrl_image_delete(ref);
+    hdrl_image_delete(ref_dark);
+    hdrl_image_delete(ref_flat);
+
+    // Bad pixels marked in the same pass, a zero flat pixel becomes bad
+    cpl_frame * bpm;
+    cpl_mask * bpm_mask;
+    hdrl_image * bpm_ima = cr2res_create_hdrl(nx, ny, 0, 0);
+    hdrl_image * zero_flat = cr2res_create_hdrl(nx, ny, 2, 0.1);
+    char *my_path4 = cpl_sprintf("%s/TEST_bpm.fits", localdir);
+    hdrl_image_set_pixel(bpm_ima, 1, 5, (hdrl_value){1., 0.});
+    save_hdrl(my_path4, bpm_ima, MODE_BPM, 0);
+    bpm = cpl_frame_new();
+    cpl_frame_set_filename(bpm, my_path4);
+    cpl_frame_set_tag(bpm, "BPM");
+    cpl_frame_set_group(bpm, CPL_FRAME_GROUP_CALIB);
+    hdrl_image_set_pixel(zero_flat, 3, 2, (hdrl_value){0., 0.1});
+    save_hdrl(my_path1, zero_flat, MODE_FLAT, 0);
+
+    ref_dark = cr2res_io_load_MASTER_DARK(my_path2, chip);
+    ref_flat = cr2res_io_load_MASTER_FLAT(my_path1, chip);
+    ref = hdrl_image_duplicate(in);
+    bpm_mask = cpl_mask_threshold_image_create(
+        hdrl_image_get_image(bpm_ima), -0.5, 0.5);
+    cpl_mask_not(bpm_mask);
+    hdrl_image_reject_from_mask(ref, bpm_mask);
+    hdrl_image_mul_scalar(ref_dark, (hdrl_value){dit / 10., 0.});
+    hdrl_image_sub_image(ref, ref_dark);
+    hdrl_image_div_image(ref, ref_flat);
+
+    ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, bpm, NULL);
+    cpl_test_nonnull(ctx);
+    cpl_test_nonnull(out = cr2res_calib_context_apply(ctx, in, dit));
+    cpl_test_image_abs(hdrl_image_get_image(out), hdrl_image_get_image(ref),
+        1e-12);
+    cpl_test_image_abs(hdrl_image_get_error(out), hdrl_image_get_error(ref),
+        1e-12);
+    cpl_test_eq(hdrl_image_count_rejected(out), 3);
+    cpl_test(hdrl_image_is_rejected(out, 4, 4));
+    cpl_test(hdrl_image_is_rejected(out, 1, 5));
+    cpl_test(hdrl_image_is_rejected(out, 3, 2));
+    // The input is not changed
+    cpl_test_eq(hdrl_image_count_rejected(in), 1);
+
+    cr2res_calib_context_delete(ctx);
+    hdrl_image_delete(out);
+    hdrl_image_delete(ref);
+    hdrl_image_delete(ref_dark);
+    hdrl_image_delete(ref_flat);
+    hdrl_image_delete(in);
+    hdrl_image_delete(ima);
+    hdrl_image_delete(imb);
+    hdrl_image_delete(imc);
+    hdrl_image_delete(bpm_ima);
+    hdrl_image_delete(zero_flat);
+    hdrl_imagelist_delete(coeffs);
+    cpl_mask_delete(bpm_mask);
+    cpl_frame_delete(flat);
+    cpl_frame_delete(dark);
+    cpl_frame_delete(detlin);
+    cpl_frame_delete(bpm);
+    cpl_free(my_path1);
+    cpl_free(my_path2);
+    cpl_free(my_path3);
+    cpl_free(my_path4);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the calibration of a mapped raw with the loaded image
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_calib_context_apply_raw()
+{
+    int nx = 5;
+    int ny = 4;
+    int chip = 1;
+    double dit = 20;
+
+    char *my_path1 = cpl_sprintf("%s/TEST_master_flat.fits", localdir);
+    char *my_path2 = cpl_sprintf("%s/TEST_master_dark.fits", localdir);
+    char *my_path3 = cpl_sprintf("%s/TEST_raw.fits", localdir);
+    cpl_frame * flat = create_master_flat(my_path1, nx, ny, 2, 0.1, NULL);
+    cpl_frame * dark = create_master_dark(my_path2, nx, ny, 10, 1, 10, NULL);
+    cpl_propertylist * plist = cpl_propertylist_new();
+    cpl_image * data = cpl_image_new(nx, ny, CPL_TYPE_INT);
+    char *my_path4 = cpl_sprintf("%s/TEST_bpm_raw.fits", localdir);
+    hdrl_image * bpm_ima = cr2res_create_hdrl(nx, ny, 0, 0);
+    cpl_frame * bpm;
+    cpl_image * loaded;
+    hdrl_image * ref_in;
+    hdrl_image * ref;
+    hdrl_image * out;
+    cr2res_calib_context * ctx;
+    cr2res_io_raw * raw;
+    double rows[2 * 5];
+    char * extname;
+
+    for (int j = 1; j <= ny; j++)
+        for (int i = 1; i <= nx; i++)
+            cpl_image_set(data, i, j, 1000 * j + 10 * i - 30000);
+
+    // Raw file with a data extension for chip 1 and data + error for chip 2
+    cpl_propertylist_save(plist, my_path3, CPL_IO_CREATE);
+    extname = cr2res_io_create_extname(1, 1);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(data, my_path3, CPL_TYPE_SHORT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+    extname = cr2res_io_create_extname(2, 1);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(data, my_path3, CPL_TYPE_FLOAT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+    extname = cr2res_io_create_extname(2, 0);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(data, my_path3, CPL_TYPE_FLOAT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+
+    // NULL input
+    cpl_test_null(cr2res_io_raw_open(NULL, chip));
+    cpl_test_null(cr2res_io_raw_load_image(NULL));
+    cpl_test_eq(cr2res_io_raw_get_rows(NULL, 1, 1, rows), -1);
+    cr2res_io_raw_close(NULL);
+
+    // The extensions with errors are not mapped
+    cpl_test_null(cr2res_io_raw_open(my_path3, 2));
+
+    raw = cr2res_io_raw_open(my_path3, chip);
+#ifdef HAVE_SYS_MMAN_H
+    cpl_test_nonnull(raw);
+#endif
+    if (raw != NULL) {
+        cpl_test_eq(cr2res_io_raw_get_size_x(raw), nx);
+        cpl_test_eq(cr2res_io_raw_get_size_y(raw), ny);
+        cpl_test_eq(cr2res_io_raw_get_rows(raw, 0, 2, rows), -1);
+        cpl_test_eq(cr2res_io_raw_get_rows(raw, 2, 3, rows), 0);
+        cpl_test_abs(rows[0], 2000 + 10 - 30000, 0);
+        cpl_test_abs(rows[2 * nx - 1], 3000 + 10 * nx - 30000, 0);
+
+        // Reference with the CPL loading
+        loaded = cpl_image_load(my_path3, CPL_TYPE_DOUBLE, 0, 1);
+        ref_in = hdrl_image_create(loaded, NULL);
+        ctx = cr2res_calib_context_new(chip, 0, 0, flat, dark, NULL, NULL);
+        ref = cr2res_calib_context_apply(ctx, ref_in, dit);
+        cpl_test_nonnull(out = cr2res_calib_context_apply_raw(ctx, raw, dit));
+        cpl_test_image_abs(hdrl_image_get_image(out),
+            hdrl_image_get_image(ref), 1e-12);
+        cpl_test_image_abs(hdrl_image_get_error(out),
+            hdrl_image_get_error(ref), 1e-12);
+        cr2res_calib_context_delete(ctx);
+        hdrl_image_delete(out);
+        hdrl_image_delete(ref);
+
+        // Bad pixels marked row by row, and cleaned on the full image
+        hdrl_image_set_pixel(bpm_ima, 2, 3, (hdrl_value){1., 0.});
+        save_hdrl(my_path4, bpm_ima, MODE_BPM, 0);
+        bpm = cpl_frame_new();
+        cpl_frame_set_filename(bpm, my_path4);
+        cpl_frame_set_tag(bpm, "BPM");
+        cpl_frame_set_group(bpm, CPL_FRAME_GROUP_CALIB);
+        for (int clean_bad = 0; clean_bad <= 1; clean_bad++) {
+            ctx = cr2res_calib_context_new(chip, clean_bad, 0, flat, dark,
+                    bpm, NULL);
+            ref = cr2res_calib_context_apply(ctx, ref_in, dit);
+            cpl_test_nonnull(out = cr2res_calib_context_apply_raw(ctx, raw,
+                        dit));
+            cpl_test_image_abs(hdrl_image_get_image(out),
+                hdrl_image_get_image(ref), 1e-12);
+            cpl_test_image_abs(hdrl_image_get_error(out),
+                hdrl_image_get_error(ref), 1e-12);
+            cpl_test_eq_mask(hdrl_image_get_mask(out),
+                hdrl_image_get_mask(ref));
+            cpl_test_eq(hdrl_image_count_rejected(out), 1 - clean_bad);
+            cr2res_calib_context_delete(ctx);
+            hdrl_image_delete(out);
+            hdrl_image_delete(ref);
+        }
+        cpl_frame_delete(bpm);
+
+        cr2res_io_raw_close(raw);
+        hdrl_image_delete(ref_in);
+        cpl_image_delete(loaded);
+    }
+
+    cpl_image_delete(data);
+    cpl_propertylist_delete(plist);
+    cpl_frame_delete(flat);
+    cpl_frame_delete(dark);
+    cpl_free(my_path1);
+    cpl_free(my_path2);
+    cpl_free(my_path3);
+    cpl_free(my_path4);
+    hdrl_image_delete(bpm_ima);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the stack with the hdrl collapse of the same images
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_calib_stack()
+{
+    int nx = 4;
+    int ny = 3;
+    int nima = 5;
+    hdrl_imagelist * list = hdrl_imagelist_new();
+    hdrl_image * ima;
+    hdrl_image * ref;
+    hdrl_image * out;
+    cpl_image * ref_contrib;
+    cpl_image * contrib;
+    cr2res_calib_stack * stack;
+    cpl_size k;
+
+    for (int i = 0; i < nima; i++) {
+        ima = cr2res_create_hdrl(nx, ny, 10 + i, 1 + 0.5 * i);
+        hdrl_image_set_pixel(ima, 2, 2, (hdrl_value){3. * i, 0.1 + i});
+        if (i != 2) hdrl_image_reject(ima, 3, 1);
+        hdrl_image_reject(ima, 4, 3);
+        hdrl_imagelist_set(list, ima, i);
+    }
+
+    // NULL input
+    cpl_test_null(cr2res_calib_stack_collapse(NULL, NULL));
+    cpl_test_eq(cr2res_calib_stack_add(NULL, ima), -1);
+
+    for (int weighted = 0; weighted < 2; weighted++) {
+        stack = cr2res_calib_stack_new(weighted);
+        cpl_test_null(cr2res_calib_stack_collapse(stack, NULL));
+        for (int i = 0; i < nima; i++)
+            cpl_test_eq(cr2res_calib_stack_add(stack,
+                hdrl_imagelist_get(list, i)), 0);
+        out = cr2res_calib_stack_collapse(stack, &contrib);
+
+        if (weighted) hdrl_imagelist_collapse_weighted_mean(list, &ref,
+            &ref_contrib);
+        else hdrl_imagelist_collapse_mean(list, &ref, &ref_contrib);
+
+        cpl_test_image_abs(hdrl_image_get_image(out),
+            hdrl_image_get_image(ref), 1e-12);
+        cpl_test_image_abs(hdrl_image_get_error(out),
+            hdrl_image_get_error(ref), 1e-12);
+        cpl_test_image_abs(contrib, ref_contrib, 0);
+        cpl_test(hdrl_image_is_rejected(out, 4, 3));
+        cpl_test_eq(hdrl_image_count_rejected(out), 1);
+
+        // The pixel bad in every image is NAN, as with hdrl
+        k = (3 - 1) * nx + 4 - 1;
+        cpl_test(isnan(cpl_image_get_data_double(
+                        hdrl_image_get_image(ref))[k]));
+        cpl_test(isnan(cpl_image_get_data_double(
+                        hdrl_image_get_image(out))[k]));
+        cpl_test(isnan(cpl_image_get_data_double(
+                        hdrl_image_get_error(out))[k]));
+
+        // Wrong size
+        ima = cr2res_create_hdrl(nx + 1, ny, 1, 1);
+        cpl_test_eq(cr2res_calib_stack_add(stack, ima), -1);
+        hdrl_image_delete(ima);
+
+        hdrl_image_delete(out);
+        hdrl_image_delete(ref);
+        cpl_image_delete(contrib);
+        cpl_image_delete(ref_contrib);
+        cr2res_calib_stack_delete(stack);
+    }
+    hdrl_imagelist_delete(list);
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Run the Unit tests
@@ -1079,6 +1525,11 @@ int main(void)
     test_cr2res_calib_dark();
     test_cr2res_calib_bpm();
     test_cr2res_calib_detlin();
+    test_cr2res_calib_imagelist();
+    test_cr2res_calib_context_apply();
+    test_cr2res_calib_context_apply_raw();
+    test_cr2res_calib_stack();
 
+    cr2res_io_ext_cache_clear();
     return cpl_test_end(0);
 }
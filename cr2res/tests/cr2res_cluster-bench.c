@@ -0,0 +1,459 @@
+/*
+ * This file is part of the CR2RES Pipeline
+ * Copyright (C) 2002,2003 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
+ */
+
+/*
+   Benchmark of the clusters detection, not part of make check.
+   The former engine (sorted neighbour lists and a colour look-up table)
+   is run side by side with cr2res_cluster_detect() on a synthetic
+   2048x2048 flat mask with 20 curved orders and isolated pixels.
+
+   Build and run it with:
+       make cr2res_cluster-bench
+       ./cr2res_cluster-bench [number of runs]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cpl.h>
+#include <cr2res_dfs.h>
+#include <cr2res_cluster.h>
+
+/*-----------------------------------------------------------------------------
+                                Defines
+ -----------------------------------------------------------------------------*/
+
+#define SWAP(r,s)  do{int t=r; r=s; s=t; } while(0)
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static int cr2res_cluster_bench_legacy(int *x, int *y, int n, int nX, int nY,
+        int thres, int *index) ;
+static void cr2res_cluster_bench_sift_down(int *a, int *i, int start,
+        int end) ;
+static void cr2res_cluster_bench_isort(int *a, int *i, int count) ;
+static int * cr2res_cluster_bench_diag_sort(int *x, int *y, int *index,
+        int n, int nX, int nY) ;
+static cpl_mask * cr2res_cluster_bench_flat(int nx, int ny) ;
+
+/*-----------------------------------------------------------------------------
+                                Functions code
+ -----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Former clusters engine, copied from cr2res_cluster.c
+  @param    x       x positions of the pixels, column sorted
+  @param    y       y positions of the pixels
+  @param    n       number of pixels
+  @param    nX      mask size in x
+  @param    nY      mask size in y
+  @param    thres   minimum number of pixels in a cluster
+  @param    index   [out] cluster of each pixel, 0 for the small ones
+  @return   the number of clusters
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cluster_bench_legacy(int *x, int *y, int n, int nX, int nY,
+        int thres, int *index)
+{
+  //int *x, *y, n, nX, nY, thres, *index;
+  int *Xsort, *i2X, *X2i, *Ysort, *i2Y, *Y2i,
+      *Lsort, *i2L, *L2i, *Rsort, *i2R, *R2i,
+      *dummy, *dummy1;
+  int i, j[9], jj, nj, njj, j1, j2, iX, iY, n_branches;
+  int threshold, nregions;
+  int min_clr, max_clr, clrs[9], *uniq_clr, *translation;
+
+  //if(argc<7) return -1;
+  //x=(int *)argv[0];
+  //y=(int *)argv[1];
+  //n=*(int *)argv[2];
+  if(n<=0) return -2;
+  //nX=*(int *)argv[3];
+  //nY=*(int *)argv[4];
+  if(n>nX*nY) return -4;
+  //thres=*(int *)argv[5];
+  //index=(int *)argv[6];
+
+  dummy =(int *)cpl_malloc(n*sizeof(int));
+  dummy1=(int *)cpl_malloc(n*sizeof(int));
+
+  i2X   =(int *)cpl_malloc(n*sizeof(int));
+  X2i   =(int *)cpl_malloc(n*sizeof(int));
+
+  i2Y   =(int *)cpl_malloc(n*sizeof(int));
+  Y2i   =(int *)cpl_malloc(n*sizeof(int));
+
+  i2L   =(int *)cpl_malloc(n*sizeof(int));
+  L2i   =(int *)cpl_malloc(n*sizeof(int));
+
+  i2R   =(int *)cpl_malloc(n*sizeof(int));
+  R2i   =(int *)cpl_malloc(n*sizeof(int));
+
+  for(i=0; i<n; i++) index[i]=0;
+
+/*
+   The initial X and Y are Y-sorted, which
+   means that X runs faster while Y is
+   increasing monotonously.
+*/
+
+  for(i=0; i<n; i++) dummy[i]=x[i]+y[i]*nX;
+  cr2res_cluster_bench_isort(dummy, X2i, n);                  /* X-sorted indices for each i     */
+  for(i=0;i<n;i++) i2X[X2i[i]]=i;        /* i-value for each X-sorted index */
+
+  for(i=0; i<n; i++) dummy[i]=y[i]+x[i]*nY;
+  cr2res_cluster_bench_isort(dummy, Y2i, n);                  /* Y-sorted indices for each i     */
+  for(i=0;i<n;i++) i2Y[Y2i[i]]=i;        /* i-value for each Y-sorted index */
+
+  cr2res_cluster_bench_diag_sort(x, y, dummy, n, nX, nY);
+  cr2res_cluster_bench_isort(dummy, L2i, n);                  /* Left-diag-sorted indices for each i     */
+  for(i=0; i<n; i++) i2L[L2i[i]]=i;      /* i-value for each left-diag-sorted index */
+
+  for(i=0; i<n; i++) dummy1[i]=nX-1-x[i];
+  cr2res_cluster_bench_diag_sort(dummy1, y, dummy, n, nX, nY);
+  cr2res_cluster_bench_isort(dummy, R2i, n);                  /* Right-diag-sorted indices for each i     */
+  for(i=0; i<n; i++) i2R[R2i[i]]=i;      /* i-value for each right-diag-sorted index */
+
+  cpl_free(dummy);
+  cpl_free(dummy1);
+
+  translation=(int *)cpl_calloc(n+1, sizeof(int)); /* Color look-up table */
+
+  n_branches=0;                          /* Branch counter */
+
+  jj=0;
+  for(i=0;i<n;i++)                       /* Loop through pixels */
+  {
+    nj=1;
+    j[0]= i;                             /* Mark the current pixel i    */
+
+    j1=i2X[i];                           /* X-sorted number of pixel i  */
+    j2=j1-1;                             /* Previous X-sorted number    */
+    if(j2>=0 && x[X2i[j2]]+1==x[i] && y[X2i[j2]]==y[i]) j[nj++]=X2i[j2];
+    j2=j1+1;                             /* Next X-sorted number        */
+    if(j2<n  && x[X2i[j2]]-1==x[i] && y[X2i[j2]]==y[i]) j[nj++]=X2i[j2];
+
+    j1=i2Y[i];                           /* X-sorted number of pixel i  */
+    j2=j1-1;                             /* Previous X-sorted number    */
+    if(j2>=0 && x[Y2i[j2]]==x[i] && y[Y2i[j2]]+1==y[i]) j[nj++]=Y2i[j2];
+    j2=j1+1;                             /* Next X-sorted number        */
+    if(j2<n  && x[Y2i[j2]]==x[i] && y[Y2i[j2]]-1==y[i]) j[nj++]=Y2i[j2];
+
+    j1=i2L[i];                           /* X-sorted number of pixel i  */
+    j2=j1-1;                             /* Previous X-sorted number    */
+    if(j2>=0 && x[L2i[j2]]-1==x[i] && y[L2i[j2]]+1==y[i]) j[nj++]=L2i[j2];
+    j2=j1+1;                             /* Next X-sorted number        */
+    if(j2<n  && x[L2i[j2]]+1==x[i] && y[L2i[j2]]-1==y[i]) j[nj++]=L2i[j2];
+
+    j1=i2R[i];                           /* X-sorted number of pixel i  */
+    j2=j1-1;                             /* Previous X-sorted number    */
+    if(j2>=0 && x[R2i[j2]]+1==x[i] && y[R2i[j2]]+1==y[i]) j[nj++]=R2i[j2];
+    j2=j1+1;                             /* Next X-sorted number        */
+    if(j2<n  && x[R2i[j2]]-1==x[i] && y[R2i[j2]]-1==y[i]) j[nj++]=R2i[j2];
+
+    njj=0;
+    min_clr=n+1;                         /* Initialize minimum color     */
+    for(j1=0; j1<nj; j1++)               /* Find minimum color           */
+    {                                    /* any existing cluster member  */
+      j2=index[j[j1]];                   /* Color of this pixel          */
+      if(j2 > 0 && j2 < min_clr) min_clr=j2;
+    }
+
+	if(min_clr == n+1)                   /* None found (only uncolored pixels)  */
+    {
+      n_branches++;
+      for(j1=0; j1<nj; j1++) index[j[j1]]=n_branches;
+      translation[n_branches]=n_branches;
+    }
+    else                                  /* Found colored pixels, re-paint all  */
+    {                                     /* pixels with smallest non-zero color */
+      for(j1=0;j1<nj;j1++)
+      {
+        j2=index[j[j1]];                  /* Color of this pixel          */
+        if(j2>min_clr) translation[j2]=min_clr; /* Adjust the look-up table     */
+        index[j[j1]]=min_clr;             /* Re-color this pixel          */
+      }
+    }
+  }
+  cpl_free(X2i); cpl_free(i2X);
+  cpl_free(Y2i); cpl_free(i2Y);
+  cpl_free(L2i); cpl_free(i2L);
+  cpl_free(R2i); cpl_free(i2R);
+
+  for(i=0; i<n; i++)                      /* Reduce reference chains in look-up  */
+  {                                       /* table to single direct references   */
+    translation[i]=translation[translation[i]];
+  }
+
+  for(i=0; i<n; i++)                      /* Apply look-up table                 */
+  {
+    index[i]=translation[index[i]];
+  }
+
+  threshold=thres>1?thres:1;              /* Prepare for measuring cluster sizes */
+
+  max_clr=0;                              /* Find maximum color index            */
+  for(i=0;i<n;i++) if(index[i]>max_clr) max_clr=index[i];
+  max_clr++;
+
+  uniq_clr=(int *)cpl_calloc(max_clr, sizeof(int));
+
+  for(i=0;i<n;i++) uniq_clr[index[i]]++;
+
+  j1=0;
+  translation[0]=0;
+  for(i=1;i<max_clr;i++)
+  {
+    if(uniq_clr[i]>=threshold)
+    {
+      j1++;
+      translation[i]=j1;
+    }
+    else translation[i]=0;
+  }
+
+  nregions=j1;
+  cpl_free(uniq_clr);
+
+  for(i=0;i<n;i++) index[i]=translation[index[i]];
+
+  cpl_free(translation);
+
+  return nregions;
+}
+
+static void cr2res_cluster_bench_sift_down(int *a, int *i, int start,
+        int end)
+{
+  int root = start;
+
+  while(root*2+1 < end)
+  {
+    int child = 2*root + 1;
+    if((child+1 < end) && (a[child] < a[child+1]))
+    {
+      child++;
+    }
+    if(a[root] < a[child])
+    {
+      SWAP(a[child], a[root]);
+      SWAP(i[child], i[root]);
+      root = child;
+    }
+    else return;
+  }
+}
+
+static void cr2res_cluster_bench_isort(int *a, int *i, int count)
+{
+  int start, end;
+
+  for(start=0; start<count; start++) i[start]=start;
+
+  for(start=(count-2)/2; start>=0; start--)
+  {
+    cr2res_cluster_bench_sift_down(a, i, start, count);
+  }
+
+  for (end=count-1; end > 0; end--)
+  {
+    SWAP(a[end], a[0]);
+    SWAP(i[end], i[0]);
+    cr2res_cluster_bench_sift_down(a, i, 0, end);
+  }
+}
+
+static int * cr2res_cluster_bench_diag_sort(int *x, int *y, int *index,
+        int n, int nX, int nY)
+{
+  int i, diag;
+
+  if(nX<=nY)
+  {
+    for(i=0;i<n;i++)
+    {
+      diag=x[i]+y[i]+1;
+      if(diag<nX-1)
+      {
+        index[i]=diag*(diag+1)/2-x[i]-1;
+      }
+      else if(diag>=nX-1 && diag<nY)
+      {
+        index[i]=nX*(nX-1)/2+(diag-nX)*nX+nX-x[i]-1;
+      }
+      else if(diag>=nY)
+      {
+        index[i]=nX*nY-(nX+nY-diag)*(nX+nY-diag+1)/2+nX-x[i]-1;
+      }
+    }
+  }
+  else
+  {
+    for(i=0;i<n;i++)
+    {
+      diag=x[i]+y[i]+1;
+      if(diag<nY)
+      {
+        index[i]=diag*(diag+1)/2-x[i]-1;
+      }
+      else if(diag>=nY && diag<=nX)
+      {
+        index[i]=nY*(nY-1)/2+(diag-nY)*nY+y[i];
+      }
+      else if(diag>nX)
+      {
+        index[i]=nX*nY-(nX+nY-diag)*(nX+nY-diag+1)/2+nX-x[i]-1;
+      }
+    }
+  }
+  return index;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Synthetic flat mask
+  @param    nx      mask size in x
+  @param    ny      mask size in y
+  @return   the newly allocated mask
+
+  20 curved orders 40 pixels high with random holes, and 20000 random
+  isolated pixels.
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_mask * cr2res_cluster_bench_flat(int nx, int ny)
+{
+    cpl_mask    *   mask ;
+    cpl_binary  *   pmask ;
+    double          yc ;
+    int             order, i, j, k ;
+
+    mask = cpl_mask_new(nx, ny) ;
+    pmask = cpl_mask_get_data(mask) ;
+    srand(1) ;
+    for (order = 0 ; order < 20 ; order++) {
+        for (i = 0 ; i < nx ; i++) {
+            yc = 50 + order * 100 + 0.02 * i +
+                5e-6 * (i - 1024.) * (i - 1024.) ;
+            for (j = (int)yc - 20 ; j < (int)yc + 20 ; j++)
+                if (j >= 0 && j < ny && rand() % 50)
+                    pmask[(cpl_size)j * nx + i] = CPL_BINARY_1 ;
+        }
+    }
+    for (k = 0 ; k < 20000 ; k++)
+        pmask[(cpl_size)(rand() % ny) * nx + rand() % nx] = CPL_BINARY_1 ;
+    return mask ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Time the former and the current clusters detection
+ */
+/*----------------------------------------------------------------------------*/
+int main(int argc, char * argv[])
+{
+    cpl_mask        *   mask ;
+    cpl_table       *   res ;
+    const int       *   pclusters ;
+    int             *   xs ;
+    int             *   ys ;
+    int             *   clusters ;
+    double              t0, t_legacy, t_new ;
+    int                 nx, ny, npix, nruns, nclusters, ndiff, run, i, j,
+                        count ;
+
+    cpl_init(CPL_INIT_DEFAULT) ;
+
+    nruns = argc > 1 ? atoi(argv[1]) : 3 ;
+    if (nruns < 1) nruns = 1 ;
+    nx = ny = 2048 ;
+    mask = cr2res_cluster_bench_flat(nx, ny) ;
+    npix = cpl_mask_count(mask) ;
+    xs = cpl_malloc(npix * sizeof(int)) ;
+    ys = cpl_malloc(npix * sizeof(int)) ;
+    clusters = cpl_malloc(npix * sizeof(int)) ;
+
+    /* Former cr2res_cluster_detect(): pixel lists, then the engine */
+    t_legacy = 0 ;
+    nclusters = 0 ;
+    for (run = 0 ; run < nruns ; run++) {
+        t0 = cpl_test_get_walltime() ;
+        count = 0 ;
+        for (i = 1 ; i <= nx ; i++) {
+            for (j = 1 ; j <= ny ; j++) {
+                if (cpl_mask_get(mask, i, j) == CPL_BINARY_1) {
+                    xs[count] = i ;
+                    ys[count] = j ;
+                    count++ ;
+                }
+            }
+        }
+        nclusters = cr2res_cluster_bench_legacy(xs, ys, npix, nx, ny, 10,
+                clusters) ;
+        t_legacy += cpl_test_get_walltime() - t0 ;
+    }
+
+    t_new = 0 ;
+    res = NULL ;
+    for (run = 0 ; run < nruns ; run++) {
+        cpl_table_delete(res) ;
+        t0 = cpl_test_get_walltime() ;
+        res = cr2res_cluster_detect(mask, 10) ;
+        t_new += cpl_test_get_walltime() - t0 ;
+    }
+    if (res == NULL || cpl_table_get_nrow(res) != npix) {
+        fprintf(stderr, "The clusters detection failed\n") ;
+        cpl_table_delete(res) ;
+        cpl_free(xs) ;
+        cpl_free(ys) ;
+        cpl_free(clusters) ;
+        cpl_mask_delete(mask) ;
+        cpl_end() ;
+        return EXIT_FAILURE ;
+    }
+
+    /* Both label lists are in column order */
+    pclusters = cpl_table_get_data_int_const(res, CR2RES_COL_CLUSTERS) ;
+    ndiff = 0 ;
+    for (i = 0 ; i < npix ; i++) if (pclusters[i] != clusters[i]) ndiff++ ;
+
+    printf("%dx%d mask, %d pixels, %d clusters, %d runs:\n", nx, ny, npix,
+            nclusters, nruns) ;
+    printf("  former engine:         %8.4f s\n", t_legacy) ;
+    printf("  cr2res_cluster_detect: %8.4f s\n", t_new) ;
+    printf("  speedup %.1fx, %d differing labels\n", t_legacy / t_new,
+            ndiff) ;
+
+    cpl_table_delete(res) ;
+    cpl_free(xs) ;
+    cpl_free(ys) ;
+    cpl_free(clusters) ;
+    cpl_mask_delete(mask) ;
+    cpl_end() ;
+    return ndiff == 0 ? EXIT_SUCCESS : EXIT_FAILURE ;
+}
@@ -0,0 +1,468 @@
+/*
+ * This file is part of the CR2RES Pipeline
+ * Copyright (C) 2002,2003 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <cpl.h>
+#include "cr2res_dfs.h"
+#include "cr2res_cluster.h"
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static void test_cr2res_cluster_opening_x_cmp(int nx, int ny, int kernel_x);
+static void test_cr2res_cluster_opening_x(void);
+static void test_cr2res_cluster_labels_new(void);
+static void test_cr2res_cluster_labels_get_mask(void);
+static void test_cr2res_cluster_labels_get_table(void);
+static void test_cr2res_cluster_detect(void);
+static int * test_cr2res_cluster_detect_ref(const cpl_mask *mask,
+        int mincluster);
+static void test_cr2res_cluster_detect_flat(void);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup cr2res_cluster-test    Unit test of cr2res_cluster
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the bit-packed opening of a random mask to cpl_mask_filter()
+  @param    nx          The mask width
+  @param    ny          The mask height
+  @param    kernel_x    The kernel width
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_opening_x_cmp(int nx, int ny, int kernel_x)
+{
+    cpl_mask *mask = cpl_mask_new(nx, ny);
+    cpl_mask *kernel = cpl_mask_new(kernel_x, 1);
+    cpl_mask *cmp;
+    cpl_mask *res;
+
+    // all the columns are filled, including the borders
+    for (int j = 1; j <= ny; j++)
+        for (int i = 1; i <= nx; i++)
+            if (rand() % 3) cpl_mask_set(mask, i, j, CPL_BINARY_1);
+    // a lone pixel and a gap next to each border
+    if (nx > 2) {
+        cpl_mask_set(mask, 1, 1, CPL_BINARY_1);
+        cpl_mask_set(mask, 2, 1, CPL_BINARY_0);
+        cpl_mask_set(mask, nx, 1, CPL_BINARY_1);
+        cpl_mask_set(mask, nx - 1, 1, CPL_BINARY_0);
+        cpl_mask_set(mask, 1, ny, CPL_BINARY_0);
+        cpl_mask_set(mask, nx, ny, CPL_BINARY_0);
+    }
+
+    if (kernel_x <= nx) {
+        cmp = cpl_mask_new(nx, ny);
+        cpl_mask_not(kernel);
+        cpl_mask_filter(cmp, mask, kernel, CPL_FILTER_OPENING,
+                CPL_BORDER_COPY);
+    } else {
+        // cpl_mask_filter() needs a kernel no wider than the mask: a
+        // narrower mask is all border, and copied
+        cmp = cpl_mask_duplicate(mask);
+    }
+
+    cpl_test(res = cr2res_cluster_opening_x(mask, kernel_x));
+    cpl_test_eq_mask(res, cmp);
+
+    cpl_mask_delete(mask);
+    cpl_mask_delete(kernel);
+    cpl_mask_delete(cmp);
+    cpl_mask_delete(res);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the bit-packed opening to cpl_mask_filter()
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_opening_x(void)
+{
+    //define input
+    cpl_mask *mask = cpl_mask_new(10, 3);
+
+    //run test
+    cpl_test_null(cr2res_cluster_opening_x(NULL, 5));
+    cpl_test_null(cr2res_cluster_opening_x(mask, 4));
+    cpl_mask_delete(mask);
+
+    //test output
+    // the borders are copied, the rows span 1, 2 or 3 words
+    srand(1);
+    test_cr2res_cluster_opening_x_cmp(100, 7, 5);
+    test_cr2res_cluster_opening_x_cmp(64, 7, 5);
+    test_cr2res_cluster_opening_x_cmp(65, 7, 9);
+    test_cr2res_cluster_opening_x_cmp(130, 7, 9);
+    test_cr2res_cluster_opening_x_cmp(100, 7, 1);
+    // the mask as wide as the kernel, and narrower than the kernel
+    test_cr2res_cluster_opening_x_cmp(9, 7, 9);
+    test_cr2res_cluster_opening_x_cmp(7, 7, 9);
+    test_cr2res_cluster_opening_x_cmp(1, 7, 5);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the labels counts and bounding boxes on a 6x6 patch
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_labels_new(void)
+{
+    //define input
+    cpl_binary data[] = {1, 1, 0, 0, 0, 0,
+                         1, 1, 0, 0, 0, 1,
+                         0, 0, 0, 0, 0, 1,
+                         0, 1, 0, 1, 1, 1,
+                         0, 1, 0, 0, 0, 0,
+                         1, 0, 0, 0, 1, 1};
+    cpl_mask *mask = cpl_mask_wrap(6, 6, data);
+    cr2res_cluster_labels *labels;
+    cpl_image *image;
+    cpl_size nlabels;
+    int llx, lly, urx, ury;
+
+    //run test
+    cpl_test_null(cr2res_cluster_labels_new(NULL));
+    cpl_test(labels = cr2res_cluster_labels_new(mask));
+
+    //test output
+    // Same labels as cpl_image_labelise_mask_create()
+    cpl_test(image = cr2res_cluster_labels_get_image(labels));
+    cpl_image *cmp = cpl_image_labelise_mask_create(mask, &nlabels);
+    cpl_test_image_abs(image, cmp, 0);
+    cpl_test_eq(nlabels, cr2res_cluster_labels_get_size(labels));
+    cpl_test_eq(5, cr2res_cluster_labels_get_size(labels));
+
+    cpl_test_eq(4, cr2res_cluster_labels_get_npix(labels, 1));
+    cpl_test_eq(5, cr2res_cluster_labels_get_npix(labels, 2));
+    cpl_test_eq(2, cr2res_cluster_labels_get_npix(labels, 3));
+    cpl_test_eq(-1, cr2res_cluster_labels_get_npix(labels, 0));
+    cpl_test_eq(-1, cr2res_cluster_labels_get_npix(labels, 6));
+
+    cpl_test_eq(0, cr2res_cluster_labels_get_bbox(labels, 2, &llx, &lly,
+                &urx, &ury));
+    cpl_test_eq(4, llx);
+    cpl_test_eq(2, lly);
+    cpl_test_eq(6, urx);
+    cpl_test_eq(4, ury);
+    cpl_test_eq(-1, cr2res_cluster_labels_get_bbox(labels, 6, &llx, &lly,
+                &urx, &ury));
+
+    //deallocate memory
+    cr2res_cluster_labels_delete(labels);
+    cpl_image_delete(image);
+    cpl_image_delete(cmp);
+    cpl_mask_unwrap(mask);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the removal of small clusters in small 4x4 patch
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_labels_get_mask(void)
+{
+    //define input
+    cpl_binary data[] = {1, 1, 0, 0,
+                         1, 1, 0, 0,
+                         0, 0, 1, 0,
+                         0, 0, 1, 0};
+    cpl_mask *mask = cpl_mask_wrap(4, 4, data);
+    cpl_binary data2[] = {1, 1, 0, 0,
+                          1, 1, 0, 0,
+                          0, 0, 0, 0,
+                          0, 0, 0, 0};
+    cpl_mask *cmp = cpl_mask_wrap(4, 4, data2);
+    cr2res_cluster_labels *labels = cr2res_cluster_labels_new(mask);
+    cpl_mask *res;
+
+    //run test
+    cpl_test_null(cr2res_cluster_labels_get_mask(NULL, 3));
+
+    // if min_npix <= 1 nothing changes
+    cpl_test(res = cr2res_cluster_labels_get_mask(labels, 0));
+    cpl_test_eq_mask(res, mask);
+    cpl_mask_delete(res);
+
+    cpl_test(res = cr2res_cluster_labels_get_mask(labels, 3));
+    //test output
+    //small blob of size 2 removed
+    cpl_test_eq_mask(res, cmp);
+
+    //deallocate memory
+    cr2res_cluster_labels_delete(labels);
+    cpl_mask_unwrap(mask);
+    cpl_mask_unwrap(cmp);
+    cpl_mask_delete(res);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check that small 5x5 mask is converted to correct table of data points
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_labels_get_table(void)
+{
+    //define input
+    cpl_binary data_inverse[] = {1, 1, 1, 1, 0,
+                                 1, 1, 1, 1, 1,
+                                 0, 1, 1, 1, 1,
+                                 0, 0, 0, 1, 1,
+                                 1, 1, 0, 0, 0};
+    cpl_mask *mask = cpl_mask_wrap(5, 5, data_inverse);
+    cr2res_cluster_labels *labels = cr2res_cluster_labels_new(mask);
+    cpl_table *res;
+
+    int xs[] = {1, 2, 3, 4, 1, 2, 3, 4, 5, 2, 3, 4, 5, 4, 5, 1, 2};
+    int ys[] = {1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5};
+    int clusters[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2};
+
+    //run test
+    cpl_test_null(cr2res_cluster_labels_get_table(NULL));
+    cpl_test(res = cr2res_cluster_labels_get_table(labels));
+    //test output
+    cpl_test_eq(17, cpl_table_get_nrow(res));
+    for (int i = 0; i < 17; i++)
+    {
+        cpl_test_eq(xs[i], cpl_table_get(res, CR2RES_COL_XS, i, NULL));
+        cpl_test_eq(ys[i], cpl_table_get(res, CR2RES_COL_YS, i, NULL));
+        cpl_test_eq(clusters[i], cpl_table_get(res, CR2RES_COL_CLUSTERS, i, NULL));
+    }
+
+    //deallocate memory
+    cr2res_cluster_labels_delete(labels);
+    cpl_mask_unwrap(mask);
+    cpl_table_delete(res);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Check the diagonal neighbours and the small clusters on a 4x3 patch
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_detect(void)
+{
+    //define input
+    cpl_binary data[] = {1, 0, 0, 1,
+                         0, 1, 0, 0,
+                         0, 0, 0, 1};
+    cpl_mask *mask = cpl_mask_wrap(4, 3, data);
+    cpl_table *res;
+
+    // rows in the columns order
+    int xs[] = {1, 2, 4, 4};
+    int ys[] = {1, 2, 1, 3};
+    int clusters[] = {1, 1, 2, 3};
+    int clusters_min2[] = {1, 1, 0, 0};
+
+    //run test
+    cpl_test_null(cr2res_cluster_detect(NULL, 1));
+
+    cpl_test(res = cr2res_cluster_detect(mask, 1));
+    //test output
+    cpl_test_eq(4, cpl_table_get_nrow(res));
+    for (int i = 0; i < 4; i++) {
+        cpl_test_eq(xs[i], cpl_table_get(res, CR2RES_COL_XS, i, NULL));
+        cpl_test_eq(ys[i], cpl_table_get(res, CR2RES_COL_YS, i, NULL));
+        cpl_test_eq(clusters[i],
+                cpl_table_get(res, CR2RES_COL_CLUSTERS, i, NULL));
+    }
+    cpl_table_delete(res);
+
+    // the single pixels are not members of any cluster
+    cpl_test(res = cr2res_cluster_detect(mask, 2));
+    cpl_test_eq(4, cpl_table_get_nrow(res));
+    for (int i = 0; i < 4; i++)
+        cpl_test_eq(clusters_min2[i],
+                cpl_table_get(res, CR2RES_COL_CLUSTERS, i, NULL));
+
+    //deallocate memory
+    cpl_table_delete(res);
+    cpl_mask_unwrap(mask);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Label the clusters of a mask with a flood fill
+  @param    mask        The mask
+  @param    mincluster  The minimum number of pixels of a cluster
+  @return   The cluster of each selected pixel, in the columns order
+
+  The 8 neighbours are connected. The clusters are numbered in the columns
+  order of their first pixel, the ones smaller than mincluster are 0.
+ */
+/*----------------------------------------------------------------------------*/
+static int * test_cr2res_cluster_detect_ref(const cpl_mask *mask,
+        int mincluster)
+{
+    int nx = cpl_mask_get_size_x(mask);
+    int ny = cpl_mask_get_size_y(mask);
+    const cpl_binary *pmask = cpl_mask_get_data_const(mask);
+    int *label = cpl_calloc((cpl_size)nx * ny, sizeof(int));
+    int *stack = cpl_malloc((cpl_size)nx * ny * sizeof(int));
+    int *size = cpl_calloc((cpl_size)nx * ny + 1, sizeof(int));
+    int *number = cpl_calloc((cpl_size)nx * ny + 1, sizeof(int));
+    int *clusters = cpl_malloc((cpl_size)nx * ny * sizeof(int));
+    int nlabels = 0;
+    int nclusters = 0;
+    int npix = 0;
+
+    for (int i = 0; i < nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            int k = j * nx + i;
+            int nstack = 0;
+            if (!pmask[k] || label[k]) continue;
+            label[k] = ++nlabels;
+            stack[nstack++] = k;
+            while (nstack > 0) {
+                int p = stack[--nstack];
+                int x = p % nx;
+                int y = p / nx;
+                size[nlabels]++;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int q = (y + dy) * nx + x + dx;
+                        if (x + dx < 0 || x + dx >= nx || y + dy < 0 ||
+                                y + dy >= ny) continue;
+                        if (!pmask[q] || label[q]) continue;
+                        label[q] = nlabels;
+                        stack[nstack++] = q;
+                    }
+                }
+            }
+        }
+    }
+    for (int l = 1; l <= nlabels; l++)
+        number[l] = size[l] >= mincluster ? ++nclusters : 0;
+    for (int i = 0; i < nx; i++)
+        for (int j = 0; j < ny; j++)
+            if (pmask[j * nx + i])
+                clusters[npix++] = number[label[j * nx + i]];
+
+    cpl_free(label);
+    cpl_free(stack);
+    cpl_free(size);
+    cpl_free(number);
+    return clusters;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the clusters of a flat mask to a flood fill labelling
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_cluster_detect_flat(void)
+{
+    //define input
+    // 4 curved orders 40 pixels high, with holes, running into the right
+    // and top borders, and isolated pixels
+    int nx = 300;
+    int ny = 250;
+    int mincluster[] = {1, 2, 10};
+    cpl_mask *mask = cpl_mask_new(nx, ny);
+    cpl_binary *pmask = cpl_mask_get_data(mask);
+    cpl_table *res;
+    int *ref;
+    double yc;
+    int npix, nbad, n;
+
+    srand(1);
+    for (int order = 0; order < 4; order++) {
+        for (int i = 0; i < nx; i++) {
+            yc = 30 + order * 60 + 0.05 * i + 3e-4 * (i - 150.) * (i - 150.);
+            for (int j = (int)yc - 20; j < (int)yc + 20; j++)
+                if (j >= 0 && j < ny && rand() % 50)
+                    pmask[(cpl_size)j * nx + i] = CPL_BINARY_1;
+        }
+    }
+    for (int k = 0; k < 1000; k++)
+        pmask[(cpl_size)(rand() % ny) * nx + rand() % nx] = CPL_BINARY_1;
+    // diagonal pairs across the last column
+    for (int j = 0; j < 20; j += 4) {
+        pmask[(cpl_size)j * nx + nx - 1] = CPL_BINARY_1;
+        pmask[(cpl_size)(j + 1) * nx + nx - 2] = CPL_BINARY_1;
+    }
+    npix = cpl_mask_count(mask);
+
+    for (int m = 0; m < 3; m++) {
+        //run test
+        cpl_test(res = cr2res_cluster_detect(mask, mincluster[m]));
+        ref = test_cr2res_cluster_detect_ref(mask, mincluster[m]);
+
+        //test output
+        cpl_test_eq(npix, cpl_table_get_nrow(res));
+        nbad = 0;
+        n = 0;
+        for (int i = 1; i <= nx; i++) {
+            for (int j = 1; j <= ny; j++) {
+                if (!cpl_mask_get(mask, i, j)) continue;
+                if (cpl_table_get(res, CR2RES_COL_XS, n, NULL) != i ||
+                        cpl_table_get(res, CR2RES_COL_YS, n, NULL) != j ||
+                        cpl_table_get(res, CR2RES_COL_CLUSTERS, n, NULL)
+                        != ref[n]) nbad++;
+                n++;
+            }
+        }
+        cpl_test_zero(nbad);
+        if (mincluster[m] == 10)
+            cpl_test_eq(4, cpl_table_get_column_max(res,
+                        CR2RES_COL_CLUSTERS));
+
+        //deallocate memory
+        cpl_table_delete(res);
+        cpl_free(ref);
+    }
+    cpl_mask_delete(mask);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the Unit tests
+ */
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_DEBUG);
+
+    test_cr2res_cluster_opening_x();
+    test_cr2res_cluster_labels_new();
+    test_cr2res_cluster_labels_get_mask();
+    test_cr2res_cluster_labels_get_table();
+    test_cr2res_cluster_detect();
+    test_cr2res_cluster_detect_flat();
+
+    return cpl_test_end(0);
+}
+
+/**@}*/
@@ -33,6 +33,7 @@
 #include <cr2res_dfs.h>
 #include <cr2res_detlin.h>
 #include <cr2res_utils.h>
+#include <cr2res_bpm.h>
 
 #define CR2RES_DETECTOR_SIZE            2048
 
@@ -113,6 +114,106 @@ for (i=0; i<n; i++){
   return ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the fit of all pixels with cr2res_detlin_compute()
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_detlin_compute_image(void)
+{
+    int nx = 4;
+    int ny = 3;
+    int n = 20;
+    cpl_size max_degree = 2;
+    cpl_vector * dits = cpl_vector_new(n);
+    cpl_vector * adus = cpl_vector_new(n);
+    hdrl_imagelist * imlist = hdrl_imagelist_new();
+    cpl_imagelist * coeffs = cpl_imagelist_new();
+    cpl_imagelist * errors = cpl_imagelist_new();
+    cpl_image * bpm = cpl_image_new(nx, ny, CPL_TYPE_INT);
+    cpl_image * trace_image = cpl_image_new(nx, ny, CPL_TYPE_INT);
+    cpl_polynomial * poly_fitted;
+    cpl_vector * error;
+    cpl_image * ima;
+    double rate, adu, x;
+    int nsuccess, nfailed, i, j, k, ref_success, rej;
+    cpl_size l;
+
+    for (l = 0; l <= max_degree; l++) {
+        cpl_imagelist_set(coeffs, cpl_image_new(nx, ny, CPL_TYPE_DOUBLE), l);
+        cpl_imagelist_set(errors, cpl_image_new(nx, ny, CPL_TYPE_DOUBLE), l);
+    }
+
+    /* Each pixel has its own ADU/s */
+    for (k = 0; k < n; k++) {
+        cpl_vector_set(dits, k, k + 1);
+        ima = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE);
+        for (j = 0; j < ny; j++) {
+            for (i = 0; i < nx; i++) {
+                rate = 300. + 100. * i + 400. * j;
+                x = (k + 1) * rate;
+                adu = x / (1 + 4e-6 * x) * (1 + 1e-3 * sin(k + i + 7 * j));
+                cpl_image_set(ima, i + 1, j + 1, adu);
+            }
+        }
+        hdrl_imagelist_set(imlist, hdrl_image_create(ima, NULL), k);
+        cpl_image_delete(ima);
+    }
+    cpl_image_fill_window(trace_image, 1, 1, nx, ny, 1);
+    cpl_image_set(trace_image, 2, 2, 0);
+
+    // NULL input
+    cpl_test_eq(cr2res_detlin_compute_image(NULL, dits, trace_image,
+        max_degree, coeffs, errors, bpm, NULL), -1);
+
+    nsuccess = cr2res_detlin_compute_image(imlist, dits, trace_image,
+        max_degree, coeffs, errors, bpm, &nfailed);
+    cpl_test_eq(nsuccess + nfailed, nx * ny - 1);
+    cpl_test_eq(cpl_image_get(bpm, 2, 2, &rej), CR2RES_BPM_OUTOFORDER);
+
+    /* Same result as one pixel at a time */
+    ref_success = 0;
+    for (j = 0; j < ny; j++) {
+        for (i = 0; i < nx; i++) {
+            if (i == 1 && j == 1) continue;
+            for (k = 0; k < n; k++) {
+                ima = hdrl_image_get_image(hdrl_imagelist_get(imlist, k));
+                cpl_vector_set(adus, k,
+                    (float)cpl_image_get(ima, i + 1, j + 1, &rej));
+            }
+            if (cr2res_detlin_compute(dits, adus, max_degree, &poly_fitted,
+                        &error) != 0) {
+                cpl_error_reset();
+                cpl_test_eq(cpl_image_get(bpm, i + 1, j + 1, &rej),
+                    CR2RES_BPM_DETLIN);
+                continue;
+            }
+            ref_success++;
+            cpl_test_eq(cpl_image_get(bpm, i + 1, j + 1, &rej), 0);
+            for (l = 0; l <= max_degree; l++) {
+                cpl_test_rel(cpl_image_get(cpl_imagelist_get(coeffs, l),
+                    i + 1, j + 1, &rej),
+                    cpl_polynomial_get_coeff(poly_fitted, &l), 1e-6);
+                cpl_test_rel(cpl_image_get(cpl_imagelist_get(errors, l),
+                    i + 1, j + 1, &rej),
+                    fabs(cpl_vector_get(error, l)), 1e-6);
+            }
+            cpl_polynomial_delete(poly_fitted);
+            cpl_vector_delete(error);
+        }
+    }
+    cpl_test_eq(nsuccess, ref_success);
+    cpl_test(nsuccess > 0);
+
+    cpl_vector_delete(dits);
+    cpl_vector_delete(adus);
+    hdrl_imagelist_delete(imlist);
+    cpl_imagelist_delete(coeffs);
+    cpl_imagelist_delete(errors);
+    cpl_image_delete(bpm);
+    cpl_image_delete(trace_image);
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Run the Unit tests
@@ -123,6 +224,7 @@ int main(void)
     cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_DEBUG);
 
     test_cr2res_detlin_compute();
+    test_cr2res_detlin_compute_image();
     
     return cpl_test_end(0);
 }
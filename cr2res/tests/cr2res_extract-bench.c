@@ -0,0 +1,954 @@
+/*
+ * This file is part of the CR2RES Pipeline
+ * Copyright (C) 2002,2003 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
+ */
+
+/*
+   Benchmark of the curved slit decomposition tensors, not part of make check.
+   The former array of structs tensors (xi, zeta) and their 5-deep fill of
+   the normal equations are run side by side with the structure of arrays
+   zeta tensor and its fill kernels, on the swaths of the
+   cr2res_slit_curv_test.fits fixture.
+
+   Build and run it with:
+       make cr2res_extract-bench
+       ./cr2res_extract-bench [fixture directory [number of runs]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cpl.h>
+#include <hdrl.h>
+#include <cr2res_dfs.h>
+#include <cr2res_extract.h>
+#include <cr2res_extract.c>
+
+/*-----------------------------------------------------------------------------
+                                Defines
+ -----------------------------------------------------------------------------*/
+
+/* Former array of structs layout of the tensors */
+#define zeta_index(x, y, z) (z * ncols * nrows) + (y * ncols) + x
+#define mzeta_index(x, y) (y * ncols) + x
+#define xi_index(x, y, z) (z * ncols * ny) + (y * ncols) + x
+
+typedef struct {
+    int     x ;
+    int     y ;     /* Coordinates of target pixel x,y  */
+    double  w ;     /* Contribution weight <= 1/osample */
+} xi_ref;
+
+typedef struct {
+    int     x ;
+    int     iy ;    /* Contributing subpixel  x,iy      */
+    double  w;      /* Contribution weight <= 1/osample */
+} zeta_ref;
+
+/* Timings of one layout */
+typedef struct {
+    double  build ;
+    double  fill ;
+} bench_times ;
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static int cr2res_extract_bench_aos_tensors(
+        int         ncols,
+        int         nrows,
+        int         ny,
+        double  *   ycen,
+        int     *   ycen_offset,
+        int         y_lower_lim,
+        int         osample,
+        cpl_polynomial ** slitcurves,
+        xi_ref   *  xi,
+        zeta_ref *  zeta,
+        int      *  m_zeta) ;
+
+static void cr2res_extract_bench_aos_fill(
+        int         ncols,
+        int         nrows,
+        int         ny,
+        int         ml,
+        int         mp,
+        const double    *   im,
+        const int       *   mask,
+        const double    *   sL,
+        const double    *   sP,
+        const xi_ref    *   xi,
+        const zeta_ref  *   zeta,
+        const int       *   m_zeta,
+        double      *   l_Aij,
+        double      *   l_bj,
+        double      *   p_Aij,
+        double      *   p_bj) ;
+
+static double cr2res_extract_bench_diff(
+        const double    *   a,
+        const double    *   b,
+        int                 n) ;
+
+static int cr2res_extract_bench_run(
+        const hdrl_image    *   img,
+        const cpl_table     *   trace_wave,
+        int                     oversample,
+        int                     nruns) ;
+
+/*-----------------------------------------------------------------------------
+                                Functions code
+ -----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Former computation of the xi and zeta tensors (array of structs)
+  @param ncols          Swath width in pixels
+  @param nrows          Extraction slit height in pixels
+  @param ny             Size of the slit function array: ny=osample(nrows+1)+1
+  @param ycen           Order centre line offset from pixel row boundary
+  @param ycen_offset    Order image column shift
+  @param y_lower_lim    Number of detector pixels below the pixel
+                        containing the central line yc
+  @param osample        Subpixel ovsersampling factor
+  @param slitcurves     Slit curvature polynomials of each column [ncols]
+  @param xi[ncols][ny][4]   Convolution tensor telling the coordinates
+                            of detector pixels on which {x, iy} element
+                            falls and the corresponding projections
+  @param zeta[ncols][nrows][3 * (osample + 1)]
+                        Convolution tensor telling the coordinates
+                        of subpixels {x, iy} contributing to detector pixel
+                        {x, y}
+  @param m_zeta[ncols][nrows]
+                        The actual number of contributing elements in zeta
+  @return   0
+
+  Copy of cr2res_extract_xi_zeta_tensors() as it was before the structure
+  of arrays layout.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_bench_aos_tensors(
+        int         ncols,
+        int         nrows,
+        int         ny,
+        double  *   ycen,
+        int     *   ycen_offset,
+        int         y_lower_lim,
+        int         osample,
+        cpl_polynomial ** slitcurves,
+        xi_ref   *  xi,
+        zeta_ref *  zeta,
+        int      *  m_zeta)
+{
+    int x, xx, y, yy, ix, ix1, ix2, iy, iy1, iy2, m;
+    double step, delta, dy, w, d1, d2;
+    step = 1.e0 / osample;
+
+    /* Clean xi */
+    for (x = 0; x < ncols; x++)
+    {
+        for (iy = 0; iy < ny; iy++)
+        {
+            for (m = 0; m < 4; m++)
+            {
+                xi[xi_index(x, iy, m)].x = -1;
+                xi[xi_index(x, iy, m)].y = -1;
+                xi[xi_index(x, iy, m)].w = 0.;
+            }
+        }
+    }
+
+    /* Clean zeta */
+    for (x = 0; x < ncols; x++)
+    {
+        for (y = 0; y < nrows; y++)
+        {
+            m_zeta[mzeta_index(x, y)] = 0;
+            for (ix = 0; ix < 3 * (osample + 1); ix++)
+            {
+                zeta[zeta_index(x, y, ix)].x = -1;
+                zeta[zeta_index(x, y, ix)].iy = -1;
+                zeta[zeta_index(x, y, ix)].w = 0.;
+            }
+        }
+    }
+
+    /*
+    Construct the xi and zeta tensors. They contain pixel references and contribution. 
+    values going from a given subpixel to other pixels (xi) and coming from other subpixels
+    to a given detector pixel (zeta).
+    Note, that xi and zeta are used in the equations for sL, sP and for the model but they
+    do not involve the data, only the geometry. Thus it can be pre-computed once.
+    */
+    for (x = 0; x < ncols; x++)
+    {
+        /*
+        I promised to reconsider the initial offset. Here it is. For the original layout
+        (no column shifts and discontinuities in ycen) there is pixel y that contains the
+        central line yc. There are two options here (by construction of ycen that can be 0
+        but cannot be 1): (1) yc is inside pixel y and (2) yc falls at the boundary between
+        pixels y and y-1. yc cannot be at the boundary of pixels y+1 and y because we would
+        select y+1 to be pixel y in that case.
+
+        Next we need to define starting and ending indices iy for sL subpixels that contribute
+        to pixel y. I call them iy1 and iy2. For both cases we assume osample+1 subpixels covering
+        pixel y (wierd). So for case 1 iy1 will be (y-1)*osample and iy2 == y*osample. Special
+        treatment of the boundary subpixels will compensate for introducing extra subpixel in
+        case 1. In case 2 things are more logical: iy1=(yc-y)*osample+(y-1)*osample;
+        iy2=(y+1-yc)*osample)+(y-1)*osample. ycen is yc-y making things simpler. Note also that
+        the same pattern repeates for all rows: we only need to initialize iy1 and iy2 and keep
+        incrementing them by osample. 
+        */
+
+        iy2 = osample - floor(ycen[x] * osample);
+        iy1 = iy2 - osample;
+
+        /*
+        Handling partial subpixels cut by detector pixel rows is again tricky. Here we have three
+        cases (mostly because of the decision to assume that we always have osample+1 subpixels
+        per one detector pixel). Here d1 is the fraction of the subpixel iy1 inside detector pixel y.
+        d2 is then the fraction of subpixel iy2 inside detector pixel y. By definition d1+d2==step.
+        Case 1: ycen falls on the top boundary of each detector pixel (ycen == 1). Here we conclude
+                that the first subpixel is fully contained inside pixel y and d1 is set to step.
+        Case 2: ycen falls on the bottom boundary of each detector pixel (ycen == 0). Here we conclude
+                that the first subpixel is totally outside of pixel y and d1 is set to 0.
+        Case 3: ycen falls inside of each pixel (0>ycen>1). In this case d1 is set to the fraction of
+                the first step contained inside of each pixel.
+        And BTW, this also means that central line coinsides with the upper boundary of subpixel iy2
+        when the y loop reaches pixel y_lower_lim. In other words:
+
+        dy=(iy-(y_lower_lim+ycen[x])*osample)*step-0.5*step
+        */
+
+        d1 = fmod(ycen[x], step);
+        if (d1 == 0)
+            d1 = step;
+        d2 = step - d1;
+
+        /*
+        The final hurdle for 2D slit decomposition is to construct two 3D reference tensors. We proceed
+        similar to 1D case except that now each iy subpixel can be shifted left or right following
+        the curvature of the slit image on the detector. We assume for now that each subpixel is
+        exactly 1 detector pixel wide. This may not be exactly true if the curvature changes accross
+        the focal plane but will deal with it when the necessity will become apparent. For now we
+        just assume that a shift delta the weight w assigned to subpixel iy is divided between
+        ix1=int(delta) and ix2=int(delta)+signum(delta) as (1-|delta-ix1|)*w and |delta-ix1|*w.
+
+        The curvature is given by a quadratic polynomial evaluated from an approximation for column
+        x: delta = PSF_curve[x][0] + PSF_curve[x][1] * (y-yc[x]) + PSF_curve[x][2] * (y-yc[x])^2.
+        It looks easy except that y and yc are set in the global detector coordinate system rather than
+        in the shifted and cropped swath passed to slit_func_2d. One possible solution I will try here
+        is to modify PSF_curve before the call such as:
+        delta = PSF_curve'[x][0] + PSF_curve'[x][1] * (y'-ycen[x]) + PSF_curve'[x][2] * (y'-ycen[x])^2
+        where y' = y - floor(yc).
+        */
+
+        /* Define initial distance from ycen       */
+        /* It is given by the center of the first  */
+        /* subpixel falling into pixel y_lower_lim */
+        dy = ycen[x] - floor((y_lower_lim + ycen[x]) / step) * step - step;
+
+        /*
+        Now we go detector pixels x and y incrementing subpixels looking for their controibutions
+        to the current and adjacent pixels. Note that the curvature/tilt of the projected slit
+        image could be so large that subpixel iy may no contribute to column x at all. On the
+        other hand, subpixels around ycen by definition must contribute to pixel x,y. 
+        3rd index in xi refers corners of pixel xx,y: 0:LL, 1:LR, 2:UL, 3:UR.
+        */
+        for (y = 0; y < nrows; y++) {
+            iy1 += osample; // Bottom subpixel falling in row y
+            iy2 += osample; // Top subpixel falling in row y
+            dy -= step;
+            for (iy = iy1; iy <= iy2; iy++) {
+                if (iy == iy1)      w = d1;
+                else if (iy == iy2) w = d2;
+                else                w = step;
+                dy += step;
+                delta = cpl_polynomial_eval_1d(slitcurves[x], dy - ycen[x], NULL);
+                ix1 = delta;
+                ix2 = ix1 + signum(delta);
+
+                /* Three cases: subpixel on the bottom boundary of row y, intermediate subpixels and top boundary */
+
+                if (iy == iy1) /* Case A: Subpixel iy is entering detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x  */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Upper right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 3)].x = xx;
+                            xi[xi_index(x, iy, 3)].y = yy;
+                            xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 3)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix2; /* Upper left corner of subpixel iy */
+                            // This offset is required because the iy subpixel
+                            // is going to contribute to the yy row in xx column
+                            // of detector pixels where yy and y are in the same
+                            // row. In the packed array this is not necessarily true.
+                            // Instead, what we know is that:
+                            // y+ycen_offset[x] == yy+ycen_offset[xx]
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+
+                            xi[xi_index(x, iy, 2)].x = xx;
+                            xi[xi_index(x, iy, 2)].y = yy;
+                            xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 2)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Upper left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 2)].x = xx;
+                            xi[xi_index(x, iy, 2)].y = yy;
+                            xi[xi_index(x, iy, 2)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 2)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 2)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix1; /* Upper right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 3)].x = xx;
+                            xi[xi_index(x, iy, 3)].y = yy;
+                            xi[xi_index(x, iy, 3)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 3)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 3)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else
+                    {
+                        if (x + ix1 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix1; /* Subpixel iy stays inside column x */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 2)].x = xx;
+                            xi[xi_index(x, iy, 2)].y = yy;
+                            xi[xi_index(x, iy, 2)].w = w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                }
+                else if (iy == iy2) /* Case C: Subpixel iy is leaving detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 1)].x = xx;
+                            xi[xi_index(x, iy, 1)].y = yy;
+                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 1)].x = xx;
+                            xi[xi_index(x, iy, 1)].y = yy;
+                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else /* Subpixel iy stays inside column x        */
+                    {
+                        if (x + ix1 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix1;
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                }
+                else /* CASE B: Subpixel iy is fully inside detector row y */
+                {
+                    if (ix1 < ix2) /* Subpixel iy shifts to the right from column x      */
+                    {
+                        if (x + ix1 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix1; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 1)].x = xx;
+                            xi[xi_index(x, iy, 1)].y = yy;
+                            xi[xi_index(x, iy, 1)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix2; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else if (ix1 > ix2) /* Subpixel iy shifts to the left from column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix1 < ncols)
+                        {
+                            xx = x + ix2; /* Bottom right corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 1)].x = xx;
+                            xi[xi_index(x, iy, 1)].y = yy;
+                            xi[xi_index(x, iy, 1)].w = fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 1)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 1)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                            xx = x + ix1; /* Bottom left corner of subpixel iy */
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = w - fabs(delta - ix1) * w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && xi[xi_index(x, iy, 0)].w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = xi[xi_index(x, iy, 0)].w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                    else /* Subpixel iy stays inside column x */
+                    {
+                        if (x + ix2 >= 0 && x + ix2 < ncols)
+                        {
+                            xx = x + ix2;
+                            yy = y + ycen_offset[x] - ycen_offset[xx];
+                            xi[xi_index(x, iy, 0)].x = xx;
+                            xi[xi_index(x, iy, 0)].y = yy;
+                            xi[xi_index(x, iy, 0)].w = w;
+                            if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows && w > 0)
+                            {
+                                m = m_zeta[mzeta_index(xx, yy)];
+                                zeta[zeta_index(xx, yy, m)].x = x;
+                                zeta[zeta_index(xx, yy, m)].iy = iy;
+                                zeta[zeta_index(xx, yy, m)].w = w;
+                                m_zeta[mzeta_index(xx, yy)]++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Former fill of the normal equations of sL and sP
+  @param    ncols   Swath width in pixels
+  @param    nrows   Extraction slit height in pixels
+  @param    ny      Size of the slit function
+  @param    ml      Number of sub-diagonals of the sL system
+  @param    mp      Number of sub-diagonals of the sP system
+  @param    im      Swath image [nrows][ncols]
+  @param    mask    Good pixels mask [nrows][ncols]
+  @param    sL      Slit function [ny]
+  @param    sP      Spectrum [ncols]
+  @param    xi      xi tensor
+  @param    zeta    zeta tensor
+  @param    m_zeta  Number of entries of zeta per pixel
+  @param    l_Aij   [out] Band matrix of the sL system [ny][ml+1]
+  @param    l_bj    [out] Right hand side of the sL system [ny]
+  @param    p_Aij   [out] Band matrix of the sP system [ncols][mp+1]
+  @param    p_bj    [out] Right hand side of the sP system [ncols]
+  @return   nothing
+
+  The 5-deep loops of cr2res_extract_slit_func_curved() before the
+  structure of arrays layout, without the regularization.
+ */
+/*----------------------------------------------------------------------------*/
+static void cr2res_extract_bench_aos_fill(
+        int         ncols,
+        int         nrows,
+        int         ny,
+        int         ml,
+        int         mp,
+        const double    *   im,
+        const int       *   mask,
+        const double    *   sL,
+        const double    *   sP,
+        const xi_ref    *   xi,
+        const zeta_ref  *   zeta,
+        const int       *   m_zeta,
+        double      *   l_Aij,
+        double      *   l_bj,
+        double      *   p_Aij,
+        double      *   p_bj)
+{
+    int         x, xx, xxx, yy, iy, jy, n, m ;
+    double      ww, www ;
+
+    /* Slit function */
+    for (iy = 0; iy < ny; iy++) {
+        l_bj[iy] = 0.e0;
+        for (jy = 0; jy <= ml; jy++) l_Aij[iy * (ml + 1) + jy] = 0.e0;
+    }
+    for (iy = 0; iy < ny; iy++) {
+        for (x = 0; x < ncols; x++) {
+            for (n = 0; n < 4; n++) {
+                ww = xi[xi_index(x,iy,n)].w;
+                if (ww > 0) {
+                    xx = xi[xi_index(x,iy,n)].x;
+                    yy = xi[xi_index(x,iy,n)].y;
+                    if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows) {
+                        if (m_zeta[mzeta_index(xx,yy)] > 0){
+                            for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
+                                xxx = zeta[zeta_index(xx,yy,m)].x;
+                                jy = zeta[zeta_index(xx,yy,m)].iy;
+                                if (jy > iy) continue;
+                                www = zeta[zeta_index(xx,yy,m)].w;
+                                l_Aij[iy * (ml + 1) + jy - iy + ml] +=
+                                    sP[xxx] * sP[x] * www * ww * mask[yy *
+                                    ncols + xx];
+                            }
+                            l_bj[iy] += im[yy * ncols + xx] * mask[yy * ncols +
+                                xx] * sP[x] * ww;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Spectrum */
+    for (x = 0; x < ncols; x++) {
+        for (xx = 0; xx <= mp; xx++) p_Aij[x * (mp + 1) + xx] = 0.;
+        p_bj[x] = 0;
+    }
+    for (x = 0; x < ncols; x++) {
+        for (iy = 0; iy < ny; iy++) {
+            for (n=0; n < 4; n++) {
+                ww = xi[xi_index(x,iy,n)].w;
+                if (ww > 0) {
+                    xx = xi[xi_index(x,iy,n)].x;
+                    yy = xi[xi_index(x,iy,n)].y;
+                    if (xx >= 0 && xx < ncols && yy >= 0 && yy < nrows) {
+                        if (m_zeta[mzeta_index(xx,yy)] > 0){
+                            for (m = 0; m < m_zeta[mzeta_index(xx,yy)]; m++) {
+                                xxx = zeta[zeta_index(xx,yy,m)].x;
+                                if (xxx > x) continue;
+                                jy = zeta[zeta_index(xx,yy,m)].iy;
+                                www = zeta[zeta_index(xx,yy,m)].w;
+                                p_Aij[x * (mp + 1) + xxx - x + mp] +=
+                                    sL[jy] * sL[iy] * www * ww *
+                                    mask[yy * ncols + xx];
+                            }
+                            p_bj[x] += im[yy * ncols + xx] * mask[yy * ncols +
+                                xx] * sL[iy] * ww;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Largest difference of two arrays, relative to the largest value
+  @param    a       First array
+  @param    b       Second array
+  @param    n       Size of the arrays
+  @return   max|a-b| / max|a|, 0 if a is 0
+ */
+/*----------------------------------------------------------------------------*/
+static double cr2res_extract_bench_diff(
+        const double    *   a,
+        const double    *   b,
+        int                 n)
+{
+    double      dmax, amax ;
+    int         i ;
+
+    dmax = amax = 0.0 ;
+    for (i = 0; i < n; i++) {
+        if (fabs(a[i] - b[i]) > dmax) dmax = fabs(a[i] - b[i]) ;
+        if (fabs(a[i]) > amax) amax = fabs(a[i]) ;
+    }
+    return amax > 0.0 ? dmax / amax : 0.0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Time both layouts on all the swaths of the fixture trace
+  @param    img         The fixture image
+  @param    trace_wave  The fixture traces, with slit curvature
+  @param    oversample  The oversampling factor
+  @param    nruns       The number of runs per swath
+  @return   0 if ok, -1 otherwise
+
+  Each run builds the tensors of the swath and fills the normal equations
+  of sL and sP once, as one iteration of the decomposition does. The
+  image, the mask and the current sL and sP are the same for both
+  layouts, so are the systems.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_extract_bench_run(
+        const hdrl_image    *   img,
+        const cpl_table     *   trace_wave,
+        int                     oversample,
+        int                     nruns)
+{
+    trace_geometry  *   g ;
+    cpl_image       *   img_rect ;
+    cpl_image       *   err_rect ;
+    cpl_polynomial  **  slitcurves ;
+    xi_ref          *   xi ;
+    zeta_ref        *   zeta_aos ;
+    int             *   m_zeta ;
+    zeta_tensor     *   zeta ;
+    swath_view          view ;
+    bench_times         t_aos, t_soa ;
+    double          *   ycen_sw ;
+    int             *   ycen_offset_sw ;
+    int             *   mask ;
+    double          *   im ;
+    double          *   sL ;
+    double          *   sP ;
+    double          *   loc ;
+    double          *   A[2][2] ;
+    double          *   bj[2][2] ;
+    double              t0, diff, d, s ;
+    int                 i, k, x, y, iy, isw, run, swath, height, ny, ml, mp,
+                        nx ;
+
+    /* Geometry of order 1, trace 1 */
+    g = cr2res_extract_geometry_new(trace_wave, 1, 1, -1, 80, oversample,
+            hdrl_image_get_size_x(img), hdrl_image_get_size_y(img), 1) ;
+    if (g == NULL) {
+        cpl_msg_error(__func__, "Cannot compute the trace geometry") ;
+        return -1 ;
+    }
+    swath = g->swath ;
+    height = g->height ;
+    ny = oversample * (height + 1) + 1 ;
+    nx = 4 * g->delta_x + 1 ;
+    if (nx < 3) nx = 3 ;
+    ml = 2 * oversample ;
+    mp = nx / 2 ;
+
+    /* The rectified order, as in cr2res_extract_slitdec_curved_geom() */
+    img_rect = cr2res_image_cut_rectify(hdrl_image_get_image_const(img),
+            g->ycen, height) ;
+    err_rect = cr2res_image_cut_rectify(hdrl_image_get_error_const(img),
+            g->ycen, height) ;
+    if (cr2res_extract_slitdec_reject_bad(img_rect, err_rect) != 0) {
+        cpl_msg_error(__func__, "Cannot rectify the order") ;
+        cpl_image_delete(img_rect) ;
+        cpl_image_delete(err_rect) ;
+        cr2res_extract_geometry_delete(g) ;
+        return -1 ;
+    }
+
+    /* Allocate */
+    ycen_sw = cpl_malloc(swath * sizeof(double)) ;
+    ycen_offset_sw = cpl_malloc(swath * sizeof(int)) ;
+    slitcurves = cpl_malloc(swath * sizeof(cpl_polynomial *)) ;
+    for (i = 0; i < swath; i++) slitcurves[i] = cpl_polynomial_new(1) ;
+    xi = cpl_malloc(swath * ny * 4 * sizeof(xi_ref)) ;
+    zeta_aos = cpl_malloc(swath * height * 3 * (oversample + 1) *
+            sizeof(zeta_ref)) ;
+    m_zeta = cpl_malloc(swath * height * sizeof(int)) ;
+    zeta = cr2res_extract_zeta_tensor_new(swath, height, oversample, 0) ;
+    mask = cpl_malloc(swath * height * sizeof(int)) ;
+    im = cpl_malloc(swath * height * sizeof(double)) ;
+    sL = cpl_malloc(ny * sizeof(double)) ;
+    sP = cpl_malloc(swath * sizeof(double)) ;
+    loc = cpl_malloc(max(ny, swath) * sizeof(double)) ;
+    for (k = 0; k < 2; k++) {
+        A[k][0] = cpl_malloc(ny * (ml + 1) * sizeof(double)) ;
+        bj[k][0] = cpl_malloc(ny * sizeof(double)) ;
+        A[k][1] = cpl_malloc(swath * (mp + 1) * sizeof(double)) ;
+        bj[k][1] = cpl_malloc(swath * sizeof(double)) ;
+    }
+
+    /* Smooth slit function, normalized as in the decomposition */
+    s = 0.0 ;
+    for (iy = 0; iy < ny; iy++) {
+        d = (iy - 0.5 * ny) / (0.2 * ny) ;
+        sL[iy] = exp(-d * d) ;
+        s += sL[iy] ;
+    }
+    for (iy = 0; iy < ny; iy++) sL[iy] *= oversample / s ;
+
+    t_aos.build = t_aos.fill = t_soa.build = t_soa.fill = 0.0 ;
+    diff = 0.0 ;
+    for (isw = 0; isw < g->nswaths; isw++) {
+        /* Swath data: the former code used a contiguous copy */
+        cr2res_extract_swath_view(img_rect, err_rect,
+                cpl_vector_get(g->bins_begin, isw), &view) ;
+        cr2res_extract_swath_mask(&view, swath, height, mask) ;
+        for (y = 0; y < height; y++)
+            for (x = 0; x < swath; x++)
+                im[y * swath + x] = view.img[y * view.stride + x] ;
+        for (x = 0; x < swath; x++) {
+            sP[x] = 0.0 ;
+            for (y = 0; y < height; y++)
+                if (mask[y * swath + x]) sP[x] += im[y * swath + x] ;
+        }
+        cr2res_extract_geometry_swath(g, isw, ycen_sw, ycen_offset_sw,
+                slitcurves) ;
+
+        for (run = 0; run < nruns; run++) {
+            /* Array of structs */
+            t0 = cpl_test_get_walltime() ;
+            cr2res_extract_bench_aos_tensors(swath, height, ny, ycen_sw,
+                    ycen_offset_sw, height / 2, oversample, slitcurves, xi,
+                    zeta_aos, m_zeta) ;
+            t_aos.build += cpl_test_get_walltime() - t0 ;
+            t0 = cpl_test_get_walltime() ;
+            cr2res_extract_bench_aos_fill(swath, height, ny, ml, mp, im,
+                    mask, sL, sP, xi, zeta_aos, m_zeta, A[0][0], bj[0][0],
+                    A[0][1], bj[0][1]) ;
+            t_aos.fill += cpl_test_get_walltime() - t0 ;
+
+            /* Structure of arrays */
+            t0 = cpl_test_get_walltime() ;
+            cr2res_extract_zeta_tensor(swath, height, ycen_sw,
+                    ycen_offset_sw, height / 2, oversample, slitcurves, zeta);
+            t_soa.build += cpl_test_get_walltime() - t0 ;
+            t0 = cpl_test_get_walltime() ;
+            cr2res_extract_slitdec_fill_sL(zeta, view.img, view.stride, mask,
+                    sP, ny, ml, A[1][0], bj[1][0], loc) ;
+            cr2res_extract_slitdec_fill_sP(zeta, view.img, view.stride, mask,
+                    sL, mp, A[1][1], bj[1][1], loc) ;
+            t_soa.fill += cpl_test_get_walltime() - t0 ;
+        }
+
+        /* Both layouts give the same systems */
+        d = cr2res_extract_bench_diff(A[0][0], A[1][0], ny * (ml + 1)) ;
+        if (d > diff) diff = d ;
+        d = cr2res_extract_bench_diff(bj[0][0], bj[1][0], ny) ;
+        if (d > diff) diff = d ;
+        d = cr2res_extract_bench_diff(A[0][1], A[1][1], swath * (mp + 1)) ;
+        if (d > diff) diff = d ;
+        d = cr2res_extract_bench_diff(bj[0][1], bj[1][1], swath) ;
+        if (d > diff) diff = d ;
+    }
+
+    printf("oversample %2d, %d swaths of %dx%d, %d runs:\n", oversample,
+            g->nswaths, swath, height, nruns) ;
+    printf("  array of structs:    tensors %8.4f s, fill %8.4f s\n",
+            t_aos.build, t_aos.fill) ;
+    printf("  structure of arrays: tensors %8.4f s, fill %8.4f s\n",
+            t_soa.build, t_soa.fill) ;
+    printf("  speedup: tensors %.1fx, fill %.1fx, max. rel. difference %g\n",
+            t_aos.build / t_soa.build, t_aos.fill / t_soa.fill, diff) ;
+
+    for (k = 0; k < 2; k++) {
+        cpl_free(A[k][0]) ;
+        cpl_free(bj[k][0]) ;
+        cpl_free(A[k][1]) ;
+        cpl_free(bj[k][1]) ;
+    }
+    cpl_free(loc) ;
+    cpl_free(sP) ;
+    cpl_free(sL) ;
+    cpl_free(im) ;
+    cpl_free(mask) ;
+    cr2res_extract_zeta_tensor_delete(zeta) ;
+    cpl_free(m_zeta) ;
+    cpl_free(zeta_aos) ;
+    cpl_free(xi) ;
+    for (i = 0; i < swath; i++) cpl_polynomial_delete(slitcurves[i]) ;
+    cpl_free(slitcurves) ;
+    cpl_free(ycen_offset_sw) ;
+    cpl_free(ycen_sw) ;
+    cpl_image_delete(img_rect) ;
+    cpl_image_delete(err_rect) ;
+    cr2res_extract_geometry_delete(g) ;
+    return 0 ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the benchmark at oversample 5 and 10
+ */
+/*----------------------------------------------------------------------------*/
+int main(int argc, char * argv[])
+{
+    const char      *   dir ;
+    char            *   path ;
+    cpl_image       *   img_in ;
+    cpl_table       *   trace_wave ;
+    cpl_array       *   poly ;
+    hdrl_image      *   img ;
+    int                 nruns, ret ;
+
+    cpl_init(CPL_INIT_DEFAULT) ;
+
+    if (argc > 1) dir = argv[1] ;
+    else if (getenv("srcdir") != NULL) dir = getenv("srcdir") ;
+    else dir = "." ;
+    nruns = argc > 2 ? atoi(argv[2]) : 3 ;
+    if (nruns < 1) nruns = 1 ;
+
+    path = cpl_sprintf("%s/cr2res_slit_curv_test.fits", dir) ;
+    img_in = cpl_image_load(path, CPL_TYPE_DOUBLE, 0, 1) ;
+    cpl_free(path) ;
+    path = cpl_sprintf("%s/cr2res_slit_curv_test_tw.fits", dir) ;
+    trace_wave = cpl_table_load(path, 1, 0) ;
+    cpl_free(path) ;
+    if (img_in == NULL || trace_wave == NULL) {
+        fprintf(stderr, "Cannot load the fixture from %s\n", dir) ;
+        cpl_image_delete(img_in) ;
+        cpl_table_delete(trace_wave) ;
+        cpl_end() ;
+        return EXIT_FAILURE ;
+    }
+    img = hdrl_image_create(img_in, NULL) ;
+
+    /* The fixture has no slit curvature, use a tilted and curved slit */
+    poly = cpl_array_new(3, CPL_TYPE_DOUBLE) ;
+    cpl_array_fill_window_double(poly, 0, 3, 0) ;
+    cpl_array_set(poly, 1, 1) ;
+    cpl_table_set_array(trace_wave, CR2RES_COL_SLIT_CURV_A, 0, poly) ;
+    cpl_array_fill_window_double(poly, 0, 3, 0) ;
+    cpl_array_set(poly, 0, 0.05) ;
+    cpl_table_set_array(trace_wave, CR2RES_COL_SLIT_CURV_B, 0, poly) ;
+    cpl_array_set(poly, 0, 1e-4) ;
+    cpl_table_set_array(trace_wave, CR2RES_COL_SLIT_CURV_C, 0, poly) ;
+    cpl_array_delete(poly) ;
+
+    ret = cr2res_extract_bench_run(img, trace_wave, 5, nruns) ;
+    if (ret == 0) ret = cr2res_extract_bench_run(img, trace_wave, 10, nruns) ;
+
+    hdrl_image_delete(img) ;
+    cpl_image_delete(img_in) ;
+    cpl_table_delete(trace_wave) ;
+    cpl_end() ;
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE ;
+}
@@ -43,9 +43,12 @@ static void test_cr2res_slitdec_vert_regression(void);
 static void test_cr2res_slitdec_vert_edge_cases(void);
 static void test_cr2res_slitdec_vert(void);
 static void test_cr2res_slitdec_curved(void);
+static void test_cr2res_extract_plan(void);
+static void test_cr2res_extract_traces_nthreads(void);
 static void test_cr2res_slitdec_compare_vert_curved(void);
 static void test_cr2res_slitdec_errors(void);
 static void test_cr2res_slitdec_input_slitfunc(void);
+static void test_cr2res_extract_slitdec_bandsol_spd(void);
 
 
 static cpl_table *create_test_table()
@@ -755,6 +758,303 @@ static void test_cr2res_slitdec_curved(void)
     hdrl_image_delete(img_hdrl);
 }
 
+static void test_cr2res_extract_plan(void)
+{
+    int width = 1000;
+    int height = 20;
+    int order = 1;
+    int trace = 1;
+    int swath = 400;
+    int oversample = 2;
+    double smooth_slit = 10;
+    double spec_in[width];
+    double const_shear = 1;
+
+    cpl_image * img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, const_shear);
+    hdrl_image * img_hdrl = hdrl_image_create(img_in, NULL);
+    cpl_table * trace_table = create_table_linear_increase(width, height,
+        const_shear);
+
+    cr2res_extract_plan * plan;
+    cpl_table * extracted;
+    cpl_table * slit_func;
+    hdrl_image * model;
+    cpl_table * extracted_plan;
+    cpl_table * slit_func_plan;
+    hdrl_image * model_plan;
+    cpl_bivector * spec;
+    cpl_bivector * spec_err;
+    cpl_bivector * spec_plan;
+    cpl_bivector * spec_err_plan;
+    cpl_vector * slit_func_one;
+    cpl_bivector * spec_one;
+    hdrl_image * model_one;
+
+    // NULL input
+    cpl_test_null(cr2res_extract_plan_new(NULL, -1, -1, CR2RES_EXTR_OPT_CURV,
+        height, swath, oversample, width, height, 0));
+    cpl_test_eq(-1, cr2res_extract_plan_apply(img_hdrl, NULL, NULL,
+        smooth_slit, 0, 1, 0, 0, 0, &extracted, &slit_func, &model));
+
+    // Reference: one-time extraction
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, -1, -1,
+        CR2RES_EXTR_OPT_CURV, height, swath, oversample, smooth_slit, 0, 1,
+        0, 0, 0, &extracted, &slit_func, &model));
+    cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted, order,
+        trace, &spec, &spec_err));
+
+    // The plan with cached tensors gives the same result every time
+    plan = cr2res_extract_plan_new(trace_table, -1, -1, CR2RES_EXTR_OPT_CURV,
+        height, swath, oversample, width, height, 1);
+    cpl_test_nonnull(plan);
+    for (int i = 0; i < 2; i++) {
+        cpl_test_eq(0, cr2res_extract_plan_apply(img_hdrl, plan, NULL,
+            smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan,
+            &model_plan));
+        cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+            order, trace, &spec_plan, &spec_err_plan));
+        cpl_test_vector_abs(cpl_bivector_get_x(spec),
+            cpl_bivector_get_x(spec_plan), DBL_EPSILON);
+        cpl_test_vector_abs(cpl_bivector_get_x(spec_err),
+            cpl_bivector_get_x(spec_err_plan), DBL_EPSILON);
+        cpl_test_image_abs(hdrl_image_get_image(model),
+            hdrl_image_get_image(model_plan), DBL_EPSILON);
+
+        cpl_bivector_delete(spec_plan);
+        cpl_bivector_delete(spec_err_plan);
+        cpl_table_delete(extracted_plan);
+        cpl_table_delete(slit_func_plan);
+        hdrl_image_delete(model_plan);
+    }
+
+    // The model is optional, and does not change the spectrum
+    cpl_test_eq(0, cr2res_extract_plan_apply(img_hdrl, plan, NULL,
+        smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan, NULL));
+    cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+        order, trace, &spec_plan, &spec_err_plan));
+    cpl_test_vector_abs(cpl_bivector_get_x(spec),
+        cpl_bivector_get_x(spec_plan), DBL_EPSILON);
+    cpl_bivector_delete(spec_plan);
+    cpl_bivector_delete(spec_err_plan);
+    cpl_table_delete(extracted_plan);
+    cpl_table_delete(slit_func_plan);
+
+    // The composited model is the full frame model of the trace
+    cpl_test_eq(0, cr2res_extract_slitdec_curved(img_hdrl, trace_table, NULL,
+        order, trace, height, swath, oversample, smooth_slit, 0,
+        &slit_func_one, &spec_one, &model_one));
+    cpl_test_image_abs(hdrl_image_get_image(model),
+        hdrl_image_get_image(model_one), DBL_EPSILON);
+    cpl_vector_delete(slit_func_one);
+    cpl_bivector_delete(spec_one);
+    hdrl_image_delete(model_one);
+
+    // The warm start from the slit function converges to the same result
+    cpl_test_eq(-1, cr2res_extract_plan_set_warm_start(NULL, 1));
+    cpl_test_eq(0, cr2res_extract_plan_set_warm_start(plan, 1));
+    cpl_test_eq(0, cr2res_extract_plan_apply(img_hdrl, plan, slit_func,
+        smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan, NULL));
+    cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+        order, trace, &spec_plan, &spec_err_plan));
+    cpl_test_vector_abs(cpl_bivector_get_x(spec),
+        cpl_bivector_get_x(spec_plan),
+        1e-3 * cpl_vector_get_max(cpl_bivector_get_x(spec)));
+    cpl_bivector_delete(spec_plan);
+    cpl_bivector_delete(spec_err_plan);
+    cpl_table_delete(extracted_plan);
+    cpl_table_delete(slit_func_plan);
+    cr2res_extract_plan_set_warm_start(plan, 0);
+
+    // Same for the vertical decomposition of an unsheared trace
+    {
+        double spec_vert_in[width];
+        cpl_image * img_vert = create_image_sinusoidal(width, height,
+            spec_vert_in);
+        hdrl_image * img_vert_hdrl = hdrl_image_create(img_vert, NULL);
+        cpl_table * extracted_cold;
+        cpl_table * slit_func_cold;
+        cpl_bivector * spec_cold;
+        cpl_bivector * spec_err_cold;
+        cr2res_extract_plan * plan_vert = cr2res_extract_plan_new(
+            trace_table, -1, -1, CR2RES_EXTR_OPT_VERT, height, swath,
+            oversample, width, height, 0);
+        cpl_test_eq(0, cr2res_extract_plan_apply(img_vert_hdrl, plan_vert,
+            NULL, smooth_slit, 0, 1, 0, 0, 0, &extracted_cold,
+            &slit_func_cold, NULL));
+        cpl_test_eq(0, cr2res_extract_plan_set_warm_start(plan_vert, 1));
+        cpl_test_eq(0, cr2res_extract_plan_apply(img_vert_hdrl, plan_vert,
+            slit_func_cold, smooth_slit, 0, 1, 0, 0, 0, &extracted_plan,
+            &slit_func_plan, NULL));
+        cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_cold,
+            order, trace, &spec_cold, &spec_err_cold));
+        cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+            order, trace, &spec_plan, &spec_err_plan));
+        cpl_test_vector_abs(cpl_bivector_get_x(spec_cold),
+            cpl_bivector_get_x(spec_plan),
+            1e-3 * cpl_vector_get_max(cpl_bivector_get_x(spec_cold)));
+        cpl_bivector_delete(spec_cold);
+        cpl_bivector_delete(spec_err_cold);
+        cpl_bivector_delete(spec_plan);
+        cpl_bivector_delete(spec_err_plan);
+        cpl_table_delete(extracted_cold);
+        cpl_table_delete(slit_func_cold);
+        cpl_table_delete(extracted_plan);
+        cpl_table_delete(slit_func_plan);
+        cr2res_extract_plan_delete(plan_vert);
+        hdrl_image_delete(img_vert_hdrl);
+        cpl_image_delete(img_vert);
+    }
+
+    // Single precision tensor weights, with or without cached tensors
+    // The weights are rounded to 24 bits, the systems are still solved
+    // in double precision: the spectra agree to better than 1e-6 relative
+    cpl_test_eq(-1, cr2res_extract_plan_set_single_precision(NULL, 1));
+    for (int i = 0; i < 2; i++) {
+        cr2res_extract_plan * plan_single = cr2res_extract_plan_new(
+            trace_table, -1, -1, CR2RES_EXTR_OPT_CURV, height, swath,
+            oversample, width, height, i);
+        cpl_test_eq(0, cr2res_extract_plan_set_single_precision(plan_single,
+            1));
+        cpl_test_eq(0, cr2res_extract_plan_apply(img_hdrl, plan_single, NULL,
+            smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan,
+            &model_plan));
+        cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+            order, trace, &spec_plan, &spec_err_plan));
+        cpl_test_vector_abs(cpl_bivector_get_x(spec),
+            cpl_bivector_get_x(spec_plan),
+            1e-6 * cpl_vector_get_max(cpl_bivector_get_x(spec)));
+        cpl_test_image_abs(hdrl_image_get_image(model),
+            hdrl_image_get_image(model_plan),
+            1e-6 * cpl_image_get_max(hdrl_image_get_image(model)));
+
+        // Back to double precision, the results are the reference again
+        cpl_test_eq(0, cr2res_extract_plan_set_single_precision(plan_single,
+            0));
+        cpl_bivector_delete(spec_plan);
+        cpl_bivector_delete(spec_err_plan);
+        cpl_table_delete(extracted_plan);
+        cpl_table_delete(slit_func_plan);
+        hdrl_image_delete(model_plan);
+        cpl_test_eq(0, cr2res_extract_plan_apply(img_hdrl, plan_single, NULL,
+            smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan,
+            NULL));
+        cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted_plan,
+            order, trace, &spec_plan, &spec_err_plan));
+        cpl_test_vector_abs(cpl_bivector_get_x(spec),
+            cpl_bivector_get_x(spec_plan), DBL_EPSILON);
+        cpl_bivector_delete(spec_plan);
+        cpl_bivector_delete(spec_err_plan);
+        cpl_table_delete(extracted_plan);
+        cpl_table_delete(slit_func_plan);
+        cr2res_extract_plan_delete(plan_single);
+    }
+
+    // The image must have the size of the plan
+    hdrl_image * img_small = hdrl_image_new(width/2, height);
+    cpl_test_eq(-1, cr2res_extract_plan_apply(img_small, plan, NULL,
+        smooth_slit, 0, 1, 0, 0, 0, &extracted_plan, &slit_func_plan,
+        &model_plan));
+    hdrl_image_delete(img_small);
+
+    // Free memory
+    cr2res_extract_plan_delete(plan);
+    cpl_bivector_delete(spec);
+    cpl_bivector_delete(spec_err);
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+    cpl_image_delete(img_in);
+    cpl_table_delete(trace_table);
+    hdrl_image_delete(img_hdrl);
+}
+
+static void test_cr2res_extract_traces_nthreads(void)
+{
+    int width = 1000;
+    int height = 20;
+    int swath = 100;
+    int oversample = 2;
+    double smooth_slit = 10;
+    double spec_in[width];
+    double const_shear = 0.5;
+    int nthreads[] = {2, 0};
+    cpl_msg_severity level;
+
+    cpl_image * img_in = create_image_sinusoidal(width, height, spec_in);
+    img_in = apply_shear(img_in, width, height, const_shear);
+    hdrl_image * img_hdrl = hdrl_image_create(img_in, NULL);
+    cpl_table * trace_table = create_table_linear_increase(width, height,
+        const_shear);
+
+    cpl_table * extracted;
+    cpl_table * slit_func;
+    hdrl_image * model;
+    cpl_table * extracted_par;
+    cpl_table * slit_func_par;
+    hdrl_image * model_par;
+    cpl_bivector * spec;
+    cpl_bivector * spec_err;
+    cpl_bivector * spec_par;
+    cpl_bivector * spec_err_par;
+    cpl_vector * slit;
+    cpl_vector * slit_par;
+
+    // Serial reference: one trace at a time, the swaths are solved
+    // serially in debug mode
+    level = cpl_msg_get_level();
+    cpl_msg_set_level(CPL_MSG_DEBUG);
+    cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL, -1, -1,
+        CR2RES_EXTR_OPT_CURV, height, swath, oversample, smooth_slit, 0, 1,
+        0, 0, 0, &extracted, &slit_func, &model));
+
+    // Traces and swaths in parallel: the results are identical
+    cpl_msg_set_level(CPL_MSG_WARNING);
+    for (int k = 0; k < 2; k++) {
+        cpl_test_eq(0, cr2res_extract_traces(img_hdrl, trace_table, NULL,
+            -1, -1, CR2RES_EXTR_OPT_CURV, height, swath, oversample,
+            smooth_slit, 0, nthreads[k], 0, 0, 0, &extracted_par,
+            &slit_func_par, &model_par));
+        for (int trace = 1; trace <= 2; trace++) {
+            cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(extracted,
+                1, trace, &spec, &spec_err));
+            cpl_test_eq(0, cr2res_extract_EXTRACT1D_get_spectrum(
+                extracted_par, 1, trace, &spec_par, &spec_err_par));
+            cpl_test_vector_abs(cpl_bivector_get_x(spec),
+                cpl_bivector_get_x(spec_par), 0);
+            cpl_test_vector_abs(cpl_bivector_get_x(spec_err),
+                cpl_bivector_get_x(spec_err_par), 0);
+            cpl_test_eq(0, cr2res_extract_SLIT_FUNC_get_vector(slit_func,
+                1, trace, &slit));
+            cpl_test_eq(0, cr2res_extract_SLIT_FUNC_get_vector(
+                slit_func_par, 1, trace, &slit_par));
+            cpl_test_vector_abs(slit, slit_par, 0);
+            cpl_bivector_delete(spec);
+            cpl_bivector_delete(spec_err);
+            cpl_bivector_delete(spec_par);
+            cpl_bivector_delete(spec_err_par);
+            cpl_vector_delete(slit);
+            cpl_vector_delete(slit_par);
+        }
+        cpl_test_image_abs(hdrl_image_get_image(model),
+            hdrl_image_get_image(model_par), 0);
+        cpl_test_image_abs(hdrl_image_get_error(model),
+            hdrl_image_get_error(model_par), 0);
+        cpl_table_delete(extracted_par);
+        cpl_table_delete(slit_func_par);
+        hdrl_image_delete(model_par);
+    }
+    cpl_msg_set_level(level);
+
+    // Free memory
+    cpl_table_delete(extracted);
+    cpl_table_delete(slit_func);
+    hdrl_image_delete(model);
+    cpl_image_delete(img_in);
+    cpl_table_delete(trace_table);
+    hdrl_image_delete(img_hdrl);
+}
+
 static void test_cr2res_slitdec_compare_vert_curved(void)
 {
     int width = 1000;
@@ -967,6 +1267,44 @@ static void test_cr2res_slitdec_input_slitfunc(void)
     hdrl_image_delete(img_hdrl);
 }
 
+static void test_cr2res_extract_slitdec_bandsol_spd(void)
+{
+    int n = 20;
+    int m = 2;
+    double ab[20 * 3];
+    double r[20];
+    double x[20];
+    int i, j;
+
+    /* Symmetric penta-diagonal matrix with 4, -1, 0.5 on the diagonals */
+    for (i = 0; i < n; i++) {
+        ab[i * (m + 1)] = 0.5;
+        ab[i * (m + 1) + 1] = -1;
+        ab[i * (m + 1) + 2] = 4;
+        x[i] = i + 1;
+    }
+    /* r = A x */
+    for (i = 0; i < n; i++) {
+        r[i] = 0;
+        for (j = i - m; j <= i + m; j++) {
+            if (j < 0 || j >= n) continue;
+            if (j == i) r[i] += 4 * x[j];
+            else if (abs(j - i) == 1) r[i] += -1 * x[j];
+            else r[i] += 0.5 * x[j];
+        }
+    }
+
+    cpl_test_eq(cr2res_extract_slitdec_bandsol_spd(NULL, r, n, m), -1);
+    cpl_test_eq(cr2res_extract_slitdec_bandsol_spd(ab, r, 0, m), -1);
+
+    cpl_test_eq(cr2res_extract_slitdec_bandsol_spd(ab, r, n, m), 0);
+    for (i = 0; i < n; i++) cpl_test_abs(r[i], x[i], 1e-10);
+
+    /* Degenerate matrix */
+    for (i = 0; i < n * (m + 1); i++) ab[i] = 0;
+    cpl_test_eq(cr2res_extract_slitdec_bandsol_spd(ab, r, n, m), -4);
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Run the Unit tests
@@ -988,9 +1326,12 @@ int main(void)
     // /* TMP */
     test_cr2res_slitdec_vert();
     test_cr2res_slitdec_curved();
+    test_cr2res_extract_plan();
+    test_cr2res_extract_traces_nthreads();
     /* test_cr2res_slitdec_compare_vert_curved(); */
 
     test_cr2res_slitdec_errors();
+    test_cr2res_extract_slitdec_bandsol_spd();
     // test_cr2res_slitdec_input_slitfunc();
     
     return cpl_test_end(0);
@@ -0,0 +1,647 @@
+/*
+ * This file is part of the CR2RES Pipeline
+ * Copyright (C) 2002,2003 European Southern Observatory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1307  USA
+ */
+
+/* utimensat() and truncate(), to modify the test files */
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*-----------------------------------------------------------------------------
+                                Includes
+ -----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <cpl.h>
+#include <hdrl.h>
+#include "cr2res_dfs.h"
+#include "cr2res_io.h"
+
+#define localdir "."
+
+/*-----------------------------------------------------------------------------
+                                Functions prototypes
+ -----------------------------------------------------------------------------*/
+
+static void test_cr2res_io_save_chips(const char * filename, int nchips) ;
+static void test_cr2res_io_swap_chips(const char * filename) ;
+static void test_cr2res_io_set_mtime(const char * filename, time_t sec,
+        long nsec) ;
+static void test_cr2res_io_save_frame(const char * filename, int nx, int ny,
+        double offset) ;
+static void test_cr2res_io_get_ext_idx(void);
+static void test_cr2res_io_load_image_rows(void);
+static void test_cr2res_io_load_image_list_from_set_rows(void);
+static void test_cr2res_io_load_image_list_from_set(void);
+static void test_cr2res_io_raw_open(void);
+static void test_cr2res_io_writer(void);
+
+/*----------------------------------------------------------------------------*/
+/**
+ * @defgroup cr2res_io-test    Unit test of cr2res_io
+ *
+ */
+/*----------------------------------------------------------------------------*/
+
+/**@{*/
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Save a file with the data extensions of the first chips
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_save_chips(const char * filename, int nchips)
+{
+    cpl_propertylist * plist = cpl_propertylist_new();
+    cpl_image * ima = cpl_image_new(4, 3, CPL_TYPE_FLOAT);
+    char * extname;
+
+    cpl_propertylist_save(plist, filename, CPL_IO_CREATE);
+    for (int det = 1; det <= nchips; det++) {
+        extname = cr2res_io_create_extname(det, 1);
+        cpl_propertylist_update_string(plist, "EXTNAME", extname);
+        cpl_image_save(ima, filename, CPL_TYPE_FLOAT, plist, CPL_IO_EXTEND);
+        cpl_free(extname);
+    }
+    cpl_image_delete(ima);
+    cpl_propertylist_delete(plist);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Swap the EXTNAMEs of the chips 1 and 2 in place
+
+  The file keeps its inode and its size, as if it were rewritten without
+  the time changing.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_swap_chips(const char * filename)
+{
+    FILE * fp;
+    char * buf;
+    long size;
+
+    cpl_test_nonnull(fp = fopen(filename, "r+b"));
+    if (fp == NULL) return;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = cpl_malloc(size);
+    cpl_test_eq(fread(buf, 1, size, fp), size);
+    for (long i = 0; i + 10 <= size; i++) {
+        if (!strncmp(buf + i, "CHIP1.INT1", 10))      buf[i + 4] = '2';
+        else if (!strncmp(buf + i, "CHIP2.INT1", 10)) buf[i + 4] = '1';
+    }
+    rewind(fp);
+    cpl_test_eq(fwrite(buf, 1, size, fp), size);
+    fclose(fp);
+    cpl_free(buf);
+
+    /* Do not read the headers from the files kept open by CPL */
+    cpl_fits_set_mode(CPL_FITS_RESTART_CACHING);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Set the modification time of a file
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_set_mtime(const char * filename, time_t sec,
+        long nsec)
+{
+    struct timespec ts[2];
+
+    ts[0].tv_sec = ts[1].tv_sec = sec;
+    ts[0].tv_nsec = ts[1].tv_nsec = nsec;
+    cpl_test_zero(utimensat(AT_FDCWD, filename, ts, 0));
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Save a frame with the data and error extensions of chip 1
+
+  The data value of the pixel (i,j) is offset + 100*j + i, its error is
+  j + i/100. The pixel (2,2) is NaN.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_save_frame(const char * filename, int nx, int ny,
+        double offset)
+{
+    cpl_propertylist * plist = cpl_propertylist_new();
+    cpl_image * data = cpl_image_new(nx, ny, CPL_TYPE_FLOAT);
+    cpl_image * err = cpl_image_new(nx, ny, CPL_TYPE_FLOAT);
+    char * extname;
+
+    for (int j = 1; j <= ny; j++) {
+        for (int i = 1; i <= nx; i++) {
+            cpl_image_set(data, i, j, offset + 100 * j + i);
+            cpl_image_set(err, i, j, j + i / 100.0);
+        }
+    }
+    cpl_image_set(data, 2, 2, NAN);
+
+    cpl_propertylist_save(plist, filename, CPL_IO_CREATE);
+    extname = cr2res_io_create_extname(1, 1);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(data, filename, CPL_TYPE_FLOAT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+    extname = cr2res_io_create_extname(1, 0);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(err, filename, CPL_TYPE_FLOAT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+
+    cpl_image_delete(data);
+    cpl_image_delete(err);
+    cpl_propertylist_delete(plist);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the extension numbers and their cache
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_get_ext_idx(void)
+{
+    char * my_path = cpl_sprintf("%s/TEST_io_ext_idx.fits", localdir);
+    struct stat st;
+    time_t mtime;
+
+    // NULL input, missing file, wrong detector
+    cpl_test_eq(cr2res_io_get_ext_idx(NULL, 1, 1), -1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 0, 1), -1);
+    cr2res_io_ext_cache_forget(NULL);
+
+    test_cr2res_io_save_chips(my_path, 2);
+    cpl_test_zero(stat(my_path, &st));
+    mtime = st.st_mtime;
+    test_cr2res_io_set_mtime(my_path, mtime, 0);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 1), 1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 2, 1), 2);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 3, 1), -1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 0), -1);
+
+    // Changed in place with the same size, inode and time: cache hit
+    test_cr2res_io_swap_chips(my_path);
+    test_cr2res_io_set_mtime(my_path, mtime, 0);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 1), 1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 2, 1), 2);
+
+    // Forgotten: read again
+    cr2res_io_ext_cache_forget(my_path);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 1), 2);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 2, 1), 1);
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC) || \
+    defined(HAVE_STRUCT_STAT_ST_MTIMENSEC) || \
+    defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+    // Changed within the same second: read again
+    test_cr2res_io_swap_chips(my_path);
+    test_cr2res_io_set_mtime(my_path, mtime, 500000000);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 1), 1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 2, 1), 2);
+#endif
+
+    // Rewritten: read again
+    test_cr2res_io_save_chips(my_path, 3);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 1, 1), 1);
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 3, 1), 3);
+
+    // Emptied: read again
+    cr2res_io_ext_cache_clear();
+    cpl_test_eq(cr2res_io_get_ext_idx(my_path, 2, 1), 2);
+
+    cr2res_io_ext_cache_clear();
+    cpl_free(my_path);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the loading of some rows of an image
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_load_image_rows(void)
+{
+    char * my_path = cpl_sprintf("%s/TEST_io_rows.fits", localdir);
+    int nx = 5;
+    int ny = 6;
+    hdrl_image * full;
+    hdrl_image * out;
+    hdrl_value val;
+    int rej;
+
+    test_cr2res_io_save_frame(my_path, nx, ny, 1000);
+    cpl_test_nonnull(full = cr2res_io_load_image(my_path, 1));
+
+    // NULL input, wrong detector, empty window
+    cpl_test_null(cr2res_io_load_image_rows(NULL, 1, 2, 3));
+    cpl_test_null(cr2res_io_load_image_rows(my_path, 0, 2, 3));
+    cpl_test_null(cr2res_io_load_image_rows(my_path, 1, 4, 3));
+    cpl_test_error(CPL_ERROR_NONE);
+
+    // No window: the full image
+    cpl_test_nonnull(out = cr2res_io_load_image_rows(my_path, 1, -1, -1));
+    cpl_test_image_abs(hdrl_image_get_image(out),
+            hdrl_image_get_image(full), 0);
+    cpl_test_image_abs(hdrl_image_get_error(out),
+            hdrl_image_get_error(full), 0);
+    hdrl_image_delete(out);
+
+    // Rows 2 to 3 at their place, the other rows are 0
+    cpl_test_nonnull(out = cr2res_io_load_image_rows(my_path, 1, 2, 3));
+    cpl_test_eq(hdrl_image_get_size_x(out), nx);
+    cpl_test_eq(hdrl_image_get_size_y(out), ny);
+    for (int j = 1; j <= ny; j++) {
+        for (int i = 1; i <= nx; i++) {
+            val = hdrl_image_get_pixel(out, i, j, &rej);
+            if (i == 2 && j == 2) {
+                cpl_test(rej);
+            } else if (j >= 2 && j <= 3) {
+                cpl_test_zero(rej);
+                cpl_test_abs(val.data, 1000 + 100 * j + i, 1e-3);
+                cpl_test_abs(val.error, j + i / 100.0, 1e-6);
+            } else {
+                cpl_test_zero(rej);
+                cpl_test_abs(val.data, 0, 0);
+                cpl_test_abs(val.error, 0, 0);
+            }
+        }
+    }
+    hdrl_image_delete(out);
+
+    // The window is clipped to the image
+    cpl_test_nonnull(out = cr2res_io_load_image_rows(my_path, 1, 5, 100));
+    val = hdrl_image_get_pixel(out, 3, ny, &rej);
+    cpl_test_abs(val.data, 1000 + 100 * ny + 3, 1e-3);
+    val = hdrl_image_get_pixel(out, 3, 4, &rej);
+    cpl_test_abs(val.data, 0, 0);
+    hdrl_image_delete(out);
+
+    hdrl_image_delete(full);
+    cpl_free(my_path);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the loading of some rows of a frameset
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_load_image_list_from_set_rows(void)
+{
+    cpl_frameset * set = cpl_frameset_new();
+    cpl_frame * frame;
+    hdrl_imagelist * out;
+    hdrl_image * ima;
+    hdrl_value val;
+    char * my_path;
+    int nx = 4;
+    int ny = 5;
+    int rej;
+
+    for (int k = 0; k < 3; k++) {
+        my_path = cpl_sprintf("%s/TEST_io_rows_%d.fits", localdir, k);
+        test_cr2res_io_save_frame(my_path, nx, ny, 1000 * k);
+        frame = cpl_frame_new();
+        cpl_frame_set_filename(frame, my_path);
+        cpl_frame_set_tag(frame, "FLAT");
+        cpl_frameset_insert(set, frame);
+        cpl_free(my_path);
+    }
+
+    // NULL input, wrong detector
+    cpl_test_null(cr2res_io_load_image_list_from_set_rows(NULL, 1, 2, 3));
+    cpl_test_null(cr2res_io_load_image_list_from_set_rows(set, 4, 2, 3));
+    cpl_test_error(CPL_ERROR_NONE);
+
+    // Rows 3 to 4 of each frame, in the frameset order
+    cpl_test_nonnull(out = cr2res_io_load_image_list_from_set_rows(set, 1,
+                3, 4));
+    cpl_test_eq(hdrl_imagelist_get_size(out), 3);
+    for (int k = 0; k < 3; k++) {
+        ima = hdrl_imagelist_get(out, k);
+        cpl_test_eq(hdrl_image_get_size_y(ima), ny);
+        for (int j = 1; j <= ny; j++) {
+            val = hdrl_image_get_pixel(ima, 1, j, &rej);
+            cpl_test_zero(rej);
+            if (j >= 3 && j <= 4) {
+                cpl_test_abs(val.data, 1000 * k + 100 * j + 1, 1e-3);
+                cpl_test_abs(val.error, j + 0.01, 1e-6);
+            } else {
+                cpl_test_abs(val.data, 0, 0);
+                cpl_test_abs(val.error, 0, 0);
+            }
+        }
+    }
+    hdrl_imagelist_delete(out);
+
+    cpl_frameset_delete(set);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the concurrent loading of a frameset with the serial one
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_load_image_list_from_set(void)
+{
+    cpl_frameset * set = cpl_frameset_new();
+    cpl_frame * frame;
+    hdrl_imagelist * out;
+    hdrl_imagelist * ref;
+    hdrl_image * ima;
+    char * my_path;
+    int nframes = 7;
+
+    for (int k = 0; k < nframes; k++) {
+        my_path = cpl_sprintf("%s/TEST_io_set_%d.fits", localdir, k);
+        test_cr2res_io_save_frame(my_path, 4, 3, 1000 * k);
+        frame = cpl_frame_new();
+        cpl_frame_set_filename(frame, my_path);
+        cpl_frame_set_tag(frame, "FLAT");
+        cpl_frameset_insert(set, frame);
+        cpl_free(my_path);
+    }
+
+    // Serial
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+    cpl_test_nonnull(ref = cr2res_io_load_image_list_from_set(set, 1));
+#ifdef _OPENMP
+    omp_set_num_threads(4);
+#endif
+    cpl_test_nonnull(out = cr2res_io_load_image_list_from_set(set, 1));
+
+    // Same images, in the frameset order, with the NaN pixels bad
+    cpl_test_eq(hdrl_imagelist_get_size(out), nframes);
+    cpl_test_eq(hdrl_imagelist_get_size(ref), nframes);
+    for (int k = 0; k < nframes; k++) {
+        ima = hdrl_imagelist_get(out, k);
+        cpl_test_image_abs(hdrl_image_get_image(ima),
+                hdrl_image_get_image(hdrl_imagelist_get(ref, k)), 0);
+        cpl_test_image_abs(hdrl_image_get_error(ima),
+                hdrl_image_get_error(hdrl_imagelist_get(ref, k)), 0);
+        cpl_test_eq_mask(hdrl_image_get_mask(ima),
+                hdrl_image_get_mask(hdrl_imagelist_get(ref, k)));
+        cpl_test_eq(hdrl_image_count_rejected(ima), 1);
+        cpl_test(cpl_image_is_rejected(hdrl_image_get_image(ima), 2, 2));
+        cpl_test_abs(cpl_image_get(hdrl_image_get_image(ima), 3, 2, NULL),
+                1000 * k + 203, 1e-3);
+    }
+    hdrl_imagelist_delete(out);
+    hdrl_imagelist_delete(ref);
+
+    // A missing frame: its index and error are reported
+    my_path = cpl_sprintf("%s/TEST_io_set_missing.fits", localdir);
+    remove(my_path);
+    frame = cpl_frame_new();
+    cpl_frame_set_filename(frame, my_path);
+    cpl_frame_set_tag(frame, "FLAT");
+    cpl_frameset_insert(set, frame);
+    cpl_free(my_path);
+    cpl_test_null(cr2res_io_load_image_list_from_set(set, 1));
+    cpl_test(cpl_error_get_code() != CPL_ERROR_NONE);
+    cpl_test_nonnull(strstr(cpl_error_get_message(), "Frame 8 of 8"));
+    cpl_test_nonnull(strstr(cpl_error_get_message(),
+                "TEST_io_set_missing.fits"));
+    cpl_error_reset();
+
+    cpl_frameset_delete(set);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the mapped loading of raw frames
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_raw_open(void)
+{
+    char * my_path = cpl_sprintf("%s/TEST_io_raw.fits", localdir);
+    cpl_frameset * set = cpl_frameset_new();
+    cpl_propertylist * plist = cpl_propertylist_new();
+    cpl_image * data = cpl_image_new(5, 4, CPL_TYPE_INT);
+    cpl_image * ref;
+    cpl_frame * frame;
+    hdrl_imagelist * list;
+    cr2res_io_raw * raw;
+    struct stat st;
+    char * extname;
+
+    for (int j = 1; j <= 4; j++)
+        for (int i = 1; i <= 5; i++)
+            cpl_image_set(data, i, j, 1000 * j + 10 * i - 30000);
+    cpl_propertylist_save(plist, my_path, CPL_IO_CREATE);
+    extname = cr2res_io_create_extname(1, 1);
+    cpl_propertylist_update_string(plist, "EXTNAME", extname);
+    cpl_image_save(data, my_path, CPL_TYPE_SHORT, plist, CPL_IO_EXTEND);
+    cpl_free(extname);
+    frame = cpl_frame_new();
+    cpl_frame_set_filename(frame, my_path);
+    cpl_frame_set_tag(frame, "FLAT");
+    cpl_frameset_insert(set, frame);
+
+    // The frameset loading converts the mapping as CPL loads the file
+    raw = cr2res_io_raw_open(my_path, 1);
+#ifdef HAVE_SYS_MMAN_H
+    cpl_test_nonnull(raw);
+#endif
+    cr2res_io_raw_close(raw);
+    cpl_test_nonnull(list = cr2res_io_load_image_list_from_set(set, 1));
+    ref = cpl_image_load(my_path, CPL_TYPE_DOUBLE, 0, 1);
+    cpl_test_image_abs(hdrl_image_get_image(hdrl_imagelist_get(list, 0)),
+            ref, 0);
+    cpl_image_delete(ref);
+    hdrl_imagelist_delete(list);
+
+    // A truncated file is not mapped
+    cpl_test_zero(stat(my_path, &st));
+    cpl_test_zero(truncate(my_path, st.st_size - 2880 + 20));
+    cpl_fits_set_mode(CPL_FITS_RESTART_CACHING);
+    cpl_test_null(cr2res_io_raw_open(my_path, 1));
+    cpl_error_reset();
+
+    cr2res_io_ext_cache_forget(my_path);
+    cpl_frameset_delete(set);
+    cpl_image_delete(data);
+    cpl_propertylist_delete(plist);
+    cpl_free(my_path);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Test the products writer thread
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_io_writer(void)
+{
+    char * my_path = cpl_sprintf("%s/TEST_io_writer_in.fits", localdir);
+    char * path_flat = cpl_sprintf("%s/TEST_io_writer_flat.fits", localdir);
+    char * path_detlin = cpl_sprintf("%s/TEST_io_writer_detlin.fits",
+            localdir);
+    char * path_tw = cpl_sprintf("%s/TEST_io_writer_tw.fits", localdir);
+    char * path_bad = cpl_sprintf("%s/TEST_io_no_dir/TEST_io_writer.fits",
+            localdir);
+    cpl_parameterlist * parlist = cpl_parameterlist_new();
+    cpl_propertylist * plist = cpl_propertylist_new();
+    cpl_propertylist * ext_plist[] = {NULL, NULL, NULL};
+    cpl_frameset * allframes = cpl_frameset_new();
+    cpl_frameset * inframes;
+    cpl_frame * frame;
+    hdrl_image * flats[] = {NULL, NULL, NULL};
+    hdrl_imagelist * coeffs[] = {NULL, NULL, NULL};
+    cpl_table * tables[] = {NULL, NULL, NULL};
+    hdrl_image * ima;
+    hdrl_imagelist * list;
+    cpl_table * tab;
+    int started, ret_bad;
+
+    // Recipe input frame
+    cpl_propertylist_save(plist, my_path, CPL_IO_CREATE);
+    frame = cpl_frame_new();
+    cpl_frame_set_filename(frame, my_path);
+    cpl_frame_set_tag(frame, "FLAT");
+    cpl_frame_set_group(frame, CPL_FRAME_GROUP_RAW);
+    cpl_frameset_insert(allframes, frame);
+    inframes = cpl_frameset_duplicate(allframes);
+
+    // Products
+    flats[0] = hdrl_image_new(4, 3);
+    hdrl_image_add_scalar(flats[0], (hdrl_value){2., 0.1});
+    coeffs[1] = hdrl_imagelist_new();
+    for (int k = 0; k < 3; k++) {
+        ima = hdrl_image_new(4, 3);
+        hdrl_image_add_scalar(ima, (hdrl_value){k, 0.});
+        hdrl_imagelist_set(coeffs[1], ima, k);
+    }
+    tables[2] = cpl_table_new(2);
+    cpl_table_new_column(tables[2], "Order", CPL_TYPE_INT);
+    cpl_table_set_int(tables[2], "Order", 0, 3);
+    cpl_table_set_int(tables[2], "Order", 1, 4);
+
+    // Queue the products, the writer copies them
+    started = !cr2res_io_writer_start();
+    cpl_test_zero(cr2res_io_save_MASTER_FLAT(path_flat, allframes, inframes,
+                parlist, flats, NULL, ext_plist,
+                CR2RES_CAL_FLAT_MASTER_PROCATG, "test"));
+    cpl_test_zero(cr2res_io_save_DETLIN_COEFFS(path_detlin, allframes,
+                inframes, parlist, coeffs, NULL, ext_plist,
+                CR2RES_CAL_DETLIN_COEFFS_PROCATG, "test"));
+    cpl_test_zero(cr2res_io_save_TRACE_WAVE(path_tw, allframes, inframes,
+                parlist, tables, NULL, ext_plist,
+                CR2RES_CAL_FLAT_TW_PROCATG, "test"));
+    hdrl_image_delete(flats[0]);
+    hdrl_imagelist_delete(coeffs[1]);
+    cpl_table_delete(tables[2]);
+    tables[2] = NULL;
+    if (started) {
+        // The products are added to the frames at the join
+        cpl_test_eq(cpl_frameset_get_size(allframes), 1);
+    }
+
+    // A product that cannot be written
+    ret_bad = cr2res_io_save_TRACE_WAVE(path_bad, allframes, inframes,
+            parlist, tables, NULL, ext_plist, CR2RES_CAL_FLAT_TW_PROCATG,
+            "test");
+    if (started) {
+        cpl_test_zero(ret_bad);
+        cpl_test_eq(cr2res_io_writer_join(), -1);
+        cpl_test_error(CPL_ERROR_FILE_IO);
+    } else {
+        cpl_test_eq(ret_bad, -1);
+        cpl_test_zero(cr2res_io_writer_join());
+        cpl_error_reset();
+    }
+
+    // The product frames, in the submission order
+    cpl_test_leq(4, cpl_frameset_get_size(allframes));
+    cpl_test_eq_string(cpl_frame_get_filename(
+                cpl_frameset_get_position_const(allframes, 1)), path_flat);
+    cpl_test_eq_string(cpl_frame_get_tag(
+                cpl_frameset_get_position_const(allframes, 1)),
+            CR2RES_CAL_FLAT_MASTER_PROCATG);
+    cpl_test_eq_string(cpl_frame_get_filename(
+                cpl_frameset_get_position_const(allframes, 2)), path_detlin);
+    cpl_test_eq_string(cpl_frame_get_filename(
+                cpl_frameset_get_position_const(allframes, 3)), path_tw);
+    cpl_test_eq_string(cpl_frame_get_tag(
+                cpl_frameset_get_position_const(allframes, 3)),
+            CR2RES_CAL_FLAT_TW_PROCATG);
+
+    // The files
+    cpl_test_nonnull(ima = cr2res_io_load_MASTER_FLAT(path_flat, 1));
+    if (ima != NULL) {
+        cpl_test_abs(cpl_image_get_mean(hdrl_image_get_image(ima)), 2., 0);
+        hdrl_image_delete(ima);
+    }
+    cpl_test_nonnull(list = cr2res_io_load_DETLIN_COEFFS(path_detlin, 2));
+    if (list != NULL) {
+        cpl_test_eq(hdrl_imagelist_get_size(list), 3);
+        cpl_test_abs(cpl_image_get_mean(hdrl_image_get_image(
+                        hdrl_imagelist_get(list, 2))), 2., 0);
+        hdrl_imagelist_delete(list);
+    }
+    cpl_test_nonnull(tab = cr2res_io_load_TRACE_WAVE(path_tw, 3));
+    if (tab != NULL) {
+        cpl_test_eq(cpl_table_get_nrow(tab), 2);
+        cpl_test_eq(cpl_table_get_int(tab, "Order", 1, NULL), 4);
+        cpl_table_delete(tab);
+    }
+    cpl_test_error(CPL_ERROR_NONE);
+
+    cpl_frameset_delete(allframes);
+    cpl_frameset_delete(inframes);
+    cpl_propertylist_delete(plist);
+    cpl_parameterlist_delete(parlist);
+    cpl_free(my_path);
+    cpl_free(path_flat);
+    cpl_free(path_detlin);
+    cpl_free(path_tw);
+    cpl_free(path_bad);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Run the Unit tests
+ */
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+    cpl_test_init(PACKAGE_BUGREPORT, CPL_MSG_DEBUG);
+
+    test_cr2res_io_get_ext_idx();
+    test_cr2res_io_load_image_rows();
+    test_cr2res_io_load_image_list_from_set_rows();
+    test_cr2res_io_load_image_list_from_set();
+    test_cr2res_io_raw_open();
+    test_cr2res_io_writer();
+
+    cr2res_io_ext_cache_clear();
+    return cpl_test_end(0);
+}
+
+/**@}*/
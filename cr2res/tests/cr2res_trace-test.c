@@ -47,14 +47,23 @@ static void test_cr2res_trace_gen_image(void);
 static void test_cr2res_trace_get_order_idx_values(void);
 static void test_cr2res_trace_get_ycen(void);
 static void test_cr2res_trace_get_height(void);
+static void test_cr2res_trace_get_rows(void);
 static void test_cr2res_trace_compute_middle(void);
 static void test_cr2res_trace_compute_height(void);
 static void test_cr2res_trace_get_trace_ypos(void);
+static cpl_mask * test_cr2res_trace_signal_detect_ref(
+        const cpl_image *   image,
+        int                 smooth_x,
+        int                 smooth_y,
+        double              thresh,
+        cpl_image       **  diff);
+static void test_cr2res_trace_signal_detect_check(const cpl_image * image,
+        int smooth_x, int smooth_y, double thresh);
 static void test_cr2res_trace_signal_detect(void);
 static void test_cr2res_trace_fit_traces(void);
 static void test_cr2res_trace_fit_trace(void);
 static void test_cr2res_trace_convert_cluster_to_labels(void);
-static void test_cr2res_trace_convert_labels_to_cluster(void);
+static void test_cr2res_trace_cluster_offsets(void);
 static void test_cr2res_trace_clean_blobs(void);
 static void test_cr2res_trace_extract_edges(void);
 static void test_cr2res_trace_new_slit_fraction(void);
@@ -505,6 +514,34 @@ static void test_cr2res_trace_get_height(void)
   @brief    Use two linear polynomials as input data and compare trace_compute_middle with expected result
  */
 /*----------------------------------------------------------------------------*/
+static void test_cr2res_trace_get_rows(void)
+{
+    cpl_table *trace = create_test_table();
+    int ymin, ymax;
+
+    cpl_test_eq(cr2res_trace_get_rows(NULL, 3, 1, 2, 2048, &ymin, &ymax), -1);
+    cpl_test_eq(cr2res_trace_get_rows(trace, 3, 1, 2, 2048, NULL, &ymax), -1);
+    cpl_test_eq(cr2res_trace_get_rows(trace, 20, 1, 2, 2048, &ymin, &ymax),
+            -1);
+    cpl_test_eq(cr2res_trace_get_rows(trace, 3, 5, 2, 2048, &ymin, &ymax), -1);
+
+    // Lower edge 350.415 at x=1, upper edge 559.343 at x=2048
+    cpl_test_eq(cr2res_trace_get_rows(trace, 3, 1, 2, 2048, &ymin, &ymax), 0);
+    cpl_test_eq(ymin, 348);
+    cpl_test_eq(ymax, 562);
+    cpl_test_eq(cr2res_trace_get_rows(trace, 3, -1, 0, 2048, &ymin, &ymax), 0);
+    cpl_test_eq(ymin, 350);
+    cpl_test_eq(ymax, 560);
+
+    // All the traces, clipped to the detector
+    cpl_test_eq(cr2res_trace_get_rows(trace, -1, -1, 2, 2048, &ymin, &ymax),
+            0);
+    cpl_test_eq(ymin, 1);
+    cpl_test_eq(ymax, 2048);
+
+    cpl_table_delete(trace);
+}
+
 static void test_cr2res_trace_compute_middle(void)
 {
     //define input
@@ -780,7 +817,130 @@ static void test_cr2res_trace_new_slit_fraction(void)
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Test a small 10x10 patch of the result to expected result based on trace image
+  @brief    Detect the traces signal with the CPL filters, as it used to be
+  @param    image       The input image
+  @param    smooth_x    Low pass filter kernel size in x
+  @param    smooth_y    Low pass filter kernel size in y
+  @param    thresh      The threshold used for detection
+  @param    diff        [out] The x-smoothed minus the xy-smoothed image
+  @return   The detection mask
+ */
+/*----------------------------------------------------------------------------*/
+static cpl_mask * test_cr2res_trace_signal_detect_ref(
+        const cpl_image *   image,
+        int                 smooth_x,
+        int                 smooth_y,
+        double              thresh,
+        cpl_image       **  diff)
+{
+    cpl_image * smx_image;
+    cpl_image * smxy_image;
+    cpl_image * tmp_image;
+    cpl_mask * kernel;
+    cpl_mask * mask;
+    int kernel_x = smooth_x % 2 ? smooth_x : smooth_x + 1;
+    int kernel_y = smooth_y % 2 ? smooth_y : smooth_y + 1;
+
+    // Smooth in x
+    kernel = cpl_mask_new(kernel_x, 1);
+    cpl_mask_not(kernel);
+    smx_image = cpl_image_duplicate(image);
+    cpl_test_eq_error(cpl_image_filter_mask(smx_image, image, kernel,
+                CPL_FILTER_AVERAGE_FAST, CPL_BORDER_FILTER), CPL_ERROR_NONE);
+    cpl_mask_delete(kernel);
+
+    // Shift to counts > 1, smooth the logarithm in y
+    cpl_image_subtract_scalar(smx_image, cpl_image_get_min(smx_image) - 1.0);
+    smxy_image = cpl_image_logarithm_create(smx_image, CPL_MATH_E);
+    kernel = cpl_mask_new(1, kernel_y);
+    cpl_mask_not(kernel);
+    tmp_image = cpl_image_duplicate(smxy_image);
+    cpl_test_eq_error(cpl_image_filter_mask(smxy_image, tmp_image, kernel,
+                CPL_FILTER_AVERAGE_FAST, CPL_BORDER_FILTER), CPL_ERROR_NONE);
+    cpl_mask_delete(kernel);
+    cpl_image_delete(tmp_image);
+    cpl_image_exponential(smxy_image, CPL_MATH_E);
+
+    // Threshold the difference
+    cpl_image_subtract(smx_image, smxy_image);
+    mask = cpl_mask_threshold_image_create(smx_image, thresh, DBL_MAX);
+    cpl_image_delete(smxy_image);
+    *diff = smx_image;
+    return mask;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the detection with the CPL filters computation
+
+  The pixels whose difference is within rounding errors of the threshold
+  are not compared. The pixels without any good pixel in their window
+  are never detected.
+ */
+/*----------------------------------------------------------------------------*/
+static void test_cr2res_trace_signal_detect_check(const cpl_image * image,
+        int smooth_x, int smooth_y, double thresh)
+{
+    cpl_mask * res;
+    cpl_mask * ref;
+    cpl_image * diff;
+    cpl_size nx = cpl_image_get_size_x(image);
+    cpl_size ny = cpl_image_get_size_y(image);
+    cpl_size ncmp = 0;
+    cpl_size ndet = 0;
+    cpl_size nbad = 0;
+    double d;
+    int rej;
+
+    cpl_test_nonnull(res = cr2res_trace_signal_detect(image, smooth_x,
+                smooth_y, thresh));
+    ref = test_cr2res_trace_signal_detect_ref(image, smooth_x, smooth_y,
+            thresh, &diff);
+    if (res == NULL) {
+        cpl_mask_delete(ref);
+        cpl_image_delete(diff);
+        return;
+    }
+
+    for (cpl_size j = 1; j <= ny; j++) {
+        for (cpl_size i = 1; i <= nx; i++) {
+            d = cpl_image_get(diff, i, j, &rej);
+            if (rej) {
+                nbad++;
+                cpl_test_zero(cpl_mask_get(res, i, j));
+                continue;
+            }
+            if (fabs(d - thresh) < 1e-6 * (1.0 + fabs(thresh))) continue;
+            ncmp++;
+            ndet += cpl_mask_get(ref, i, j);
+            if (cpl_mask_get(res, i, j) != cpl_mask_get(ref, i, j)) {
+                cpl_msg_error(__func__, "smooth %dx%d: pixel (%"
+                        CPL_SIZE_FORMAT",%"CPL_SIZE_FORMAT") differs",
+                        smooth_x, smooth_y, i, j);
+                cpl_test_eq(cpl_mask_get(res, i, j), cpl_mask_get(ref, i, j));
+            }
+        }
+    }
+    // Nearly all pixels are compared, some are detected unless the y
+    // smoothing is a no-op
+    cpl_test_leq(nx * ny - nx, ncmp + nbad);
+    if (smooth_y > 1) {
+        cpl_test_lt(0, ndet);
+        cpl_test_lt(ndet, ncmp);
+    } else {
+        cpl_test_zero(ndet);
+    }
+
+    cpl_mask_delete(res);
+    cpl_mask_delete(ref);
+    cpl_image_delete(diff);
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Compare the detection with the CPL filters computation, on the
+            test traces image and on traces cut by the borders with bad
+            pixels
  */
 /*----------------------------------------------------------------------------*/
 static void test_cr2res_trace_signal_detect(void)
@@ -792,42 +952,50 @@ static void test_cr2res_trace_signal_detect(void)
     int trace_sep = 150;
     double smoothfactor = 1;
     double thresh = 0.5;
-    cpl_mask *sub;
-
-    cpl_binary data2[10 * 10] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 0, 0, 0, 0, 0, 0, 0, 1, 1, 1,
-                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-                                 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
-
-    cpl_mask *cmp = cpl_mask_wrap(10, 10, data2);
-
-    cpl_mask *res;
+    int smooth[][2] = {{1, 1}, {4, 5}, {9, 31}, {30, 120}, {150, 1}};
+    double yc[] = {-2.0, 70.0, 150.0, 230.0, 298.0};
+    cpl_size nx = 160;
+    cpl_size ny = 300;
+    double v;
 
     //run test
     cpl_test_null(cr2res_trace_signal_detect(NULL, trace_sep, smoothfactor, thresh));
     cpl_test_null(cr2res_trace_signal_detect(image, -10, smoothfactor, thresh));
     cpl_test_null(cr2res_trace_signal_detect(image, trace_sep, -1, thresh));
-    //cpl_test_null(cr2res_trace_signal_detect(image, trace_sep, smoothfactor, 50000));
 
-    cpl_test(res = cr2res_trace_signal_detect(image, trace_sep, smoothfactor, thresh));
-    //test output
-    sub = cpl_mask_extract(res, 32, 105, 41, 114);
+    // The test image, as in cr2res_trace()
+    test_cr2res_trace_signal_detect_check(image, trace_sep, smoothfactor,
+            thresh);
+    test_cr2res_trace_signal_detect_check(image, 5, trace_sep, thresh);
+    cpl_image_delete(image);
 
+    // Tilted traces, the first and last ones cut by the borders, over
+    // several bands of rows
+    image = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE);
+    for (cpl_size j = 1; j <= ny; j++) {
+        for (cpl_size i = 1; i <= nx; i++) {
+            v = 20.0 + ((i * 7919 + j * 104729) % 101) / 20.0;
+            for (int k = 0; k < 5; k++) {
+                double dy = (j - yc[k] - 0.05 * i) / 6.0;
+                v += 1000.0 * exp(-dy * dy);
+            }
+            cpl_image_set(image, i, j, v);
+        }
+    }
 
-/* TODO : Why is this failing ? */
-    /* cpl_test_eq_mask(sub, cmp); */
+    // Scattered bad pixels, and a row segment wider than most x windows
+    for (cpl_size j = 1; j <= ny; j++)
+        for (cpl_size i = 1 + (j * 13) % 37; i <= nx; i += 37)
+            cpl_image_reject(image, i, j);
+    for (cpl_size i = 40; i <= 80; i++) cpl_image_reject(image, i, 100);
+    for (cpl_size j = 1; j <= ny; j++) cpl_image_reject(image, 1, j);
 
-    //deallocate memory
+    for (int k = 0; k < 5; k++) {
+        test_cr2res_trace_signal_detect_check(image, smooth[k][0],
+                smooth[k][1], 5.0);
+    }
+    test_cr2res_trace_signal_detect_check(image, 20, 60, 50.0);
     cpl_image_delete(image);
-    cpl_mask_delete(res);
-    cpl_mask_unwrap(cmp);
-    cpl_mask_delete(sub);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -880,12 +1048,37 @@ static void test_cr2res_trace_fit_traces(void)
     cpl_test_abs(5, cpl_array_get(arr, 0, NULL), DBL_EPSILON * 10);
     cpl_test_abs(0, cpl_array_get(arr, 1, NULL), DBL_EPSILON * 10);
 
+    // the result does not depend on the rows order
+    cpl_table *reversed = cpl_table_new(17);
+    cpl_table_new_column(reversed, CR2RES_COL_XS, CPL_TYPE_INT);
+    cpl_table_new_column(reversed, CR2RES_COL_YS, CPL_TYPE_INT);
+    cpl_table_new_column(reversed, CR2RES_COL_CLUSTERS, CPL_TYPE_INT);
+    for (int i = 0; i < 17; i++) {
+        cpl_table_set_int(reversed, CR2RES_COL_XS, 16-i, xs[i]);
+        cpl_table_set_int(reversed, CR2RES_COL_YS, 16-i, ys[i]);
+        cpl_table_set_int(reversed, CR2RES_COL_CLUSTERS, 16-i, clusters[i]);
+    }
+    cpl_table *res_reversed;
+    cpl_test(res_reversed = cr2res_trace_fit_traces(reversed, degree));
+    for (int i = 0; i < 2; i++) {
+        cpl_test_array_abs(cpl_table_get_array(res_reversed, CR2RES_COL_ALL, i),
+                cpl_table_get_array(res, CR2RES_COL_ALL, i), DBL_EPSILON * 10);
+        cpl_test_array_abs(
+                cpl_table_get_array(res_reversed, CR2RES_COL_UPPER, i),
+                cpl_table_get_array(res, CR2RES_COL_UPPER, i), DBL_EPSILON * 10);
+        cpl_test_array_abs(
+                cpl_table_get_array(res_reversed, CR2RES_COL_LOWER, i),
+                cpl_table_get_array(res, CR2RES_COL_LOWER, i), DBL_EPSILON * 10);
+    }
+
     //deallocate memory
     cpl_table_unwrap(cluster, CR2RES_COL_XS);
     cpl_table_unwrap(cluster, CR2RES_COL_YS);
     cpl_table_unwrap(cluster, CR2RES_COL_CLUSTERS);
     cpl_table_delete(cluster);
     cpl_table_delete(res);
+    cpl_table_delete(reversed);
+    cpl_table_delete(res_reversed);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -898,9 +1091,10 @@ static void test_cr2res_trace_fit_trace(void)
     //define input
     // use only cluster 3 from test image
     cpl_image *test_image = create_test_image();
-    cpl_table *all = cr2res_trace_convert_labels_to_cluster(test_image);
-    cpl_table_and_selected_int(all, CR2RES_COL_CLUSTERS, CPL_EQUAL_TO, 30);
-    cpl_table *table = cpl_table_extract_selected(all);
+    cpl_mask *trace_mask = cpl_mask_threshold_image_create(test_image, 29.5,
+            30.5);
+    cr2res_cluster_labels *labels = cr2res_cluster_labels_new(trace_mask);
+    cpl_table *table = cr2res_cluster_labels_get_table(labels);
 
     int degree = 2;
     cpl_array *res;
@@ -918,7 +1112,8 @@ static void test_cr2res_trace_fit_trace(void)
 
     //deallocate memory
     cpl_image_delete(test_image);
-    cpl_table_delete(all);
+    cpl_mask_delete(trace_mask);
+    cr2res_cluster_labels_delete(labels);
     cpl_table_delete(table);
     cpl_array_delete(res);
 }
@@ -975,40 +1170,35 @@ static void test_cr2res_trace_fit_trace(void)
 
 /*----------------------------------------------------------------------------*/
 /**
-  @brief    Check that small 5x5 image is converted to correct table of data points
+  @brief    Check the label offsets of grouped and ungrouped cluster tables
  */
 /*----------------------------------------------------------------------------*/
-static void test_cr2res_trace_convert_labels_to_cluster(void)
+static void test_cr2res_trace_cluster_offsets(void)
 {
     //define input
-    int data_inverse[] = {1, 1, 1, 1, 0,
-                          1, 1, 1, 1, 1,
-                          0, 1, 1, 1, 1,
-                          0, 0, 0, 1, 1,
-                          2, 2, 0, 0, 0};
-    cpl_image *labels = cpl_image_wrap(5, 5, CPL_TYPE_INT, data_inverse);
-    cpl_table *res;
-
-    int xs[] = {1, 2, 3, 4, 1, 2, 3, 4, 5, 2, 3, 4, 5, 4, 5, 1, 2};
-    int ys[] = {1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5};
-    int clusters[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2};
+    int grouped[] = {1, 1, 1, 3, 3};
+    int ungrouped[] = {3, 1, 1, 3, 1};
+    int invalid[] = {1, 0, 3};
+    cpl_size offsets[5];
 
     //run test
-    cpl_test_null(cr2res_trace_convert_labels_to_cluster(NULL));
-    cpl_test(res = cr2res_trace_convert_labels_to_cluster(labels));
+    cpl_test_eq(1, cr2res_trace_cluster_offsets(grouped, 5, 3, offsets));
     //test output
-    // cpl_table_save(res, NULL, NULL, "TEST_convert.fits", CPL_IO_CREATE);
-
-    for (int i = 0; i < 17; i++)
-    {
-        cpl_test_eq(xs[i], cpl_table_get(res, CR2RES_COL_XS, i, NULL));
-        cpl_test_eq(ys[i], cpl_table_get(res, CR2RES_COL_YS, i, NULL));
-        cpl_test_eq(clusters[i], cpl_table_get(res, CR2RES_COL_CLUSTERS, i, NULL));
-    }
-
-    //deallocate memory
-    cpl_image_unwrap(labels);
-    cpl_table_delete(res);
+    cpl_test_eq(0, offsets[1]);
+    cpl_test_eq(3, offsets[2]);
+    cpl_test_eq(3, offsets[3]);
+    cpl_test_eq(5, offsets[4]);
+
+    cpl_test_eq(0, cr2res_trace_cluster_offsets(ungrouped, 5, 3, offsets));
+    cpl_test_eq(0, offsets[1]);
+    cpl_test_eq(3, offsets[2]);
+    cpl_test_eq(3, offsets[3]);
+    cpl_test_eq(5, offsets[4]);
+
+    // rows without a valid label are not counted
+    cpl_test_eq(0, cr2res_trace_cluster_offsets(invalid, 3, 3, offsets));
+    cpl_test_eq(1, offsets[2]);
+    cpl_test_eq(2, offsets[4]);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1209,6 +1399,7 @@ int main(void)
     test_cr2res_trace_get_order_idx_values();
     test_cr2res_trace_get_ycen();
     test_cr2res_trace_get_height();
+    test_cr2res_trace_get_rows();
     test_cr2res_trace_compute_middle();
     test_cr2res_trace_compute_height();
     test_cr2res_trace_get_trace_ypos();
@@ -1216,7 +1407,7 @@ int main(void)
     test_cr2res_trace_signal_detect();
     test_cr2res_trace_fit_traces();
     test_cr2res_trace_fit_trace();
-    test_cr2res_trace_convert_labels_to_cluster();
+    test_cr2res_trace_cluster_offsets();
     test_cr2res_trace_clean_blobs();
     test_cr2res_trace_extract_edges();
     test_cr2res_trace_new_slit_fraction();
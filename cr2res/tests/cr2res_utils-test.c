@@ -59,6 +59,8 @@ static void test_cr2res_fit_interorder(void);
 static void test_cr2res_slit_pos(void);
 static void test_cr2res_slit_pos_img(void);
 static void test_cr2res_get_license(void);
+static void test_cr2res_detector_error(void);
+static void test_cr2res_image_median_window(void);
 static void test_cr2res_slit_curv_compute_order_trace(void);
 static void test_cr2res_optimal_filter_2d(void);
 
@@ -857,6 +859,114 @@ static void test_cr2res_get_license(void)
     return;
 }
 
+static void test_cr2res_detector_error(void)
+{
+    cpl_error_code  det_err[CR2RES_NB_DETECTORS] ;
+    int             det_nr, nthreads ;
+
+    cpl_test_eq(cr2res_detector_nthreads(2, 1), 1) ;
+    cpl_test_eq(cr2res_detector_nthreads(0, 0), 1) ;
+    nthreads = cr2res_detector_nthreads(0, 1) ;
+    cpl_test(nthreads >= 1 && nthreads <= CR2RES_NB_DETECTORS) ;
+
+    /* Only the second detector fails */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static,1)
+#endif
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        if (det_nr == 2) cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
+        det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
+    }
+    cpl_test_error(CPL_ERROR_NONE) ;
+    cpl_test_eq(det_err[0], CPL_ERROR_NONE) ;
+    cpl_test_eq(det_err[1], CPL_ERROR_ILLEGAL_INPUT) ;
+    cpl_test_eq(det_err[2], CPL_ERROR_NONE) ;
+
+    /* The error is raised again in the calling thread */
+    cpl_test_eq(cr2res_detector_error_restore(det_err), -1) ;
+    cpl_test_error(CPL_ERROR_ILLEGAL_INPUT) ;
+
+    det_err[1] = CPL_ERROR_NONE ;
+    cpl_test_eq(cr2res_detector_error_restore(det_err), 0) ;
+    cpl_test_error(CPL_ERROR_NONE) ;
+    cpl_test_eq(cr2res_detector_error_restore(NULL), -1) ;
+    return;
+}
+
+static void test_cr2res_image_median_window(void)
+{
+    cpl_image   *   img ;
+    cpl_image   *   med ;
+    cpl_image   *   dev ;
+    double          ref_med, ref_dev ;
+    int             nx = 23, ny = 17, hx = 3, hy = 2, badpix ;
+    cpl_size        i, j ;
+
+    img = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+    for (j=1 ; j<=ny ; j++)
+        for (i=1 ; i<=nx ; i++)
+            cpl_image_set(img, i, j, (double)((i * 37 + j * 11) % 29)) ;
+    cpl_image_reject(img, 5, 5) ;
+    cpl_image_reject(img, 6, 5) ;
+    cpl_image_reject(img, 12, 1) ;
+
+    cpl_test_eq(cr2res_image_median_window(NULL, hx, hy, &med, &dev), -1) ;
+    cpl_test_eq(cr2res_image_median_window(img, -1, hy, &med, &dev), -1) ;
+    cpl_test_eq(cr2res_image_median_window(img, hx, hy, &med, &dev), 0) ;
+
+    /* Same as the statistics of each window */
+    for (j=1 ; j<=ny ; j++) {
+        for (i=1 ; i<=nx ; i++) {
+            ref_med = cpl_image_get_median_dev_window(img,
+                    CPL_MAX(i-hx, 1), CPL_MAX(j-hy, 1),
+                    CPL_MIN(i+hx, nx), CPL_MIN(j+hy, ny), &ref_dev) ;
+            cpl_test_abs(cpl_image_get(med, i, j, &badpix), ref_med, 1e-12);
+            cpl_test_abs(cpl_image_get(dev, i, j, &badpix), ref_dev, 1e-12);
+        }
+    }
+    cpl_test_eq(cpl_image_count_rejected(med), 0) ;
+    cpl_image_delete(med) ;
+    cpl_image_delete(dev) ;
+
+    /* A window without good pixels */
+    cpl_mask_not(cpl_image_get_bpm(img)) ;
+    cpl_image_accept(img, 23, 17) ;
+    cpl_test_eq(cr2res_image_median_window(img, 1, 1, &med, NULL), 0) ;
+    cpl_test(cpl_image_is_rejected(med, 1, 1)) ;
+    cpl_test_abs(cpl_image_get(med, 22, 16, &badpix),
+            cpl_image_get(img, 23, 17, &badpix), 0) ;
+    cpl_image_delete(med) ;
+    cpl_image_delete(img) ;
+
+    /* Real values, bad pixels and NaNs, the values cross the median */
+    nx = 41 ;
+    ny = 30 ;
+    hx = 4 ;
+    hy = 4 ;
+    img = cpl_image_new(nx, ny, CPL_TYPE_DOUBLE) ;
+    for (j=1 ; j<=ny ; j++)
+        for (i=1 ; i<=nx ; i++)
+            cpl_image_set(img, i, j, 1e4 + 100. * sin(0.7 * i * j) +
+                    (((i * 13 + j * 7) % 17) == 0 ? 5000. : 0.)) ;
+    for (i=3 ; i<=nx ; i+=7) cpl_image_reject(img, i, (i * 5) % ny + 1) ;
+    cpl_image_set(img, 20, 10, NAN) ;
+    cpl_test_eq(cr2res_image_median_window(img, hx, hy, &med, &dev), 0) ;
+    cpl_image_reject(img, 20, 10) ;
+    for (j=1 ; j<=ny ; j++) {
+        for (i=1 ; i<=nx ; i++) {
+            ref_med = cpl_image_get_median_dev_window(img,
+                    CPL_MAX(i-hx, 1), CPL_MAX(j-hy, 1),
+                    CPL_MIN(i+hx, nx), CPL_MIN(j+hy, ny), &ref_dev) ;
+            cpl_test_abs(cpl_image_get(med, i, j, &badpix), ref_med, 0) ;
+            cpl_test_rel(cpl_image_get(dev, i, j, &badpix), ref_dev, 1e-10);
+        }
+    }
+    cpl_image_delete(med) ;
+    cpl_image_delete(dev) ;
+    cpl_image_delete(img) ;
+    return;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Run the Unit tests
@@ -879,6 +989,8 @@ int main(void)
     test_cr2res_convert_poly_to_array();
     test_cr2res_detector_shotnoise_model();
     test_cr2res_get_license();
+    test_cr2res_detector_error();
+    test_cr2res_image_median_window();
     test_cr2res_fit_interorder();
     test_cr2res_slit_pos();
     test_cr2res_slit_pos_img();
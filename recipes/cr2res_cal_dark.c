@@ -44,6 +44,9 @@
 
 #define RECIPE_STRING "cr2res_cal_dark"
 
+/* Memory for the frames of one tile with the non-linear collapse methods */
+#define CR2RES_CAL_DARK_TILE_BYTES  (256*1024*1024)
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -57,6 +60,19 @@ int cpl_plugin_get_info(cpl_pluginlist * list);
 static int cr2res_cal_dark_compare(
         const cpl_frame   *   frame1,
         const cpl_frame   *   frame2) ;
+static hdrl_image * cr2res_cal_dark_load(
+        const char          *   fname,
+        int                     det_nr,
+        double                  gain,
+        int                     ymin,
+        int                     ymax) ;
+static int cr2res_cal_dark_collapse(
+        const cpl_frameset      *   raw_one,
+        int                         det_nr,
+        double                      gain,
+        const hdrl_parameter    *   collapse_params,
+        hdrl_imagelist          *   ron_frames,
+        hdrl_image              **  master) ;
 
 static int cr2res_cal_dark_create(cpl_plugin *);
 static int cr2res_cal_dark_exec(cpl_plugin *);
@@ -88,6 +104,8 @@ Dark                                                                    \n\
         Load the images and create the associate error for each of      \n\
                them using cr2res_detector_shotnoise_model(--gain)       \n\
         Collapse the images with hdrl_imagelist_collapse(--collapse.*)  \n\
+               MEAN and WEIGHTED_MEAN add the frames one by one,        \n\
+               the other methods load the frames by blocks of rows      \n\
         Compute BPM form the collapsed master dark using                \n\
                cr2res_bpm_compute(--bpm_kappa, --bpm_lines_ratio)       \n\
         Set the BPM in the master dark                                  \n\
@@ -189,6 +207,13 @@ static int cr2res_cal_dark_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_dark.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_cal_dark", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     /* --bpm_method */
     p = cpl_parameter_new_value("cr2res.cr2res_cal_dark.bpm_method",
             CPL_TYPE_STRING, "Method (DEFAULT, GLOBAL, LOCAL or RUNNING)",
@@ -286,6 +311,7 @@ static int cr2res_cal_dark_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -302,9 +328,10 @@ static int cr2res_cal_dark(
         const cpl_parameterlist *   parlist)
 {
     const cpl_parameter *   par ;
-    int                     reduce_det, ron_hsize, ron_nsamples, ndit ;
+    int                     reduce_det, ron_hsize, ron_nsamples, ndit,
+                            parallel_detectors, det_nthreads, nb_failed ;
     double                  gain, dit, bpm_kappa, bpm_lines_ratio, mean, med,
-                            sigma, ron1, ron2, ron ;
+                            sigma, ron1, ron2 ;
     cr2res_bpm_method       bpm_method, my_bpm_method ;
     const char          *   sval ;
     hdrl_parameter      *   collapse_params ;
@@ -320,20 +347,15 @@ static int cr2res_cal_dark(
     hdrl_image          *   master_darks[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpms[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
 
     hdrl_imagelist      *   dark_cube ;
     cpl_mask            *   my_bpm ;
-    const char          *   fname ;
-    hdrl_image          *   ima_data ;
-    hdrl_image          *   ima_data_err ;
-    cpl_image           *   ima_err ;
 
-    hdrl_image          *   master;
-    cpl_image           *   contrib_map;
     cpl_mask            *   bpm ;
     const char          *   first_fname ;
     char                *   filename ;
-    int                     nb_frames, i, l, det_nr, nb_bad ;
+    int                     i, l, det_nr, nb_bad ;
     int                     single_dit_ndit_setting ;
     int                     original_ndit ;
     double                  original_dit ;
@@ -350,6 +372,11 @@ static int cr2res_cal_dark(
             "cr2res.cr2res_cal_dark.detector");
     reduce_det = cpl_parameter_get_int(par);
 
+    /* --parallel_detectors */
+    par = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_dark.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(par);
+
     /* --bpm_method */
     par = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_dark.bpm_method");
@@ -460,11 +487,16 @@ static int cr2res_cal_dark(
     }
     cpl_free(original_setting);
 
+    /* Number of detectors reduced concurrently */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+
     /* Loop on the settings */
     for (l=0 ; l<(int)nlabels ; l++) {
         /* Get the frames for the current setting */
         raw_one = cpl_frameset_extract(rawframes, labels, (cpl_size)l) ;
-        nb_frames = cpl_frameset_get_size(raw_one) ;
         first_fname = 
             cpl_frame_get_filename(cpl_frameset_get_position(raw_one, 0)) ;
 
@@ -478,11 +510,18 @@ static int cr2res_cal_dark(
 
         cpl_msg_info(__func__, "Process SETTING %s / DIT %g / %d",
                 setting_id, dit, ndit) ;
-        cpl_msg_indent_more() ;
+        cr2res_msg_indent_more() ;
 
         /* Loop on the detectors */
+        nb_failed = 0 ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1) private(dark_cube, my_bpm, my_bpm_method, \
+    my_bpm_kappa, bpm, i, ron1, ron2, med, mean, sigma, nb_bad)
+#endif
         for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
             /* Initialise */
+            det_err[det_nr-1] = CPL_ERROR_NONE ;
             master_darks[det_nr-1] = NULL ;
             bpms[det_nr-1] = NULL ;
 
@@ -493,74 +532,29 @@ static int cr2res_cal_dark(
             /* Compute only one detector */
             if (reduce_det != 0 && det_nr != reduce_det) continue ;
 
-            cpl_msg_info(__func__, "Process Detector nb %i", det_nr) ;
-            cpl_msg_indent_more() ;
+            cpl_msg_info(__func__, "%sProcess Detector nb %i",
+                    cr2res_detector_prefix(det_nr), det_nr) ;
+            cr2res_msg_indent_more() ;
 
-            /* Loop on the frames */
+            /* Collapse the frames, keep the first ones for the RON QC */
             dark_cube = hdrl_imagelist_new();
-            for (i=0; i<nb_frames ; i++) {
-                /* Identify current file */
-                fname=cpl_frame_get_filename(
-                        cpl_frameset_get_position(raw_one, i)) ; 
-                cpl_msg_info(__func__, "Load Image from File %s / Detector %i", 
-                        cr2res_get_base_name(fname), det_nr) ;
-
-                /* Load the image */
-                if ((ima_data = cr2res_io_load_image(fname, det_nr)) == NULL) {
-                    cpl_msg_error(__func__, 
-                            "Cannot load image from File %s / Detector %d", 
-                            fname, det_nr) ;
-                    cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
-                    cpl_msg_indent_less() ;
-                    cpl_msg_indent_less() ;
-                    cpl_frameset_delete(rawframes) ;
-                    hdrl_parameter_destroy(collapse_params) ;
-                    cpl_free(labels);
-                    cpl_free(setting_id) ;
-                    cpl_frameset_delete(raw_one) ;
-                    hdrl_imagelist_delete(dark_cube) ;
-                    return -1 ;
-                }
-
-                /* Create the noise image */
-                cpl_msg_info(__func__, "Create the associated Noise image");
-                ron = 0.0 ;
-                if (cr2res_detector_shotnoise_model(
-                            hdrl_image_get_image(ima_data), gain, ron,
-                            &ima_err) != CPL_ERROR_NONE) {
-                    cpl_free(labels);
-                    cpl_msg_error(__func__, "Cannot create the Noise image") ;
-                    cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
-                    cpl_msg_indent_less() ;
-                    cpl_msg_indent_less() ;
-                    cpl_frameset_delete(rawframes) ;
-                    hdrl_parameter_destroy(collapse_params) ;
-                    cpl_free(setting_id) ;
-                    cpl_free(labels);
-                    cpl_frameset_delete(raw_one) ;
-                    hdrl_imagelist_delete(dark_cube) ;
-                    hdrl_image_delete(ima_data); 
-                    return -1 ;
-                }
-
-                /* Set the new error image */
-                ima_data_err =
-                    hdrl_image_create(hdrl_image_get_image(ima_data), ima_err);
-                cpl_image_delete(ima_err) ;
-                hdrl_image_delete(ima_data) ;
-                
-                /* Store the hdrl image in the dark_cube */
-                hdrl_imagelist_set(dark_cube, ima_data_err, i);
+            if (cr2res_cal_dark_collapse(raw_one, det_nr, gain,
+                        collapse_params, dark_cube,
+                        &(master_darks[det_nr-1]))) {
+                cr2res_msg_indent_less() ;
+                hdrl_imagelist_delete(dark_cube) ;
+                det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+                nb_failed++ ;
+                continue ;
             }
-
-            /* Get the proper collapsing function and do frames combination */
-            if (hdrl_imagelist_collapse(dark_cube, collapse_params,
-                    &(master_darks[det_nr-1]), &contrib_map) != CPL_ERROR_NONE){
-                cpl_msg_warning(__func__, "Cannot collapse Detector %d",det_nr);
-                master_darks[det_nr-1] = NULL ;
-                contrib_map = NULL ;
+            if (master_darks[det_nr-1] == NULL) {
+                cpl_msg_warning(__func__, "%sCannot collapse Detector %d",
+                        cr2res_detector_prefix(det_nr),det_nr);
+                cpl_error_reset() ;
             }
-            cpl_image_delete(contrib_map);
        
             /* Compute BPM from the MASTER dark */
             if (master_darks[det_nr-1] != NULL) {
@@ -584,7 +578,8 @@ static int cr2res_cal_dark(
                                 hdrl_image_get_image(master_darks[det_nr-1]),
                                 my_bpm_method, my_bpm_kappa, bpm_lines_ratio, 
                                 0))==NULL) {
-                    cpl_msg_warning(__func__, "Cannot create BPM") ;
+                    cpl_msg_warning(__func__, "%sCannot create BPM",
+                            cr2res_detector_prefix(det_nr)) ;
                 } else {
                     /* Convert mask to BPM */
                     bpms[det_nr-1] = cr2res_bpm_from_mask(my_bpm, 
@@ -655,7 +650,27 @@ static int cr2res_cal_dark(
                 cpl_propertylist_append_int(ext_plist[det_nr-1], 
                         CR2RES_HEADER_QC_DARK_NBAD, nb_bad) ;
             }
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
+            det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
+        }
+        cr2res_detector_error_restore(det_err) ;
+        if (nb_failed > 0) {
+            cpl_error_set(__func__, CPL_ERROR_DATA_NOT_FOUND) ;
+            cr2res_msg_indent_less() ;
+            cpl_frameset_delete(rawframes) ;
+            hdrl_parameter_destroy(collapse_params) ;
+            cpl_free(labels);
+            cpl_free(setting_id) ;
+            cpl_frameset_delete(raw_one) ;
+            for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+                if (bpms[det_nr-1] != NULL) 
+                    cpl_image_delete(bpms[det_nr-1]);
+                if (master_darks[det_nr-1] != NULL) 
+                    hdrl_image_delete(master_darks[det_nr-1]);
+                if (ext_plist[det_nr-1] != NULL) 
+                    cpl_propertylist_delete(ext_plist[det_nr-1]) ;
+            }
+            return -1 ;
         }
 
         /* Save the results */
@@ -681,7 +696,7 @@ static int cr2res_cal_dark(
             cpl_free(filename) ;
             cpl_msg_error(__func__, "Cannot save the MASTER DARK") ;
             cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             return -1 ;
 
         }
@@ -709,7 +724,7 @@ static int cr2res_cal_dark(
             cpl_free(filename) ;
             cpl_msg_error(__func__, "Cannot save the BPM") ;
             cpl_error_set(__func__, CPL_ERROR_ILLEGAL_INPUT) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             return -1 ;
 
         }
@@ -726,7 +741,7 @@ static int cr2res_cal_dark(
             if (ext_plist[det_nr-1] != NULL) 
                 cpl_propertylist_delete(ext_plist[det_nr-1]);
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
     cpl_free(labels);
     hdrl_parameter_delete(collapse_params);
@@ -735,6 +750,188 @@ static int cr2res_cal_dark(
     return (int)cpl_error_get_code();
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Load a dark frame and create its error
+  @param    fname   The file name
+  @param    det_nr  The detector number
+  @param    gain    The gain for the shot noise model
+  @param    ymin    The first row to load, or -1 for the full image
+  @param    ymax    The last row to load, or -1 for the full image
+  @return   The image with the shot noise error, or NULL in error case
+ */
+/*----------------------------------------------------------------------------*/
+static hdrl_image * cr2res_cal_dark_load(
+        const char          *   fname,
+        int                     det_nr,
+        double                  gain,
+        int                     ymin,
+        int                     ymax)
+{
+    hdrl_image          *   ima_data ;
+    hdrl_image          *   ima_data_err ;
+    cpl_image           *   ima_err ;
+
+    /* Load the image */
+    if (ymin < 0) ima_data = cr2res_io_load_image(fname, det_nr) ;
+    else ima_data = cr2res_io_load_image_window(fname, det_nr, ymin, ymax) ;
+    if (ima_data == NULL) {
+        cpl_msg_error(__func__, 
+                "%sCannot load image from File %s / Detector %d",
+                cr2res_detector_prefix(det_nr), 
+                fname, det_nr) ;
+        return NULL ;
+    }
+
+    /* Create the noise image */
+    if (cr2res_detector_shotnoise_model(hdrl_image_get_image(ima_data), gain,
+                0.0, &ima_err) != CPL_ERROR_NONE) {
+        cpl_msg_error(__func__, "%sCannot create the Noise image",
+                cr2res_detector_prefix(det_nr)) ;
+        hdrl_image_delete(ima_data); 
+        return NULL ;
+    }
+
+    /* Set the new error image */
+    ima_data_err = hdrl_image_create(hdrl_image_get_image(ima_data), ima_err);
+    cpl_image_delete(ima_err) ;
+    hdrl_image_delete(ima_data) ;
+    return ima_data_err ;
+}
+
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Collapse the dark frames of one detector
+  @param    raw_one         The frames of one setting
+  @param    det_nr          The detector number
+  @param    gain            The gain for the shot noise model
+  @param    collapse_params The hdrl collapse parameters
+  @param    ron_frames      [out] Receives the first 3 frames for the RON
+  @param    master          [out] The collapsed image, NULL if it failed
+  @return   0 if ok, -1 if a frame cannot be loaded
+
+  The mean and the weighted mean are computed with cr2res_calib_stack_add()
+  on one frame at a time. The other methods need all values of a pixel,
+  so they collapse blocks of rows of all frames with
+  hdrl_imagelist_collapse(). The result is the same as collapsing the
+  full frames, with a memory bounded by CR2RES_CAL_DARK_TILE_BYTES.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_cal_dark_collapse(
+        const cpl_frameset      *   raw_one,
+        int                         det_nr,
+        double                      gain,
+        const hdrl_parameter    *   collapse_params,
+        hdrl_imagelist          *   ron_frames,
+        hdrl_image              **  master)
+{
+    cr2res_calib_stack  *   stack ;
+    hdrl_imagelist      *   tile ;
+    hdrl_image          *   ima ;
+    hdrl_image          *   tile_master ;
+    cpl_image           *   contrib_map ;
+    cpl_propertylist    *   plist ;
+    const char          *   fname ;
+    cpl_size                nx, ny, tile_ny, ymin, ymax ;
+    int                     nb_frames, i ;
+
+    /* Initialise */
+    *master = NULL ;
+    nb_frames = cpl_frameset_get_size(raw_one) ;
+
+    /* Keep the first frames for the RON QC */
+    if (nb_frames >= 3) {
+        for (i=0 ; i<3 ; i++) {
+            fname = cpl_frame_get_filename(
+                    cpl_frameset_get_position_const(raw_one, i)) ;
+            if ((ima = cr2res_cal_dark_load(fname, det_nr, gain, -1,
+                            -1)) == NULL) return -1 ;
+            hdrl_imagelist_set(ron_frames, ima, i) ;
+        }
+    }
+
+    /* Add the frames one by one for the mean */
+    if (hdrl_collapse_parameter_is_mean(collapse_params) ||
+            hdrl_collapse_parameter_is_weighted_mean(collapse_params)) {
+        stack = cr2res_calib_stack_new(
+                hdrl_collapse_parameter_is_weighted_mean(collapse_params)) ;
+        for (i=0; i<nb_frames ; i++) {
+            fname = cpl_frame_get_filename(
+                    cpl_frameset_get_position_const(raw_one, i)) ; 
+            cpl_msg_info(__func__, "%sLoad Image from File %s / Detector %i",
+                    cr2res_detector_prefix(det_nr), 
+                    cr2res_get_base_name(fname), det_nr) ;
+            if ((ima = cr2res_cal_dark_load(fname, det_nr, gain, -1,
+                            -1)) == NULL) {
+                cr2res_calib_stack_delete(stack) ;
+                return -1 ;
+            }
+            cr2res_calib_stack_add(stack, ima) ;
+            hdrl_image_delete(ima) ;
+        }
+        *master = cr2res_calib_stack_collapse(stack, NULL) ;
+        cr2res_calib_stack_delete(stack) ;
+        return 0 ;
+    }
+
+    /* Get the image size */
+    fname = cpl_frame_get_filename(cpl_frameset_get_position_const(raw_one,0));
+    if ((plist = cpl_propertylist_load(fname,
+                    cr2res_io_get_ext_idx(fname, det_nr, 1))) == NULL) {
+        cpl_msg_error(__func__, "%sCannot load the header of %s",
+                cr2res_detector_prefix(det_nr), fname) ;
+        return -1 ;
+    }
+    nx = cpl_propertylist_get_int(plist, CR2RES_HEADER_NAXIS1) ;
+    ny = cpl_propertylist_get_int(plist, CR2RES_HEADER_NAXIS2) ;
+    cpl_propertylist_delete(plist) ;
+
+    /* Number of rows per tile, with the data and the error */
+    tile_ny = CR2RES_CAL_DARK_TILE_BYTES / (nb_frames * nx * 2 *
+            sizeof(double)) ;
+    if (tile_ny < 1) tile_ny = 1 ;
+    if (tile_ny > ny) tile_ny = ny ;
+    cpl_msg_info(__func__, "%sCollapse Detector %d by blocks of %"
+            CPL_SIZE_FORMAT " rows",
+            cr2res_detector_prefix(det_nr), det_nr, tile_ny) ;
+
+    /* Collapse the tiles */
+    *master = hdrl_image_new(nx, ny) ;
+    for (ymin=1 ; ymin<=ny ; ymin+=tile_ny) {
+        ymax = ymin + tile_ny - 1 ;
+        if (ymax > ny) ymax = ny ;
+
+        /* Load the rows of all frames */
+        tile = hdrl_imagelist_new() ;
+        for (i=0; i<nb_frames ; i++) {
+            fname = cpl_frame_get_filename(
+                    cpl_frameset_get_position_const(raw_one, i)) ; 
+            if ((ima = cr2res_cal_dark_load(fname, det_nr, gain, ymin,
+                            ymax)) == NULL) {
+                hdrl_imagelist_delete(tile) ;
+                hdrl_image_delete(*master) ;
+                *master = NULL ;
+                return -1 ;
+            }
+            hdrl_imagelist_set(tile, ima, i) ;
+        }
+
+        /* Collapse them */
+        if (hdrl_imagelist_collapse(tile, collapse_params, &tile_master,
+                    &contrib_map) != CPL_ERROR_NONE) {
+            hdrl_imagelist_delete(tile) ;
+            hdrl_image_delete(*master) ;
+            *master = NULL ;
+            return 0 ;
+        }
+        hdrl_image_copy(*master, tile_master, 1, ymin) ;
+        hdrl_image_delete(tile_master) ;
+        cpl_image_delete(contrib_map) ;
+        hdrl_imagelist_delete(tile) ;
+    }
+    return 0 ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Comparison function to identify different settings
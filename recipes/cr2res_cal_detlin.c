@@ -118,16 +118,17 @@ Detector Linearity                                                      \n\
       compute the traces (from 1. image, or collapsed if --trace_collapse)\n\
         use cr2res_trace(--trace_smooth, --trace_degree,                \n\
                          --trace_min_cluster, --trace_opening)          \n\
-      loop on the detector pixels pix:                                  \n\
+      loop on the detector pixels pix, by rows in parallel:             \n\
         if the pixel is within a trace:                                 \n\
-          cr2res_detlin_compute() computes polynomial(pix) and errors(pix)\n\
+          cr2res_detlin_compute_image() computes polynomial(pix)        \n\
+                                         and errors(pix)                \n\
       use the coeffs for the bpm computation                            \n\
       set the bad pixel coefficients as NaN                             \n\
       store the qc parameters in the returned property list             \n\
                                                                         \n\
   Library Functions used                                                \n\
     cr2res_trace()                                                      \n\
-    cr2res_detlin_compute()                                             \n\
+    cr2res_detlin_compute_image()                                       \n\
     cr2res_qc_detlin_gain()                                             \n\
     cr2res_qc_detlin_median()                                           \n\
     cr2res_qc_detlin_min_max_level()                                    \n\
@@ -276,6 +277,13 @@ static int cr2res_cal_detlin_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_detlin.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_cal_detlin", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_cal_detlin.plot_x",
             CPL_TYPE_INT, "X position for the plot",
             "cr2res.cr2res_cal_detlin", 0);
@@ -329,6 +337,7 @@ static int cr2res_cal_detlin_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -347,7 +356,8 @@ static int cr2res_cal_detlin(
     const cpl_parameter *   param ;
     int                     trace_degree, trace_min_cluster, trace_collapse,
                             trace_opening, single_settings, reduce_det, 
-                            trace_smooth_x, trace_smooth_y, plot_x, plot_y ;
+                            trace_smooth_x, trace_smooth_y, plot_x, plot_y,
+                            parallel_detectors, det_nthreads ;
     double                  bpm_kappa, trace_threshold ;
     cpl_frameset        *   rawframes ;
     cpl_frameset        *   darkframes ;
@@ -361,6 +371,7 @@ static int cr2res_cal_detlin(
     hdrl_imagelist      *   coeffs[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpm[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   plist ;
     hdrl_image          *   img;
     char                *   out_file;
@@ -401,6 +412,9 @@ static int cr2res_cal_detlin(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_detlin.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_detlin.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_detlin.plot_x");
     plot_x = cpl_parameter_get_int(param);
@@ -444,6 +458,13 @@ static int cr2res_cal_detlin(
         ext_plist_merged[det_nr-1] = NULL ;
     }
 
+    /* Number of detectors reduced concurrently - the plots stay serial */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (plot_x > 0 && plot_y > 0) det_nthreads = 1 ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+
     /* Loop on the settings */
     for (l=0 ; l<(int)nlabels ; l++) {
         /* Get the frames for the current setting */
@@ -457,13 +478,19 @@ static int cr2res_cal_detlin(
         cpl_propertylist_delete(plist) ;
 
         cpl_msg_info(__func__, "Process SETTING %s", setting_id) ;
-        cpl_msg_indent_more() ;
+        cr2res_msg_indent_more() ;
 
         /* Loop on the detectors */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1)
+#endif
         for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
-            cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
+            cpl_msg_info(__func__, "%sProcess Detector %d",
+                    cr2res_detector_prefix(det_nr), det_nr) ;
 
             /* Initialise */
+            det_err[det_nr-1] = CPL_ERROR_NONE ;
             coeffs[det_nr-1] = NULL ;
             bpm[det_nr-1] = NULL ;
             ext_plist[det_nr-1] = NULL ;
@@ -472,7 +499,7 @@ static int cr2res_cal_detlin(
             if (reduce_det != 0 && det_nr != reduce_det) continue ;
     
             /* Call the reduction function */
-            cpl_msg_indent_more() ;
+            cr2res_msg_indent_more() ;
             if (cr2res_cal_detlin_reduce(raw_one, darkframes, bpm_kappa,
                         trace_degree, trace_min_cluster, trace_smooth_x,
                         trace_smooth_y, trace_threshold, trace_opening, 
@@ -481,11 +508,12 @@ static int cr2res_cal_detlin(
                         &(bpm[det_nr-1]),
                         &(ext_plist[det_nr-1])) == -1) {
                 cpl_msg_warning(__func__, 
-                        "Failed to reduce SETTING %s / det %d", 
+                        "%sFailed to reduce SETTING %s / det %d",
+                        cr2res_detector_prefix(det_nr), 
                         setting_id, det_nr);
                 cpl_error_reset() ;
             } 
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
 
             /* Merge the products */
             if (ext_plist[det_nr-1] != NULL && coeffs[det_nr-1] != NULL
@@ -502,7 +530,9 @@ static int cr2res_cal_detlin(
                                          &bpm_merged[det_nr - 1],
                                          &coeffs_merged[det_nr - 1]);
             }
+            det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
         }
+        cr2res_detector_error_restore(det_err) ;
 
         /* Save the products */
         if (single_settings) {
@@ -533,7 +563,7 @@ static int cr2res_cal_detlin(
                 cpl_propertylist_delete(ext_plist[det_nr-1]) ;
         }
         cpl_free(setting_id) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
     cpl_free(labels);
 
@@ -644,7 +674,6 @@ static int cr2res_cal_detlin_reduce(
     double              *   pcur_coeffs ;
     cpl_imagelist       *   errors_loc ;
     cpl_image           *   cur_errors ;
-    double              *   pcur_errors ;
     cpl_propertylist    *   plist ;
     cpl_image           *   bpm_loc ;
     int                 *   pbpm_loc ;
@@ -667,7 +696,8 @@ static int cr2res_cal_detlin_reduce(
 
     /* Sort the frames by increasing DIT */
     if ((sorted_frames = cr2res_detlin_sort_frames(rawframes)) == NULL) {
-        cpl_msg_error(__func__, "Failed sorting frames by increasing DITs") ;
+        cpl_msg_error(__func__, "%sFailed sorting frames by increasing DITs",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -691,7 +721,8 @@ static int cr2res_cal_detlin_reduce(
                     reduce_det)) == NULL) {
         cpl_propertylist_delete(plist);
         cpl_frameset_delete(sorted_frames) ;
-        cpl_msg_error(__func__, "Failed to Load the images") ;
+        cpl_msg_error(__func__, "%sFailed to Load the images",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -701,17 +732,20 @@ static int cr2res_cal_detlin_reduce(
         /* Sort the frames by increasing DIT */
         if ((sorted_darkframes=cr2res_detlin_sort_frames(darkframes)) == NULL) {
             cpl_msg_warning(__func__, 
-                    "Failed sorting dark frames by increasing DITs - skip") ;
+                    "%sFailed sorting dark frames by increasing DITs - skip",
+                    cr2res_detector_prefix(reduce_det)) ;
         } else {
             /* Load the image list */
             if ((darklist=cr2res_io_load_image_list_from_set(sorted_darkframes,
                             reduce_det)) == NULL) {
-                cpl_msg_warning(__func__, "Failed to Load the darks - skip") ;
+                cpl_msg_warning(__func__, "%sFailed to Load the darks - skip",
+                        cr2res_detector_prefix(reduce_det)) ;
             } else {
                 /* Apply correction */
                 if (hdrl_imagelist_sub_imagelist(imlist, darklist)) {
                     cpl_msg_warning(__func__, 
-                            "Failed to Subtract the darks - skip") ;
+                            "%sFailed to Subtract the darks - skip",
+                            cr2res_detector_prefix(reduce_det)) ;
                     cpl_error_reset() ;
                 }
                 hdrl_imagelist_delete(darklist) ;
@@ -725,50 +759,55 @@ static int cr2res_cal_detlin_reduce(
         hdrl_imagelist_delete(imlist) ;
         cpl_propertylist_delete(plist);
         cpl_frameset_delete(sorted_frames) ;
-        cpl_msg_error(__func__, "Failed to Load the DIT values") ;
+        cpl_msg_error(__func__, "%sFailed to Load the DIT values",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
     cpl_frameset_delete(sorted_frames) ;
 
     /* Collapse all input images for the traces detection (only if wished) */
     if (trace_collapse) {
-        cpl_msg_info(__func__, "Collapse the input images") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sCollapse the input images",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
         if (hdrl_imagelist_collapse_mean(imlist, &collapsed, &contrib) !=
                 CPL_ERROR_NONE) {
-            cpl_msg_error(__func__, "Failed to Collapse") ;
+            cpl_msg_error(__func__, "%sFailed to Collapse",
+                    cr2res_detector_prefix(reduce_det)) ;
             cpl_propertylist_delete(plist);
             hdrl_imagelist_delete(imlist) ;
             cpl_vector_delete(dits); 
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             return -1 ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     } else {
         /* Only use the first image */
         collapsed = hdrl_image_duplicate(hdrl_imagelist_get(imlist, 0)) ;
     }
 
     /* Compute traces */
-    cpl_msg_info(__func__, "Compute the traces") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute the traces",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     nx = hdrl_image_get_size_x(collapsed) ;
     ny = hdrl_image_get_size_y(collapsed) ;
     if ((traces = cr2res_trace(hdrl_image_get_image(collapsed), 
                     trace_smooth_x, trace_smooth_y, trace_threshold, 
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
-        cpl_msg_error(__func__, "Failed compute the traces") ;
+        cpl_msg_error(__func__, "%sFailed compute the traces",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_imagelist_delete(imlist) ;
         cpl_vector_delete(dits); 
         cpl_propertylist_delete(plist);
         hdrl_image_delete(collapsed) ;
         cpl_image_delete(contrib);
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return -1 ;
     }
     hdrl_image_delete(collapsed) ;
     cpl_image_delete(contrib);
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Allocate */
     bpm_loc = cpl_image_new(nx, ny, CPL_TYPE_INT) ;
@@ -788,106 +827,69 @@ static int cr2res_cal_detlin_reduce(
     cpl_table_delete(traces) ;
 
     /* Loop over the traces and compute the non-linearity */
-    cpl_msg_info(__func__, "Compute Non Linearity") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute Non Linearity",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
 
-    /* Loop on the traces pixels */
+    /* Fit all the traces pixels */
     qc_nbfailed = 0 ;
-    qc_nbsuccess = 0 ;
-    for (j=0 ; j<ny ; j++) {
-        for (i=0 ; i<nx ; i++) {
-            idx = i + j*nx ;
-            if (pti[idx] > 0) {
-                /* Prepare values to fit */
-                fitvals = cpl_vector_new(cpl_vector_get_size(dits)) ;
-                for (k=0 ; k<cpl_vector_get_size(dits) ; k++) {
-                    cur_im = hdrl_imagelist_get(imlist,  k) ;
-                    pcur_im = cpl_image_get_data_double(
-                            hdrl_image_get_image(cur_im)) ;
-                    cpl_vector_set(fitvals, k, (float)(pcur_im[idx])) ;
-                }
+    if ((qc_nbsuccess = cr2res_detlin_compute_image(imlist, dits, trace_image,
+                    max_degree, coeffs_loc, errors_loc, bpm_loc,
+                    &qc_nbfailed)) < 0) {
+        cpl_msg_error(__func__, "%sFailed to compute the Non Linearity",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_less() ;
+        cpl_image_delete(trace_image) ;
+        hdrl_imagelist_delete(imlist) ;
+        cpl_vector_delete(dits); 
+        cpl_propertylist_delete(plist);
+        cpl_image_delete(bpm_loc) ;
+        cpl_imagelist_delete(coeffs_loc) ;
+        cpl_imagelist_delete(errors_loc) ;
+        return -1 ;
+    }
 
-                /* We are in a trace, let's compute the linearity */
-                if (cr2res_detlin_compute(dits, fitvals, max_degree,
-                            &fitted_poly, &fitted_errors) == -1) {
-                    qc_nbfailed++ ;
-                    /* Store the null Coefficients in the output image list */
-                    pbpm_loc[idx] = CR2RES_BPM_DETLIN ;
-                    for (l=0 ; l<=max_degree ; l++) {
-                        cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                        pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                        pcur_coeffs[idx] = 0.0/0.0 ;
-                        cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                        pcur_errors = cpl_image_get_data_double(cur_errors) ;
-                        pcur_errors[idx] = 0.0/0.0 ;
-                    } 
-                } else {
-                    qc_nbsuccess++ ;
-
-                    /* Plot the values and the fit */
-                    if (plotx==i+1 && ploty==j+1) {
-                        aduPsec = cpl_vector_duplicate(fitvals);
-                        cpl_vector_divide(aduPsec, dits);
-                        cpl_bivector * toplot_measure =
-                            cpl_bivector_wrap_vectors(fitvals,aduPsec) ;
-                        
-                        cpl_vector * poly_eval = cr2res_polynomial_eval_vector(
-                                fitted_poly, fitvals) ;
-                        cpl_bivector * toplot_fitted =
-                            cpl_bivector_wrap_vectors(fitvals, poly_eval) ;
-                        cpl_plot_bivector(
-                        "set grid;set xlabel 'ADU';set ylabel 'ADU/s';",
-                        "t 'Measured ADU/s' w lines", "", toplot_measure);
-                        cpl_plot_bivector(
-                        "set grid;set xlabel 'ADU';set ylabel 'Corr. fact';",
-                        "t 'Fit' w lines", "", toplot_fitted);
-                        cpl_bivector_unwrap_vectors(toplot_fitted) ;
-                        cpl_vector_delete(poly_eval) ;
-                        cpl_bivector_unwrap_vectors(toplot_measure) ;
-                        cpl_vector_delete(aduPsec);
-                    }
-
-                    /* Store the Coefficients in the output image list */
-                    pbpm_loc[idx] = 0 ;
-                    for (l=0 ; l<=max_degree ; l++) {
-                        cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                        pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                        pcur_coeffs[idx] =
-                            cpl_polynomial_get_coeff(fitted_poly, &l) ;
-                        cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                        pcur_errors = cpl_image_get_data_double(cur_errors) ;
-
-                        /* Store error */
-                        if (fitted_errors != NULL) {
-                            pcur_errors[idx] =
-                                fabs(cpl_vector_get(fitted_errors, l));
-                        } else {
-                            pcur_errors[idx] = 0.0 ;
-                        }
-                    }
-                    if (fitted_errors != NULL) cpl_vector_delete(fitted_errors);
-                    cpl_polynomial_delete(fitted_poly) ;
-                }
-                cpl_vector_delete(fitvals) ;
-            } else {
-                /* Outside the orders */
-                /* Set the values as NaNs */
-                for (l=0 ; l<=max_degree ; l++) {
-                    cur_coeffs = cpl_imagelist_get(coeffs_loc, l) ;
-                    pcur_coeffs = cpl_image_get_data_double(cur_coeffs) ;
-                    pcur_coeffs[idx] = 0.0/0.0 ;
-                    cur_errors = cpl_imagelist_get(errors_loc, l) ;
-                    pcur_errors = cpl_image_get_data_double(cur_errors) ;
-                    pcur_errors[idx] = 0.0/0.0 ;
-                }
-                /* Set the BPM as bad */
-                pbpm_loc[idx] = CR2RES_BPM_OUTOFORDER ;
-            }
+    /* Plot the values and the fit */
+    if (plotx >= 1 && plotx <= nx && ploty >= 1 && ploty <= ny &&
+            pti[(plotx-1) + (ploty-1)*nx] > 0) {
+        idx = (plotx-1) + (ploty-1)*nx ;
+        fitvals = cpl_vector_new(cpl_vector_get_size(dits)) ;
+        for (k=0 ; k<cpl_vector_get_size(dits) ; k++) {
+            cur_im = hdrl_imagelist_get(imlist,  k) ;
+            pcur_im = cpl_image_get_data_double(
+                    hdrl_image_get_image(cur_im)) ;
+            cpl_vector_set(fitvals, k, (float)(pcur_im[idx])) ;
+        }
+        if (cr2res_detlin_compute(dits, fitvals, max_degree,
+                    &fitted_poly, &fitted_errors) == 0) {
+            aduPsec = cpl_vector_duplicate(fitvals);
+            cpl_vector_divide(aduPsec, dits);
+            cpl_bivector * toplot_measure =
+                cpl_bivector_wrap_vectors(fitvals,aduPsec) ;
+
+            cpl_vector * poly_eval = cr2res_polynomial_eval_vector(
+                    fitted_poly, fitvals) ;
+            cpl_bivector * toplot_fitted =
+                cpl_bivector_wrap_vectors(fitvals, poly_eval) ;
+            cpl_plot_bivector(
+            "set grid;set xlabel 'ADU';set ylabel 'ADU/s';",
+            "t 'Measured ADU/s' w lines", "", toplot_measure);
+            cpl_plot_bivector(
+            "set grid;set xlabel 'ADU';set ylabel 'Corr. fact';",
+            "t 'Fit' w lines", "", toplot_fitted);
+            cpl_bivector_unwrap_vectors(toplot_fitted) ;
+            cpl_vector_delete(poly_eval) ;
+            cpl_bivector_unwrap_vectors(toplot_measure) ;
+            cpl_vector_delete(aduPsec);
+            if (fitted_errors != NULL) cpl_vector_delete(fitted_errors);
+            cpl_polynomial_delete(fitted_poly) ;
         }
+        cpl_vector_delete(fitvals) ;
     }
-    cpl_msg_info(__func__, "%d pix success, %d failed",qc_nbsuccess,
+    cpl_msg_info(__func__, "%s%d pix success, %d failed",
+            cr2res_detector_prefix(reduce_det),qc_nbsuccess,
                                                             qc_nbfailed);
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
     cpl_image_delete(trace_image) ;
     hdrl_imagelist_delete(imlist) ;
     cpl_vector_delete(dits); 
@@ -907,7 +909,8 @@ static int cr2res_cal_detlin_reduce(
     cpl_mask_delete(bpm_mask); 
 
     /* Use the second coefficient stats for the BPM detection */
-    cpl_msg_info(__func__, "BPM detection") ;
+    cpl_msg_info(__func__, "%sBPM detection",
+            cr2res_detector_prefix(reduce_det)) ;
     cur_coeffs = cpl_imagelist_get(coeffs_loc, 1) ;
 
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -920,9 +923,11 @@ static int cr2res_cal_detlin_reduce(
     median = cpl_image_get_median_dev(cur_coeffs, &sigma) ;
     low_thresh = median - bpm_kappa * sigma ;
     high_thresh = median + bpm_kappa * sigma ;
-    cpl_msg_info(__func__, "Low & high threshold for linear coeff: %.2e %.2e",
-           low_thresh, high_thresh );
-    cpl_msg_info(__func__, "Median, sigma: %.2e %.2e",
+    cpl_msg_info(__func__,
+            "%sLow & high threshold for linear coeff: %.2e %.2e",
+            cr2res_detector_prefix(reduce_det), low_thresh, high_thresh );
+    cpl_msg_info(__func__, "%sMedian, sigma: %.2e %.2e",
+            cr2res_detector_prefix(reduce_det),
            median, sigma );
     for (j=0 ; j<ny ; j++) {
         for (i=0 ; i<nx ; i++) {
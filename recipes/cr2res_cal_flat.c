@@ -389,6 +389,13 @@ static int cr2res_cal_flat_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_flat.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_cal_flat", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_cal_flat.order",
             CPL_TYPE_INT, "Only reduce the specified order",
             "cr2res.cr2res_cal_flat", -1);
@@ -442,6 +449,7 @@ static int cr2res_cal_flat_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -462,7 +470,8 @@ static int cr2res_cal_flat(
                             trace_opening, trace_filter,
                             extract_oversample, extract_swath_width,
                             extract_height, reduce_det, reduce_order,
-                            reduce_trace, trace_smooth_x, trace_smooth_y ;
+                            reduce_trace, trace_smooth_x, trace_smooth_y,
+                            parallel_detectors, det_nthreads ;
     double                  bpm_low, bpm_high, bpm_lines_ratio,
                             trace_threshold, extract_smooth_slit ;
     cr2res_extr_method      extr_method;
@@ -492,6 +501,7 @@ static int cr2res_cal_flat(
     cpl_table           *   extract_1d[CR2RES_NB_DETECTORS] ;
     hdrl_image          *   slit_model[CR2RES_NB_DETECTORS] ;
     cpl_image           *   bpm[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     char                *   out_file;
     int                     l, i, det_nr;
 
@@ -567,6 +577,9 @@ static int cr2res_cal_flat(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_flat.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_flat.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_flat.order");
     reduce_order = cpl_parameter_get_int(param);
@@ -598,6 +611,12 @@ static int cr2res_cal_flat(
         return -1 ;
     }
 
+    /* Number of detectors reduced concurrently */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+
     /* Labelise the raw frames with the different settings */
     if ((labels = cpl_frameset_labelise(rawframes, cr2res_cal_flat_compare,
                 &nlabels)) == NULL) {
@@ -607,6 +626,9 @@ static int cr2res_cal_flat(
         return -1 ;
     }
 
+    /* Write the products while the next settings are reduced */
+    cr2res_io_writer_start() ;
+
     /* Loop on the settings */
     for (l=0 ; l<(int)nlabels ; l++) {
         /* Get the frames for the current setting */
@@ -620,7 +642,7 @@ static int cr2res_cal_flat(
         cpl_propertylist_delete(plist) ;
         
         cpl_msg_info(__func__, "Process SETTING %s", setting_id) ;
-        cpl_msg_indent_more() ;
+        cr2res_msg_indent_more() ;
 
         /* Loop on the decker positions */
         for (i=0 ; i<CR2RES_NB_DECKER_POSITIONS ; i++) {
@@ -639,11 +661,16 @@ static int cr2res_cal_flat(
                 continue ;
             }
             cpl_msg_info(__func__, "Reduce %s Frames", decker_desc[i]) ;
-            cpl_msg_indent_more() ;
+            cr2res_msg_indent_more() ;
 
             /* Loop on the detectors */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1)
+#endif
             for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
                 /* Initialise */
+                det_err[det_nr-1] = CPL_ERROR_NONE ;
                 master_flat[det_nr-1] = NULL ;
                 slit_func[det_nr-1] = NULL ;
                 extract_1d[det_nr-1] = NULL ;
@@ -653,8 +680,9 @@ static int cr2res_cal_flat(
                 /* Compute only one detector */
                 if (reduce_det != 0 && det_nr != reduce_det) continue ;
 
-                cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-                cpl_msg_indent_more() ;
+                cpl_msg_info(__func__, "%sProcess Detector %d",
+                        cr2res_detector_prefix(det_nr), det_nr) ;
+                cr2res_msg_indent_more() ;
 
                 /* Call the reduction function */
                 if (cr2res_cal_flat_reduce(raw_one_setting_decker,
@@ -674,12 +702,15 @@ static int cr2res_cal_flat(
                             &(bpm[det_nr-1]),
                             &(ext_plist[i][det_nr-1])) == -1) {
                     cpl_msg_warning(__func__,
-                            "Failed to reduce detector %d of %s Frames",
+                            "%sFailed to reduce detector %d of %s Frames",
+                            cr2res_detector_prefix(det_nr),
                             det_nr, decker_desc[i]);
                     cpl_error_reset() ;
                 }
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
+                det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
             }
+            cr2res_detector_error_restore(det_err) ;
 
             /* Ѕave Products */
 
@@ -779,7 +810,7 @@ static int cr2res_cal_flat(
                 if (bpm[det_nr-1] != NULL)
                     cpl_image_delete(bpm[det_nr-1]) ;
             }
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
         }
 
         /* Merge the Decker positions TRACE_WAVE files in a single one */
@@ -847,11 +878,13 @@ static int cr2res_cal_flat(
                 cpl_table_delete(trace_wave_merged[det_nr-1]) ;
 
         cpl_frameset_delete(raw_one_setting) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
     cpl_free(labels);
     cpl_frameset_delete(rawframes) ;
 
+    /* Wait for the products */
+    cr2res_io_writer_join() ;
     return (int)cpl_error_get_code();
 }
 
@@ -927,8 +960,7 @@ static int cr2res_cal_flat_reduce(
 {
     const char          *   first_file ;
     hdrl_image          *   first_image ;
-    hdrl_imagelist      *   imlist ;
-    hdrl_imagelist      *   imlist_calibrated ;
+    cr2res_calib_context *  calib_ctx ;
     hdrl_image          *   collapsed ;
     cpl_image           *   contrib ;
     cpl_propertylist    *   plist ;
@@ -959,7 +991,8 @@ static int cr2res_cal_flat_reduce(
     if (rawframes == NULL) return -1 ;
     if (extr_method != CR2RES_EXTR_OPT_CURV && 
             extr_method != CR2RES_EXTR_SUM) {
-        cpl_msg_error(__func__, "Failed to read the dits") ;
+        cpl_msg_error(__func__, "%sFailed to read the dits",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -969,70 +1002,61 @@ static int cr2res_cal_flat_reduce(
 
     /* Get the DIT for the Dark correction */
     if ((dits = cr2res_io_read_dits(rawframes)) == NULL) {
-        cpl_msg_error(__func__, "Failed to read the dits") ;
+        cpl_msg_error(__func__, "%sFailed to read the dits",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
-    /* Load the image list */
-    imlist = cr2res_io_load_image_list_from_set(rawframes, reduce_det) ;
-    if (imlist == NULL) {
-        cpl_msg_error(__func__, "Failed to load the images") ;
+    /* Load the calibrations */
+    if ((calib_ctx = cr2res_calib_context_new(reduce_det, 0,
+                    calib_cosmics_corr, NULL, master_dark_frame, bpm_frame,
+                    detlin_frame)) == NULL) {
+        cpl_msg_error(__func__, "%sFailed to Calibrate the Data",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_vector_delete(dits) ;
         return -1 ;
     }
 
-    /* Calibrate the Data */
-    cpl_msg_info(__func__, "Calibrate the input images") ;
-    cpl_msg_indent_more() ;
-    if ((imlist_calibrated = cr2res_calib_imagelist(imlist, reduce_det, 
-                    0, calib_cosmics_corr, NULL, master_dark_frame, bpm_frame, 
-                    detlin_frame, dits)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Calibrate the Data") ;
+    /* Calibrate and collapse the images one by one */
+    cpl_msg_info(__func__, "%sCalibrate and collapse the input images",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
+    if ((collapsed = cr2res_calib_frameset_collapse_mean(rawframes, calib_ctx,
+                    dits, &contrib)) == NULL) {
+        cpl_msg_error(__func__, "%sFailed to Collapse",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_calib_context_delete(calib_ctx) ;
         cpl_vector_delete(dits) ;
-        hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return -1 ;
-    } else {
-        /* Replace the calibrated image in the list */
-        hdrl_imagelist_delete(imlist) ;
-        imlist = imlist_calibrated ;
     }
+    cr2res_calib_context_delete(calib_ctx) ;
     cpl_vector_delete(dits) ;
-    cpl_msg_indent_less() ;
-
-    /* Collapse */
-    cpl_msg_info(__func__, "Collapse the input images") ;
-    cpl_msg_indent_more() ;
-    if (hdrl_imagelist_collapse_mean(imlist, &collapsed, &contrib) !=
-            CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Failed to Collapse") ;
-        hdrl_imagelist_delete(imlist) ;
-        cpl_msg_indent_less() ;
-        return -1 ;
-    }
-    hdrl_imagelist_delete(imlist) ;
     cpl_image_delete(contrib) ;
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Compute traces */
-    cpl_msg_info(__func__, "Compute the traces") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute the traces",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if ((computed_traces = cr2res_trace(hdrl_image_get_image(collapsed),
                     trace_smooth_x, trace_smooth_y, trace_threshold, 
                     trace_opening, trace_degree, trace_min_cluster)) == NULL) {
-        cpl_msg_error(__func__, "Failed compute the traces") ;
+        cpl_msg_error(__func__, "%sFailed compute the traces",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_image_delete(collapsed) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Add The remaining Columns to the trace table */
     cr2res_trace_add_extra_columns(computed_traces, first_file, reduce_det) ;
 
     /* Filter out traces */
     if (filter_traces) {
-        cpl_msg_info(__func__, "Filter out the traces") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sFilter out the traces",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
 
         /* Get the setting and the zp_order */
         plist = cpl_propertylist_load(first_file, 0) ;
@@ -1044,12 +1068,13 @@ static int cr2res_cal_flat_reduce(
         cpl_free(setting_id) ;
         cpl_table_delete(computed_traces) ;
         computed_traces = filtered_traces ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         if (cpl_table_get_nrow(computed_traces) == 0) {
-            cpl_msg_error(__func__, "All traces are filtered out") ;
+            cpl_msg_error(__func__, "%sAll traces are filtered out",
+                    cr2res_detector_prefix(reduce_det)) ;
             hdrl_image_delete(collapsed) ;
             cpl_table_delete(computed_traces) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             return -1 ;
         }
     } 
@@ -1070,8 +1095,9 @@ static int cr2res_cal_flat_reduce(
     hdrl_image_mul_scalar(model_master, (hdrl_value){0.0, 0.0}) ;
 
     /* Loop over the traces and extract them */
-    cpl_msg_info(__func__, "Extract the traces") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sExtract the traces",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     for (i=0 ; i<nb_traces ; i++) {
         /* Initialise */
         slit_func_vec[i] = NULL ;
@@ -1088,44 +1114,48 @@ static int cr2res_cal_flat_reduce(
         /* Check if this trace needs to be skipped */
         if (reduce_trace > -1 && trace_id != reduce_trace) continue ;
 
-        cpl_msg_info(__func__, "Process Order %d/Trace %d", order, trace_id) ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sProcess Order %d/Trace %d",
+                cr2res_detector_prefix(reduce_det), order, trace_id) ;
+        cr2res_msg_indent_more() ;
 
         /* Call the Extraction */
         if (extr_method == CR2RES_EXTR_SUM) {
             if (cr2res_extract_sum_vert(collapsed, traces, order, trace_id, 
                         extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
                         &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (sum-)extract the trace") ;
+                cpl_msg_error(__func__, "%sCannot (sum-)extract the trace",
+                        cr2res_detector_prefix(reduce_det)) ;
                 slit_func_vec[i] = NULL ;
                 spectrum[i] = NULL ;
                 model_tmp = NULL ;
                 cpl_error_reset() ;
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 continue ;
             }
         } else if (extr_method == CR2RES_EXTR_MEDIAN) {
             if (cr2res_extract_median(collapsed, traces, order, trace_id, 
                         extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
                         &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (median-)extract the trace") ;
+                cpl_msg_error(__func__, "%sCannot (median-)extract the trace",
+                        cr2res_detector_prefix(reduce_det)) ;
                 slit_func_vec[i] = NULL ;
                 spectrum[i] = NULL ;
                 model_tmp = NULL ;
                 cpl_error_reset() ;
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 continue ;
             }
         } else if (extr_method == CR2RES_EXTR_TILTSUM) {
             if (cr2res_extract_sum_tilt(collapsed, traces, order, trace_id, 
                         extract_height, &(slit_func_vec[i]), &(spectrum[i]), 
                         &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (tiltsum-)extract the trace") ;
+                cpl_msg_error(__func__, "%sCannot (tiltsum-)extract the trace",
+                        cr2res_detector_prefix(reduce_det)) ;
                 slit_func_vec[i] = NULL ;
                 spectrum[i] = NULL ;
                 model_tmp = NULL ;
                 cpl_error_reset() ;
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 continue ;
             }
         } else if (extr_method == CR2RES_EXTR_OPT_VERT) {
@@ -1134,12 +1164,13 @@ static int cr2res_cal_flat_reduce(
                         extract_oversample, extract_smooth_slit, 0.0,
                         &(slit_func_vec[i]), &(spectrum[i]), &model_tmp) != 0) {
                 cpl_msg_error(__func__,
-                        "Cannot (slitdec-vert-) extract the trace") ;
+                        "%sCannot (slitdec-vert-) extract the trace",
+                        cr2res_detector_prefix(reduce_det)) ;
                 slit_func_vec[i] = NULL ;
                 spectrum[i] = NULL ;
                 model_tmp = NULL ;
                 cpl_error_reset() ;
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 continue ;
             }
         } else if (extr_method == CR2RES_EXTR_OPT_CURV) {
@@ -1147,12 +1178,14 @@ static int cr2res_cal_flat_reduce(
                         trace_id, extract_height, extract_swath_width, 
                         extract_oversample, extract_smooth_slit, 0.0,
                         &(slit_func_vec[i]), &(spectrum[i]), &model_tmp) != 0) {
-                cpl_msg_error(__func__, "Cannot (slitdec-) extract the trace") ;
+                cpl_msg_error(__func__,
+                        "%sCannot (slitdec-) extract the trace",
+                        cr2res_detector_prefix(reduce_det)) ;
                 slit_func_vec[i] = NULL ;
                 spectrum[i] = NULL ;
                 model_tmp = NULL ;
                 cpl_error_reset() ;
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 continue ;
             }
         }
@@ -1162,9 +1195,9 @@ static int cr2res_cal_flat_reduce(
             hdrl_image_add_image(model_master, model_tmp) ;
             hdrl_image_delete(model_tmp) ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Create the slit_func_tab for the current detector */
     slit_func_tab = cr2res_extract_SLITFUNC_create(slit_func_vec, traces) ;
@@ -1182,21 +1215,23 @@ static int cr2res_cal_flat_reduce(
     cpl_table_delete(traces) ;
 
     /* Compute the Master flat */
-    cpl_msg_info(__func__, "Compute the master flat") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute the master flat",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if ((master_flat_loc = cr2res_master_flat(collapsed,
                     model_master, bpm_low, bpm_high, bpm_linemax,
                     &bpm_flat)) == NULL) {
-        cpl_msg_error(__func__, "Failed compute the Master Flat") ;
+        cpl_msg_error(__func__, "%sFailed compute the Master Flat",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_table_delete(slit_func_tab) ;
         cpl_table_delete(extract_tab) ;
         hdrl_image_delete(model_master) ;
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(computed_traces) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
     hdrl_image_delete(collapsed) ;
 
     /* Create BPM image */
@@ -1205,14 +1240,16 @@ static int cr2res_cal_flat_reduce(
         if ((bpm_im = cr2res_io_load_BPM(
                         cpl_frame_get_filename(bpm_frame),
                         reduce_det, 1)) == NULL) {
-            cpl_msg_warning(__func__, "Failed to Load the Master BPM") ;
+            cpl_msg_warning(__func__, "%sFailed to Load the Master BPM",
+                    cr2res_detector_prefix(reduce_det)) ;
         }
     }
     if (bpm_im == NULL) {
         bpm_im = cpl_image_duplicate(bpm_flat) ;
     } else {
         if (cpl_image_or(bpm_im, NULL, bpm_flat)) {
-            cpl_msg_error(__func__, "Failed to add the mask to the BPM") ;
+            cpl_msg_error(__func__, "%sFailed to add the mask to the BPM",
+                    cr2res_detector_prefix(reduce_det)) ;
             cpl_table_delete(slit_func_tab) ;
             cpl_table_delete(extract_tab) ;
             hdrl_image_delete(model_master) ;
@@ -1220,7 +1257,7 @@ static int cr2res_cal_flat_reduce(
             cpl_image_delete(bpm_im) ;
             cpl_image_delete(bpm_flat) ;
             cpl_table_delete(computed_traces) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
             return -1 ;
         }
     }
@@ -1271,7 +1308,8 @@ static int cr2res_cal_flat_reduce(
         hdrl_image_delete(model_master) ;
         hdrl_image_delete(master_flat_loc) ;
         cpl_image_delete(bpm_im) ;
-        cpl_msg_error(__func__, "Failed to load the plist") ;
+        cpl_msg_error(__func__, "%sFailed to load the plist",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -74,6 +74,7 @@ static int cr2res_cal_wave_reduce(
         int                     ext_swath_width,
         int                     ext_oversample,
         double                  ext_smooth_slit,
+        int                     ext_nthreads,
         cr2res_wavecal_type     wavecal_type,
         int                     wl_degree,
         double                  wl_start,
@@ -272,6 +273,13 @@ static int cr2res_cal_wave_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_wave.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_cal_wave", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_cal_wave.order",
             CPL_TYPE_INT, "Only reduce the specified order",
             "cr2res.cr2res_cal_wave", -1);
@@ -321,6 +329,14 @@ static int cr2res_cal_wave_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_cal_wave.ext_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_cal_wave", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "ext_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_cal_wave.wl_method",
             CPL_TYPE_STRING, 
             "Wavelength Method (AUTO / XCORR / LINE1D / LINE2D / ETALON)",
@@ -440,6 +456,7 @@ static int cr2res_cal_wave_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -458,10 +475,11 @@ static int cr2res_cal_wave(
     const cpl_parameter *   param;
     int                     reduce_det, reduce_order, reduce_trace,
                             ext_oversample, ext_swath_width, ext_height,
-                            wl_degree, display, log_flag,
+                            ext_nthreads, wl_degree, display, log_flag,
                             fallback_input_wavecal_flag,
                             keep_higher_degrees_flag, 
-                            clean_spectrum ;
+                            clean_spectrum, parallel_detectors,
+                            det_nthreads ;
     double                  ext_smooth_slit, wl_start, wl_end, wl_err, wl_shift,
                             display_wmin, display_wmax ;
     cr2res_collapse         collapse ;
@@ -480,6 +498,7 @@ static int cr2res_cal_wave(
     cpl_table           *   out_extracted[CR2RES_NB_DETECTORS] ;
     hdrl_image          *   out_wave_map[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   plist ;
     char                *   setting_id ;
     int                     det_nr, order, i ;
@@ -497,6 +516,9 @@ static int cr2res_cal_wave(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_wave.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_wave.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_wave.order");
     reduce_order = cpl_parameter_get_int(param);
@@ -525,6 +547,9 @@ static int cr2res_cal_wave(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_wave.ext_smooth_slit");
     ext_smooth_slit = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_cal_wave.ext_nthreads");
+    ext_nthreads = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_cal_wave.wl_method");
     sval = cpl_parameter_get_string(param) ;
@@ -647,10 +672,20 @@ static int cr2res_cal_wave(
         return -1 ;
     }
 
-    /* Loop over the detectors */
+    /* Loop over the detectors - the display stays serial */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (display) det_nthreads = 1 ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1)
+#endif
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
 
         /* Initialise */
+        det_err[det_nr-1] = CPL_ERROR_NONE ;
         out_trace_wave[det_nr-1] = NULL ;
         lines_diagnostics[det_nr-1] = NULL ;
         out_extracted[det_nr-1] = NULL ;
@@ -681,15 +716,17 @@ static int cr2res_cal_wave(
             continue ;
         }
 
-        cpl_msg_info(__func__, "Process detector number %d", det_nr) ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sProcess detector number %d",
+                cr2res_detector_prefix(det_nr), det_nr) ;
+        cr2res_msg_indent_more() ;
 
         /* Call the reduction function */
         if (cr2res_cal_wave_reduce(rawframes, detlin_frame,
                     master_dark_frame, master_flat_frame, bpm_frame,
                     trace_wave_frame, lines_frame, det_nr, reduce_order,
                     reduce_trace, collapse, ext_height, ext_swath_width,
-                    ext_oversample, ext_smooth_slit, wavecal_type, wl_degree, 
+                    ext_oversample, ext_smooth_slit, ext_nthreads, 
+                    wavecal_type, wl_degree, 
                     wl_start, wl_end, wl_err, wl_shift, log_flag, 
                     fallback_input_wavecal_flag,
                     keep_higher_degrees_flag, clean_spectrum,
@@ -700,11 +737,14 @@ static int cr2res_cal_wave(
                     &(out_extracted[det_nr-1]),
                     &(out_wave_map[det_nr-1]),
                     &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
+            cpl_msg_warning(__func__, "%sFailed to reduce detector %d",
+                    cr2res_detector_prefix(det_nr), det_nr);
             cpl_error_reset() ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
+        det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
     }
+    cr2res_detector_error_restore(det_err) ;
 
     /* Get the setting */
     plist = cpl_propertylist_load(cpl_frame_get_filename(
@@ -797,6 +837,7 @@ static int cr2res_cal_wave(
   @param ext_swath_width    Extraction related
   @param ext_oversample     Extraction related
   @param ext_smooth_slit    Extraction related
+  @param ext_nthreads       Extraction: number of parallel traces
   @param wavecal_type       CR2RES_XCORR/LINE1D/LINE2D/ETALON
   @param wl_start           WL estimate of the first pixel
   @param wl_end             WL estimate of the last pixel
@@ -835,6 +876,7 @@ static int cr2res_cal_wave_reduce(
         int                     ext_swath_width,
         int                     ext_oversample, 
         double                  ext_smooth_slit,
+        int                     ext_nthreads,
         cr2res_wavecal_type     wavecal_type,
         int                     wl_degree,
         double                  wl_start,
@@ -862,7 +904,6 @@ static int cr2res_cal_wave_reduce(
     cpl_table           *   tw_in ;
     cpl_table           *   extracted ;
     cpl_table           *   slit_func ;
-    hdrl_image          *   model_master ;
     hdrl_image          *   wl_map ;
     cpl_table           *   tw_out ;
     cpl_table           *   lines_diagnostics_out ;
@@ -870,7 +911,7 @@ static int cr2res_cal_wave_reduce(
     cpl_propertylist    *   plist ;
     cpl_propertylist    *   qcs_plist ;
     const char          *   first_file ;
-    int                     ext_nr, zp_order;
+    int                     ext_nr, zp_order, ymin, ymax ;
     double                  best_xcorr ;
     
     /* Check Inputs */
@@ -890,17 +931,46 @@ static int cr2res_cal_wave_reduce(
     if (cpl_msg_get_level() == CPL_MSG_DEBUG && dits != NULL)
         cpl_vector_dump(dits, stdout) ;
 
+    /* Load the trace wave */
+    cpl_msg_info(__func__, "%sLoad the TRACE WAVE",
+            cr2res_detector_prefix(reduce_det)) ;
+    if ((tw_in = cr2res_io_load_TRACE_WAVE(cpl_frame_get_filename(
+                        trace_wave_frame), reduce_det)) == NULL) {
+        cpl_msg_error(__func__, "%sFailed to Load the traces file",
+                cr2res_detector_prefix(reduce_det)) ;
+        if (dits != NULL) cpl_vector_delete(dits) ;
+        return -1 ;
+    }
+
+    /* Only read the rows of the selected traces */
+    ymin = ymax = -1 ;
+    if (reduce_order > -1 || reduce_trace > -1) {
+        if (cr2res_trace_get_rows(tw_in, reduce_order, reduce_trace,
+                    ext_height > 0 ? ext_height : 1, CR2RES_DETECTOR_SIZE,
+                    &ymin, &ymax) == 0) {
+            cpl_msg_info(__func__, "%sLoad the rows %d to %d only",
+                    cr2res_detector_prefix(reduce_det), ymin, ymax);
+        } else {
+            ymin = ymax = -1 ;
+            cpl_error_reset() ;
+        }
+    }
+
     /* Load image list */
-    if ((in = cr2res_io_load_image_list_from_set(rawframes,
-                    reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Cannot load images") ;
+    if ((in = cr2res_io_load_image_list_from_set_rows(rawframes,
+                    reduce_det, ymin, ymax)) == NULL) {
+        cpl_msg_error(__func__, "%sCannot load images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
+        cpl_table_delete(tw_in) ;
         return -1 ;
     }
     if (hdrl_imagelist_get_size(in) != cpl_frameset_get_size(rawframes)) {
-        cpl_msg_error(__func__, "Inconsistent number of loaded images") ;
+        cpl_msg_error(__func__, "%sInconsistent number of loaded images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         hdrl_imagelist_delete(in) ;
+        cpl_table_delete(tw_in) ;
         return -1 ;
     }
 
@@ -908,9 +978,11 @@ static int cr2res_cal_wave_reduce(
     if ((in_calib = cr2res_calib_imagelist(in, reduce_det, 0, 0,
                     master_flat_frame, master_dark_frame, bpm_frame, 
                     detlin_frame, dits)) == NULL) {
-        cpl_msg_error(__func__, "Failed to apply the calibrations") ;
+        cpl_msg_error(__func__, "%sFailed to apply the calibrations",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         hdrl_imagelist_delete(in) ;
+        cpl_table_delete(tw_in) ;
         return -1 ;
     }
     hdrl_imagelist_delete(in) ;
@@ -919,12 +991,14 @@ static int cr2res_cal_wave_reduce(
     /* Collapse */
     contrib = NULL ;
     if (collapse == CR2RES_COLLAPSE_MEAN) {
-        cpl_msg_info(__func__, "Collapse (Mean) the input frames") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sCollapse (Mean) the input frames",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
         hdrl_imagelist_collapse_mean(in_calib, &collapsed, &contrib) ;
     } else if (collapse == CR2RES_COLLAPSE_MEDIAN) {
-        cpl_msg_info(__func__, "Collapse (Median) the input frames") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sCollapse (Median) the input frames",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
         hdrl_imagelist_collapse_median(in_calib, &collapsed, &contrib) ;
     } else {
         /* Should never happen */
@@ -934,35 +1008,29 @@ static int cr2res_cal_wave_reduce(
     hdrl_imagelist_delete(in_calib) ;
     if (contrib != NULL) cpl_image_delete(contrib) ;
     if (cpl_error_get_code() != CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Failed to Collapse: %d", cpl_error_get_code()) ;
-        cpl_msg_indent_less() ;
-        return -1 ;
-    }
-    cpl_msg_indent_less() ;
-
-    /* Load the trace wave */
-    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
-    if ((tw_in = cr2res_io_load_TRACE_WAVE(cpl_frame_get_filename(
-                        trace_wave_frame), reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Load the traces file") ;
-        hdrl_image_delete(collapsed) ;
+        cpl_msg_error(__func__, "%sFailed to Collapse: %d",
+                cr2res_detector_prefix(reduce_det), cpl_error_get_code()) ;
+        cr2res_msg_indent_less() ;
+        cpl_table_delete(tw_in) ;
         return -1 ;
     }
+    cr2res_msg_indent_less() ;
 
     /* Execute the extraction */
-    cpl_msg_info(__func__, "Spectra Extraction") ;
+    cpl_msg_info(__func__, "%sSpectra Extraction",
+            cr2res_detector_prefix(reduce_det)) ;
     if (cr2res_extract_traces(collapsed, tw_in, NULL, reduce_order, 
                 reduce_trace, CR2RES_EXTR_OPT_CURV, ext_height, ext_swath_width,
-                ext_oversample, ext_smooth_slit, 0.0, 
+                ext_oversample, ext_smooth_slit, 0.0, ext_nthreads,
                 0, 0, 0, // display flags
-                &extracted, &slit_func, &model_master) == -1) {
-        cpl_msg_error(__func__, "Failed to extract");
+                &extracted, &slit_func, NULL) == -1) {
+        cpl_msg_error(__func__, "%sFailed to extract",
+                cr2res_detector_prefix(reduce_det));
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(tw_in) ;
         return -1 ;
     }
     cpl_table_delete(slit_func) ;
-    hdrl_image_delete(model_master) ;
     hdrl_image_delete(collapsed);
 
     first_file = cpl_frame_get_filename(
@@ -972,7 +1040,8 @@ static int cr2res_cal_wave_reduce(
     cpl_propertylist_delete(plist);
     
     /* Compute the Wavelength Calibration */
-    cpl_msg_info(__func__, "Compute the Wavelength") ;
+    cpl_msg_info(__func__, "%sCompute the Wavelength",
+            cr2res_detector_prefix(reduce_det)) ;
     if (cr2res_wave_apply(tw_in, extracted, lines_frame, reduce_order, 
                 reduce_trace, wavecal_type, wl_degree, wl_start, wl_end, 
                 wl_err, wl_shift, log_flag, fallback_input_wavecal_flag, 
@@ -982,7 +1051,8 @@ static int cr2res_cal_wave_reduce(
                 &lines_diagnostics_out,
                 &extracted_out,
                 &tw_out) || cpl_error_get_code()) {
-        cpl_msg_error(__func__, "Failed to calibrate");
+        cpl_msg_error(__func__, "%sFailed to calibrate",
+                cr2res_detector_prefix(reduce_det));
         cpl_table_delete(tw_in) ;
         cpl_table_delete(extracted) ;
         return -1 ;
@@ -1003,7 +1073,8 @@ static int cr2res_cal_wave_reduce(
         cpl_table_delete(lines_diagnostics_out) ;
         cpl_table_delete(extracted_out) ;
         hdrl_image_delete(wl_map) ;
-        cpl_msg_error(__func__, "Failed to load the plist") ;
+        cpl_msg_error(__func__, "%sFailed to load the plist",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -261,6 +261,7 @@ static int cr2res_obs_2d_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -431,7 +432,7 @@ static int cr2res_obs_2d_reduce(
     char                *   key_name ;
     int                 *   order_idx_values ;
     int                     det_nr, nb_order_idx_values, order_real,
-                            order_zp, order_idx, order_idxp ;
+                            order_zp, order_idx, order_idxp, ymin, ymax ;
 
     /* Check Inputs */
     if (extract == NULL || ext_plist == NULL || rawframe == NULL || 
@@ -468,10 +469,32 @@ static int cr2res_obs_2d_reduce(
     }
     cpl_msg_debug(__func__, "DIT value : %g", dit) ;
 
-    /* Load the input image */
-    if ((in = cr2res_io_load_image(cpl_frame_get_filename(rawframe),
+    /* Load the trace wave */
+    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
+    if ((trace_wave = cr2res_io_load_TRACE_WAVE(
+                    cpl_frame_get_filename(trace_wave_frame), 
                     reduce_det)) == NULL) {
+        cpl_msg_error(__func__, "Failed to Load the traces file") ;
+        return -1 ;
+    }
+
+    /* Only read the rows of the selected traces */
+    ymin = ymax = -1 ;
+    if (reduce_order > -1 || reduce_trace > -1) {
+        if (cr2res_trace_get_rows(trace_wave, reduce_order, reduce_trace, 1,
+                    CR2RES_DETECTOR_SIZE, &ymin, &ymax) == 0) {
+            cpl_msg_info(__func__, "Load the rows %d to %d only", ymin, ymax);
+        } else {
+            ymin = ymax = -1 ;
+            cpl_error_reset() ;
+        }
+    }
+
+    /* Load the input image */
+    if ((in = cr2res_io_load_image_rows(cpl_frame_get_filename(rawframe),
+                    reduce_det, ymin, ymax)) == NULL) {
         cpl_msg_error(__func__, "Cannot load image") ;
+        cpl_table_delete(trace_wave) ;
         return -1 ;
     }
 
@@ -480,20 +503,11 @@ static int cr2res_obs_2d_reduce(
             master_dark_frame, bpm_frame, detlin_frame, dit)) == NULL) {
         cpl_msg_error(__func__, "Failed to apply the calibrations") ;
         hdrl_image_delete(in) ;
+        cpl_table_delete(trace_wave) ;
         return -1 ;
     }
     hdrl_image_delete(in) ;
 
-    /* Load the trace wave */
-    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
-    if ((trace_wave = cr2res_io_load_TRACE_WAVE(
-                    cpl_frame_get_filename(trace_wave_frame), 
-                    reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Load the traces file") ;
-        hdrl_image_delete(in_calib) ;
-        return -1 ;
-    }
-
     /* Execute the extraction */
     cpl_msg_info(__func__, "Spectra Extraction 2D") ;
     if (cr2res_extract2d_traces(in_calib, trace_wave, reduce_order,
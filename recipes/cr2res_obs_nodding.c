@@ -77,6 +77,7 @@ static int cr2res_obs_nodding_reduce(
         int                     extract_height,
         double                  extract_smooth_slit,
         double                  extract_smooth_spec,
+        int                     extract_nthreads,
         int                     reduce_det,
         int                     disp_det,
         int                     disp_order_idx,
@@ -96,6 +97,14 @@ static int cr2res_obs_nodding_reduce(
 static cpl_table * cr2res_obs_nodding_combine(
         const cpl_table     *  extracta,
         const cpl_table     *  extractb) ;
+static int cr2res_obs_nodding_collapse_pairs(
+        const cpl_frameset          *   rawframes,
+        const cr2res_nodding_pos    *   nod_positions,
+        int                             reduce_det,
+        const cr2res_calib_context  *   calib_ctx,
+        const cpl_vector            *   dits,
+        hdrl_image                  **  collapsed_a,
+        hdrl_image                  **  collapsed_b) ;
  
 static int cr2res_obs_nodding_create(cpl_plugin *);
 static int cr2res_obs_nodding_exec(cpl_plugin *);
@@ -198,9 +207,10 @@ Nodding Observation                                                     \n\
     cr2res_obs_nodding_reduce()                                         \n\
     cr2res_nodding_read_positions()                                     \n\
     cr2res_io_read_dits()                                               \n\
-    cr2res_io_load_image_list_from_set()                                \n\
-    cr2res_calib_imagelist()                                            \n\
-    cr2res_combine_nodding_split()                                      \n\
+    cr2res_calib_context_new()                                          \n\
+    cr2res_io_load_image()                                              \n\
+    cr2res_calib_context_apply()                                        \n\
+    cr2res_calib_stack_collapse()                                       \n\
     cr2res_io_load_TRACE_WAVE()                                         \n\
     cr2res_pfits_get_nodthrow()                                         \n\
     cr2res_trace_new_slit_fraction()                                    \n\
@@ -330,6 +340,14 @@ static int cr2res_obs_nodding_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.extract_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_obs_nodding", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_obs_nodding", 0);
@@ -337,6 +355,13 @@ static int cr2res_obs_nodding_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_obs_nodding", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_nodding.create_idp",
             CPL_TYPE_BOOL, "Flag to produce  IDP files",
             "cr2res.cr2res_obs_nodding", FALSE);
@@ -404,6 +429,7 @@ static int cr2res_obs_nodding_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -423,7 +449,8 @@ static int cr2res_obs_nodding(
     int                     extract_oversample, extract_swath_width,
                             extract_height, reduce_det, 
                             disp_order_idx, disp_trace, disp_det, 
-                            nodding_invert, create_idp ;
+                            nodding_invert, create_idp, extract_nthreads,
+                            parallel_detectors, det_nthreads ;
     double                  extract_smooth_slit, extract_smooth_spec;
     double                  ra, dec, dit, gain ;
     cpl_frameset        *   rawframes ;
@@ -448,6 +475,7 @@ static int cr2res_obs_nodding(
     cpl_table           *   throughput[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   plist ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     char                *   out_file;
     int                     i, det_nr, type; 
 
@@ -473,9 +501,15 @@ static int cr2res_obs_nodding(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.extract_smooth_spec");
     extract_smooth_spec = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_nodding.extract_nthreads");
+    extract_nthreads = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_nodding.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_nodding.create_idp");
     create_idp = cpl_parameter_get_bool(param);
@@ -523,8 +557,17 @@ static int cr2res_obs_nodding(
     raw_flat_frames = cr2res_extract_frameset(frameset, CR2RES_FLAT_RAW) ;
 
     /* Loop on the detectors */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1) private(plist,ra,dec,dit) firstprivate(gain)
+#endif
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
         /* Initialise */
+        det_err[det_nr-1] = CPL_ERROR_NONE ;
         combineda[det_nr-1] = NULL ;
         extracta[det_nr-1] = NULL ;
         slitfunca[det_nr-1] = NULL ;
@@ -542,8 +585,9 @@ static int cr2res_obs_nodding(
         /* Compute only one detector */
         if (reduce_det != 0 && det_nr != reduce_det) continue ;
     
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sProcess Detector %d",
+                cr2res_detector_prefix(det_nr), det_nr) ;
+        cr2res_msg_indent_more() ;
 
         /* Call the reduction function */
         if (cr2res_obs_nodding_reduce(rawframes, raw_flat_frames, 
@@ -551,7 +595,7 @@ static int cr2res_obs_nodding(
                     master_flat_frame, bpm_frame, nodding_invert, 0, 
                     extract_oversample, extract_swath_width, extract_height, 
                     extract_smooth_slit, extract_smooth_spec, 
-                    det_nr, disp_det, disp_order_idx, 
+                    extract_nthreads, det_nr, disp_det, disp_order_idx, 
                     disp_trace,
                     &(combineda[det_nr-1]),
                     &(extracta[det_nr-1]),
@@ -565,12 +609,14 @@ static int cr2res_obs_nodding(
                     &(twb[det_nr-1]),
                     &(extractc[det_nr-1]),
                     &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
+            cpl_msg_warning(__func__, "%sFailed to reduce detector %d",
+                    cr2res_detector_prefix(det_nr), det_nr);
             cpl_error_reset() ;
         } else if (type == 2) {
             cpl_msg_info(__func__,
-                    "Sensitivity / Conversion / Throughput computation") ;
-            cpl_msg_indent_more() ;
+                    "%sSensitivity / Conversion / Throughput computation",
+                    cr2res_detector_prefix(det_nr)) ;
+            cr2res_msg_indent_more() ;
 
             /* Define the gain */
             if (det_nr==1) gain = CR2RES_GAIN_CHIP1 ;
@@ -585,9 +631,10 @@ static int cr2res_obs_nodding(
             dit = cr2res_pfits_get_dit(plist) ;
             cpl_propertylist_delete(plist) ;
             if (cpl_error_get_code()) {
-                cpl_msg_indent_less() ;
+                cr2res_msg_indent_less() ;
                 cpl_error_reset() ;
-                cpl_msg_warning(__func__, "Missing Header Informations") ;
+                cpl_msg_warning(__func__, "%sMissing Header Informations",
+                        cr2res_detector_prefix(det_nr)) ;
             } else {
                 /* Compute the photometry */
                 if (cr2res_photom_engine(extracta[det_nr-1],
@@ -596,14 +643,17 @@ static int cr2res_obs_nodding(
                             disp_det==det_nr, disp_order_idx,
                             disp_trace, &(throughput[det_nr-1]))) {
                     cpl_msg_warning(__func__, 
-                            "Failed to reduce detector %d", det_nr);
+                            "%sFailed to reduce detector %d",
+                            cr2res_detector_prefix(det_nr), det_nr);
                     cpl_error_reset() ;
                 }
             }
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
+        det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
     }
+    cr2res_detector_error_restore(det_err) ;
 
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_combinedA.fits", RECIPE_STRING) ;
@@ -740,6 +790,7 @@ static int cr2res_obs_nodding(
   @param extract_height         Extraction related
   @param extract_smooth_slit    Extraction: smoothing along slit
   @param extract_smooth_spec    Extraction: smoothing along spectrum
+  @param extract_nthreads       Extraction: number of parallel traces
   @param reduce_det             The detector to compute
   @param disp_det               The detector to display
   @param disp_order_idx         The order index to display
@@ -774,6 +825,7 @@ static int cr2res_obs_nodding_reduce(
         int                     extract_height,
         double                  extract_smooth_slit,
         double                  extract_smooth_spec,
+        int                     extract_nthreads,
         int                     reduce_det,
         int                     disp_det,
         int                     disp_order_idx,
@@ -791,16 +843,9 @@ static int cr2res_obs_nodding_reduce(
         cpl_table           **  extractc,
         cpl_propertylist    **  ext_plist)
 {
-    hdrl_imagelist      *   in ;
-    hdrl_imagelist      *   in_calib ;
-    hdrl_imagelist      *   in_a ;
-    hdrl_imagelist      *   in_b ;
-    hdrl_imagelist      *   diff_a ;
-    hdrl_imagelist      *   diff_b ;
+    cr2res_calib_context *  calib_ctx ;
     hdrl_image          *   collapsed_a ;
     hdrl_image          *   collapsed_b ;
-    cpl_image           *   contrib_a ;
-    cpl_image           *   contrib_b ;
     cr2res_nodding_pos  *   nod_positions ;
     cpl_vector          *   dits ;
     cpl_table           *   trace_wave ;
@@ -843,7 +888,8 @@ static int cr2res_obs_nodding_reduce(
 
     /* Check raw frames consistency */
     if (cr2res_obs_nodding_check_inputs_validity(rawframes) != 1) {
-        cpl_msg_error(__func__, "Invalid Inputs") ;
+        cpl_msg_error(__func__, "%sInvalid Inputs",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -855,29 +901,33 @@ static int cr2res_obs_nodding_reduce(
     /* Get the order zeropoint */
     if ((plist = cpl_propertylist_load(cpl_frame_get_filename(trace_wave_frame),
                     0)) == NULL) {
-        cpl_msg_error(__func__, "Cannot read the ORDER_ZP from the input TW") ;
+        cpl_msg_error(__func__, "%sCannot read the ORDER_ZP from the input TW",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
     order_zp = cr2res_pfits_get_order_zp(plist) ;
     cpl_propertylist_delete(plist) ;
     if (cpl_error_get_code()) {
-        cpl_msg_error(__func__, "Missing ORDER_ZP in the header - Skip") ;
+        cpl_msg_error(__func__, "%sMissing ORDER_ZP in the header - Skip",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_error_reset() ;
         /* Negative Zerop to log the fact that it is missing */
         order_zp = -100 ;
     } 
 
     /* Get the Nodding positions */
-    cpl_msg_info(__func__, "Get the Nodding positions") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sGet the Nodding positions",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     nod_positions = cr2res_nodding_read_positions(rawframes) ;
     for (i=0 ; i<nframes ; i++) {
-        cpl_msg_info(__func__, "Frame %s - Nodding %c", 
+        cpl_msg_info(__func__, "%sFrame %s - Nodding %c",
+                cr2res_detector_prefix(reduce_det), 
                 cpl_frame_get_filename(
                     cpl_frameset_get_position_const(rawframes, i)), 
             cr2res_nodding_position_char(nod_positions[i])) ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Load the DITs if necessary */
     if (master_dark_frame != NULL)  dits = cr2res_io_read_dits(rawframes) ;
@@ -885,103 +935,48 @@ static int cr2res_obs_nodding_reduce(
     if (cpl_msg_get_level() == CPL_MSG_DEBUG && dits != NULL) 
         cpl_vector_dump(dits, stdout) ;
 
-    /* Load image list */
-    cpl_msg_info(__func__, "Load the image list") ;
-    if ((in = cr2res_io_load_image_list_from_set(rawframes, 
-                    reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Cannot load images") ;
-        cpl_free(nod_positions) ;    
-        if (dits != NULL) cpl_vector_delete(dits) ;
-        return -1 ;
-    }
-    if (hdrl_imagelist_get_size(in) != cpl_frameset_get_size(rawframes)) {
-        cpl_msg_error(__func__, "Inconsistent number of loaded images") ;
+    /* Load the calibrations */
+    cpl_msg_info(__func__, "%sLoad the Calibrations",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
+    if ((calib_ctx = cr2res_calib_context_new(reduce_det, 0, 0,
+                    master_flat_frame, master_dark_frame, bpm_frame,
+                    detlin_frame)) == NULL) {
+        cpl_msg_error(__func__, "%sFailed to apply the calibrations",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_less() ;
         cpl_free(nod_positions) ;    
         if (dits != NULL) cpl_vector_delete(dits) ;
-        hdrl_imagelist_delete(in) ;
         return -1 ;
     }
-
-    /* Calibrate the images */
-    cpl_msg_info(__func__, "Apply the Calibrations") ;
-    cpl_msg_indent_more() ;
-    if ((in_calib = cr2res_calib_imagelist(in, reduce_det, 0, 0, 
-                    master_flat_frame, master_dark_frame, bpm_frame, 
-                    detlin_frame, dits)) == NULL) {
-        cpl_msg_error(__func__, "Failed to apply the calibrations") ;
-        cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
+
+    /* Calibrate the frames and collapse A-B and B-A */
+    cpl_msg_info(__func__, "%sCollapse A-B and B-A",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
+    if (cr2res_obs_nodding_collapse_pairs(rawframes, nod_positions,
+                reduce_det, calib_ctx, dits, &collapsed_a, &collapsed_b)) {
+        cpl_msg_error(__func__, "%sFailed to Collapse A-B and B-A",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_less() ;
+        cr2res_calib_context_delete(calib_ctx) ;
         cpl_free(nod_positions) ;    
         if (dits != NULL) cpl_vector_delete(dits) ;
-        hdrl_imagelist_delete(in) ;
-        return -1 ;
-    }
-    hdrl_imagelist_delete(in) ;
-    if (dits != NULL) cpl_vector_delete(dits) ;
-    cpl_msg_indent_less() ;
-
-    /* Split the image lists */
-    cpl_msg_info(__func__, "Split the images in A and B lists") ;
-    cpl_msg_indent_more() ;
-    if (cr2res_combine_nodding_split(in_calib, nod_positions, &in_a, 
-            &in_b)) {
-        cpl_msg_error(__func__, "Failed to split the nodding positions") ;
-        cpl_msg_indent_less() ;
-        cpl_free(nod_positions) ;    
-        hdrl_imagelist_delete(in_calib) ;
         return -1 ;
     }
+    cr2res_calib_context_delete(calib_ctx) ;
     cpl_free(nod_positions) ;    
-    hdrl_imagelist_delete(in_calib) ;
-    cpl_msg_indent_less() ;
-
-    /* Check the sizes of A/B image lists */
-    if (hdrl_imagelist_get_size(in_a) != hdrl_imagelist_get_size(in_b)
-            || hdrl_imagelist_get_size(in_a) == 0) {
-        cpl_msg_error(__func__, "Іnconsistent A / B number of images") ;
-        hdrl_imagelist_delete(in_a) ;
-        hdrl_imagelist_delete(in_b) ;
-        return -1 ;
-    }
-
-    /* Compute diff_a = in_a - in_b and diff_b = in_b - in_a */
-    cpl_msg_info(__func__, "Compute difference image lists A-B and B-A") ;
-    diff_a = hdrl_imagelist_duplicate(in_a) ;
-    hdrl_imagelist_sub_imagelist(diff_a, in_b) ;
-    diff_b = hdrl_imagelist_duplicate(in_b) ;
-    hdrl_imagelist_sub_imagelist(diff_b, in_a) ;
-    hdrl_imagelist_delete(in_a) ;
-    hdrl_imagelist_delete(in_b) ;
-    
-    /* Collapse A-B and B-A */
-    cpl_msg_info(__func__, "Collapse image lists A-B and B-A") ;
-    cpl_msg_indent_more() ;
-    if (hdrl_imagelist_collapse_mean(diff_a, &collapsed_a, &contrib_a) !=
-            CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Failed to Collapse A-B") ;
-        hdrl_imagelist_delete(diff_a) ;
-        hdrl_imagelist_delete(diff_b) ;
-        cpl_msg_indent_less() ;
-        return -1 ;
-    }
-    cpl_image_delete(contrib_a) ;
-    hdrl_imagelist_delete(diff_a) ;
-    if (hdrl_imagelist_collapse_mean(diff_b, &collapsed_b, &contrib_b) !=
-            CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Failed to Collapse B-A") ;
-        hdrl_imagelist_delete(diff_b) ;
-        hdrl_image_delete(collapsed_a) ;
-        cpl_msg_indent_less() ;
-        return -1 ;
-    }
-    cpl_image_delete(contrib_b) ;
-    hdrl_imagelist_delete(diff_b) ;
-    cpl_msg_indent_less() ;
+    if (dits != NULL) cpl_vector_delete(dits) ;
+    cr2res_msg_indent_less() ;
 
     /* Load the trace wave */
-    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
+    cpl_msg_info(__func__, "%sLoad the TRACE WAVE",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((trace_wave = cr2res_io_load_TRACE_WAVE(cpl_frame_get_filename(
                         trace_wave_frame), reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Load the traces file") ;
+        cpl_msg_error(__func__, "%sFailed to Load the traces file",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         return -1 ;
@@ -989,8 +984,9 @@ static int cr2res_obs_nodding_reduce(
 
     /* Correct trace_wave with some provided raw flats */
     if (raw_flat_frames != NULL) {
-        cpl_msg_info(__func__, "Try to correct the reproducibility error") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sTry to correct the reproducibility error",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
         trace_wave_corrected = cr2res_trace_adjust(trace_wave, raw_flat_frames, 
                 reduce_det) ;
         if (trace_wave_corrected != NULL) {
@@ -998,12 +994,14 @@ static int cr2res_obs_nodding_reduce(
             trace_wave = trace_wave_corrected ;
             trace_wave_corrected = NULL ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
 
     /* Compute the slit fractions for A and B positions extraction */   
-    cpl_msg_info(__func__, "Compute the slit fractions for A and B positions");
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__,
+            "%sCompute the slit fractions for A and B positions",
+            cr2res_detector_prefix(reduce_det));
+    cr2res_msg_indent_more() ;
     /*
     The assumption is made here that :  
         - The slit center is exactly in the middle of A and B poѕitions
@@ -1013,8 +1011,10 @@ static int cr2res_obs_nodding_reduce(
     */
     slit_length = 10 ;
     if ((plist = cpl_propertylist_load(first_fname, 0)) == NULL) {
-        cpl_msg_error(__func__, "Cannot read the NODTHROW in the input files") ;
-        cpl_msg_indent_less() ;
+        cpl_msg_error(__func__,
+                "%sCannot read the NODTHROW in the input files",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_less() ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         cpl_table_delete(trace_wave) ;
@@ -1057,18 +1057,22 @@ static int cr2res_obs_nodding_reduce(
             slit_frac_b_bot = slit_frac_b_top - extr_width_frac ;
         }
     } else {
-        cpl_msg_error(__func__, "NODTHROW > slit length (%g>%g)- abort", 
+        cpl_msg_error(__func__, "%sNODTHROW > slit length (%g>%g)- abort",
+                cr2res_detector_prefix(reduce_det), 
                 nod_throw, slit_length) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         cpl_table_delete(trace_wave) ;
         return -1 ;
     }
-    cpl_msg_info(__func__, "Nod Throw : %g arcsecs", nod_throw) ;
-    cpl_msg_info(__func__, "Nodding A extraction: Slit fraction %g - %g",
+    cpl_msg_info(__func__, "%sNod Throw : %g arcsecs",
+            cr2res_detector_prefix(reduce_det), nod_throw) ;
+    cpl_msg_info(__func__, "%sNodding A extraction: Slit fraction %g - %g",
+            cr2res_detector_prefix(reduce_det),
             slit_frac_a_bot, slit_frac_a_top) ;
-    cpl_msg_info(__func__, "Nodding B extraction: Slit fraction %g - %g",
+    cpl_msg_info(__func__, "%sNodding B extraction: Slit fraction %g - %g",
+            cr2res_detector_prefix(reduce_det),
             slit_frac_b_bot, slit_frac_b_top) ;
 
     slit_frac_a = cpl_array_new(3, CPL_TYPE_DOUBLE) ;
@@ -1080,14 +1084,16 @@ static int cr2res_obs_nodding_reduce(
     cpl_array_set(slit_frac_b, 0, slit_frac_b_bot) ;
     cpl_array_set(slit_frac_b, 1, slit_frac_b_mid) ;
     cpl_array_set(slit_frac_b, 2, slit_frac_b_top) ;
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Recompute the traces for the new slit fractions */
-    cpl_msg_info(__func__, "Recompute the traces for the A slit fraction") ;
+    cpl_msg_info(__func__, "%sRecompute the traces for the A slit fraction",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((trace_wave_a = cr2res_trace_new_slit_fraction(trace_wave,
             slit_frac_a)) == NULL) {
         cpl_msg_error(__func__, 
-                "Failed to compute the traces for extraction of A") ;
+                "%sFailed to compute the traces for extraction of A",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         cpl_table_delete(trace_wave) ;
@@ -1097,11 +1103,13 @@ static int cr2res_obs_nodding_reduce(
     }
     cpl_array_delete(slit_frac_a) ;
 
-    cpl_msg_info(__func__, "Recompute the traces for the B slit fraction") ;
+    cpl_msg_info(__func__, "%sRecompute the traces for the B slit fraction",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((trace_wave_b = cr2res_trace_new_slit_fraction(trace_wave,
             slit_frac_b)) == NULL) {
         cpl_msg_error(__func__, 
-                "Failed to compute the traces for extraction of B") ;
+                "%sFailed to compute the traces for extraction of B",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         cpl_table_delete(trace_wave) ;
@@ -1112,15 +1120,17 @@ static int cr2res_obs_nodding_reduce(
     cpl_array_delete(slit_frac_b) ;
     
     /* Execute the extraction */
-    cpl_msg_info(__func__, "A position Spectra Extraction") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sA position Spectra Extraction",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if (cr2res_extract_traces(collapsed_a, trace_wave_a, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
                 extract_oversample, extract_smooth_slit, extract_smooth_spec,
-                disp_det==reduce_det, disp_order_idx, disp_trace,
+                extract_nthreads, disp_det==reduce_det, disp_order_idx, disp_trace,
                 &extracted_a, &slit_func_a, &model_master_a) == -1) {
-        cpl_msg_error(__func__, "Failed to extract A");
-        cpl_msg_indent_less() ;
+        cpl_msg_error(__func__, "%sFailed to extract A",
+                cr2res_detector_prefix(reduce_det));
+        cr2res_msg_indent_less() ;
         hdrl_image_delete(collapsed_a) ;
         hdrl_image_delete(collapsed_b) ;
         cpl_table_delete(trace_wave_a) ;
@@ -1128,17 +1138,19 @@ static int cr2res_obs_nodding_reduce(
         cpl_table_delete(trace_wave) ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
-    cpl_msg_info(__func__, "B position Spectra Extraction") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sB position Spectra Extraction",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if (cr2res_extract_traces(collapsed_b, trace_wave_b, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
                 extract_oversample, extract_smooth_slit, extract_smooth_spec,
-                disp_det==reduce_det, disp_order_idx, disp_trace,
+                extract_nthreads, disp_det==reduce_det, disp_order_idx, disp_trace,
                 &extracted_b, &slit_func_b, &model_master_b) == -1) {
-        cpl_msg_error(__func__, "Failed to extract B");
-        cpl_msg_indent_less() ;
+        cpl_msg_error(__func__, "%sFailed to extract B",
+                cr2res_detector_prefix(reduce_det));
+        cr2res_msg_indent_less() ;
         cpl_table_delete(extracted_a) ;
         cpl_table_delete(slit_func_a) ;
         hdrl_image_delete(model_master_a) ;
@@ -1149,20 +1161,22 @@ static int cr2res_obs_nodding_reduce(
         cpl_table_delete(trace_wave) ;
         return -1 ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Combine both a and b extracted spectra together */
-    cpl_msg_info(__func__, "A and B spectra combination") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sA and B spectra combination",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     extracted_combined = cr2res_obs_nodding_combine(extracted_a, extracted_b) ;
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Store the extenѕion header for product saving */
     plist = cpl_propertylist_load(first_fname,
             cr2res_io_get_ext_idx(first_fname, reduce_det, 1)) ;
                     
     /* QC - Signal and FWHM */
-    cpl_msg_info(__func__, "QC parameters computation") ;
+    cpl_msg_info(__func__, "%sQC parameters computation",
+            cr2res_detector_prefix(reduce_det)) ;
     qc_signal_a = cr2res_qc_obs_nodding_signal(extracted_a) ;
     qc_signal_b = cr2res_qc_obs_nodding_signal(extracted_b) ;
     cpl_propertylist_append_double(plist, CR2RES_HEADER_QC_SIGNAL, 
@@ -1405,6 +1419,117 @@ static cpl_table * cr2res_obs_nodding_combine(
     return extractc ;
 }
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief  Calibrate the frames and collapse the A-B and B-A differences
+  @param rawframes      The raw frames
+  @param nod_positions  The nodding positions of the raw frames
+  @param reduce_det     The detector to reduce
+  @param calib_ctx      The calibrations of this detector
+  @param dits           The DITs for the dark correction, or NULL
+  @param collapsed_a    [out] The mean of A-B
+  @param collapsed_b    [out] The mean of B-A
+  @return  0 if ok, -1 otherwise
+
+  The i-th A frame is paired with the i-th B frame, as in
+  cr2res_combine_nodding_split(). The frames are loaded one by one, and
+  only the frames still waiting for their pair are kept in memory.
+ */
+/*----------------------------------------------------------------------------*/
+static int cr2res_obs_nodding_collapse_pairs(
+        const cpl_frameset          *   rawframes,
+        const cr2res_nodding_pos    *   nod_positions,
+        int                             reduce_det,
+        const cr2res_calib_context  *   calib_ctx,
+        const cpl_vector            *   dits,
+        hdrl_image                  **  collapsed_a,
+        hdrl_image                  **  collapsed_b)
+{
+    cr2res_calib_stack  *   stack_a ;
+    cr2res_calib_stack  *   stack_b ;
+    hdrl_image          **  pending_a ;
+    hdrl_image          **  pending_b ;
+    hdrl_image          *   in ;
+    hdrl_image          *   in_calib ;
+    hdrl_image          *   diff ;
+    const char          *   fname ;
+    cpl_size                nframes, na, nb, ia, ib, i ;
+    int                     ret ;
+
+    /* Initialise */
+    nframes = cpl_frameset_get_size(rawframes) ;
+    pending_a = cpl_calloc(nframes, sizeof(hdrl_image *)) ;
+    pending_b = cpl_calloc(nframes, sizeof(hdrl_image *)) ;
+    stack_a = cr2res_calib_stack_new(0) ;
+    stack_b = cr2res_calib_stack_new(0) ;
+    na = nb = ia = ib = 0 ;
+    ret = 0 ;
+
+    /* Loop on the frames */
+    for (i=0 ; i<nframes && ret == 0 ; i++) {
+        if (nod_positions[i] != CR2RES_NODDING_A &&
+                nod_positions[i] != CR2RES_NODDING_B) continue ;
+
+        /* Load and calibrate */
+        fname = cpl_frame_get_filename(
+                cpl_frameset_get_position_const(rawframes, i)) ;
+        if ((in = cr2res_io_load_image(fname, reduce_det)) == NULL) {
+            cpl_msg_error(__func__, "%sCannot load images",
+                    cr2res_detector_prefix(reduce_det)) ;
+            ret = -1 ;
+            break ;
+        }
+        in_calib = cr2res_calib_context_apply(calib_ctx, in,
+                dits != NULL ? cpl_vector_get(dits, i) : 0.0) ;
+        hdrl_image_delete(in) ;
+        if (in_calib == NULL) {
+            cpl_msg_error(__func__, "%sFailed to apply the calibrations",
+                    cr2res_detector_prefix(reduce_det)) ;
+            ret = -1 ;
+            break ;
+        }
+        if (nod_positions[i] == CR2RES_NODDING_A) pending_a[na++] = in_calib ;
+        else                                       pending_b[nb++] = in_calib ;
+
+        /* Stack the pairs that are complete */
+        while (ia < na && ib < nb) {
+            diff = hdrl_image_duplicate(pending_a[ia]) ;
+            hdrl_image_sub_image(diff, pending_b[ib]) ;
+            if (cr2res_calib_stack_add(stack_a, diff)) ret = -1 ;
+            hdrl_image_delete(diff) ;
+            diff = hdrl_image_duplicate(pending_b[ib]) ;
+            hdrl_image_sub_image(diff, pending_a[ia]) ;
+            if (cr2res_calib_stack_add(stack_b, diff)) ret = -1 ;
+            hdrl_image_delete(diff) ;
+            hdrl_image_delete(pending_a[ia]) ;
+            hdrl_image_delete(pending_b[ib]) ;
+            pending_a[ia++] = pending_b[ib++] = NULL ;
+        }
+    }
+
+    /* Check the sizes of A/B */
+    if (ret == 0 && (na != nb || na == 0)) {
+        cpl_msg_error(__func__, "%sІnconsistent A / B number of images",
+                cr2res_detector_prefix(reduce_det)) ;
+        ret = -1 ;
+    }
+
+    /* Collapse */
+    if (ret == 0) {
+        *collapsed_a = cr2res_calib_stack_collapse(stack_a, NULL) ;
+        *collapsed_b = cr2res_calib_stack_collapse(stack_b, NULL) ;
+    }
+
+    /* Free */
+    for (i=ia ; i<na ; i++) hdrl_image_delete(pending_a[i]) ;
+    for (i=ib ; i<nb ; i++) hdrl_image_delete(pending_b[i]) ;
+    cpl_free(pending_a) ;
+    cpl_free(pending_b) ;
+    cr2res_calib_stack_delete(stack_a) ;
+    cr2res_calib_stack_delete(stack_b) ;
+    return ret ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief  Run basic checks for the rawframes consistency
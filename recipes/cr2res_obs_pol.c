@@ -46,6 +46,9 @@
 
 #define RECIPE_STRING "cr2res_obs_pol"
 
+/* One extraction plan per decker position and beam (up/down) */
+#define CR2RES_OBS_POL_NB_PLANS     (2*(CR2RES_DECKER_2_4+1))
+
 /*-----------------------------------------------------------------------------
                              Plugin registration
  -----------------------------------------------------------------------------*/
@@ -62,6 +65,17 @@ static int * cr2res_obs_pol_get_order_numbers(
         int             *   norders) ;
 static int cr2res_obs_pol_check_inputs_validity(
         const cpl_frameset  *   rawframes) ;
+static const cr2res_extract_plan * cr2res_obs_pol_get_plan(
+        cr2res_extract_plan **  plans,
+        cpl_table           **  traces,
+        const cpl_table     *   trace_wave,
+        cr2res_decker           decker,
+        int                     up_or_down,
+        const hdrl_image    *   img,
+        int                     extract_oversample,
+        int                     extract_swath_width,
+        int                     extract_height,
+        const cpl_table     **  trace_wave_loc) ;
 static int cr2res_obs_pol_reduce(
         const cpl_frameset  *   rawframes,
         const cpl_frameset  *   raw_flat_frames,
@@ -75,6 +89,7 @@ static int cr2res_obs_pol_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  pol_spec_a,
         cpl_table           **  pol_spec_b,
@@ -94,6 +109,7 @@ static int cr2res_obs_pol_reduce_one(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  pol_spec,
         cpl_propertylist    **  ext_plist) ;
@@ -164,6 +180,8 @@ Polarimetry Observation                                                 \n\
             where u/d are for up and down                               \n\
                   1->4 iѕ derived with cr2res_pol_sort_frames()         \n\
                   The decker info is used to derive the 8 slit fractions\n\
+                  The extraction plan of each decker position and       \n\
+                  beam is computed once and shared by all groups        \n\
         Count norders the number of different orders in those 8 tables  \n\
             [Note : 1 extracted table has 1 spectrum per order]         \n\
         loop on orders o:                                               \n\
@@ -195,7 +213,8 @@ Polarimetry Observation                                                 \n\
     cr2res_pol_sort_frames()                                            \n\
     cr2res_trace_slit_fraction_create()                                 \n\
     cr2res_trace_new_slit_fraction()                                    \n\
-    cr2res_extract_traces()                                             \n\
+    cr2res_extract_plan_new()                                           \n\
+    cr2res_extract_plan_apply()                                         \n\
     cr2res_obs_pol_get_order_numbers()                                  \n\
     cr2res_pol_demod_stokes()                                           \n\
     cr2res_pol_demod_null()                                             \n\
@@ -304,6 +323,14 @@ static int cr2res_obs_pol_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_pol.extract_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_obs_pol", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_pol.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_obs_pol", 0);
@@ -311,6 +338,13 @@ static int cr2res_obs_pol_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_pol.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_obs_pol", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     return 0;
 }
 
@@ -350,6 +384,7 @@ static int cr2res_obs_pol_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -367,7 +402,8 @@ static int cr2res_obs_pol(
 {
     const cpl_parameter *   param ;
     int                     extract_oversample, extract_swath_width,
-                            extract_height, reduce_det ;
+                            extract_height, reduce_det, extract_nthreads,
+                            parallel_detectors, det_nthreads ;
     double                  extract_smooth ;
     cpl_frameset        *   rawframes ;
     cpl_frameset        *   raw_flat_frames ;
@@ -380,6 +416,7 @@ static int cr2res_obs_pol(
     cpl_table           *   pol_specb[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plista[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plistb[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     char                *   out_file;
     int                     i, det_nr; 
 
@@ -398,9 +435,15 @@ static int cr2res_obs_pol(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_pol.extract_smooth");
     extract_smooth = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_pol.extract_nthreads");
+    extract_nthreads = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_pol.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_pol.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
 
     /* Identify the RAW and CALIB frames in the input frameset */
     if (cr2res_dfs_set_groups(frameset)) {
@@ -435,8 +478,17 @@ static int cr2res_obs_pol(
     raw_flat_frames = cr2res_extract_frameset(frameset, CR2RES_FLAT_RAW) ;
 
     /* Loop on the detectors */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1)
+#endif
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
         /* Initialise */
+        det_err[det_nr-1] = CPL_ERROR_NONE ;
         pol_speca[det_nr-1] = NULL ;
         pol_specb[det_nr-1] = NULL ;
         ext_plista[det_nr-1] = NULL ;
@@ -445,23 +497,27 @@ static int cr2res_obs_pol(
         /* Compute only one detector */
         if (reduce_det != 0 && det_nr != reduce_det) continue ;
     
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sProcess Detector %d",
+                cr2res_detector_prefix(det_nr), det_nr) ;
+        cr2res_msg_indent_more() ;
 
         /* Call the reduction function */
         if (cr2res_obs_pol_reduce(rawframes, raw_flat_frames, trace_wave_frame, 
                     detlin_frame, master_dark_frame, master_flat_frame, 
                     bpm_frame, 0, extract_oversample, extract_swath_width, 
-                    extract_height, extract_smooth, det_nr,
+                    extract_height, extract_smooth, extract_nthreads, det_nr,
                     &(pol_speca[det_nr-1]),
                     &(pol_specb[det_nr-1]),
                     &(ext_plista[det_nr-1]),
                     &(ext_plistb[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
+            cpl_msg_warning(__func__, "%sFailed to reduce detector %d",
+                    cr2res_detector_prefix(det_nr), det_nr);
             cpl_error_reset() ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
+        det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
     }
+    cr2res_detector_error_restore(det_err) ;
 
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_pol_specA.fits", RECIPE_STRING) ;
@@ -508,6 +564,7 @@ static int cr2res_obs_pol(
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_nthreads       Extraction: number of parallel traces
   @param reduce_det             The detector to compute
   @param pol_speca              [out] polarimetry spectrum (A)
   @param pol_specb              [out] polarimetry spectrum (B)
@@ -529,6 +586,7 @@ static int cr2res_obs_pol_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  pol_speca,
         cpl_table           **  pol_specb,
@@ -553,7 +611,8 @@ static int cr2res_obs_pol_reduce(
     nod_positions = cr2res_nodding_read_positions(rawframes) ;
     if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
         for (i=0 ; i<cpl_frameset_get_size(rawframes) ; i++) {
-            cpl_msg_debug(__func__, "Frame %s - Nodding %c",
+            cpl_msg_debug(__func__, "%sFrame %s - Nodding %c",
+                    cr2res_detector_prefix(reduce_det),
                     cpl_frame_get_filename(
                         cpl_frameset_get_position_const(rawframes,i)),
                     cr2res_nodding_position_char(nod_positions[i])) ;
@@ -563,39 +622,47 @@ static int cr2res_obs_pol_reduce(
     /* Split the frames */
     if (cr2res_combine_nodding_split_frames(rawframes, nod_positions, 
                 &rawframes_a, &rawframes_b)) {
-        cpl_msg_error(__func__, "Failed to split the nodding positions") ;
+        cpl_msg_error(__func__, "%sFailed to split the nodding positions",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_free(nod_positions) ;    
         return -1 ;
     }
     cpl_free(nod_positions) ;    
 
-    cpl_msg_debug(__func__,"Number of frames posA:posB %lld:%lld",
+    cpl_msg_debug(__func__,"%sNumber of frames posA:posB %lld:%lld",
+            cr2res_detector_prefix(reduce_det),
                     cpl_frameset_get_size(rawframes_a),
                     cpl_frameset_get_size(rawframes_b));
 
     /* Reduce A position */
-    cpl_msg_info(__func__, "Compute Polarimetry for nodding A position") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute Polarimetry for nodding A position",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if (cr2res_obs_pol_reduce_one(rawframes_a, raw_flat_frames, rawframes_b,
                 trace_wave_frame, detlin_frame, master_dark_frame, 
                 master_flat_frame, bpm_frame, 0, extract_oversample, 
-                extract_swath_width, extract_height, extract_smooth, reduce_det,
+                extract_swath_width, extract_height, extract_smooth, 
+                extract_nthreads, reduce_det,
                 &pol_speca_loc, &ext_plista_loc) == -1) {
-        cpl_msg_error(__func__, "Failed to Reduce A nodding frames") ;
+        cpl_msg_error(__func__, "%sFailed to Reduce A nodding frames",
+                cr2res_detector_prefix(reduce_det)) ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Reduce B position */
-    cpl_msg_info(__func__, "Compute Polarimetry for nodding B position") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCompute Polarimetry for nodding B position",
+            cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if (cr2res_obs_pol_reduce_one(rawframes_b, raw_flat_frames, rawframes_a,
                 trace_wave_frame, detlin_frame, master_dark_frame, 
                 master_flat_frame, bpm_frame, 0, extract_oversample, 
-                extract_swath_width, extract_height, extract_smooth, reduce_det,
+                extract_swath_width, extract_height, extract_smooth, 
+                extract_nthreads, reduce_det,
                 &pol_specb_loc, &ext_plistb_loc) == -1) {
-        cpl_msg_error(__func__, "Failed to Reduce B nodding frames") ;
+        cpl_msg_error(__func__, "%sFailed to Reduce B nodding frames",
+                cr2res_detector_prefix(reduce_det)) ;
     }
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
     if (rawframes_a != NULL) cpl_frameset_delete(rawframes_a);
     if (rawframes_b != NULL) cpl_frameset_delete(rawframes_b);
 
@@ -621,6 +688,7 @@ static int cr2res_obs_pol_reduce(
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_nthreads       Extraction: number of parallel traces
   @param reduce_det             The detector to compute
   @param pol_spec               [out] polarimetry spectrum
   @param ext_plist              [out] the header for saving the products
@@ -641,6 +709,7 @@ static int cr2res_obs_pol_reduce_one(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  pol_spec,
         cpl_propertylist    **  ext_plist)
@@ -655,12 +724,13 @@ static int cr2res_obs_pol_reduce_one(
     int                 *   pol_sorting ;
     cpl_table           *   trace_wave ;
     cpl_table           *   trace_wave_corrected ;
-    cpl_table           *   trace_wave_loc ;
-    cpl_array           *   slit_frac ;
+    cpl_table           *   traces_loc[CR2RES_OBS_POL_NB_PLANS] ;
+    cr2res_extract_plan *   plans[CR2RES_OBS_POL_NB_PLANS] ;
+    const cr2res_extract_plan * plan ;
+    const cpl_table     *   trace_wave_loc ;
     const char          *   fname ;
     char                *   decker_name ;
     cpl_table           *   slit_func ;
-    hdrl_image          *   model_master ;
     cpl_table           **  pol_spec_one_group ;
     cpl_table           **  extract_1d ;
     char                *   colname ;
@@ -699,13 +769,15 @@ static int cr2res_obs_pol_reduce_one(
     /* Get the order zeropoint */
     if ((plist = cpl_propertylist_load(cpl_frame_get_filename(trace_wave_frame),
                     0)) == NULL) {
-        cpl_msg_error(__func__, "Cannot read the ORDER_ZP from the input TW") ;
+        cpl_msg_error(__func__, "%sCannot read the ORDER_ZP from the input TW",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
     order_zp = cr2res_pfits_get_order_zp(plist) ;
     cpl_propertylist_delete(plist) ;
     if (cpl_error_get_code()) {
-        cpl_msg_error(__func__, "Missing ORDER_ZP in the header - Skip") ;
+        cpl_msg_error(__func__, "%sMissing ORDER_ZP in the header - Skip",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_error_reset() ;
         /* Negative Zerop to log the fact that it is missing */
         order_zp = -100 ;
@@ -715,7 +787,9 @@ static int cr2res_obs_pol_reduce_one(
     nframes = cpl_frameset_get_size(rawframes) ;
     if (nframes == 0 || nframes % CR2RES_POLARIMETRY_GROUP_SIZE) {
         cpl_msg_error(__func__, 
-            "Input number of frames is %"CPL_SIZE_FORMAT" and should be multiple of %d",
+            "%sInput number of frames is %"CPL_SIZE_FORMAT
+            " and should be multiple of %d",
+            cr2res_detector_prefix(reduce_det),
             nframes, CR2RES_POLARIMETRY_GROUP_SIZE) ;
         return -1 ;
     }
@@ -728,22 +802,26 @@ static int cr2res_obs_pol_reduce_one(
 
     /* Get the decker positions */
     if ((decker_positions = cr2res_io_read_decker_positions(rawframes))==NULL) {
-        cpl_msg_error(__func__, "Cannot read the Decker positions") ;
+        cpl_msg_error(__func__, "%sCannot read the Decker positions",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         return -1 ;
     }
 
     /* Load image list */
-    cpl_msg_info(__func__, "Load the images") ;
+    cpl_msg_info(__func__, "%sLoad the images",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((in = cr2res_io_load_image_list_from_set(rawframes, 
                     reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Cannot load images") ;
+        cpl_msg_error(__func__, "%sCannot load images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         cpl_free(decker_positions) ;
         return -1 ;
     }
     if (hdrl_imagelist_get_size(in) != cpl_frameset_get_size(rawframes)) {
-        cpl_msg_error(__func__, "Inconsistent number of loaded images") ;
+        cpl_msg_error(__func__, "%sInconsistent number of loaded images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         cpl_free(decker_positions) ;
         hdrl_imagelist_delete(in) ;
@@ -751,11 +829,13 @@ static int cr2res_obs_pol_reduce_one(
     }
 
     /* Calibrate the images */
-    cpl_msg_info(__func__, "Apply the calibrations") ;
+    cpl_msg_info(__func__, "%sApply the calibrations",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((in_calib = cr2res_calib_imagelist(in, reduce_det, 0, 0, 
                     master_flat_frame, master_dark_frame, bpm_frame, 
                     detlin_frame, dits)) == NULL) {
-        cpl_msg_error(__func__, "Failed to apply the calibrations") ;
+        cpl_msg_error(__func__, "%sFailed to apply the calibrations",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         cpl_free(decker_positions) ;
         hdrl_imagelist_delete(in) ;
@@ -765,10 +845,12 @@ static int cr2res_obs_pol_reduce_one(
 
     if (cpl_frameset_get_size(raw_background_frames) > 1 ) {
         /* Load image list for BACKGROUND frames */
-        cpl_msg_info(__func__, "Load the images") ;
+        cpl_msg_info(__func__, "%sLoad the images",
+                cr2res_detector_prefix(reduce_det)) ;
         if ((in = cr2res_io_load_image_list_from_set(raw_background_frames, 
                         reduce_det)) == NULL) {
-            cpl_msg_error(__func__, "Cannot load background images") ;
+            cpl_msg_error(__func__, "%sCannot load background images",
+                    cr2res_detector_prefix(reduce_det)) ;
             if (dits != NULL) cpl_vector_delete(dits) ;
             cpl_free(decker_positions) ;
             hdrl_imagelist_delete(in_calib) ;
@@ -776,12 +858,14 @@ static int cr2res_obs_pol_reduce_one(
         }
 
         /* Calibrate the background same as science images */
-        cpl_msg_info(__func__, "Apply the calibrations to background") ;
+        cpl_msg_info(__func__, "%sApply the calibrations to background",
+                cr2res_detector_prefix(reduce_det)) ;
         if ((in_backgr = cr2res_calib_imagelist(in, reduce_det, 0, 0, 
                         master_flat_frame, master_dark_frame, bpm_frame, 
                         detlin_frame, dits)) == NULL) {
             cpl_msg_error(__func__,
-                            "Failed to apply the calibrations to background") ;
+                            "%sFailed to apply the calibrations to background",
+                            cr2res_detector_prefix(reduce_det)) ;
             if (dits != NULL) cpl_vector_delete(dits) ;
             cpl_free(decker_positions) ;
             hdrl_imagelist_delete(in) ;
@@ -794,7 +878,8 @@ static int cr2res_obs_pol_reduce_one(
         if (hdrl_imagelist_collapse_mean(in_backgr, &backgr, &contrib) != \
                         CPL_ERROR_NONE) {
             cpl_msg_error(__func__,
-                            "Failed to collapse background") ;
+                            "%sFailed to collapse background",
+                            cr2res_detector_prefix(reduce_det)) ;
             if (dits != NULL) cpl_vector_delete(dits) ;
             cpl_free(decker_positions) ;
             hdrl_imagelist_delete(in_calib) ;
@@ -807,7 +892,8 @@ static int cr2res_obs_pol_reduce_one(
         /* Subtract background from calibrated images */
         if (hdrl_imagelist_sub_image(in_calib, backgr) != CPL_ERROR_NONE) {
             cpl_msg_error(__func__,
-                            "Failed to subtract background") ;
+                            "%sFailed to subtract background",
+                            cr2res_detector_prefix(reduce_det)) ;
             if (dits != NULL) cpl_vector_delete(dits) ;
             cpl_free(decker_positions) ;
             hdrl_imagelist_delete(in_calib);
@@ -816,15 +902,18 @@ static int cr2res_obs_pol_reduce_one(
         }
         hdrl_image_delete(backgr);
     } else{
-        cpl_msg_warning(__func__, "No background subtraction");
+        cpl_msg_warning(__func__, "%sNo background subtraction",
+                cr2res_detector_prefix(reduce_det));
     }
     if (dits != NULL) cpl_vector_delete(dits) ;
 
     /* Load the trace wave */
-    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
+    cpl_msg_info(__func__, "%sLoad the TRACE WAVE",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((trace_wave = cr2res_io_load_TRACE_WAVE(cpl_frame_get_filename(
                         trace_wave_frame), reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Load the traces file") ;
+        cpl_msg_error(__func__, "%sFailed to Load the traces file",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_free(decker_positions) ;
         hdrl_imagelist_delete(in_calib) ;
         return -1 ;
@@ -832,8 +921,9 @@ static int cr2res_obs_pol_reduce_one(
 
     /* Correct trace_wave with some provided raw flats */
     if (raw_flat_frames != NULL) {
-        cpl_msg_info(__func__, "Try to correct the reproducibility error") ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sTry to correct the reproducibility error",
+                cr2res_detector_prefix(reduce_det)) ;
+        cr2res_msg_indent_more() ;
         trace_wave_corrected = cr2res_trace_adjust(trace_wave, raw_flat_frames, 
                 reduce_det) ;
         if (trace_wave_corrected != NULL) {
@@ -841,7 +931,7 @@ static int cr2res_obs_pol_reduce_one(
             trace_wave = trace_wave_corrected ;
             trace_wave_corrected = NULL ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
     }
 
     /* Compute the number of groups */
@@ -852,11 +942,18 @@ static int cr2res_obs_pol_reduce_one(
     pol_spec_one_group = cpl_malloc(ngroups * sizeof(cpl_table*)) ;
     for (i = 0; i < ngroups; i++) pol_spec_one_group[i] = NULL;
 
+    /* The plans are shared by the groups */
+    for (i=0 ; i<CR2RES_OBS_POL_NB_PLANS ; i++) {
+        plans[i] = NULL ;
+        traces_loc[i] = NULL ;
+    }
+
     /* Loop on the groups */
     for (i=0 ; i<ngroups ; i++) {
-        cpl_msg_info(__func__, "Process %d-group number %d/%d", 
+        cpl_msg_info(__func__, "%sProcess %d-group number %d/%d",
+                cr2res_detector_prefix(reduce_det), 
                 CR2RES_POLARIMETRY_GROUP_SIZE, i+1, ngroups) ;
-        cpl_msg_indent_more() ;    
+        cr2res_msg_indent_more() ;    
 
         /* Compute the proper order of the frames group */
         if ((pol_sorting = cr2res_pol_sort_frames(
@@ -868,14 +965,16 @@ static int cr2res_obs_pol_reduce_one(
                     i * CR2RES_POLARIMETRY_GROUP_SIZE + 2),
                 cpl_frameset_get_position_const(rawframes, 
                     i * CR2RES_POLARIMETRY_GROUP_SIZE + 3))) == NULL) {
-            cpl_msg_warning(__func__, "Failed to sort the files") ;
+            cpl_msg_warning(__func__, "%sFailed to sort the files",
+                    cr2res_detector_prefix(reduce_det)) ;
             continue ;
         } 
         if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
             for (j=0 ; j<CR2RES_POLARIMETRY_GROUP_SIZE ; j++) {
                 if (pol_sorting[j] != j) 
                     cpl_msg_warning(__func__, 
-                            "Frame #%d moved to position #%d", 
+                            "%sFrame #%d moved to position #%d",
+                            cr2res_detector_prefix(reduce_det), 
                             j+1, pol_sorting[j]+1) ;
             }
         }
@@ -894,33 +993,31 @@ static int cr2res_obs_pol_reduce_one(
             decker_name = cr2res_decker_print_position(
                     decker_positions[frame_idx]) ;
             cpl_msg_info(__func__, 
-                    "Extract Up Spectrum from %s (Det %d / Decker %s)", 
+                    "%sExtract Up Spectrum from %s (Det %d / Decker %s)",
+                    cr2res_detector_prefix(reduce_det), 
                     fname, reduce_det, decker_name) ;
             cpl_free(decker_name) ;
-            cpl_msg_indent_more() ;
+            cr2res_msg_indent_more() ;
            
-            /* Get slit fraction for the upper trace */
-            slit_frac = cr2res_trace_slit_fraction_create(
-                    decker_positions[frame_idx], 1) ;
-
-            /* Compute the new trace_wave for the extraction */
-            trace_wave_loc = cr2res_trace_new_slit_fraction(trace_wave,
-                            slit_frac) ;
-            cpl_array_delete(slit_frac) ;
+            /* Get the plan for the upper trace */
+            plan = cr2res_obs_pol_get_plan(plans, traces_loc, trace_wave,
+                    decker_positions[frame_idx], 1,
+                    hdrl_imagelist_get_const(in_calib, frame_idx),
+                    extract_oversample, extract_swath_width, extract_height,
+                    &trace_wave_loc) ;
 
             /* Execute the extraction */
-            cpl_msg_info(__func__, "Spectra Extraction") ;
-            if (cr2res_extract_traces(
-                        hdrl_imagelist_get_const(in_calib, frame_idx),
-                        trace_wave_loc, NULL, -1, -1, CR2RES_EXTR_OPT_CURV, 
-                        extract_height, extract_swath_width, extract_oversample,
-                        extract_smooth, 0.0, 0, 0, 0, 
-                        &(extract_1d[2*j]), &slit_func, &model_master) == -1) {
-                cpl_msg_error(__func__, "Failed Extraction") ;
+            cpl_msg_info(__func__, "%sSpectra Extraction",
+                    cr2res_detector_prefix(reduce_det)) ;
+            if (cr2res_extract_plan_apply(
+                        hdrl_imagelist_get_const(in_calib, frame_idx), plan,
+                        NULL, extract_smooth, 0.0, extract_nthreads, 0, 0, 0, 
+                        &(extract_1d[2*j]), &slit_func, NULL) == -1) {
+                cpl_msg_error(__func__, "%sFailed Extraction",
+                        cr2res_detector_prefix(reduce_det)) ;
                 extract_1d[2*j] = NULL ;
             } else {
                 cpl_table_delete(slit_func) ;
-                hdrl_image_delete(model_master) ;
                 
                 /* Save the table and the trace for debug */
                 if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -938,40 +1035,37 @@ static int cr2res_obs_pol_reduce_one(
                     cpl_free(out_file) ; 
                 }
             }
-            cpl_table_delete(trace_wave_loc) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
 
             /* Extract Down */
             decker_name = cr2res_decker_print_position(
                     decker_positions[frame_idx]) ;
             cpl_msg_info(__func__, 
-                    "Extract Down Spectrum from %s (Det %d / Decker %s)", 
+                    "%sExtract Down Spectrum from %s (Det %d / Decker %s)",
+                    cr2res_detector_prefix(reduce_det), 
                     fname, reduce_det, decker_name) ;
             cpl_free(decker_name) ;
-            cpl_msg_indent_more() ;
+            cr2res_msg_indent_more() ;
            
-            /* Get slit fraction for the lower trace */
-            slit_frac = cr2res_trace_slit_fraction_create(
-                    decker_positions[frame_idx], 2) ;
-
-            /* Compute the new trace_wave for the extraction */
-            trace_wave_loc = cr2res_trace_new_slit_fraction(trace_wave,
-                            slit_frac) ;
-            cpl_array_delete(slit_frac) ;
+            /* Get the plan for the lower trace */
+            plan = cr2res_obs_pol_get_plan(plans, traces_loc, trace_wave,
+                    decker_positions[frame_idx], 2,
+                    hdrl_imagelist_get_const(in_calib, frame_idx),
+                    extract_oversample, extract_swath_width, extract_height,
+                    &trace_wave_loc) ;
 
             /* Execute the extraction */
-            cpl_msg_info(__func__, "Spectra Extraction") ;
-            if (cr2res_extract_traces(
-                        hdrl_imagelist_get_const(in_calib, frame_idx),
-                        trace_wave_loc, NULL, -1, -1, CR2RES_EXTR_OPT_CURV, 
-                        extract_height, extract_swath_width, extract_oversample,
-                        extract_smooth, 0.0, 0, 0, 0, 
-                        &(extract_1d[2*j+1]), &slit_func, &model_master)== -1) {
-                cpl_msg_error(__func__, "Failed Extraction") ;
+            cpl_msg_info(__func__, "%sSpectra Extraction",
+                    cr2res_detector_prefix(reduce_det)) ;
+            if (cr2res_extract_plan_apply(
+                        hdrl_imagelist_get_const(in_calib, frame_idx), plan,
+                        NULL, extract_smooth, 0.0, extract_nthreads, 0, 0, 0, 
+                        &(extract_1d[2*j+1]), &slit_func, NULL)== -1) {
+                cpl_msg_error(__func__, "%sFailed Extraction",
+                        cr2res_detector_prefix(reduce_det)) ;
                 extract_1d[2*j+1] = NULL ;
             } else {
                 cpl_table_delete(slit_func) ;
-                hdrl_image_delete(model_master) ;
 
                 /* Save the table and the trace for debug */
                 if (cpl_msg_get_level() == CPL_MSG_DEBUG) {
@@ -990,8 +1084,7 @@ static int cr2res_obs_pol_reduce_one(
                 }
             }
 
-            cpl_table_delete(trace_wave_loc) ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
         }
         cpl_free(pol_sorting) ;
 
@@ -1000,13 +1093,16 @@ static int cr2res_obs_pol_reduce_one(
                         (const cpl_table **)extract_1d, 
                         nspec_group, 
                         &norders)) == NULL) {
-            cpl_msg_warning(__func__, "No Order found in the extracted tables");
+            cpl_msg_warning(__func__,
+                    "%sNo Order found in the extracted tables",
+                    cr2res_detector_prefix(reduce_det));
             for (j=0 ; j<nspec_group ; j++) 
                 if (extract_1d[j] != NULL) cpl_table_delete(extract_1d[j]) ;
             cpl_free(extract_1d) ;
             continue ;
         }
-        cpl_msg_debug(__func__, "%d different orders found", norders) ;
+        cpl_msg_debug(__func__, "%s%d different orders found",
+                cr2res_detector_prefix(reduce_det), norders) ;
 
         /* Allocate data containerѕ */
         demod_wl = cpl_malloc(norders * sizeof(cpl_vector*)) ;
@@ -1031,7 +1127,8 @@ static int cr2res_obs_pol_reduce_one(
 
         /* Loop on the orders */
         for (o=0 ; o<norders ; o++) {
-            cpl_msg_info(__func__, "Compute Polarimetry for order %d",
+            cpl_msg_info(__func__, "%sCompute Polarimetry for order %d",
+                    cr2res_detector_prefix(reduce_det),
                     orders[o]) ;
             /* Get the inputs for the demod functions calls */
             for (k=0 ; k<nspec_group ; k++) {
@@ -1121,7 +1218,8 @@ static int cr2res_obs_pol_reduce_one(
         cpl_free(extract_1d) ;
 
         /* Create the pol_spec table */
-        cpl_msg_info(__func__, "Create the POL_SPEC table for this group");
+        cpl_msg_info(__func__, "%sCreate the POL_SPEC table for this group",
+                cr2res_detector_prefix(reduce_det));
         pol_spec_one_group[i] = cr2res_pol_POL_SPEC_create(orders, demod_wl, 
                 demod_stokes, demod_null, demod_intens, norders) ;
 
@@ -1137,15 +1235,20 @@ static int cr2res_obs_pol_reduce_one(
         cpl_free(demod_null) ;
         cpl_free(demod_intens) ;
         cpl_free(orders) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
+    }
+    for (i=0 ; i<CR2RES_OBS_POL_NB_PLANS ; i++) {
+        cr2res_extract_plan_delete(plans[i]) ;
+        if (traces_loc[i] != NULL) cpl_table_delete(traces_loc[i]) ;
     }
     cpl_free(decker_positions) ;
     hdrl_imagelist_delete(in_calib) ;
 
     /* Merge the groups together */
     if (ngroups > 1) {
-        cpl_msg_info(__func__, "Merge the %d groups POL_SPEC tables into one", 
-                ngroups);
+        cpl_msg_info(__func__,
+                "%sMerge the %d groups POL_SPEC tables into one",
+                cr2res_detector_prefix(reduce_det), ngroups);
         pol_spec_merged = cr2res_pol_spec_pol_merge(
                 (const cpl_table **)pol_spec_one_group, ngroups) ;
     } else {
@@ -1162,7 +1265,8 @@ static int cr2res_obs_pol_reduce_one(
 
     /* Check */
     if (pol_spec_merged == NULL) {
-        cpl_msg_error(__func__, "Cannot create the POL_SPEC table");
+        cpl_msg_error(__func__, "%sCannot create the POL_SPEC table",
+                cr2res_detector_prefix(reduce_det));
         cpl_table_delete(trace_wave) ;
         return -1 ;
     }
@@ -1197,6 +1301,70 @@ static int cr2res_obs_pol_reduce_one(
 }
 
 
+/*----------------------------------------------------------------------------*/
+/**
+  @brief    Get the extraction plan of one polarimetric beam
+  @param    plans           The plans [CR2RES_OBS_POL_NB_PLANS]
+  @param    traces          The plans trace waves [CR2RES_OBS_POL_NB_PLANS]
+  @param    trace_wave      The trace wave of the full slit
+  @param    decker          The decker position
+  @param    up_or_down      1 for the upper beam, 2 for the lower one
+  @param    img             An image to extract
+  @param    extract_oversample      factor for oversampling
+  @param    extract_swath_width     width per swath
+  @param    extract_height          number of pix above and below mid-line
+  @param    trace_wave_loc  [out] the trace wave of the beam
+  @return   the plan or NULL in error case
+
+  The beam slit fraction only depends on the decker position, so the plan
+  of a beam is computed the first time and reused for all the frames with
+  the same decker position. The plans and trace waves are stored in and
+  deallocated with the passed arrays.
+ */
+/*----------------------------------------------------------------------------*/
+static const cr2res_extract_plan * cr2res_obs_pol_get_plan(
+        cr2res_extract_plan **  plans,
+        cpl_table           **  traces,
+        const cpl_table     *   trace_wave,
+        cr2res_decker           decker,
+        int                     up_or_down,
+        const hdrl_image    *   img,
+        int                     extract_oversample,
+        int                     extract_swath_width,
+        int                     extract_height,
+        const cpl_table     **  trace_wave_loc)
+{
+    cpl_array           *   slit_frac ;
+    int                     idx ;
+
+    /* Check Inputs */
+    *trace_wave_loc = NULL ;
+    if (decker < 0 || decker > CR2RES_DECKER_2_4) return NULL ;
+    if (up_or_down != 1 && up_or_down != 2) return NULL ;
+    idx = 2 * decker + up_or_down - 1 ;
+
+    if (plans[idx] == NULL) {
+        /* Get slit fraction for the beam */
+        if ((slit_frac = cr2res_trace_slit_fraction_create(decker,
+                        up_or_down)) == NULL) return NULL ;
+
+        /* Compute the new trace_wave for the extraction */
+        if (traces[idx] == NULL)
+            traces[idx] = cr2res_trace_new_slit_fraction(trace_wave,
+                    slit_frac) ;
+        cpl_array_delete(slit_frac) ;
+        if (traces[idx] == NULL) return NULL ;
+
+        /* Compute the plan, it is applied to several frames */
+        plans[idx] = cr2res_extract_plan_new(traces[idx], -1, -1,
+                CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width,
+                extract_oversample, hdrl_image_get_size_x(img),
+                hdrl_image_get_size_y(img), 1) ;
+    }
+    *trace_wave_loc = traces[idx] ;
+    return plans[idx] ;
+}
+
 /*----------------------------------------------------------------------------*/
 /**
   @brief    Count and return the order numbers from extracted tables
@@ -69,6 +69,7 @@ static int cr2res_obs_staring_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  extract,
         cpl_table           **  slitfunc,
@@ -247,6 +248,14 @@ static int cr2res_obs_staring_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_staring.extract_nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_obs_staring", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "extract_nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_staring.detector",
             CPL_TYPE_INT, "Only reduce the specified detector",
             "cr2res.cr2res_obs_staring", 0);
@@ -254,6 +263,13 @@ static int cr2res_obs_staring_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_obs_staring.parallel_detectors",
+            CPL_TYPE_BOOL, "Flag to reduce the detectors concurrently",
+            "cr2res.cr2res_obs_staring", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "parallel_detectors");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_obs_staring.display_order",
             CPL_TYPE_INT, "Apply the display for the specified order",
             "cr2res.cr2res_obs_staring", 0);
@@ -308,6 +324,7 @@ static int cr2res_obs_staring_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -326,7 +343,8 @@ static int cr2res_obs_staring(
     const cpl_parameter *   param ;
     int                     extract_oversample, extract_swath_width,
                             extract_height, reduce_det, ndit, nexp,
-                            disp_order, disp_trace ;
+                            disp_order, disp_trace, extract_nthreads,
+                            parallel_detectors, det_nthreads ;
     double                  extract_smooth, ra, dec, dit ;
     cpl_frameset        *   rawframes ;
     const cpl_frame     *   trace_wave_frame ;
@@ -339,6 +357,7 @@ static int cr2res_obs_staring(
     hdrl_image          *   model[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   plist ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cpl_error_code          det_err[CR2RES_NB_DETECTORS] ;
     char                *   out_file;
     int                     i, det_nr, type; 
 
@@ -356,9 +375,15 @@ static int cr2res_obs_staring(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_staring.extract_smooth");
     extract_smooth = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_staring.extract_nthreads");
+    extract_nthreads = cpl_parameter_get_int(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_staring.detector");
     reduce_det = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_obs_staring.parallel_detectors");
+    parallel_detectors = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_obs_staring.display_order");
     disp_order = cpl_parameter_get_int(param);
@@ -395,8 +420,17 @@ static int cr2res_obs_staring(
     }
       
     /* Loop on the detectors */
+    det_nthreads = cr2res_detector_nthreads(reduce_det, parallel_detectors) ;
+    if (det_nthreads > 1)
+        cpl_msg_info(__func__, "Reduce the %d detectors concurrently",
+                det_nthreads) ;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(det_nthreads) schedule(static,1) \
+    if(det_nthreads > 1)
+#endif
     for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
         /* Initialise */
+        det_err[det_nr-1] = CPL_ERROR_NONE ;
         extract[det_nr-1] = NULL ;
         slitfunc[det_nr-1] = NULL ;
         model[det_nr-1] = NULL ;
@@ -405,24 +439,29 @@ static int cr2res_obs_staring(
         /* Compute only one detector */
         if (reduce_det != 0 && det_nr != reduce_det) continue ;
     
-        cpl_msg_info(__func__, "Process Detector %d", det_nr) ;
-        cpl_msg_indent_more() ;
+        cpl_msg_info(__func__, "%sProcess Detector %d",
+                cr2res_detector_prefix(det_nr), det_nr) ;
+        cr2res_msg_indent_more() ;
 
         /* Call the reduction function */
         if (cr2res_obs_staring_reduce(rawframes, 
                     trace_wave_frame, detlin_frame, master_dark_frame, 
                     master_flat_frame, bpm_frame, 0, extract_oversample, 
-                    extract_swath_width, extract_height, extract_smooth, det_nr,
+                    extract_swath_width, extract_height, extract_smooth, 
+                    extract_nthreads, det_nr,
                     &(extract[det_nr-1]),
                     &(slitfunc[det_nr-1]),
                     &(model[det_nr-1]),
                     &(ext_plist[det_nr-1])) == -1) {
-            cpl_msg_warning(__func__, "Failed to reduce detector %d", det_nr);
+            cpl_msg_warning(__func__, "%sFailed to reduce detector %d",
+                    cr2res_detector_prefix(det_nr), det_nr);
             cpl_error_reset() ;
-            cpl_msg_indent_less() ;
+            cr2res_msg_indent_less() ;
         }
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
+        det_err[det_nr-1] = cr2res_detector_error_save(det_nr) ;
     }
+    cr2res_detector_error_restore(det_err) ;
 
     /* Ѕave Products */
     out_file = cpl_sprintf("%s_slitfunc.fits", RECIPE_STRING) ;
@@ -473,6 +512,7 @@ static int cr2res_obs_staring(
   @param extract_swath_width    Extraction related
   @param extract_height         Extraction related
   @param extract_smooth         Extraction related
+  @param extract_nthreads       Extraction: number of parallel traces
   @param reduce_det             The detector to compute
   @param extract                [out] extracted spectrum 
   @param slitfunc               [out] slit function
@@ -493,6 +533,7 @@ static int cr2res_obs_staring_reduce(
         int                     extract_swath_width,
         int                     extract_height,
         double                  extract_smooth,
+        int                     extract_nthreads,
         int                     reduce_det,
         cpl_table           **  extract,
         cpl_table           **  slitfunc,
@@ -525,7 +566,8 @@ static int cr2res_obs_staring_reduce(
 
     /* Check raw frames consistency */
     if (cr2res_obs_staring_check_inputs_validity(rawframes) != 1) {
-        cpl_msg_error(__func__, "Invalid Inputs") ;
+        cpl_msg_error(__func__, "%sInvalid Inputs",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
 
@@ -537,13 +579,15 @@ static int cr2res_obs_staring_reduce(
     /* Get the order zeropoint */
     if ((plist = cpl_propertylist_load(cpl_frame_get_filename(trace_wave_frame),
                     0)) == NULL) {
-        cpl_msg_error(__func__, "Cannot read the ORDER_ZP from the input TW") ;
+        cpl_msg_error(__func__, "%sCannot read the ORDER_ZP from the input TW",
+                cr2res_detector_prefix(reduce_det)) ;
         return -1 ;
     }
     order_zp = cr2res_pfits_get_order_zp(plist) ;
     cpl_propertylist_delete(plist) ;
     if (cpl_error_get_code()) {
-        cpl_msg_error(__func__, "Missing ORDER_ZP in the header - Skip") ;
+        cpl_msg_error(__func__, "%sMissing ORDER_ZP in the header - Skip",
+                cr2res_detector_prefix(reduce_det)) ;
         cpl_error_reset() ;
         /* Negative Zerop to log the fact that it is missing */
         order_zp = -100 ;
@@ -558,12 +602,14 @@ static int cr2res_obs_staring_reduce(
     /* Load image list */
     if ((in = cr2res_io_load_image_list_from_set(rawframes, 
                     reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Cannot load images") ;
+        cpl_msg_error(__func__, "%sCannot load images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         return -1 ;
     }
     if (hdrl_imagelist_get_size(in) != cpl_frameset_get_size(rawframes)) {
-        cpl_msg_error(__func__, "Inconsistent number of loaded images") ;
+        cpl_msg_error(__func__, "%sInconsistent number of loaded images",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         hdrl_imagelist_delete(in) ;
         return -1 ;
@@ -573,7 +619,8 @@ static int cr2res_obs_staring_reduce(
     if ((in_calib = cr2res_calib_imagelist(in, reduce_det, 0, 0, 
                     master_flat_frame, master_dark_frame, bpm_frame, 
                     detlin_frame, dits)) == NULL) {
-        cpl_msg_error(__func__, "Failed to apply the calibrations") ;
+        cpl_msg_error(__func__, "%sFailed to apply the calibrations",
+                cr2res_detector_prefix(reduce_det)) ;
         if (dits != NULL) cpl_vector_delete(dits) ;
         hdrl_imagelist_delete(in) ;
         return -1 ;
@@ -582,35 +629,41 @@ static int cr2res_obs_staring_reduce(
     if (dits != NULL) cpl_vector_delete(dits) ;
 
     /* Collapse the image list */
-    cpl_msg_info(__func__, "Collapse") ;
-    cpl_msg_indent_more() ;
+    cpl_msg_info(__func__, "%sCollapse", cr2res_detector_prefix(reduce_det)) ;
+    cr2res_msg_indent_more() ;
     if (hdrl_imagelist_collapse_mean(in_calib, &collapsed, &contrib) !=
             CPL_ERROR_NONE) {
-        cpl_msg_error(__func__, "Failed to Collapse") ;
+        cpl_msg_error(__func__, "%sFailed to Collapse",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_imagelist_delete(in_calib) ;
-        cpl_msg_indent_less() ;
+        cr2res_msg_indent_less() ;
         return -1 ;
     }
     cpl_image_delete(contrib) ;
     hdrl_imagelist_delete(in_calib) ;
-    cpl_msg_indent_less() ;
+    cr2res_msg_indent_less() ;
 
     /* Load the trace wave */
-    cpl_msg_info(__func__, "Load the TRACE WAVE") ;
+    cpl_msg_info(__func__, "%sLoad the TRACE WAVE",
+            cr2res_detector_prefix(reduce_det)) ;
     if ((trace_wave = cr2res_io_load_TRACE_WAVE(cpl_frame_get_filename(
                         trace_wave_frame), reduce_det)) == NULL) {
-        cpl_msg_error(__func__, "Failed to Load the traces file") ;
+        cpl_msg_error(__func__, "%sFailed to Load the traces file",
+                cr2res_detector_prefix(reduce_det)) ;
         hdrl_image_delete(collapsed) ;
         return -1 ;
     }
 
     /* Execute the extraction */
-    cpl_msg_info(__func__, "Spectra Extraction") ;
+    cpl_msg_info(__func__, "%sSpectra Extraction",
+            cr2res_detector_prefix(reduce_det)) ;
     if (cr2res_extract_traces(collapsed, trace_wave, NULL, -1, -1,
                 CR2RES_EXTR_OPT_CURV, extract_height, extract_swath_width, 
-                extract_oversample, extract_smooth, 0.0, 0, 0, 0,
+                extract_oversample, extract_smooth, 0.0, extract_nthreads,
+                0, 0, 0,
                 &extracted, &slit_func, &model_master) == -1) {
-        cpl_msg_error(__func__, "Failed to extract");
+        cpl_msg_error(__func__, "%sFailed to extract",
+                cr2res_detector_prefix(reduce_det));
         hdrl_image_delete(collapsed) ;
         cpl_table_delete(trace_wave) ;
         return -1 ;
@@ -109,14 +109,20 @@ Spectrum Extraction                                                     \n\
   Algorithm                                                             \n\
     loop on raw frames f:                                               \n\
       loop on detectors d:                                              \n\
-        Load the trace wave                                             \n\
-        Recompute a new trace wave with the specified slit fraction     \n\
-                 (--slit_frac) if needed                                \n\
         Load the image to extract                                       \n\
+        For the first frame only:                                       \n\
+          Load the trace wave                                           \n\
+          Recompute a new trace wave with the specified slit fraction   \n\
+                 (--slit_frac) if needed                                \n\
+          Compute the extraction plan(d) with cr2res_extract_plan_new() \n\
+                 (--method,--height,--swath_width,--oversample)         \n\
+          With --warm_start, set it in the plan(d)                      \n\
+          With --single_precision, set it in the plan(d)                \n\
         Load the BPM and set them in the image                          \n\
         Load the input slit_func if available                           \n\
-        Run the extraction cr2res_extract_traces(--method,--height,     \n\
-                 --swath_width,--oversample,--smooth_slit,--smooth_spec)\n\
+          With --warm_start, use the SLIT_FUNC(f-1,d) instead if any    \n\
+        Run the extraction cr2res_extract_plan_apply(plan(d),           \n\
+                 --smooth_slit,--smooth_spec,--nthreads)                \n\
           -> creates SLIT_MODEL(f,d), SLIT_FUNC(f,d), EXTRACT_1D(f,d)   \n\
       Save SLIT_MODEL(f), SLIT_FUNC(f), EXTRACT_1D(f)                   \n\
                                                                         \n\
@@ -125,7 +131,10 @@ Spectrum Extraction                                                     \n\
     cr2res_trace_new_slit_fraction()                                    \n\
     cr2res_io_load_image()                                              \n\
     cr2res_io_load_BPM()                                                \n\
-    cr2res_extract_traces()                                             \n\
+    cr2res_extract_plan_new()                                           \n\
+    cr2res_extract_plan_set_warm_start()                                \n\
+    cr2res_extract_plan_set_single_precision()                          \n\
+    cr2res_extract_plan_apply()                                         \n\
     cr2res_io_save_SLIT_MODEL()                                         \n\
     cr2res_io_save_SLIT_FUNC()                                          \n\
     cr2res_io_save_EXTRACT_1D()                                         \n\
@@ -238,6 +247,29 @@ static int cr2res_util_extract_create(cpl_plugin * plugin)
     cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
     cpl_parameterlist_append(recipe->parameters, p);
 
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.nthreads",
+            CPL_TYPE_INT,
+            "Number of traces extracted in parallel (0 for all cores)",
+            "cr2res.cr2res_util_extract", 1);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "nthreads");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.warm_start",
+            CPL_TYPE_BOOL, "Start the slit decomposition from the slit "
+            "function of the previous swath and frame",
+            "cr2res.cr2res_util_extract", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "warm_start");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
+    p = cpl_parameter_new_value("cr2res.cr2res_util_extract.single_precision",
+            CPL_TYPE_BOOL, "Single precision weights in the curved slit "
+            "decomposition", "cr2res.cr2res_util_extract", FALSE);
+    cpl_parameter_set_alias(p, CPL_PARAMETER_MODE_CLI, "single_precision");
+    cpl_parameter_disable(p, CPL_PARAMETER_MODE_ENV);
+    cpl_parameterlist_append(recipe->parameters, p);
+
     p = cpl_parameter_new_value("cr2res.cr2res_util_extract.method",
             CPL_TYPE_STRING, "Extraction method (SUM / MEDIAN / TILTSUM / "
             "OPT_VERT / OPT_CURV )",
@@ -313,6 +345,7 @@ static int cr2res_util_extract_destroy(cpl_plugin * plugin)
     else return -1 ;
 
     cpl_parameterlist_delete(recipe->parameters);
+    cr2res_io_ext_cache_clear() ;
     return 0 ;
 }
 
@@ -330,7 +363,8 @@ static int cr2res_util_extract(
 {
     const cpl_parameter *   param;
     int                     oversample, swath_width, extr_height,
-                            reduce_det, reduce_order, reduce_trace ;
+                            reduce_det, reduce_order, reduce_trace,
+                            nthreads, warm_start, single_precision ;
     double                  smooth_slit, smooth_spec, slit_low, slit_up ;
     cpl_array           *   slit_frac ;
     cpl_frameset        *   rawframes ;
@@ -345,7 +379,11 @@ static int cr2res_util_extract(
     hdrl_image          *   model_master[CR2RES_NB_DETECTORS] ;
     cpl_table           *   slit_func_tab[CR2RES_NB_DETECTORS] ;
     cpl_table           *   extract_tab[CR2RES_NB_DETECTORS] ;
+    cpl_table           *   slit_func_prev[CR2RES_NB_DETECTORS] ;
     cpl_propertylist    *   ext_plist[CR2RES_NB_DETECTORS] ;
+    cr2res_extract_plan *   plan[CR2RES_NB_DETECTORS] ;
+    int                     ymin[CR2RES_NB_DETECTORS] ;
+    int                     ymax[CR2RES_NB_DETECTORS] ;
     cpl_table           *   trace_table ;
     cpl_table           *   trace_table_new ;
     hdrl_image          *   science_hdrl;
@@ -371,6 +409,15 @@ static int cr2res_util_extract(
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_util_extract.smooth_spec");
     smooth_spec = cpl_parameter_get_double(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.nthreads");
+    nthreads = cpl_parameter_get_int(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.warm_start");
+    warm_start = cpl_parameter_get_bool(param);
+    param = cpl_parameterlist_find_const(parlist,
+            "cr2res.cr2res_util_extract.single_precision");
+    single_precision = cpl_parameter_get_bool(param);
     param = cpl_parameterlist_find_const(parlist,
             "cr2res.cr2res_util_extract.detector");
     reduce_det = cpl_parameter_get_int(param);
@@ -446,6 +493,14 @@ static int cr2res_util_extract(
         return -1 ;
     }
    
+    /* The extraction geometry is shared by all the frames */
+    /* With the warm start, so is the last slit function */
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        plan[det_nr-1] = NULL ;
+        slit_func_prev[det_nr-1] = NULL ;
+        ymin[det_nr-1] = ymax[det_nr-1] = -1 ;
+    }
+
     /* Loop on the RAW frames */
     for (i=0 ; i<cpl_frameset_get_size(rawframes) ; i++) {
         /* Get the Current Frame */
@@ -474,49 +529,92 @@ static int cr2res_util_extract(
             cpl_msg_info(__func__, "Process detector number %d", det_nr) ;
             cpl_msg_indent_more() ;
 
-            /* Load the trace table of this detector */
-            cpl_msg_info(__func__, "Load the trace table") ;
-            if ((trace_table = cr2res_io_load_TRACE_WAVE(
-                            cpl_frame_get_filename(trace_frame),
-                            det_nr)) == NULL) {
-                cpl_msg_error(__func__,
-                        "Failed to get trace table - skip detector");
-                cpl_error_reset() ;
-                cpl_msg_indent_less() ;
-                continue ;
-            }
+            /* Load the trace table of this detector on the first frame */
+            trace_table = NULL ;
+            if (plan[det_nr-1] == NULL) {
+                cpl_msg_info(__func__, "Load the trace table") ;
+                if ((trace_table = cr2res_io_load_TRACE_WAVE(
+                                cpl_frame_get_filename(trace_frame),
+                                det_nr)) == NULL) {
+                    cpl_msg_error(__func__,
+                            "Failed to get trace table - skip detector");
+                    cpl_error_reset() ;
+                    cpl_msg_indent_less() ;
+                    continue ;
+                }
 
-            /* Extract at the specified slit fraction */
-            if (slit_frac != NULL) {
-                if ((trace_table_new = cr2res_trace_new_slit_fraction(
-                                trace_table, slit_frac)) == NULL) {
-                    cpl_msg_warning(__func__,
+                /* Extract at the specified slit fraction */
+                if (slit_frac != NULL) {
+                    if ((trace_table_new = cr2res_trace_new_slit_fraction(
+                                    trace_table, slit_frac)) == NULL) {
+                        cpl_msg_warning(__func__,
             "Failed to compute the traces for user specified slit fraction") ;
+                        cpl_error_reset() ;
+                    } else {
+                        cpl_table_delete(trace_table) ;
+                        trace_table = trace_table_new ;
+                        trace_table_new = NULL ;
+                    }
+                }
+
+                /* Only read the rows of the selected traces */
+                if ((reduce_order > -1 || reduce_trace > -1) &&
+                        cr2res_trace_get_rows(trace_table, reduce_order,
+                            reduce_trace, extr_height > 0 ? extr_height : 1,
+                            CR2RES_DETECTOR_SIZE, &(ymin[det_nr-1]),
+                            &(ymax[det_nr-1])) != 0) {
+                    ymin[det_nr-1] = ymax[det_nr-1] = -1 ;
                     cpl_error_reset() ;
-                } else {
-                    cpl_table_delete(trace_table) ;
-                    trace_table = trace_table_new ;
-                    trace_table_new = NULL ;
                 }
             }
 
             /* Load the image in which the traces are to extract */
-            cpl_msg_info(__func__, "Load the Image") ;
-            if ((science_hdrl = cr2res_io_load_image(cur_fname, det_nr))==NULL){
-                cpl_table_delete(trace_table) ;
+            if (ymin[det_nr-1] > 0) {
+                cpl_msg_info(__func__, "Load the rows %d to %d of the Image",
+                        ymin[det_nr-1], ymax[det_nr-1]) ;
+            } else {
+                cpl_msg_info(__func__, "Load the Image") ;
+            }
+            if ((science_hdrl = cr2res_io_load_image_rows(cur_fname, det_nr,
+                            ymin[det_nr-1], ymax[det_nr-1])) == NULL) {
+                if (trace_table != NULL) cpl_table_delete(trace_table) ;
                 cpl_msg_error(__func__, 
                         "Failed to load the image - skip detector");
                 cpl_error_reset() ;
                 cpl_msg_indent_less() ;
                 continue ;
             }
+
+            /* Create the extraction plan on the first frame */
+            if (plan[det_nr-1] == NULL) {
+                /* Keep the tensors if there are several frames */
+                plan[det_nr-1] = cr2res_extract_plan_new(trace_table,
+                        reduce_order, reduce_trace, extr_method, extr_height,
+                        swath_width, oversample,
+                        hdrl_image_get_size_x(science_hdrl),
+                        hdrl_image_get_size_y(science_hdrl),
+                        cpl_frameset_get_size(rawframes) > 1) ;
+                cpl_table_delete(trace_table) ;
+                if (plan[det_nr-1] == NULL) {
+                    hdrl_image_delete(science_hdrl) ;
+                    cpl_msg_error(__func__,
+                            "Failed to create the plan - skip detector");
+                    cpl_error_reset() ;
+                    cpl_msg_indent_less() ;
+                    continue ;
+                }
+                cr2res_extract_plan_set_warm_start(plan[det_nr-1],
+                        warm_start) ;
+                cr2res_extract_plan_set_single_precision(plan[det_nr-1],
+                        single_precision) ;
+            }
+
             /* Load the BPM and assign to hdrl-mask*/
             if (bpm_frame != NULL) {
                 cpl_msg_info(__func__, "Load and assign the BPM") ;
                 if (cr2res_bpm_set_and_correct_image(
                     hdrl_image_get_image(science_hdrl), 
                     cpl_frame_get_filename(bpm_frame), det_nr, 1)){
-                    cpl_table_delete(trace_table) ;
                     hdrl_image_delete(science_hdrl) ;
                     cpl_msg_error(__func__, 
                             "Failed to load BPM - skip detector");
@@ -527,7 +625,11 @@ static int cr2res_util_extract(
             }
             
             /* Load the SLIT_FUNC table */
-            if (slit_func_frame != NULL) {
+            if (slit_func_prev[det_nr-1] != NULL) {
+                /* Start from the slit function of the previous frame */
+                slit_func_in = slit_func_prev[det_nr-1] ;
+                slit_func_prev[det_nr-1] = NULL ;
+            } else if (slit_func_frame != NULL) {
                 slit_func_in = cr2res_io_load_SLIT_FUNC(
                         cpl_frame_get_filename(slit_func_frame),
                         det_nr) ;
@@ -537,13 +639,11 @@ static int cr2res_util_extract(
             
             /* Compute the extraction */
             cpl_msg_info(__func__, "Spectra Extraction") ;
-            if (cr2res_extract_traces(science_hdrl, trace_table,
-                        slit_func_in, reduce_order, reduce_trace, extr_method, 
-                        extr_height, swath_width, oversample,
-                        smooth_slit, smooth_spec, 0, 0, 0, 
-                        &(extract_tab[det_nr-1]), &(slit_func_tab[det_nr-1]), 
+            if (cr2res_extract_plan_apply(science_hdrl, plan[det_nr-1],
+                        slit_func_in, smooth_slit, smooth_spec, nthreads,
+                        0, 0, 0, &(extract_tab[det_nr-1]),
+                        &(slit_func_tab[det_nr-1]),
                         &(model_master[det_nr-1]))==-1) {
-                cpl_table_delete(trace_table) ;
                 hdrl_image_delete(science_hdrl) ;
                 if (slit_func_in != NULL) cpl_table_delete(slit_func_in) ;
                 cpl_msg_error(__func__, "Failed to extract - skip detector");
@@ -553,10 +653,10 @@ static int cr2res_util_extract(
             }
             if (slit_func_in != NULL) cpl_table_delete(slit_func_in) ;
             hdrl_image_delete(science_hdrl) ;
-            cpl_table_delete(trace_table) ;
+            if (warm_start) slit_func_prev[det_nr-1] =
+                cpl_table_duplicate(slit_func_tab[det_nr-1]) ;
             cpl_msg_indent_less() ;
         }
-        cpl_array_delete(slit_frac) ;
 
         /* Generate the currently used frameset */
         /* TODO : add calibrations */
@@ -597,6 +697,12 @@ static int cr2res_util_extract(
         }
         cpl_msg_indent_less() ;
     }
+    for (det_nr=1 ; det_nr<=CR2RES_NB_DETECTORS ; det_nr++) {
+        cr2res_extract_plan_delete(plan[det_nr-1]) ;
+        if (slit_func_prev[det_nr-1] != NULL)
+            cpl_table_delete(slit_func_prev[det_nr-1]) ;
+    }
+    if (slit_frac != NULL) cpl_array_delete(slit_frac) ;
     cpl_frameset_delete(rawframes) ;
     return (int)cpl_error_get_code();
 }